@@ -0,0 +1,332 @@
+/*++
+
+Module Name:
+
+    AffineGap.cpp
+
+Abstract:
+
+    Banded affine-gap (Gotoh) realignment used to generate CIGAR strings for output.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "AffineGap.h"
+#include "Bam.h"
+#include "BigAlloc.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AFFINE_GAP_USE_SSE2
+#endif
+
+AffineGapWithCigar::AffineGapWithCigar(int i_matchScore, int i_mismatchPenalty, int i_gapOpenPenalty, int i_gapExtendPenalty) :
+    matchScore(i_matchScore), mismatchPenalty(i_mismatchPenalty), gapOpenPenalty(i_gapOpenPenalty), gapExtendPenalty(i_gapExtendPenalty)
+{
+    for (int i = 0; i < 2; i++) {
+        H[i] = (_int16 *)BigAlloc(sizeof(_int16) * RowStride);
+        F[i] = (_int16 *)BigAlloc(sizeof(_int16) * RowStride);
+        for (int k = 0; k < RowStride; k++) {
+            H[i][k] = F[i][k] = NegativeInfinity;
+        }
+    }
+
+    traceback = (BYTE *)BigAlloc(sizeof(BYTE) * (MaxPatternLength + 1) * RowStride);
+    paddedText = (char *)BigAlloc(MaxPatternLength + 2 * RowStride + 2 * MaxBandWidth);
+    opsBackwards = (char *)BigAlloc(2 * MaxPatternLength + 2 * MaxBandWidth + 16);
+}
+
+AffineGapWithCigar::~AffineGapWithCigar()
+{
+    for (int i = 0; i < 2; i++) {
+        BigDealloc(H[i]);
+        BigDealloc(F[i]);
+    }
+    BigDealloc(traceback);
+    BigDealloc(paddedText);
+    BigDealloc(opsBackwards);
+}
+
+    int
+AffineGapWithCigar::computeCigarOps(
+    const char *text,
+    int         textLen,
+    const char *pattern,
+    int         patternLen,
+    int         bandWidth,
+    bool        useM,
+    _uint32    *cigarOps,
+    int         maxCigarOps,
+    int        *o_cigarOpsUsed,
+    int        *o_textUsed,
+    int        *o_netIndel)
+{
+    if (NULL == text || patternLen <= 0 || patternLen > MaxPatternLength) {
+        return -1;
+    }
+
+    const int w = __max(0, __min(bandWidth, MaxBandWidth));
+    const int n = patternLen;
+    const int m = __min(textLen, n + w);    // We can never use more text than this within the band
+    const int bandCells = 2 * w + 1;
+    const int rowWidth = ((bandCells + LanesPerVector - 1) / LanesPerVector) * LanesPerVector;
+    const int gapOpenAndExtend = gapOpenPenalty + gapExtendPenalty;
+
+    //
+    // Cell (i, k) in the band is row i of the pattern (i bases consumed) and column j = i + k - w of the text.  Computing
+    // the match term for the cell needs text[j-1], which we read from paddedText[textOffset + i + k - w - 1].  Everything
+    // outside of the text is a zero, which never matches a base.
+    //
+    const int textOffset = MaxBandWidth + 1;
+    const int paddedTextSize = MaxPatternLength + 2 * RowStride + 2 * MaxBandWidth;
+    memset(paddedText, 0, textOffset);
+    memcpy(paddedText + textOffset, text, m);
+    memset(paddedText + textOffset + m, 0, paddedTextSize - (textOffset + m));
+
+    //
+    // Lanes past the end of the band have to read as impossible, and a previous call with a wider band may have used them.
+    //
+    for (int whichRow = 0; whichRow < 2; whichRow++) {
+        for (int k = rowWidth; k < RowStride; k++) {
+            H[whichRow][k] = F[whichRow][k] = NegativeInfinity;
+        }
+    }
+
+    _int16 *Hprev = H[0], *Hcur = H[1];
+    _int16 *Fprev = F[0], *Fcur = F[1];
+
+    //
+    // Row 0: the only way to get anywhere is by deleting reference bases.
+    //
+    for (int k = 0; k < rowWidth; k++) {
+        int j = k - w;
+        Fprev[k] = NegativeInfinity;
+        if (j < 0 || j > m || k >= bandCells) {
+            Hprev[k] = NegativeInfinity;
+            traceback[k] = SourceMatch;
+        } else if (j == 0) {
+            Hprev[k] = 0;
+            traceback[k] = SourceMatch;
+        } else {
+            Hprev[k] = (_int16)__max((int)NegativeInfinity, -(gapOpenPenalty + j * gapExtendPenalty));
+            traceback[k] = SourceDeletion | (j > 1 ? DeletionExtends : 0);
+        }
+    }
+
+#ifdef AFFINE_GAP_USE_SSE2
+    const __m128i vMatch = _mm_set1_epi16((short)matchScore);
+    const __m128i vMismatch = _mm_set1_epi16((short)-mismatchPenalty);
+    const __m128i vGapOpenAndExtend = _mm_set1_epi16((short)gapOpenAndExtend);
+    const __m128i vGapExtend = _mm_set1_epi16((short)gapExtendPenalty);
+    const __m128i vSourceInsertion = _mm_set1_epi8(SourceInsertion);
+    const __m128i vInsertionExtends = _mm_set1_epi8(InsertionExtends);
+#endif // AFFINE_GAP_USE_SSE2
+
+    for (int i = 1; i <= n; i++) {
+        BYTE *tracebackRow = traceback + i * RowStride;
+        const char *textForRow = paddedText + textOffset + i - w - 1;
+        const char patternBase = pattern[i - 1];
+
+        int k = 0;
+#ifdef AFFINE_GAP_USE_SSE2
+        const __m128i vPatternBase = _mm_set1_epi8(patternBase);
+        for (; k < rowWidth; k += LanesPerVector) {
+            //
+            // Match/mismatch from the diagonal, which is the same lane in the previous row.
+            //
+            __m128i textBases = _mm_loadl_epi64((const __m128i *)(textForRow + k));
+            __m128i equal8 = _mm_cmpeq_epi8(textBases, vPatternBase);
+            __m128i equal16 = _mm_unpacklo_epi8(equal8, equal8);
+            __m128i substitution = _mm_or_si128(_mm_and_si128(equal16, vMatch), _mm_andnot_si128(equal16, vMismatch));
+            __m128i fromDiagonal = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(Hprev + k)), substitution);
+
+            //
+            // Insertion from the cell above, which is one lane to the right in the previous row.
+            //
+            __m128i insertionOpen = _mm_subs_epi16(_mm_loadu_si128((const __m128i *)(Hprev + k + 1)), vGapOpenAndExtend);
+            __m128i insertionExtend = _mm_subs_epi16(_mm_loadu_si128((const __m128i *)(Fprev + k + 1)), vGapExtend);
+            __m128i insertionExtends = _mm_cmpgt_epi16(insertionExtend, insertionOpen);
+            __m128i insertion = _mm_max_epi16(insertionOpen, insertionExtend);
+            _mm_storeu_si128((__m128i *)(Fcur + k), insertion);
+
+            __m128i insertionWins = _mm_cmpgt_epi16(insertion, fromDiagonal);   // Strictly greater, so ties go to the diagonal
+            _mm_storeu_si128((__m128i *)(Hcur + k), _mm_max_epi16(insertion, fromDiagonal));
+
+            __m128i tracebackBits = _mm_or_si128(
+                _mm_and_si128(_mm_packs_epi16(insertionWins, insertionWins), vSourceInsertion),
+                _mm_and_si128(_mm_packs_epi16(insertionExtends, insertionExtends), vInsertionExtends));
+            _mm_storel_epi64((__m128i *)(tracebackRow + k), tracebackBits);
+        }
+#endif // AFFINE_GAP_USE_SSE2
+        for (; k < rowWidth; k++) {
+            int fromDiagonal = Hprev[k] + (textForRow[k] == patternBase ? matchScore : -mismatchPenalty);
+            int insertionOpen = Hprev[k + 1] - gapOpenAndExtend;
+            int insertionExtend = Fprev[k + 1] - gapExtendPenalty;
+            int insertion = __max(insertionOpen, insertionExtend);
+            Fcur[k] = (_int16)__max((int)NegativeInfinity, insertion);
+            Hcur[k] = (_int16)__max((int)NegativeInfinity, __max(insertion, fromDiagonal));
+            tracebackRow[k] = (insertion > fromDiagonal ? SourceInsertion : SourceMatch) | (insertionExtend > insertionOpen ? InsertionExtends : 0);
+        }
+
+        //
+        // Cells off either end of the text can't be part of any alignment.
+        //
+        int validLow = __max(0, w - i);
+        int validHigh = __min(bandCells - 1, m - i + w);
+        if (validLow > validHigh) {
+            return -1;
+        }
+        for (k = 0; k < validLow; k++) {
+            Hcur[k] = Fcur[k] = NegativeInfinity;
+        }
+        for (k = validHigh + 1; k < rowWidth; k++) {
+            Hcur[k] = Fcur[k] = NegativeInfinity;
+        }
+
+        //
+        // Deletions come from the cell to the left in this row, so they have to be done serially.
+        //
+        int deletion = NegativeInfinity;
+        for (k = validLow; k <= validHigh; k++) {
+            int deletionOpen = (k > 0 ? Hcur[k - 1] : NegativeInfinity) - gapOpenAndExtend;
+            int deletionExtend = deletion - gapExtendPenalty;
+            if (deletionExtend > deletionOpen) {
+                deletion = __max((int)NegativeInfinity, deletionExtend);
+                tracebackRow[k] |= DeletionExtends;
+            } else {
+                deletion = __max((int)NegativeInfinity, deletionOpen);
+            }
+
+            if (deletion > Hcur[k]) {
+                Hcur[k] = (_int16)deletion;
+                tracebackRow[k] = (tracebackRow[k] & ~SourceMask) | SourceDeletion;
+            }
+        }
+
+        _int16 *temp = Hprev;
+        Hprev = Hcur;
+        Hcur = temp;
+        temp = Fprev;
+        Fprev = Fcur;
+        Fcur = temp;
+    }
+
+    //
+    // Pick the best end point in the last row, preferring the one closest to the main diagonal.
+    //
+    int bestK = -1;
+    int bestScore = NegativeInfinity;
+    for (int k = 0; k < bandCells; k++) {
+        if (Hprev[k] > bestScore || (Hprev[k] == bestScore && bestK != -1 && abs(k - w) < abs(bestK - w))) {
+            bestScore = Hprev[k];
+            bestK = k;
+        }
+    }
+
+    if (-1 == bestK || bestScore <= NegativeInfinity / 2) {
+        return -1;
+    }
+
+    //
+    // Trace back from the end, writing one op per base into opsBackwards.
+    //
+    int nOps = 0;
+    int i = n;
+    int k = bestK;
+    BYTE state = SourceMatch;
+    while (i > 0 || i + k - w > 0) {
+        BYTE cell = traceback[i * RowStride + k];
+        if (SourceMatch == state) {
+            state = cell & SourceMask;
+        }
+
+        if (SourceMatch == state) {
+            _ASSERT(i > 0 && i + k - w > 0);
+            opsBackwards[nOps++] = (pattern[i - 1] == text[i + k - w - 1]) ? '=' : 'X';
+            i--;
+        } else if (SourceDeletion == state) {
+            opsBackwards[nOps++] = 'D';
+            state = (cell & DeletionExtends) ? SourceDeletion : SourceMatch;
+            k--;
+        } else {
+            _ASSERT(SourceInsertion == state);
+            opsBackwards[nOps++] = 'I';
+            state = (cell & InsertionExtends) ? SourceInsertion : SourceMatch;
+            i--;
+            k++;
+        }
+
+        if (k < 0 || k >= bandCells || nOps > n + m) {
+            _ASSERT(!"AffineGapWithCigar: traceback left the band");
+            return -1;
+        }
+    }
+
+    //
+    // Leave alignments that start or end with an indel to LV, which has its own handling for them (they turn into clipping).
+    //
+    if (0 == nOps || 'I' == opsBackwards[0] || 'D' == opsBackwards[0] || 'I' == opsBackwards[nOps - 1] || 'D' == opsBackwards[nOps - 1]) {
+        return -1;
+    }
+
+    //
+    // Run length encode the ops in the forward direction.
+    //
+    int editDistance = 0;
+    int netIndel = 0;
+    int textUsed = 0;
+    int nCigarOps = 0;
+    char currentOp = '\0';
+    int currentCount = 0;
+    for (int op = nOps - 1; op >= -1; op--) {
+        char thisOp = '\0';
+        if (op >= 0) {
+            thisOp = opsBackwards[op];
+            if ('X' == thisOp || 'I' == thisOp || 'D' == thisOp) {
+                editDistance++;
+            }
+            if ('I' == thisOp) {
+                netIndel--;
+            } else if ('D' == thisOp) {
+                netIndel++;
+            }
+            if ('I' != thisOp) {
+                textUsed++;
+            }
+            if (useM && ('=' == thisOp || 'X' == thisOp)) {
+                thisOp = 'M';
+            }
+        }
+
+        if (thisOp == currentOp) {
+            currentCount++;
+            continue;
+        }
+
+        if (currentCount > 0) {
+            if (nCigarOps >= maxCigarOps) {
+                return -2;
+            }
+            cigarOps[nCigarOps++] = (currentCount << 4) | BAMAlignment::CigarToCode[(unsigned char)currentOp];
+        }
+        currentOp = thisOp;
+        currentCount = 1;
+    }
+
+    *o_cigarOpsUsed = nCigarOps;
+    if (NULL != o_textUsed) {
+        *o_textUsed = textUsed;
+    }
+    if (NULL != o_netIndel) {
+        *o_netIndel = netIndel;
+    }
+
+    return editDistance;
+}
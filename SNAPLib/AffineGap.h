@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+    AffineGap.h
+
+Abstract:
+
+    Banded affine-gap (Gotoh) realignment used to generate CIGAR strings for output.
+
+Environment:
+
+    User mode service.
+
+    This class is NOT thread safe.  Each writer thread owns its own instance, in the same
+    way that it owns its LandauVishkinWithCigar.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "LandauVishkin.h"
+
+//
+// The aligners score candidates with Landau-Vishkin, which finds the smallest edit distance and
+// treats a 3 base deletion as 3 times as bad as a single base deletion.  That's the right thing
+// for choosing a location, but downstream variant callers would rather see one long indel than
+// several short indels and mismatches, and want the indels placed as far left as possible.
+//
+// AffineGapWithCigar realigns a read against the reference at a location that LV has already chosen,
+// using match/mismatch scores and a gap open + gap extend penalty, within a band of diagonals around
+// the main one.  The read is aligned end-to-end, starting at the first base of the text (just like LV);
+// the end of the text is free.  When alignments tie, the traceback prefers the diagonal, which pushes
+// gaps toward the start of the read (left normalization).
+//
+// The per-row work is done 8 cells at a time with SSE2 for the match and insertion terms.  The deletion
+// term depends on the cell to its left in the same row, so it's done in a scalar pass afterward.
+//
+// This is only run at output time, and only on alignments where LV found indels, so it doesn't affect
+// the speed of seeding or scoring.
+//
+class AffineGapWithCigar {
+public:
+    AffineGapWithCigar(int i_matchScore = 1, int i_mismatchPenalty = 4, int i_gapOpenPenalty = 6, int i_gapExtendPenalty = 1);
+    ~AffineGapWithCigar();
+
+    //
+    // Align pattern (the read) against text (the reference), allowing indels up to bandWidth net bases from the
+    // main diagonal.  Writes BAM format cigar ops (using 'M' or '='/'X' depending on useM) to cigarOps.
+    //
+    // Returns the edit distance of the alignment (mismatches plus inserted and deleted bases, i.e., what goes in
+    // the NM tag), -1 if the read is too long for this aligner or no alignment is possible, or -2 if it ran out
+    // of space in cigarOps.
+    //
+    int computeCigarOps(const char *text, int textLen, const char *pattern, int patternLen, int bandWidth, bool useM,
+                        _uint32 *cigarOps, int maxCigarOps, int *o_cigarOpsUsed, int *o_textUsed, int *o_netIndel);
+
+    //
+    // Reads longer than this are left with their LV CIGAR.  It bounds the size of the traceback matrix.
+    //
+    static const int MaxPatternLength = 2048;
+
+    static const int MaxBandWidth = MAX_K - 1;
+
+private:
+    static const int LanesPerVector = 8;   // 16 bit scores in a 128 bit register
+    static const int MaxRowWidth = ((2 * MaxBandWidth + 1 + LanesPerVector - 1) / LanesPerVector) * LanesPerVector;
+    static const int RowStride = MaxRowWidth + LanesPerVector; // Extra lanes so the insertion term can read one past the end of the band
+
+    static const _int16 NegativeInfinity = -30000;
+
+    //
+    // Traceback bits, one byte per cell.
+    //
+    static const BYTE SourceMask = 0x3;
+    static const BYTE SourceMatch = 0;
+    static const BYTE SourceDeletion = 1;
+    static const BYTE SourceInsertion = 2;
+    static const BYTE DeletionExtends = 0x4;
+    static const BYTE InsertionExtends = 0x8;
+
+    int matchScore;
+    int mismatchPenalty;
+    int gapOpenPenalty;
+    int gapExtendPenalty;
+
+    _int16 *H[2];           // Best score ending at each cell of the previous and current rows
+    _int16 *F[2];           // Best score ending in an insertion (consuming read bases)
+    BYTE *traceback;        // (MaxPatternLength + 1) rows of RowStride cells
+    char *paddedText;       // Text with sentinels on both ends, so vector loads never need bounds checks
+    char *opsBackwards;     // One op per base, written during the traceback
+};
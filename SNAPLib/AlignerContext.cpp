@@ -209,6 +209,7 @@ AlignerContext::beginIteration()
 {
     writerSupplier = NULL;
     alignStart = timeInMillis();
+    DataWriter::getContention(&writerContentionAtStart);
     clipping = options->clipping;
     totalThreads = options->numThreads;
     bindToProcessors = options->bindToProcessors;
@@ -230,7 +231,11 @@ AlignerContext::beginIteration()
     readerContext.genome = index != NULL ? index->getGenome() : NULL;
     readerContext.ignoreSecondaryAlignments = options->ignoreSecondaryAlignments;
     readerContext.ignoreSupplementaryAlignments = options->ignoreSecondaryAlignments;   // Maybe we should split them out
+    readerContext.regions = options->regions;
+    readerContext.writeMateScores = options->sortOutput && ! options->noDuplicateMarking;
     DataSupplier::ExpansionFactor = options->expansionFactor;
+    MaxReadLength = options->getMaxReadLength();
+    GzipCodec::DefaultBackend = options->gzipBackend;
 
     typeSpecificBeginIteration();
 
@@ -240,6 +245,8 @@ AlignerContext::beginIteration()
             format = FileFormat::SAM[options->useM];
         } else if (BAMFile == options->outputFile.fileType) {
             format = FileFormat::BAM[options->useM];
+        } else if (CRAMFile == options->outputFile.fileType) {
+            format = FileFormat::CRAM[options->useM];
         } else {
             //
             // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
@@ -406,6 +413,22 @@ AlignerContext::printStats()
 
     stats->printHistograms(stdout);
 
+    //
+    // How much the threads writing output got in each other's way, which is worth a look when there are lots of them.
+    //
+    DataWriter::Contention contention;
+    DataWriter::getContention(&contention);
+    _int64 reservations = contention.reservations - writerContentionAtStart.reservations;
+    if (reservations > 0) {
+        char reservationsString[strBufLen];
+        WriteStatusMessage("Output: %s batches, %lld waited for another thread's (%.3f s); %.3f s waiting for the encoder, %.3f s for writes\n",
+            FormatUIntWithCommas(reservations, reservationsString, strBufLen),
+            contention.reserveWaits - writerContentionAtStart.reserveWaits,
+            (contention.reserveWaitTime - writerContentionAtStart.reserveWaitTime) * 1e-9,
+            (contention.encodeWaitTime - writerContentionAtStart.encodeWaitTime) * 1e-9,
+            (contention.writeWaitTime - writerContentionAtStart.writeWaitTime) * 1e-9);
+    }
+
 #ifdef  TIME_STRING_DISTANCE
     WriteStatusMessage("%llds, %lld calls in BSD noneClose, not -1\n",  stats->nanosTimeInBSD[0][1]/1000000000, stats->BSDCounts[0][1]);
     WriteStatusMessage("%llds, %lld calls in BSD noneClose, -1\n",      stats->nanosTimeInBSD[0][0]/1000000000, stats->BSDCounts[0][0]);
@@ -525,6 +548,12 @@ AlignerContext::parseOptions(
 		return NULL;
     }
 
+    if (options->shardSpec != NULL && ! (options->sortOutput && options->outputFile.fileType == BAMFile && ! options->outputFile.isStdio)) {
+        WriteErrorMessage("-shard only works with sorted (-so) BAM output to a file\n");
+		delete options;
+		return NULL;
+    }
+
     if (options->maxSecondaryAlignmentAdditionalEditDistance > (int)options->extraSearchDepth) {
         WriteErrorMessage("You can't have the max edit distance for secondary alignments (-om) be bigger than the max search depth (-D)\n");
 		delete options;
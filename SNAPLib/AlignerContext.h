@@ -30,6 +30,7 @@ Revision History:
 #include "AlignerStats.h"
 #include "ParallelTask.h"
 #include "GenomeIndex.h"
+#include "DataWriter.h"
 
 class AlignerExtension;
 
@@ -96,6 +97,7 @@ public:
     ReaderContext                        readerContext;
     _int64                               alignStart;
     _int64                               alignTime;
+    DataWriter::Contention               writerContentionAtStart;
     AlignerOptions                      *options;
     AlignerStats                        *stats;
     AlignerExtension                    *extension;
@@ -28,6 +28,7 @@ Revision History:
 #include "FASTQ.h"
 #include "SAM.h"
 #include "Bam.h"
+#include "CRAM.h"
 #include "exit.h"
 #include "Error.h"
 #include "BaseAligner.h"
@@ -46,6 +47,8 @@ AlignerOptions::AlignerOptions(
     clipping(ClipBack),
     sortOutput(false),
     noIndex(false),
+    csiIndex(false),
+    shardSpec(NULL),
     noDuplicateMarking(false),
     noQualityCalibration(false),
     sortMemory(0),
@@ -69,11 +72,15 @@ AlignerOptions::AlignerOptions(
     maxSecondaryAlignmentsPerContig(-1),    // -1 means don't limit
     preserveClipping(false),
     expansionFactor(1.0),
+    gzipBackend(GzipCodec::Zlib),
+    regions(NULL),
     noUkkonen(false),
     noOrderedEvaluation(false),
 	noTruncation(false),
 	minReadLength(DEFAULT_MIN_READ_LENGTH),
     maxDistFraction(0.0),
+    longReadMinLength(0),
+    maxReadLength(0),
 	mapIndex(false),
 	prefetchIndex(false),
     writeBufferSize(16 * 1024 * 1024)
@@ -131,6 +138,12 @@ AlignerOptions::usageMessage()
         "       Even if the read itself does not.  If you specify b mode, then a read will be emitted only if it and its partner both pass the filter.\n"
         "  -S   suppress additional processing (sorted BAM output only)\n"
         "       i=index, d=duplicate marking\n"
+        " -csi  index sorted BAM output with a .csi rather than a .bai.  This is automatic when a contig is longer than a .bai\n"
+        "       can index (2^29 bases).\n"
+        " -shard with -so and BAM output, write a sorted, indexed file per contig (-shard contigs) or per interval of a BED\n"
+        "       file (-shard file.bed) instead of one big one.  They're named after -o, with the contig or interval before the\n"
+        "       extension (out.chr1.bam, out.chr1_1001-2000.bam), and out.unplaced.bam gets the unmapped reads and any outside\n"
+        "       the intervals.  A read goes in the file for where its alignment starts, even if it runs into the next interval\n"
 #if     USE_DEVTEAM_OPTIONS
         "  -I   ignore IDs that don't match in the paired-end aligner\n"
 #ifdef  _MSC_VER    // Only need this on Windows, since memory allocation is fast on Linux
@@ -142,7 +155,8 @@ AlignerOptions::usageMessage()
         "  -M   indicates that CIGAR strings in the generated SAM file should use M (alignment\n"
         "       match) rather than = and X (sequence (mis-)match).  This is the default\n"
         "  -=   use the new style CIGAR strings with = and X rather than M.  The opposite of -M\n"
-        "  -G   specify a gap penalty to use when generating CIGAR strings\n"
+        "  -G   specify a gap open penalty to use when generating CIGAR strings.  Alignments with indels are realigned\n"
+        "       with affine gap penalties (gap extend 1, mismatch 4), which gives longer, left-normalized indels\n"
         "  -pf  specify the name of a file to contain the run speed\n"
         "  --hp Indicates not to use huge pages (this may speed up index load and slow down alignment)  This is the default\n"
         "  -hp  Indicates to use huge pages (this may speed up alignment and slow down index load).\n"
@@ -163,6 +177,12 @@ AlignerOptions::usageMessage()
         "       is counted.\n"
 		"  -pc  Preserve the soft clipping for reads coming from SAM or BAM files\n"
 		"  -xf  Increase expansion factor for BAM and GZ files (default %.1f)\n"
+        " -gzc  Library for compressing and decompressing BAM and BGZF blocks: zlib (the default), libdeflate or isal.  The\n"
+        "       latter two are faster, but are only available if SNAP was built with them (see the Makefile).\n"
+        " -region Only align the reads from a sorted, indexed BAM file that overlap these regions.  This is a BED file or a comma\n"
+        "       separated list of contig, contig:begin or contig:begin-end (counting from 1, like samtools).  SNAP uses the\n"
+        "       .bai or .csi file (from -so or samtools index) to read just those parts of the input, on all of the threads.  With\n"
+        "       paired input, a pair is aligned if either read overlaps a region, and mates elsewhere are fetched using the index.\n"
 		"  -hdp Use Hadoop-style prefixes (reporter:status:...) on error messages, and emit hadoop-style progress messages\n"
 		"  -mrl Specify the minimum read length to align, reads shorter than this (after clipping) stay unaligned.  This should be\n"
 		"       a good bit bigger than the seed length or you might get some questionable alignments.  Default %d\n"
@@ -175,9 +195,13 @@ AlignerOptions::usageMessage()
 		"       already in memory and your operating system is slow at reading mapped files (i.e., some versions of Linux,\n"
 		"       but not Windows).\n"
         "  -lp  Run SNAP at low scheduling priority (Only implemented on Windows)\n"
-#ifdef LONG_READS
         "  -dp  Edit distance as a percentage of read length (single only, overrides -d)\n"
-#endif
+        "  -lr  Long read mode (single only).  Reads of at least this many bases are aligned by chaining seed hits and filling\n"
+        "       the gaps between them with banded alignment, which allows far more than -d edits.  Shorter reads that the normal\n"
+        "       aligner doesn't find are retried the same way.  The edit distance limit is -dp if given, otherwise 15%% of the\n"
+        "       read length.  -lr also raises the default for -xrl to %d.\n"
+        " -xrl  Longest read to accept, in bases (at most %d).  The input buffers are sized for reads this long, and SNAP stops\n"
+        "       with an error on a longer read.  Default %d, or %d with -lr.\n"
 		"  -nu  No Ukkonen: don't reduce edit distance search based on prior candidates. This option is purely for\n"
 		"       evaluating the performance effect of using Ukkonen's algorithm rather than Smith-Waterman, and specifying\n"
 		"       it will slow down execution without improving the alignments.\n"
@@ -194,7 +218,9 @@ AlignerOptions::usageMessage()
 			minWeightToCheck,
             MAPQ_LIMIT_FOR_SINGLE_HIT, MAPQ_LIMIT_FOR_SINGLE_HIT, MAPQ_LIMIT_FOR_SINGLE_HIT,
             expansionFactor,
-			DEFAULT_MIN_READ_LENGTH);
+			DEFAULT_MIN_READ_LENGTH,
+            MAX_READ_LENGTH,
+            MAX_READ_LENGTH, DEFAULT_MAX_READ_LENGTH, MAX_READ_LENGTH);
 
     if (extra != NULL) {
         extra->usageMessage();
@@ -219,7 +245,9 @@ AlignerOptions::usageMessage()
                       "    -fastq\n"
                       "    -compressedFastq\n"
                       "    -sam\n"
+                      "    -compressedSam\n"
                       "    -bam\n"
+                      "    -cram\n"
                       "    -pairedFastq\n"
                       "    -pairedInterleavedFastq\n"
                       "    -pairedCompressedInterleavedFastq\n"
@@ -227,6 +255,11 @@ AlignerOptions::usageMessage()
                       "So, for example, you could specify -bam input.file to make SNAP treat input.file as a BAM file,\n"
                       "even though it would ordinarily assume a FASTQ file for input or a SAM file for output when it\n"
                       "doesn't recoginize the file extension.\n"
+                      "The compressed types can be gzip (.gz) or, if SNAP was built with zstd, zstd (.zst); SNAP tells which from\n"
+                      "the file's contents.  Compressed SAM input is only recognized by extension for .sam.gz and .sam.zst.\n"
+                      "CRAM input (.cram) is decoded using the index as the reference, so it must have been written against the\n"
+                      "same reference sequences.  CRAM output is written against the index in the same way.  Its reference MD5s\n"
+                      "(M5) need an index built by a SNAP that keeps the FASTA's IUPAC codes, if the FASTA had any besides N.\n"
                       "In order to use a file name that begins with a '-' and not have SNAP treat it as a switch, you must\n"
                       "explicitly specify the type.  But really, that's just confusing and you shouldn't do it.\n"
                       "Input and output may also be from/to stdin/stdout. To do that, use a - for the input or output file\n"
@@ -329,6 +362,14 @@ AlignerOptions::parse(
 	} else if (strcmp(argv[n], "-so") == 0) {
 		sortOutput = true;
 		return true;
+	} else if (strcmp(argv[n], "-csi") == 0) {
+		csiIndex = true;
+		return true;
+	} else if (strcmp(argv[n], "-shard") == 0) {
+		if (n + 1 < argc) {
+			shardSpec = argv[++n];
+			return true;
+		}
 	} else if (strcmp(argv[n], "-map") == 0) {
 		mapIndex = true;
 		return true;
@@ -513,6 +554,26 @@ AlignerOptions::parse(
         n++;
 
         return true;
+    } else if (strcmp(argv[n], "-gzc") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            if (!GzipCodec::ParseBackend(argv[n], &gzipBackend)) {
+                WriteErrorMessage("Unknown -gzc library '%s', it must be zlib, libdeflate or isal\n", argv[n]);
+                return false;
+            }
+            if (!GzipCodec::IsAvailable(gzipBackend)) {
+                WriteErrorMessage("This SNAP wasn't built with %s, so -gzc %s isn't available\n", argv[n], argv[n]);
+                return false;
+            }
+            return true;
+        }
+    } else if (strcmp(argv[n], "-region") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            regions = argv[n];
+            return true;
+        }
+        WriteErrorMessage("-region requires a BED file or a list of regions\n");
     } else if (strcmp(argv[n], "-xf") == 0) {
         if (n + 1 < argc) {
             n++;
@@ -540,6 +601,27 @@ AlignerOptions::parse(
             minReadLength = atoi(argv[n]);
             return minReadLength > 0;
         }
+    } else if (strcmp(argv[n], "-lr") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            longReadMinLength = atoi(argv[n]);
+            if (longReadMinLength > MAX_READ_LENGTH) {
+                WriteErrorMessage("-lr %u is longer than the longest read SNAP handles (%d).\n", longReadMinLength, MAX_READ_LENGTH);
+                return false;
+            }
+            return (! isPaired()) && longReadMinLength > 0;
+        }
+    } else if (strcmp(argv[n], "-xrl") == 0) {
+        if (n + 1 < argc) {
+            n++;
+            int value = atoi(argv[n]);
+            if (value <= 0 || value > MAX_READ_LENGTH) {
+                WriteErrorMessage("-xrl must be between 1 and %d.\n", MAX_READ_LENGTH);
+                return false;
+            }
+            maxReadLength = value;
+            return true;
+        }
     } else if (strcmp(argv[n], "-dp") == 0) {
         if (n + 1 < argc) {
             n++;
@@ -795,15 +877,22 @@ AlignerOptions::passFilter(
     PairedReadSupplierGenerator *
 SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context)
 {
-    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == CRAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    if (context.regions != NULL && fileType != BAMFile) {
+        WriteErrorMessage("-region only works for BAM input, since it needs the BAM index\n");
+        soft_exit(1);
+    }
 
     switch (fileType) {
     case SAMFile:
-        return SAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context);
+        return SAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context, isCompressed);
         
     case BAMFile:
         return BAMReader::createPairedReadSupplierGenerator(fileName,numThreads, quicklyDropUnpairedReads, context);
 
+    case CRAMFile:
+        return CRAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context);
+
     case FASTQFile:
         return PairedFASTQReader::createPairedReadSupplierGenerator(fileName, secondFileName, numThreads, context, isCompressed);
 
@@ -822,13 +911,20 @@ SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpa
 SNAPFile::createReadSupplierGenerator(int numThreads, const ReaderContext& context)
 {
     _ASSERT(secondFileName == NULL);
+    if (context.regions != NULL && fileType != BAMFile) {
+        WriteErrorMessage("-region only works for BAM input, since it needs the BAM index\n");
+        soft_exit(1);
+    }
     switch (fileType) {
     case SAMFile:
-        return SAMReader::createReadSupplierGenerator(fileName, numThreads, context);
+        return SAMReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
         
     case BAMFile:
         return BAMReader::createReadSupplierGenerator(fileName,numThreads, context);
 
+    case CRAMFile:
+        return CRAMReader::createReadSupplierGenerator(fileName, numThreads, context);
+
     case FASTQFile:
         return FASTQReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
 
@@ -898,8 +994,9 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
                snapFile->fileType = FASTQFile;
                *argsConsumed = 2;
             }
-        } else if (!strcmp(args[0], "-sam")) {
+        } else if (!strcmp(args[0], "-sam") || (!strcmp(args[0], "-compressedSam") && isInput)) {
             snapFile->fileType = SAMFile;
+            snapFile->isCompressed = !strcmp(args[0], "-compressedSam");
             *argsConsumed = 2;
 		} else if (!strcmp(args[0], "-samNoSQ") && !isInput) {	// No header is only valid for output file types
 			snapFile->fileType = SAMFile;
@@ -909,6 +1006,10 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->fileType = BAMFile;
             snapFile->isCompressed = true;
             *argsConsumed = 2;
+        } else if (!strcmp(args[0], "-cram")) {
+            snapFile->fileType = CRAMFile;
+            snapFile->isCompressed = true;
+            *argsConsumed = 2;
         } else if (!strcmp(args[0], "-pairedInterleavedFastq") || !strcmp(args[0], "-pairedCompressedInterleavedFastq")) {
             if (!paired) {
                 WriteErrorMessage("Specified %s for a single-end alignment.  To treat it as single-end, just use ordinary fastq (or compressed fastq, as appropriate)\n", args[0]);
@@ -942,23 +1043,30 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
     } else if (util::stringEndsWith(args[0], ".bam")) {
         snapFile->fileType = BAMFile;
         snapFile->isCompressed = true;
+    } else if (util::stringEndsWith(args[0], ".cram")) {
+        snapFile->fileType = CRAMFile;
+        snapFile->isCompressed = true;
+    } else if (isInput && (util::stringEndsWith(args[0], ".sam.gz") || util::stringEndsWith(args[0], ".sam.zst"))) {
+        snapFile->fileType = SAMFile;
+        snapFile->isCompressed = true;
     } else if (!isInput) {
         //
         // No default output file type.
         //
-        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam or .bam, and doesn't have an explicit type\n"
+        WriteErrorMessage("You specified an output file with name '%s', which doesn't end in .sam, .bam or .cram, and doesn't have an explicit type\n"
                           "specifier.  There is no default output file type.  Consider doing something like '-o -bam %s'\n", args[0], args[0]);
 		return false;
     } else if (util::stringEndsWith(args[0], ".fq") || util::stringEndsWith(args[0], ".fastq") ||
         util::stringEndsWith(args[0], ".fq.gz") || util::stringEndsWith(args[0], ".fastq.gz") ||
-        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip")) {
+        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip") ||
+        util::stringEndsWith(args[0], ".fq.zst") || util::stringEndsWith(args[0], ".fastq.zst")) {
 
         // 
         // It's a fastq input file (either by default or because it's got a .fq or .fastq extension, we don't
         // need to check).  See if it's also compressed.
         //
         snapFile->fileType= FASTQFile;
-        if (util::stringEndsWith(args[0], ".gz") || util::stringEndsWith(args[0], ".gzip")) {
+        if (util::stringEndsWith(args[0], ".gz") || util::stringEndsWith(args[0], ".gzip") || util::stringEndsWith(args[0], ".zst")) {
             snapFile->isCompressed = true;
         } else {
             snapFile->isCompressed = false;
@@ -28,6 +28,7 @@ Revision History:
 #include "options.h"
 #include "Genome.h"
 #include "Read.h"
+#include "GzipCodec.h"
 
 #define MAPQ_LIMIT_FOR_SINGLE_HIT 10
 
@@ -64,6 +65,8 @@ struct AlignerOptions : public AbstractOptions
     int                 numThreads;
     unsigned            maxDist;
     float               maxDistFraction;
+    unsigned            longReadMinLength;  // if non-zero, reads at least this long use LongReadAligner
+    unsigned            maxReadLength;      // -xrl: longest read to accept, 0 for the default (see getMaxReadLength)
     unsigned            numSeedsFromCommandLine;
     double              seedCoverage;       // Exclusive with numSeeds; this is readSize/seedSize
     bool                seedCountSpecified; // Has either -n or -sc been specified?  This bool is used to make sure they're not both specified on the command line
@@ -77,6 +80,8 @@ struct AlignerOptions : public AbstractOptions
     ReadClippingType    clipping;
     bool                sortOutput;
     bool                noIndex;
+    bool                csiIndex;   // write a .csi rather than a .bai, even if the contigs aren't too long for a .bai
+    const char         *shardSpec;  // "contigs" or a BED file to split sorted BAM output by, or NULL for one file
     bool                noDuplicateMarking;
     bool                noQualityCalibration;
     unsigned            sortMemory; // total output sorting buffer size in Gb
@@ -84,7 +89,7 @@ struct AlignerOptions : public AbstractOptions
     bool                explorePopularSeeds;
     bool                stopOnFirstHit;
 	bool				useM;	// Should we generate CIGAR strings using = and X, or using the old-style M?
-    unsigned            gapPenalty; // if non-zero use gap penalty aligner
+    unsigned            gapPenalty; // if non-zero, realign output CIGARs with indels using affine gap penalties with this gap open penalty
     AbstractOptions    *extra; // extra options
     const char         *rgLineContents;
     const char         *perfFileName;
@@ -97,6 +102,8 @@ struct AlignerOptions : public AbstractOptions
     int                 maxSecondaryAlignmentsPerContig;
     bool                preserveClipping;
     float               expansionFactor;
+    GzipCodec::Backend  gzipBackend;
+    const char         *regions; // -region: a BED file or list of regions to read from an indexed BAM file
     bool                noUkkonen;
     bool                noOrderedEvaluation;
 	bool				noTruncation;
@@ -126,4 +133,8 @@ struct AlignerOptions : public AbstractOptions
     bool passFilter(Read* read, AlignmentResult result, bool tooShort, bool secondaryAlignment);
     
     virtual bool isPaired() { return false; }
+
+    // The longest read this run takes: -xrl if given, otherwise enough for long read mode when -lr is on
+    unsigned getMaxReadLength() const
+    { return maxReadLength != 0 ? maxReadLength : (longReadMinLength > 0 ? MAX_READ_LENGTH : DEFAULT_MAX_READ_LENGTH); }
 };
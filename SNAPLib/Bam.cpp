@@ -33,18 +33,45 @@ Environment:
 #include "VariableSizeMap.h"
 #include "PairedAligner.h"
 #include "GzipDataWriter.h"
+#include "GzipCodec.h"
 #include "Error.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BAM_USE_SSE2 1
+#endif
+
+//
+// pshufb (SSSE3) looks up 16 of the 4-bit base codes at a time.  Every x64 compiler we use can generate it, but not every
+// x64 processor has it, so the code that uses it is compiled for SSSE3 by itself and only called if the processor has it.
+//
+#if defined(_M_X64)
+#include <tmmintrin.h>
+#include <intrin.h>
+#define BAM_USE_SSSE3 1
+#define BAM_SSSE3_FUNCTION
+static bool ProcessorHasSSSE3() { int info[4]; __cpuid(info, 1); return (info[2] & (1 << 9)) != 0; }
+#elif defined(__x86_64__) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define BAM_USE_SSSE3 1
+#define BAM_SSSE3_FUNCTION __attribute__((target("ssse3")))
+static bool ProcessorHasSSSE3() { __builtin_cpu_init(); return __builtin_cpu_supports("ssse3") != 0; }
+#endif
+
 using std::max;
 using std::min;
 using util::strnchr;
 
-BAMReader::BAMReader(const ReaderContext& i_context) : ReadReader(i_context)
+BAMReader::BAMReader(const ReaderContext& i_context) : ReadReader(i_context), data(NULL), regions(NULL), splitPairs(NULL)
 {
 }
 
 BAMReader::~BAMReader()
 {
+    delete data;
+    for (VariableSizeVector<RefSeq>::iterator i = refSeqs.begin(); i != refSeqs.end(); i++) {
+        delete [] i->name;
+    }
 }
 
     bool
@@ -68,9 +95,9 @@ BAMReader::init(
     // todo: integrate supplier models
     // might need up to 3x extra for expanded sequence + quality + cigar data
     if (!strcmp("-", fileName)) {
-        data = DataSupplier::GzipBamStdio->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+        data = DataSupplier::GzipBamStdio->getDataReader(bufferCount, maxRecordLength(), 3.0 * DataSupplier::ExpansionFactor, 0);
     } else {
-        data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor, 0);
+        data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, maxRecordLength(), 3.0 * DataSupplier::ExpansionFactor, 0);
     }
 
     if (! data->init(fileName)) {
@@ -85,27 +112,41 @@ BAMReader::init(
     _ASSERT(context.headerBytes > 0);
     reinit(startingOffset, amountOfFileToProcess);
     if ((size_t) startingOffset < context.headerBytes) {
-		_int64 bytesToSkip = context.headerBytes - startingOffset;
+        skipBytes(fileName, context.headerBytes - startingOffset);
+    }
+}
 
-		while (bytesToSkip > 0) {
-			char* p;
-			_int64 valid, start;
-			bool ok = data->getData(&p, &valid, &start);
-			if (!ok) {
+    void
+BAMReader::skipBytes(
+    const char *fileName,
+    _int64 bytes)
+{
+	_int64 bytesToSkip = bytes;
+
+	while (bytesToSkip > 0) {
+		char* p;
+		_int64 valid, start;
+		if (!data->getData(&p, &valid, &start)) {
+			//
+			// When the whole file is shorter than the overflow, the first batch has nothing that may begin a record,
+			// and it all shows up in the next one, just as in getNextRead.
+			//
+			data->nextBatch();
+			if (!data->getData(&p, &valid, &start)) {
 				WriteErrorMessage("failure reading file %s\n", fileName);
 				soft_exit(1);
 			}
+		}
 
-			_int64 bytesToSkipThisTime = __min(valid, bytesToSkip);
-			data->advance(bytesToSkipThisTime);
-			if (bytesToSkipThisTime > start) {
-				data->nextBatch();
-			}
-			data->getData(&p, &valid, &start);
-
-			bytesToSkip -= bytesToSkipThisTime;
+		_int64 bytesToSkipThisTime = __min(valid, bytesToSkip);
+		data->advance(bytesToSkipThisTime);
+		if (bytesToSkipThisTime > start) {
+			data->nextBatch();
 		}
-    }
+		data->getData(&p, &valid, &start);
+
+		bytesToSkip -= bytesToSkipThisTime;
+	}
 }
 
     void
@@ -164,7 +205,12 @@ BAMReader::readHeader(
 	int n_ref = header->n_ref();
 	BAMHeaderRefSeq* refSeq = header->firstRefSeq();
 	for (int i = 0; i < n_ref; i++, refSeq = refSeq->next()) {
-		// just advance
+		RefSeq ref;
+		ref.name = new char[refSeq->l_name + 1];
+		memcpy(ref.name, refSeq->name(), refSeq->l_name);
+		ref.name[refSeq->l_name] = 0;
+		ref.length = refSeq->l_ref();
+		refSeqs.push_back(ref);
 	}
 	
 	char* p = new char[textHeaderSize + 1];
@@ -197,12 +243,1029 @@ BAMReader::reinit(
     extraOffset = 0;
 }
 
+    BAMReader*
+BAMReader::createForSpan(
+    const char *fileName,
+    int bufferCount,
+    const BAMRegionList* regions,
+    int span,
+    const ReaderContext& context)
+{
+    _ASSERT(context.headerBytes > 0);
+    BAMReader* reader = new BAMReader(context);
+    reader->data = DataSupplier::GzipBamDefault->getDataReader(bufferCount, maxRecordLength(), 3.0 * DataSupplier::ExpansionFactor, 0);
+    if (! reader->data->init(fileName)) {
+        WriteErrorMessage("Unable to read file %s\n", fileName);
+        soft_exit(1);
+    }
+
+    //
+    // Decompress the blocks from the one the span starts in through the one it ends in, and skip to the first read.
+    //
+    const BAMRegionSpan& s = regions->getSpan(span);
+    _int64 firstBlock = (_int64) (s.start >> 16), lastBlock = (_int64) (s.end >> 16);
+    reader->reinit(firstBlock, lastBlock - firstBlock + 1);
+    reader->skipBytes(fileName, (_int64) (s.start & 0xffff));
+    reader->regions = regions;
+    reader->firstRegion = s.firstRegion;
+    reader->nextRegion = s.firstRegion;
+    reader->endRegion = s.endRegion;
+    return reader;
+}
+
+    int
+BAMReader::getRefID(
+    const char* name,
+    size_t nameLength)
+{
+    for (int i = 0; i < refSeqs.size(); i++) {
+        if (strlen(refSeqs[i].name) == nameLength && ! memcmp(refSeqs[i].name, name, nameLength)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// With -region, each thread reads whole spans of the file by itself, rather than sharing one reader through a queue.
+//
+class BAMRegionReadSupplier : public ReadSupplier
+{
+public:
+    BAMRegionReadSupplier(const char* i_fileName, BAMRegionList* i_regions, const ReaderContext& i_context)
+        : fileName(i_fileName), regions(i_regions), context(i_context), reader(NULL) {}
+
+    virtual ~BAMRegionReadSupplier()
+    { delete reader; }
+
+    virtual Read* getNextRead();
+
+    virtual void holdBatch(DataBatch batch)
+    { reader->holdBatch(batch); }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return reader->releaseBatch(batch); }
+
+private:
+    const char* fileName;
+    BAMRegionList* regions;
+    const ReaderContext context;
+    BAMReader* reader;
+    Read read;
+};
+
+    Read*
+BAMRegionReadSupplier::getNextRead()
+{
+    while (reader == NULL || ! reader->getNextRead(&read)) {
+        delete reader;
+        reader = NULL;
+        int span;
+        if (! regions->getNextSpan(&span)) {
+            return NULL;
+        }
+        reader = BAMReader::createForSpan(fileName, 2, regions, span, context);
+    }
+    return &read;
+}
+
+//
+// The pairs that spans have set aside, so that when each read of a pair is set aside by a different span only one of them
+// fetches the pair.
+//
+class BAMClaimedPairs
+{
+public:
+    BAMClaimedPairs() : claimed(10000)
+    { InitializeExclusiveLock(&lock); }
+
+    ~BAMClaimedPairs()
+    { DestroyExclusiveLock(&lock); }
+
+    // True the first time it's called for a pair.
+    bool claim(_uint64 key)
+    {
+        AcquireExclusiveLock(&lock);
+        bool first = claimed.tryFind(key) == NULL;
+        if (first) {
+            claimed.put(key, 1);
+        }
+        ReleaseExclusiveLock(&lock);
+        return first;
+    }
+
+private:
+    ExclusiveLock               lock;
+    VariableSizeMap<_uint64,int> claimed;
+};
+
+//
+// The paired version matches up the reads in each span separately, but only the pairs that both start in the span's
+// regions.  The reader sets aside the rest, whose mates may be in another span or not overlap any region at all, and
+// once the span is done they're fetched a batch at a time from wherever their two reads start, using the index.
+//
+class BAMRegionPairedReadSupplier : public PairedReadSupplier
+{
+public:
+    BAMRegionPairedReadSupplier(const char* i_fileName, BAMRegionList* i_regions, BAMClaimedPairs* i_claimed,
+            bool i_quicklyDropUnmatchedReads, const ReaderContext& i_context)
+        : fileName(i_fileName), regions(i_regions), claimed(i_claimed), quicklyDropUnmatchedReads(i_quicklyDropUnmatchedReads),
+        context(i_context), matcher(NULL), nextSplitPair(0), nextFetchedPair(0) {}
+
+    virtual ~BAMRegionPairedReadSupplier()
+    {
+        delete matcher;
+        freeFetchedPairs();
+    }
+
+    virtual bool getNextReadPair(Read** read1, Read** read2);
+
+    // The fetched pairs have their own memory, so only the matcher's reads are in batches.
+    virtual void holdBatch(DataBatch batch)
+    {
+        if (matcher != NULL) {
+            matcher->holdBatch(batch);
+        }
+    }
+
+    virtual bool releaseBatch(DataBatch batch)
+    { return matcher == NULL || matcher->releaseBatch(batch); }
+
+    // How many set aside pairs to fetch at once.
+    static const int FetchBatchSize = 4096;
+
+private:
+    void fetchSplitPairs();
+    void freeFetchedPairs();
+
+    const char* fileName;
+    BAMRegionList* regions;
+    BAMClaimedPairs* claimed;
+    const bool quicklyDropUnmatchedReads;
+    const ReaderContext context;
+    PairedReadReader* matcher; // owns the reader for the current span
+    Read internalRead1;
+    Read internalRead2;
+
+    struct FetchedPair
+    {
+        ReadWithOwnMemory*  reads[NUM_READS_PER_PAIR];
+    };
+
+    VariableSizeVector<BAMSplitPair> splitPairs; // set aside by the reader for the current span
+    int nextSplitPair;
+    VariableSizeVector<FetchedPair> fetchedPairs;
+    int nextFetchedPair;
+};
+
+    bool
+BAMRegionPairedReadSupplier::getNextReadPair(
+    Read** read1,
+    Read** read2)
+{
+    while (true) {
+        if (matcher != NULL) {
+            if (matcher->getNextReadPair(&internalRead1, &internalRead2)) {
+                *read1 = &internalRead1;
+                *read2 = &internalRead2;
+                return true;
+            }
+            delete matcher;
+            matcher = NULL;
+
+            // Keep the pairs that no other span has claimed.
+            int n = 0;
+            for (int i = 0; i < splitPairs.size(); i++) {
+                if (claimed->claim(splitPairs[i].key)) {
+                    splitPairs[n++] = splitPairs[i];
+                }
+            }
+            splitPairs.truncate(n);
+            nextSplitPair = 0;
+        }
+
+        if (nextFetchedPair < fetchedPairs.size()) {
+            *read1 = fetchedPairs[nextFetchedPair].reads[0];
+            *read2 = fetchedPairs[nextFetchedPair].reads[1];
+            nextFetchedPair++;
+            return true;
+        }
+        freeFetchedPairs();
+
+        if (nextSplitPair < splitPairs.size()) {
+            fetchSplitPairs();
+            continue;
+        }
+
+        int span;
+        if (! regions->getNextSpan(&span)) {
+            return false;
+        }
+        splitPairs.clear();
+        BAMReader* reader = BAMReader::createForSpan(fileName, 2 + PairedReadReader::MatchBuffers, regions, span, context);
+        reader->setAsideSplitPairs(&splitPairs);
+        matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
+    }
+}
+
+    void
+BAMRegionPairedReadSupplier::fetchSplitPairs()
+{
+    //
+    // Read the reads that start where each of the pairs does, and keep the ones that belong to them.
+    //
+    int end = min(nextSplitPair + FetchBatchSize, (int) splitPairs.size());
+    VariableSizeMap<_uint64,int> wanted(2 * (end - nextSplitPair));
+    VariableSizeVector<BAMRegion> positions;
+    for (int i = nextSplitPair; i < end; i++) {
+        const BAMSplitPair& pair = splitPairs[i];
+        FetchedPair fetched = {{NULL, NULL}};
+        wanted.put(pair.key, fetchedPairs.size());
+        fetchedPairs.push_back(fetched);
+        BAMRegion position = {pair.refID, pair.pos, pair.pos + 1};
+        positions.push_back(position);
+        if (pair.mateRefID >= 0) { // an unplaced mate can't be fetched
+            BAMRegion matePosition = {pair.mateRefID, max(pair.matePos, 0), max(pair.matePos, 0) + 1};
+            positions.push_back(matePosition);
+        }
+    }
+    nextSplitPair = end;
+
+    BAMRegionList* fetchList = BAMRegionList::createForPositions(regions, &positions);
+    Read read;
+    for (int span = 0; span < fetchList->getSpanCount(); span++) {
+        BAMReader* reader = BAMReader::createForSpan(fileName, 2, fetchList, span, context);
+        while (reader->getNextRead(&read)) {
+            unsigned flags = read.getOriginalSAMFlags();
+            int* index = wanted.tryFind(util::hash64(read.getId(), read.getIdLength()));
+            if (index == NULL || (flags & (SAM_SECONDARY | SAM_SUPPLEMENTARY))) {
+                continue;
+            }
+            ReadWithOwnMemory** slot = &fetchedPairs[*index].reads[(flags & SAM_FIRST_SEGMENT) ? 0 : 1];
+            if (*slot == NULL) {
+                *slot = new ReadWithOwnMemory(read);
+            }
+        }
+        delete reader;
+    }
+    delete fetchList;
+
+    // Drop the pairs that are missing a read, like the matcher does at the end of a file.
+    int n = 0, missing = 0;
+    for (int i = 0; i < fetchedPairs.size(); i++) {
+        FetchedPair& fetched = fetchedPairs[i];
+        if (fetched.reads[0] != NULL && fetched.reads[1] != NULL) {
+            fetchedPairs[n++] = fetched;
+            continue;
+        }
+        for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+            if (fetched.reads[r] != NULL) {
+                fetched.reads[r]->dispose();
+                delete fetched.reads[r];
+                missing++;
+            }
+        }
+    }
+    fetchedPairs.truncate(n);
+    nextFetchedPair = 0;
+    if (missing > 0) {
+        WriteErrorMessage(" warning: -region couldn't find the mates of %d reads, so they were discarded\n", missing);
+    }
+}
+
+    void
+BAMRegionPairedReadSupplier::freeFetchedPairs()
+{
+    for (int i = 0; i < fetchedPairs.size(); i++) {
+        for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+            fetchedPairs[i].reads[r]->dispose();
+            delete fetchedPairs[i].reads[r];
+        }
+    }
+    fetchedPairs.clear();
+    nextFetchedPair = 0;
+}
+
+//
+// Reads the header and sets up the regions once, for all of the threads.
+//
+static BAMRegionList* CreateRegionList(const char* fileName, ReaderContext* io_context)
+{
+    if (! strcmp(fileName, "-")) {
+        WriteErrorMessage("-region needs a BAM file with an index, so it can't read from stdin\n");
+        soft_exit(1);
+    }
+    BAMReader* reader = BAMReader::create(fileName, 2, 0, 0, *io_context);
+    *io_context = *reader->getContext();
+    BAMRegionList* regions = BAMRegionList::create(fileName, io_context->regions, reader);
+    delete reader;
+    return regions;
+}
+
+class BAMRegionReadSupplierGenerator : public ReadSupplierGenerator
+{
+public:
+    BAMRegionReadSupplierGenerator(const char* i_fileName, const ReaderContext& i_context) : fileName(i_fileName), context(i_context)
+    { regions = CreateRegionList(fileName, &context); }
+
+    virtual ~BAMRegionReadSupplierGenerator()
+    { delete regions; }
+
+    virtual ReadSupplier* generateNewReadSupplier()
+    { return new BAMRegionReadSupplier(fileName, regions, context); }
+
+    virtual ReaderContext* getContext()
+    { return &context; }
+
+private:
+    const char* fileName;
+    ReaderContext context;
+    BAMRegionList* regions;
+};
+
+class BAMRegionPairedReadSupplierGenerator : public PairedReadSupplierGenerator
+{
+public:
+    BAMRegionPairedReadSupplierGenerator(const char* i_fileName, bool i_quicklyDropUnmatchedReads, const ReaderContext& i_context)
+        : fileName(i_fileName), quicklyDropUnmatchedReads(i_quicklyDropUnmatchedReads), context(i_context)
+    { regions = CreateRegionList(fileName, &context); }
+
+    virtual ~BAMRegionPairedReadSupplierGenerator()
+    { delete regions; }
+
+    virtual PairedReadSupplier* generateNewPairedReadSupplier()
+    { return new BAMRegionPairedReadSupplier(fileName, regions, &claimed, quicklyDropUnmatchedReads, context); }
+
+    virtual ReaderContext* getContext()
+    { return &context; }
+
+private:
+    const char* fileName;
+    const bool quicklyDropUnmatchedReads;
+    ReaderContext context;
+    BAMRegionList* regions;
+    BAMClaimedPairs claimed;
+};
+
+//
+// The .bai or .csi index, as written by BAMIndexSupplier (or samtools index).  For each reference it has the chunks of
+// the file, as pairs of virtual offsets, that hold the reads in each bin.  A .bai also has a linear index of the first read
+// whose alignment reaches each 16Kbase window, and a .csi has the first read overlapping each bin instead.
+//
+class BAMIndex
+{
+public:
+    static BAMIndex* load(const char* indexFileName);
+
+    ~BAMIndex()
+    { delete [] refs; }
+
+    int getRefCount()
+    { return nRefs; }
+
+    // Find the virtual offsets [*o_start, *o_end) that hold every read overlapping region, or return false if none do.
+    bool getSpan(const BAMRegion& region, _uint64* o_start, _uint64* o_end);
+
+private:
+    BAMIndex() : nRefs(0), refs(NULL), minShift(BAMAlignment::BAI_MIN_SHIFT), depth(BAMAlignment::BAI_DEPTH) {}
+
+    struct BinChunk
+    {
+        _uint32     bin;
+        _uint64     start;
+        _uint64     end;
+    };
+
+    static bool binChunkComparator(const BinChunk& a, const BinChunk& b)
+    { return a.bin < b.bin || (a.bin == b.bin && a.start < b.start); }
+
+    struct BinOffset
+    {
+        _uint32     bin;
+        _uint64     offset;
+    };
+
+    static bool binOffsetComparator(const BinOffset& a, const BinOffset& b)
+    { return a.bin < b.bin; }
+
+    struct RefIndex
+    {
+        VariableSizeVector<BinChunk> chunks; // sorted by bin
+        VariableSizeVector<_uint64> minOffsets; // lowest linear index offset for this window or any later one
+        VariableSizeVector<BinOffset> binOffsets; // for .csi, sorted by bin
+    };
+
+    _uint64 getCsiMinOffset(RefIndex* ref, int begin);
+
+    int         nRefs;
+    RefIndex*   refs;
+    int         minShift;
+    int         depth;
+};
+
+//
+// Pulls little endian fields out of the index file's contents, failing once it runs off the end.
+//
+class IndexFileCursor
+{
+public:
+    IndexFileCursor(const char* i_p, const char* i_end) : p(i_p), end(i_end) {}
+
+    bool read(void* value, size_t bytes)
+    {
+        if (p + bytes > end) {
+            return false;
+        }
+        memcpy(value, p, bytes);
+        p += bytes;
+        return true;
+    }
+
+private:
+    const char* p;
+    const char* end;
+};
+
+//
+// Writes an index file, BGZF compressed for a .csi as htslib does (a .bai is plain).
+//
+class IndexFileWriter
+{
+public:
+    IndexFileWriter(FILE* i_file, bool bgzf)
+        : file(i_file), codec(bgzf ? GzipCodec::create() : NULL), used(0) {}
+
+    ~IndexFileWriter()
+    { delete codec; }
+
+    void write(const void* data, size_t bytes)
+    {
+        if (codec == NULL) {
+            fwrite(data, bytes, 1, file);
+            return;
+        }
+        while (bytes > 0) {
+            size_t n = min(bytes, sizeof(block) - used);
+            memcpy(block + used, data, n);
+            used += n;
+            data = n + (const char*) data;
+            bytes -= n;
+            if (used == sizeof(block)) {
+                flush();
+            }
+        }
+    }
+
+    // finish the last block and add the end of file marker; doesn't close the file
+    bool finish()
+    {
+        if (codec != NULL) {
+            flush();
+            static const _uint8 eof[] = {
+                0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+                0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+            };
+            fwrite(eof, sizeof(eof), 1, file);
+        }
+        return ! ferror(file);
+    }
+
+private:
+    void flush()
+    {
+        if (used == 0) {
+            return;
+        }
+        size_t n = codec->compressMember(block, used, compressed, sizeof(compressed), true);
+        if (n == 0) {
+            WriteErrorMessage("Unable to compress index block\n");
+            soft_exit(1);
+        }
+        fwrite(compressed, n, 1, file);
+        used = 0;
+    }
+
+    FILE*       file;
+    GzipCodec*  codec;
+    char        block[0xff00]; // small enough that it always fits in a BGZF block compressed, like htslib's
+    size_t      used;
+    char        compressed[BAM_BLOCK];
+};
+
+//
+// Inflates a gzip file of any number of members (so a BGZF one) that's been read into memory.
+//
+    static bool
+InflateIndexFile(
+    const char* contents,
+    size_t size,
+    char** o_inflated,
+    size_t* o_inflatedSize)
+{
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    if (inflateInit2(&zstream, 16 + MAX_WBITS) != Z_OK) {
+        return false;
+    }
+    size_t capacity = max((size_t) 4096, 4 * size);
+    char* inflated = new char[capacity];
+    size_t used = 0;
+    zstream.next_in = (Bytef*) contents;
+    zstream.avail_in = (uInt) size;
+    int status = Z_OK;
+    while (zstream.avail_in > 0) {
+        if (used == capacity) {
+            char* bigger = new char[2 * capacity];
+            memcpy(bigger, inflated, used);
+            delete [] inflated;
+            inflated = bigger;
+            capacity *= 2;
+        }
+        zstream.next_out = (Bytef*) (inflated + used);
+        zstream.avail_out = (uInt) min(capacity - used, (size_t) 0x40000000);
+        size_t before = zstream.avail_out;
+        status = inflate(&zstream, Z_NO_FLUSH);
+        used += before - zstream.avail_out;
+        if (status == Z_STREAM_END) {
+            // on to the next member, if there is one
+            status = inflateReset(&zstream);
+        }
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            break;
+        }
+    }
+    inflateEnd(&zstream);
+    if (status != Z_OK) {
+        delete [] inflated;
+        return false;
+    }
+    *o_inflated = inflated;
+    *o_inflatedSize = used;
+    return true;
+}
+
+    BAMIndex*
+BAMIndex::load(
+    const char* indexFileName)
+{
+    FILE* file = fopen(indexFileName, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    _int64 size = QueryFileSize(indexFileName);
+    char* contents = new char[size];
+    bool ok = fread(contents, 1, size, file) == (size_t) size;
+    fclose(file);
+
+    // a .csi is BGZF compressed, and a .bai may be too
+    if (ok && size >= 2 && (_uint8) contents[0] == 0x1f && (_uint8) contents[1] == 0x8b) {
+        char* inflated;
+        size_t inflatedSize;
+        ok = InflateIndexFile(contents, size, &inflated, &inflatedSize);
+        if (ok) {
+            delete [] contents;
+            contents = inflated;
+            size = inflatedSize;
+        }
+    }
+
+    IndexFileCursor cursor(contents, contents + size);
+    char magic[4];
+    _int32 n_ref;
+    ok = ok && cursor.read(magic, sizeof(magic));
+    bool csi = ok && ! memcmp(magic, "CSI\1", 4);
+    BAMIndex* index = new BAMIndex();
+    if (csi) {
+        // the bin sizes, and then auxiliary data that's only used by tabix
+        _int32 min_shift = 0, depth = 0, l_aux = 0;
+        ok = cursor.read(&min_shift, sizeof(min_shift)) && cursor.read(&depth, sizeof(depth)) && cursor.read(&l_aux, sizeof(l_aux)) &&
+            min_shift > 0 && depth > 0 && min_shift + 3 * depth < 64 && depth <= 9 && l_aux >= 0;
+        for (_int32 i = 0; ok && i < l_aux; i++) {
+            char aux;
+            ok = cursor.read(&aux, 1);
+        }
+        if (ok) {
+            index->minShift = min_shift;
+            index->depth = depth;
+        }
+    } else {
+        ok = ok && ! memcmp(magic, "BAI\1", 4);
+    }
+    ok = ok && cursor.read(&n_ref, sizeof(n_ref)) && n_ref >= 0;
+    if (ok) {
+        index->nRefs = n_ref;
+        index->refs = new RefIndex[n_ref];
+    }
+    for (int i = 0; ok && i < index->nRefs; i++) {
+        RefIndex* ref = &index->refs[i];
+        _int32 n_bin;
+        ok = cursor.read(&n_bin, sizeof(n_bin));
+        _uint32 metadataBin = BAMAlignment::metadataBin(index->depth);
+        for (int j = 0; ok && j < n_bin; j++) {
+            _uint32 bin;
+            _int32 n_chunk;
+            ok = cursor.read(&bin, sizeof(bin));
+            if (ok && csi) {
+                BinOffset binOffset;
+                binOffset.bin = bin;
+                ok = cursor.read(&binOffset.offset, sizeof(binOffset.offset));
+                if (bin != metadataBin) {
+                    ref->binOffsets.push_back(binOffset);
+                }
+            }
+            ok = ok && cursor.read(&n_chunk, sizeof(n_chunk));
+            for (int k = 0; ok && k < n_chunk; k++) {
+                _uint64 chunk[2];
+                ok = cursor.read(chunk, sizeof(chunk));
+                if (bin != metadataBin) { // that's just metadata
+                    BinChunk binChunk;
+                    binChunk.bin = bin;
+                    binChunk.start = chunk[0];
+                    binChunk.end = chunk[1];
+                    ref->chunks.push_back(binChunk);
+                }
+            }
+        }
+        std::sort(ref->chunks.begin(), ref->chunks.end(), binChunkComparator);
+        std::sort(ref->binOffsets.begin(), ref->binOffsets.end(), binOffsetComparator);
+        if (csi) {
+            continue;
+        }
+
+        //
+        // Windows with no reads are 0 in samtools' index and UINT64_MAX in ours.  A read that overlaps a window is at or
+        // after the offset of that window or some later one, so the smallest offset from there on is a safe place to start.
+        //
+        _int32 n_intv;
+        ok = ok && cursor.read(&n_intv, sizeof(n_intv)) && n_intv >= 0;
+        if (ok) {
+            _uint64* offsets = new _uint64[n_intv];
+            ok = cursor.read(offsets, n_intv * sizeof(_uint64));
+            _uint64 minOffset = UINT64_MAX;
+            for (int j = n_intv - 1; ok && j >= 0; j--) {
+                if (offsets[j] != 0 && offsets[j] < minOffset) {
+                    minOffset = offsets[j];
+                }
+                offsets[j] = minOffset;
+            }
+            for (int j = 0; ok && j < n_intv; j++) {
+                ref->minOffsets.push_back(offsets[j]);
+            }
+            delete [] offsets;
+        }
+    }
+    delete [] contents;
+    if (! ok) {
+        WriteErrorMessage("BAM index file '%s' is malformed\n", indexFileName);
+        soft_exit(1);
+    }
+    return index;
+}
+
+    bool
+BAMIndex::getSpan(
+    const BAMRegion& region,
+    _uint64* o_start,
+    _uint64* o_end)
+{
+    if (region.refID >= nRefs) {
+        return false;
+    }
+    RefIndex* ref = &refs[region.refID];
+
+    _uint64 minOffset;
+    if (ref->binOffsets.size() > 0) {
+        minOffset = getCsiMinOffset(ref, region.begin);
+    } else {
+        // The linear index is by the last base of each read, so a read that just reaches begin may be in the window before.
+        int window = region.begin > 0 ? (region.begin - 1) >> 14 : 0;
+        minOffset = window < ref->minOffsets.size() && ref->minOffsets[window] != UINT64_MAX ? ref->minOffsets[window] : 0;
+    }
+
+    VariableSizeVector<_uint32> bins;
+    BAMAlignment::reg2bins(region.begin, region.end, minShift, depth, &bins);
+    int nBins = bins.size();
+    _uint64 start = UINT64_MAX, end = 0;
+    for (int i = 0; i < nBins; i++) {
+        // binary search for the first chunk in the bin
+        _int64 low = 0, high = ref->chunks.size();
+        while (low < high) {
+            _int64 mid = (low + high) / 2;
+            if (ref->chunks[mid].bin < bins[i]) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        for (_int64 j = low; j < ref->chunks.size() && ref->chunks[j].bin == bins[i]; j++) {
+            const BinChunk& chunk = ref->chunks[j];
+            if (chunk.end > minOffset) {
+                start = min(start, max(chunk.start, minOffset));
+                end = max(end, chunk.end);
+            }
+        }
+    }
+    *o_start = start;
+    *o_end = end;
+    return start < end;
+}
+
+    _uint64
+BAMIndex::getCsiMinOffset(
+    RefIndex* ref,
+    int begin)
+{
+    //
+    // Like samtools, use the offset of the smallest bin holding begin that has any reads, since every read overlapping
+    // begin is in it or one of its ancestors, and those come after the offset too.  A read that just reaches begin may
+    // end in the bin before, so step back a base like the linear index does.
+    //
+    int position = begin > 0 ? begin - 1 : 0;
+    _uint32 bin = BAMAlignment::reg2bin(position, position + 1, minShift, depth);
+    while (true) {
+        _int64 low = 0, high = ref->binOffsets.size();
+        while (low < high) {
+            _int64 mid = (low + high) / 2;
+            if (ref->binOffsets[mid].bin < bin) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low < ref->binOffsets.size() && ref->binOffsets[low].bin == bin) {
+            return ref->binOffsets[low].offset;
+        }
+        if (bin == 0) {
+            return 0;
+        }
+        bin = (bin - 1) >> 3; // parent
+    }
+}
+
+    BAMRegionList*
+BAMRegionList::create(
+    const char* fileName,
+    const char* regionSpec,
+    BAMReader* headerReader)
+{
+    BAMRegionList* list = new BAMRegionList();
+    FILE* bedFile = fopen(regionSpec, "r");
+    if (bedFile != NULL) {
+        bool ok = list->parseBedFile(regionSpec, bedFile, headerReader);
+        fclose(bedFile);
+        if (! ok) {
+            soft_exit(1);
+        }
+    } else if (! list->parseRegionList(regionSpec, headerReader)) {
+        soft_exit(1);
+    }
+    list->sortAndMerge();
+
+    //
+    // samtools looks for foo.bam.bai and then foo.bai, and then the same for .csi, and so do we.
+    //
+    size_t nameLength = strlen(fileName);
+    char* indexFileName = new char[nameLength + 5];
+    BAMIndex* index = NULL;
+    const char* extensions[2] = {".bai", ".csi"};
+    for (int i = 0; index == NULL && i < 2; i++) {
+        sprintf(indexFileName, "%s%s", fileName, extensions[i]);
+        index = BAMIndex::load(indexFileName);
+        if (index == NULL && util::stringEndsWith(fileName, ".bam")) {
+            strcpy(indexFileName + nameLength - 4, extensions[i]);
+            index = BAMIndex::load(indexFileName);
+        }
+    }
+    if (index == NULL) {
+        WriteErrorMessage("-region needs an index for '%s', but there's no '%s.bai' or '%s.csi'.  Sort and index it with -so (or samtools index) first.\n",
+            fileName, fileName, fileName);
+        soft_exit(1);
+    }
+    if (index->getRefCount() != headerReader->getRefCount()) {
+        WriteErrorMessage("BAM index file '%s' has %d references, but '%s' has %d.  It's probably for a different file.\n",
+            indexFileName, index->getRefCount(), fileName, headerReader->getRefCount());
+        soft_exit(1);
+    }
+    delete [] indexFileName;
+
+    // Keep the index, for finding the mates of paired reads.
+    list->index = index;
+    list->ownsIndex = true;
+    list->findSpans();
+    return list;
+}
+
+    BAMRegionList*
+BAMRegionList::createForPositions(
+    const BAMRegionList* other,
+    VariableSizeVector<BAMRegion>* positions)
+{
+    BAMRegionList* list = new BAMRegionList();
+    list->regions.append(positions);
+    list->sortAndMerge();
+    list->index = other->index;
+    list->findSpans();
+    return list;
+}
+
+BAMRegionList::~BAMRegionList()
+{
+    if (ownsIndex) {
+        delete index;
+    }
+}
+
+    void
+BAMRegionList::findSpans()
+{
+    //
+    // Regions whose reads are close enough together in the file get read as one span, since starting a reader has a cost too.
+    //
+    for (int i = 0; i < regions.size(); i++) {
+        BAMRegionSpan span;
+        if (! index->getSpan(regions[i], &span.start, &span.end)) {
+            continue; // there are no reads there
+        }
+        span.firstRegion = i;
+        span.endRegion = i + 1;
+        if (spans.size() > 0) {
+            BAMRegionSpan& last = spans[spans.size() - 1];
+            if ((span.start >> 16) <= (last.end >> 16) + MergeGap) {
+                last.start = min(last.start, span.start);
+                last.end = max(last.end, span.end);
+                last.endRegion = span.endRegion;
+                continue;
+            }
+        }
+        spans.push_back(span);
+    }
+}
+
+    bool
+BAMRegionList::contains(
+    int refID,
+    int pos,
+    int firstRegion,
+    int endRegion) const
+{
+    // binary search for the last region that begins at or before pos
+    int low = firstRegion, high = endRegion;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (regions[mid].refID < refID || (regions[mid].refID == refID && regions[mid].begin <= pos)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > firstRegion && regions[low - 1].refID == refID && pos < regions[low - 1].end;
+}
+
+    bool
+BAMRegionList::getNextSpan(
+    int* o_span)
+{
+    if (nextSpan >= spans.size()) {
+        return false; // don't keep incrementing once they're gone
+    }
+    int span = InterlockedIncrementAndReturnNewValue(&nextSpan) - 1;
+    if (span >= spans.size()) {
+        return false;
+    }
+    *o_span = span;
+    return true;
+}
+
+    bool
+BAMRegionList::addRegion(
+    const char* name,
+    size_t nameLength,
+    int begin,
+    int end,
+    BAMReader* headerReader)
+{
+    int refID = headerReader->getRefID(name, nameLength);
+    if (refID < 0) {
+        WriteErrorMessage("-region: '%.*s' isn't one of the reference sequences in the BAM file\n", (int) nameLength, name);
+        return false;
+    }
+    //
+    // Don't clamp to 2^29 here; a .csi can index past that, and BAMIndex::getSpan keeps the bins within its own depth.
+    //
+    BAMRegion region;
+    region.refID = refID;
+    region.begin = max(begin, 0);
+    region.end = min(end, headerReader->getRefLength(refID));
+    if (region.begin < region.end) {
+        regions.push_back(region);
+    }
+    return true;
+}
+
+    bool
+BAMRegionList::parseRegionList(
+    const char* regionSpec,
+    BAMReader* headerReader)
+{
+    for (const char* p = regionSpec; *p != 0; ) {
+        const char* comma = strchr(p, ',');
+        size_t length = comma != NULL ? comma - p : strlen(p);
+
+        //
+        // Reference names can have colons in them (HLA-A*01:01:01:01, for instance), so a whole name comes first.
+        //
+        const char* colon = NULL;
+        for (const char* q = p + length - 1; q > p; q--) {
+            if (*q == ':') {
+                colon = q;
+                break;
+            }
+        }
+        if (headerReader->getRefID(p, length) >= 0 || colon == NULL) {
+            if (! addRegion(p, length, 0, INT32_MAX, headerReader)) {
+                return false;
+            }
+        } else {
+            char* numberEnd;
+            long begin = strtol(colon + 1, &numberEnd, 10);
+            long end = INT32_MAX;
+            if (*numberEnd == '-') {
+                end = strtol(numberEnd + 1, &numberEnd, 10);
+            }
+            if (numberEnd != p + length || begin < 1 || end < begin) {
+                WriteErrorMessage("-region: '%.*s' should be contig, contig:begin or contig:begin-end\n", (int) length, p);
+                return false;
+            }
+            if (! addRegion(p, colon - p, (int) (begin - 1), (int) end, headerReader)) {
+                return false;
+            }
+        }
+        p += length + (comma != NULL ? 1 : 0);
+    }
+    return true;
+}
+
+    bool
+BAMRegionList::parseBedFile(
+    const char* bedFileName,
+    FILE* bedFile,
+    BAMReader* headerReader)
+{
+    char line[4096];
+    for (int lineNumber = 1; fgets(line, sizeof(line), bedFile) != NULL; lineNumber++) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || ! strncmp(line, "track", 5) || ! strncmp(line, "browser", 7)) {
+            continue;
+        }
+        // BED is already [begin, end) counting from 0
+        char* tab = strchr(line, '\t');
+        char* numberEnd = NULL;
+        long begin = -1, end = -1;
+        if (tab != NULL) {
+            begin = strtol(tab + 1, &numberEnd, 10);
+            if (*numberEnd == '\t') {
+                end = strtol(numberEnd + 1, &numberEnd, 10);
+            }
+        }
+        if (tab == NULL || begin < 0 || end < begin || (*numberEnd != '\t' && *numberEnd != '\n' && *numberEnd != '\r' && *numberEnd != 0)) {
+            WriteErrorMessage("-region: line %d of BED file '%s' is malformed\n", lineNumber, bedFileName);
+            return false;
+        }
+        if (! addRegion(line, tab - line, (int) begin, (int) end, headerReader)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool RegionComparator(const BAMRegion& a, const BAMRegion& b)
+{
+    return a.refID < b.refID || (a.refID == b.refID && a.begin < b.begin);
+}
+
+    void
+BAMRegionList::sortAndMerge()
+{
+    std::sort(regions.begin(), regions.end(), RegionComparator);
+    _int64 n = 0;
+    for (_int64 i = 0; i < regions.size(); i++) {
+        if (n > 0 && regions[n - 1].refID == regions[i].refID && regions[i].begin <= regions[n - 1].end) {
+            regions[n - 1].end = max(regions[n - 1].end, regions[i].end);
+        } else {
+            regions[n++] = regions[i];
+        }
+    }
+    regions.truncate((int) n);
+}
+
     ReadSupplierGenerator *
 BAMReader::createReadSupplierGenerator(
     const char *fileName,
     int numThreads,
     const ReaderContext& context)
 {
+    if (context.regions != NULL) {
+        return new BAMRegionReadSupplierGenerator(fileName, context);
+    }
     BAMReader* reader = create(fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
     ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
     queue->startReaders();
@@ -217,9 +1280,12 @@ BAMReader::createPairedReadSupplierGenerator(
     const ReaderContext& context,
     int matchBufferSize)
 {
+    if (context.regions != NULL) {
+        return new BAMRegionPairedReadSupplierGenerator(fileName, quicklyDropUnmatchedReads, context);
+    }
     BAMReader* reader = create(fileName, 
         ReadSupplierQueue::BufferCount(numThreads) + PairedReadReader::MatchBuffers, 0, 0, context);
-    PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, quicklyDropUnmatchedReads);
+    PairedReadReader* matcher = PairedReadReader::ShardedPairMatcher(reader, quicklyDropUnmatchedReads, numThreads);
     ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
     queue->startReaders();
     return queue;
@@ -246,17 +1312,84 @@ const _uint8 BAM_CIGAR_X = 8;
 
 BAMAlignment::_init BAMAlignment::_init_;
 
+#if BAM_USE_SSSE3
+static bool UseSSSE3 = false;   // Set by BAMAlignment::_init
+
+//
+// Decode whole groups of 16 bytes (32 bases), and return the number of bytes done.  Each byte is two bases, the first in
+// the high nibble, so look both up and interleave them.  For RC the lookups use the complement table and each group of
+// 32 is written reversed, from the end of the output backwards.
+//
+    static BAM_SSSE3_FUNCTION int
+decodeSeqSSSE3(
+    char* o_sequence,
+    const _uint8* nibbles,
+    int bases,
+    bool rc)
+{
+    const __m128i table = _mm_loadu_si128((const __m128i*)(rc ? BAMAlignment::CodeToSeqRC : BAMAlignment::CodeToSeq));
+    const __m128i lowNibble = _mm_set1_epi8(0xf);
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    int pairs = bases / 2;
+    int i;
+    for (i = 0; i + 16 <= pairs; i += 16) {
+        __m128i packed = _mm_loadu_si128((const __m128i*)(nibbles + i));
+        __m128i first = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibble));
+        __m128i second = _mm_shuffle_epi8(table, _mm_and_si128(packed, lowNibble));
+        __m128i low = _mm_unpacklo_epi8(first, second);
+        __m128i high = _mm_unpackhi_epi8(first, second);
+        if (rc) {
+            _mm_storeu_si128((__m128i*)(o_sequence + bases - 2 * i - 16), _mm_shuffle_epi8(low, reverse));
+            _mm_storeu_si128((__m128i*)(o_sequence + bases - 2 * i - 32), _mm_shuffle_epi8(high, reverse));
+        } else {
+            _mm_storeu_si128((__m128i*)(o_sequence + 2 * i), low);
+            _mm_storeu_si128((__m128i*)(o_sequence + 2 * i + 16), high);
+        }
+    }
+    return i;
+}
+#endif // BAM_USE_SSSE3
+
+#if BAM_USE_SSE2
+//
+// Phred to SAM for 16 qualities: add 33, except that anything out of range (including 0xff, which means that there aren't
+// any) becomes '!', just like CIGAR_QUAL_TO_SAM.
+//
+    static inline __m128i
+qualToSAM(
+    __m128i quality)
+{
+    const __m128i maxQuality = _mm_set1_epi8('~' - '!');
+    __m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(quality, maxQuality), quality);
+    return _mm_or_si128(_mm_and_si128(inRange, _mm_add_epi8(quality, _mm_set1_epi8('!'))), _mm_andnot_si128(inRange, _mm_set1_epi8('!')));
+}
+
+    static inline __m128i
+reverseBytes(
+    __m128i bytes)
+{
+    bytes = _mm_shuffle_epi32(bytes, _MM_SHUFFLE(0, 1, 2, 3));
+    bytes = _mm_shufflehi_epi16(_mm_shufflelo_epi16(bytes, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(bytes, 8), _mm_srli_epi16(bytes, 8));
+}
+#endif // BAM_USE_SSE2
+
     void
 BAMAlignment::decodeSeq(
     char* o_sequence,
     const _uint8* nibbles,
     int bases)
 {
-
+    int i = 0;
+#if BAM_USE_SSSE3
+    if (UseSSSE3) {
+        i = decodeSeqSSSE3(o_sequence, nibbles, bases, false);
+    }
+#endif
 
     _uint16 *o_sequence_pairs = (_uint16 *)o_sequence;
     int pairs = bases / 2;
-    for (int i = 0; i < pairs; i++) {
+    for (; i < pairs; i++) {
         o_sequence_pairs[i] = CodeToSeqPair[nibbles[i]];
     }
 
@@ -279,10 +1412,20 @@ char* o_sequence,
 const _uint8* nibbles,
 int bases)
 {
-    _uint16 *o_sequence_pairs = (_uint16 *)o_sequence;
+    int i = 0;
+#if BAM_USE_SSSE3
+    if (UseSSSE3) {
+        i = decodeSeqSSSE3(o_sequence, nibbles, bases, true);
+    }
+#endif
+
+    //
+    // Pair i is bases 2i and 2i + 1, which go at bases - 2i - 1 and bases - 2i - 2.  When bases is odd the pairs are
+    // one off from being aligned, and the last base (alone in the high nibble of the last byte) goes first.
+    //
     int pairs = bases / 2;
-    for (int i = 0; i < pairs; i++) {
-        o_sequence_pairs[pairs-i-1] = CodeToSeqPairRC[nibbles[i]];
+    for (; i < pairs; i++) {
+        *(_uint16 *)(o_sequence + bases - 2 * i - 2) = CodeToSeqPairRC[nibbles[i]];
     }
 
     if (bases % 2 == 1) {
@@ -295,7 +1438,13 @@ BAMAlignment::decodeQual(
     char* quality,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
+    int i = 0;
+#if BAM_USE_SSE2
+    for (; i + 16 <= bases; i += 16) {
+        _mm_storeu_si128((__m128i*)(o_qual + i), qualToSAM(_mm_loadu_si128((const __m128i*)(quality + i))));
+    }
+#endif
+    for (; i < bases; i++) {
         o_qual[i] = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[i]];
     }
 }
@@ -306,8 +1455,22 @@ BAMAlignment::decodeQualRC(
     char* quality,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
-        o_qual[bases-i-1] = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[i]];
+    //
+    // Work in from both ends at once, reading both before writing either, so that o_qual can be the same as quality.
+    //
+    int i = 0;
+#if BAM_USE_SSE2
+    for (; i + 16 <= bases - i - 16; i += 16) {
+        __m128i front = _mm_loadu_si128((const __m128i*)(quality + i));
+        __m128i back = _mm_loadu_si128((const __m128i*)(quality + bases - i - 16));
+        _mm_storeu_si128((__m128i*)(o_qual + i), reverseBytes(qualToSAM(back)));
+        _mm_storeu_si128((__m128i*)(o_qual + bases - i - 16), reverseBytes(qualToSAM(front)));
+    }
+#endif
+    for (; i <= bases - i - 1; i++) {
+        char front = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[i]];
+        o_qual[i] = CIGAR_QUAL_TO_SAM[((_uint8*)quality)[bases - i - 1]];
+        o_qual[bases - i - 1] = front;
     }
 }
 
@@ -433,37 +1596,68 @@ BAMAlignment::_init::_init()
     for (int i = 1; i < 9; i++) {
         CigarToCode[CodeToCigar[i]] = i;
     }
+
+#if BAM_USE_SSSE3
+    UseSSSE3 = ProcessorHasSSSE3();
+#endif
 }
 
     int
 BAMAlignment::reg2bin(
     int beg,
     int end)
+{
+    // past what a .bai can index the bin is meaningless, and samtools uses that of an unplaced read
+    if (end > (1 << (BAI_MIN_SHIFT + 3 * BAI_DEPTH))) {
+        return reg2bin(-1, 0, BAI_MIN_SHIFT, BAI_DEPTH);
+    }
+    return reg2bin(beg, end, BAI_MIN_SHIFT, BAI_DEPTH);
+}
+
+    _uint32
+BAMAlignment::reg2bin(
+    int beg,
+    int end,
+    int minShift,
+    int depth)
 {
     --end;
-    if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
-    if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
-    if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
-    if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
-    if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+    int shift = minShift;
+    _uint32 first = binCount(depth - 1); // of the bottom level
+    for (int level = depth; level > 0; level--) {
+        if (beg >> shift == end >> shift) {
+            return first + (beg >> shift);
+        }
+        shift += 3;
+        first -= 1 << (3 * (level - 1));
+    }
     return 0;
 }
 
-    int
+    void
 BAMAlignment::reg2bins(
     int beg,
     int end,
-    _uint16* list)
+    int minShift,
+    int depth,
+    VariableSizeVector<_uint32>* list)
 {
-    int i = 0, k;
-    --end;
-    list[i++] = 0;
-    for (k = 1 + (beg>>26); k <= 1 + (end>>26); ++k) list[i++] = k;
-    for (k = 9 + (beg>>23); k <= 9 + (end>>23); ++k) list[i++] = k;
-    for (k = 73 + (beg>>20); k <= 73 + (end>>20); ++k) list[i++] = k;
-    for (k = 585 + (beg>>17); k <= 585 + (end>>17); ++k) list[i++] = k;
-    for (k = 4681 + (beg>>14); k <= 4681 + (end>>14); ++k) list[i++] = k;
-    return i;
+    list->clear();
+    _int64 limit = (_int64) 1 << (minShift + 3 * depth);
+    _int64 first = max(beg, 0);
+    _int64 last = min((_int64) end, limit) - 1;
+    if (last < first) {
+        return;
+    }
+    _uint32 levelStart = 0;
+    int shift = minShift + 3 * depth;
+    for (int level = 0; level <= depth; level++) {
+        for (_int64 k = levelStart + (first >> shift); k <= levelStart + (last >> shift); k++) {
+            list->push_back((_uint32) k);
+        }
+        levelStart += 1 << (3 * level);
+        shift -= 3;
+    }
 }
 
 #ifdef VALIDATE_BAM
@@ -511,7 +1705,9 @@ BAMReader::getNextRead(
         flag = &local_flag;
     }
 
+    bool notInRegions;
     do {
+        notInRegions = false;
         char* buffer;
         _int64 bytes;
         if (! data->getData(&buffer, &bytes)) {
@@ -522,11 +1718,36 @@ BAMReader::getNextRead(
             extraOffset = 0;
         }
         BAMAlignment* bam = (BAMAlignment*) buffer;
+        if ((_uint64)bytes >= sizeof(BAMAlignment) && bam->l_seq > maxSeqLength()) {
+            // it wouldn't fit in the buffers, so say why rather than asking for a bigger -xf
+            Read::readTooLong(bam->read_name(), bam->l_read_name - 1, bam->l_seq);
+        }
         if ((_uint64)bytes < sizeof(bam->block_size) || (_uint64)bytes < bam->size()) {
 			WriteErrorMessage("Insufficient buffer space for BAM file, increase -xf parameter\n");
             soft_exit(1);
         }
         data->advance(bam->size());
+        if (regions != NULL) {
+            bool pastRegions;
+            if (! inRegions(bam, &pastRegions)) {
+                if (pastRegions) {
+                    return false;
+                }
+                notInRegions = true;
+                continue;
+            }
+            if (splitPairs != NULL && ! mateInSpan(bam)) {
+                BAMSplitPair pair;
+                pair.key = util::hash64(bam->read_name(), bam->l_read_name - 1);
+                pair.refID = bam->refID;
+                pair.pos = bam->pos;
+                pair.mateRefID = bam->next_refID;
+                pair.matePos = bam->next_pos;
+                splitPairs->push_back(pair);
+                notInRegions = true;
+                continue;
+            }
+        }
         size_t lineLength;
         getReadFromLine(context.genome, buffer, buffer + bytes, read, alignmentResult, genomeLocation,
             isRC, mapQ, &lineLength, flag, cigar, context.clipping);
@@ -541,12 +1762,67 @@ BAMReader::getNextRead(
                 }
             }
         }
-    } while ((context.ignoreSecondaryAlignments && (*flag & SAM_SECONDARY)) || 
+    } while (notInRegions ||
+             (context.ignoreSecondaryAlignments && (*flag & SAM_SECONDARY)) || 
              (context.ignoreSupplementaryAlignments && (*flag & SAM_SUPPLEMENTARY)));
     _ASSERT(read->getData()[0]);
     return true;
 }
 
+    bool
+BAMReader::inRegions(
+    BAMAlignment* bam,
+    bool* o_pastRegions)
+{
+    //
+    // The reads are sorted, so the regions that end before this read starts are done with.  Unplaced reads (refID -1)
+    // come after all of the others.
+    //
+    while (nextRegion < endRegion) {
+        const BAMRegion& region = regions->getRegion(nextRegion);
+        if ((_uint32) bam->refID < (_uint32) region.refID || (bam->refID == region.refID && bam->pos < region.end)) {
+            break;
+        }
+        nextRegion++;
+    }
+    *o_pastRegions = nextRegion == endRegion;
+    if (*o_pastRegions) {
+        return false;
+    }
+
+    const BAMRegion& region = regions->getRegion(nextRegion);
+    if (bam->refID != region.refID || bam->pos + max(bam->l_ref(), 1) <= region.begin) {
+        return false;
+    }
+
+    //
+    // A read that also overlaps the region before this one goes with that region.  For the first region in the span,
+    // that means it's left to whoever reads the previous span.
+    //
+    if (nextRegion > 0) {
+        const BAMRegion& previous = regions->getRegion(nextRegion - 1);
+        if (previous.refID == bam->refID && bam->pos < previous.end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+    bool
+BAMReader::mateInSpan(
+    BAMAlignment* bam)
+{
+    //
+    // This has to give the same answer for both reads of a pair, so it only looks at where they start.  A read that
+    // starts before a region and runs into it is in the span, but its mate can't know that.
+    //
+    if ((bam->FLAG & (SAM_MULTI_SEGMENT | SAM_SECONDARY | SAM_SUPPLEMENTARY)) != SAM_MULTI_SEGMENT) {
+        return true;
+    }
+    return regions->contains(bam->refID, bam->pos, firstRegion, endRegion) &&
+        regions->contains(bam->next_refID, bam->next_pos, firstRegion, endRegion);
+}
+
     void
 BAMReader::getReadFromLine(
     const Genome *genome,
@@ -577,8 +1853,8 @@ BAMReader::getReadFromLine(
     if (NULL != cigar) {
         const char* cigarBuffer;
         {
-            char *writableCigarBuffer = getExtra(min(MAX_K * 5, MAX_SEQ_LENGTH));
-            if (!BAMAlignment::decodeCigar(writableCigarBuffer, MAX_SEQ_LENGTH, bam->cigar(), bam->n_cigar_op)) {
+            char *writableCigarBuffer = getExtra(min(MAX_K * 5, maxSeqLength()));
+            if (!BAMAlignment::decodeCigar(writableCigarBuffer, maxSeqLength(), bam->cigar(), bam->n_cigar_op)) {
                 cigarBuffer = ""; // todo: fail?
             }
             else {
@@ -589,9 +1865,13 @@ BAMReader::getReadFromLine(
     }
 
     if (NULL != read) {
-        _ASSERT(bam->l_seq < MAX_SEQ_LENGTH);
+        _ASSERT(bam->l_seq < maxSeqLength());
 		char* seqBuffer = getExtra(bam->l_seq);
-        char* qualBuffer = getExtra(bam->l_seq);
+        //
+        // The qualities are the same size in BAM and SAM, so convert them where they are rather than copying them.  This is
+        // safe because the record has already been consumed, and the batch it's in is held for as long as the read is.
+        //
+        char* qualBuffer = bam->qual();
 
         unsigned originalFrontClipping, originalBackClipping, originalFrontHardClipping, originalBackHardClipping;
 
@@ -734,6 +2014,51 @@ BAMFormat::getSortInfo(
 	}
 }
 
+//
+// Each shard of sorted output is a BAM file with its own index, compressed on the same number of threads as one big file.
+//
+class BAMShards : public SortedShards
+{
+public:
+    BAMShards(AlignerOptions* i_options, const Genome* i_genome) : options(i_options), genome(i_genome) {}
+
+    virtual ~BAMShards()
+    {
+        for (int i = 0; i < indexFileNames.size(); i++) {
+            delete [] indexFileNames[i];
+        }
+    }
+
+    virtual DataWriterSupplier* createWriterSupplier(const char* fileName, DataWriter::FilterSupplier** o_filterSupplier);
+
+private:
+    AlignerOptions*             options;
+    const Genome*               genome;
+    VariableSizeVector<char*>   indexFileNames; // the index writers don't keep a copy
+};
+
+    DataWriterSupplier*
+BAMShards::createWriterSupplier(
+    const char* fileName,
+    DataWriter::FilterSupplier** o_filterSupplier)
+{
+    GzipWriterFilterSupplier* gzipSupplier =
+        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, true);
+    DataWriter::FilterSupplier* filters = gzipSupplier;
+    if (! options->noIndex) {
+        bool csi = options->csiIndex || DataWriterSupplier::needsCsiIndex(genome);
+        size_t len = strlen(fileName);
+        char* indexFileName = new char[5 + len];
+        strcpy(indexFileName, fileName);
+        strcpy(indexFileName + len, csi ? ".csi" : ".bai");
+        indexFileNames.push_back(indexFileName);
+        filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier, csi, options->numThreads)->compose(filters);
+    }
+    *o_filterSupplier = filters;
+    return DataWriterSupplier::create(fileName, options->writeBufferSize, filters,
+        FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors), 6);
+}
+
     ReadWriterSupplier*
 BAMFormat::getWriterSupplier(
     AlignerOptions* options,
@@ -745,29 +2070,37 @@ BAMFormat::getWriterSupplier(
         // (leave a thread free for main, and let OS map threads to cores to allow system IO etc.)
     if (options->sortOutput) {
         size_t len = strlen(options->outputFile.fileName);
-        // todo: this is going to leak, but there's no easy way to free it, and it's small...
         char* tempFileName = (char*) malloc(5 + len);
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
-        // todo: make markDuplicates optional?
-        DataWriter::FilterSupplier* filters = gzipSupplier;
-        if (! options->noDuplicateMarking) {
-            filters = DataWriterSupplier::markDuplicates(genome)->compose(filters);
+        BAMShards* shards = NULL;
+        if (options->shardSpec != NULL) {
+            shards = new BAMShards(options, genome);
+            if (! (strcmp(options->shardSpec, "contigs") == 0 ? shards->addContigs(genome, options->outputFile.fileName)
+                    : shards->addIntervals(genome, options->outputFile.fileName, options->shardSpec))) {
+                soft_exit(1);
+            }
         }
-        if (! options->noIndex) {
+        DataWriter::FilterSupplier* filters = gzipSupplier;
+        if (! options->noIndex && shards == NULL) {
+            // a .bai can't index past 2^29 bases, so longer contigs need a .csi
+            bool csi = options->csiIndex || DataWriterSupplier::needsCsiIndex(genome);
             char* indexFileName = (char*) malloc(5 + len);
             strcpy(indexFileName, options->outputFile.fileName);
-            strcpy(indexFileName + len, ".bai");
-            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier)->compose(filters);
+            strcpy(indexFileName + len, csi ? ".csi" : ".bai");
+            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier, csi, options->numThreads)->compose(filters);
         }
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
             options->sortMemory * (1ULL << 30),
             options->numThreads, options->outputFile.fileName, filters, options->writeBufferSize,
-            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors));
+            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors),
+            options->noDuplicateMarking ? NULL
+                : DataWriterSupplier::markDuplicates(genome, options->maxSecondaryAlignmentAdditionalEditDistance >= 0), shards);
+        free(tempFileName);
     } else {
         dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, gzipSupplier);
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
 }
 
     bool
@@ -851,9 +2184,9 @@ BAMFormat::writeRead(
     Direction mateDirection,
     bool alignedAsPair) const
 {
-    const int MAX_READ = MAX_READ_LENGTH;
+    const int MAX_READ = __max((int) read->getUnclippedLength(), INITIAL_MAX_READ_LENGTH);
     const int cigarBufSize = MAX_READ;
-    _uint32 cigarBuf[cigarBufSize];
+    util::StackOrHeapArray<_uint32, INITIAL_MAX_READ_LENGTH> cigarBuf(cigarBufSize);
 
     int flags = 0;
     const char *contigName = "*";
@@ -865,8 +2198,8 @@ BAMFormat::writeRead(
     GenomeDistance matePositionInContig = 0;
     _int64 templateLength = 0;
 
-    char data[MAX_READ];
-    char quality[MAX_READ];
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH> data(MAX_READ);
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH> quality(MAX_READ);
 
     const char* clippedData;
     unsigned fullLength;
@@ -890,7 +2223,7 @@ BAMFormat::writeRead(
         return false;
     }
     if (genomeLocation != InvalidGenomeLocation) {
-        cigarOps = computeCigarOps(context.genome, lv, (char*)cigarBuf, cigarBufSize * sizeof(_uint32),
+        cigarOps = computeCigarOps(context.genome, lv, (char*)(_uint32*)cigarBuf, cigarBufSize * sizeof(_uint32),
                                    clippedData, clippedLength, basesClippedBefore, (unsigned)extraBasesClippedBefore, basesClippedAfter,
                                    read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(),
                                    genomeLocation, direction == RC, useM, &editDistance, o_addFrontClipping);
@@ -936,6 +2269,11 @@ BAMFormat::writeRead(
         }
     }
     bamSize += 12; // NM:C PG:Z:SNAP fields
+    // only duplicate marking reads it, and only for pairs with both ends mapped
+    bool writeMateScore = context.writeMateScores && mate != NULL && (flags & (SAM_UNMAPPED | SAM_NEXT_UNMAPPED)) == 0;
+    if (writeMateScore) {
+        bamSize += 7; // ms:i
+    }
     if (bamSize > bufferSpace) {
         return false;
     }
@@ -1022,6 +2360,18 @@ BAMFormat::writeRead(
     nm->tag[0] = 'N'; nm->tag[1] = 'M'; nm->val_type = 'C';
     *(_uint8*)nm->value() = (_uint8)editDistance;
     auxLen += (unsigned) nm->size();
+    // ms, always last, so duplicate marking can take it off again (see BAMDupMarker)
+    if (writeMateScore) {
+        BAMAlignAux* ms = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        ms->tag[0] = 'm'; ms->tag[1] = 's'; ms->val_type = 'i';
+        const char* mateQuality = mate->getUnclippedQuality();
+        _int32 mateScore = 0;
+        for (unsigned i = 0; i < mate->getUnclippedLength(); i++) {
+            mateScore += mateQuality[i] - '!';
+        }
+        *(_int32*)ms->value() = mateScore;
+        auxLen += (unsigned) ms->size();
+    }
 
     if (NULL != spaceUsed) {
         *spaceUsed = bamSize;
@@ -1118,13 +2468,10 @@ public:
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
 
 protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex) = 0;
-
-    BAMAlignment* getRead(size_t fileOffset);
-
-    BAMAlignment* getNextRead(BAMAlignment* read, size_t* o_fileOffset = NULL);
+    // the batch's reads are at offsets in buffer, which is at bufferOffset in the file; by default calls onRead for each
+    virtual void onReads(char* buffer, size_t bufferOffset, VariableSizeVector<size_t>* offsets);
 
-    BAMAlignment* tryFindRead(size_t offset, size_t endOffset, const char* id, size_t* o_offset);
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex) {}
 
 private:
     bool header;
@@ -1144,10 +2491,7 @@ BAMFilter::onNextBatch(
     bool ok = writer->getBatch(-1, &currentBuffer, NULL, NULL, NULL, &currentBufferBytes, &currentOffset);
     _ASSERT(ok);
     currentWriter = writer;
-    int index = 0;
-    for (VariableSizeVector<size_t>::iterator i = offsets.begin(); i != offsets.end(); i++) {
-        onRead((BAMAlignment*) (currentBuffer + *i), currentOffset + *i, index++);
-    }
+    onReads(currentBuffer, currentOffset, &offsets);
     offsets.clear();
     currentWriter = NULL;
     currentBuffer = NULL;
@@ -1156,6 +2500,18 @@ BAMFilter::onNextBatch(
     return bytes;
 }
 
+    void
+BAMFilter::onReads(
+    char* buffer,
+    size_t bufferOffset,
+    VariableSizeVector<size_t>* offsets)
+{
+    int index = 0;
+    for (VariableSizeVector<size_t>::iterator i = offsets->begin(); i != offsets->end(); i++) {
+        onRead((BAMAlignment*) (buffer + *i), bufferOffset + *i, index++);
+    }
+}
+
     void
 BAMFilter::onAdvance(
     DataWriter* writer,
@@ -1169,79 +2525,30 @@ BAMFilter::onAdvance(
     }
 }
 
-    BAMAlignment*
-BAMFilter::getRead(
-    size_t offset)
-{
-    if (offset >= currentOffset && offset < currentOffset + currentBufferBytes) {
-        return (BAMAlignment*) (currentBuffer + (offset - currentOffset));
-    }
-    for (int i = -2; ; i--) {
-        char* buffer;
-        size_t bufferFileOffset, bufferUsed; // logical
-        if (! currentWriter->getBatch(i, &buffer, NULL, NULL, NULL, &bufferUsed, &bufferFileOffset)) {
-            break;
-        }
-        if (offset >= bufferFileOffset && offset < bufferFileOffset + bufferUsed) {
-            return (BAMAlignment*) (buffer + (offset - bufferFileOffset));
-        }
-    }
-    return NULL;
-}
-
-    BAMAlignment*
-BAMFilter::getNextRead(
-    BAMAlignment* bam,
-    size_t* io_offset)
-{
-    char* p = (char*) bam;
-    size_t size = bam->size();
-    size_t oldOffset = *io_offset;
-    *io_offset += size;
-    if (p >= currentBuffer && p < currentBuffer + currentBufferBytes) {
-        p += bam->size();
-        if (p >= currentBuffer + currentBufferBytes) {
-            return NULL;
-        }
-        _ASSERT(*io_offset == currentOffset + (p - currentBuffer));
-        _ASSERT(((BAMAlignment*)p)->refID >= -1);
-        return (BAMAlignment*) p;
-    }
-    for (int i = -2; ; i--) {
-        char* buffer;
-        size_t bufferOffset, bufferUsed; // logical
-        if (! currentWriter->getBatch(i, &buffer, NULL, NULL, NULL, &bufferUsed, &bufferOffset)) {
-            break;
-        }
-        if (p >= buffer && p < buffer+ bufferUsed) {
-            p += size;
-            _ASSERT(*io_offset == bufferOffset + (p - buffer));
-            return p < buffer + bufferUsed? (BAMAlignment*) p : getRead(*io_offset);
-        }
-    }
-    return NULL;
+// paired, with both ends mapped
+    static bool
+hasMappedMate(
+    const BAMAlignment* bam)
+{
+    return (bam->FLAG & (SAM_MULTI_SEGMENT | SAM_NEXT_UNMAPPED)) == SAM_MULTI_SEGMENT;
 }
 
-    BAMAlignment*
-BAMFilter::tryFindRead(
-    size_t offset,
-    size_t endOffset,
-    const char* id,
-    size_t* o_offset)
-{
-    BAMAlignment* bam = getRead(offset);
-    while (bam != NULL && offset < endOffset) {
-        if (readIdsMatch(bam->read_name(), id)) {
-            if (o_offset != NULL) {
-                *o_offset = offset;
-            }
-            return bam;
-        }
-        bam = getNextRead(bam, &offset);
-    }
-    return NULL;
+// the end of a pair that comes first in sorted order (by location, then forward before RC, then first segment)
+    static bool
+isFirstEnd(
+    const BAMAlignment* bam,
+    const Genome* genome)
+{
+    _uint64 end = (((_uint64) GenomeLocationAsInt64(bam->getLocation(genome))) << 1) | ((bam->FLAG & SAM_REVERSE_COMPLEMENT) ? 1 : 0);
+    _uint64 mateEnd = (((_uint64) GenomeLocationAsInt64(bam->getNextLocation(genome))) << 1) | ((bam->FLAG & SAM_NEXT_REVERSED) ? 1 : 0);
+    return end < mateEnd || (end == mateEnd && (bam->FLAG & SAM_FIRST_SEGMENT) != 0);
 }
 
+//
+// Key for a set of duplicate reads: where both ends of the pair are and which way they face, with the lower end first
+// so both ends of a pair get the same key.  Fragments (single-end reads and pairs with an unmapped mate) only have the
+// one end, with the other at UINT32_MAX.
+//
 struct DuplicateReadKey
 {
     DuplicateReadKey()
@@ -1249,22 +2556,22 @@ struct DuplicateReadKey
 
     DuplicateReadKey(const BAMAlignment* bam, const Genome* genome)
     {
-        if (bam == NULL) {
-            locations[0] = locations[1] = UINT32_MAX;
-            isRC[0] = isRC[1] = false;
-        } else {
-            locations[0] = bam->getLocation(genome);
-            locations[1] = bam->getNextLocation(genome);
-            isRC[0] = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
-            isRC[1] = (bam->FLAG & SAM_NEXT_REVERSED) != 0;
-            if (((((_uint64) GenomeLocationAsInt64(locations[0])) << 1) | (isRC[0] ? 1 : 0)) > ((((_uint64) GenomeLocationAsInt64(locations[1])) << 1) | (isRC[1] ? 1 : 0))) {
-                const GenomeLocation t = locations[1];
-                locations[1] = locations[0];
-                locations[0] = t;
-                const bool f = isRC[1];
-                isRC[1] = isRC[0];
-                isRC[0] = f;
-            }
+        memset(this, 0, sizeof(DuplicateReadKey));
+        locations[0] = bam->getLocation(genome);
+        isRC[0] = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
+        if (! hasMappedMate(bam)) {
+            locations[1] = UINT32_MAX;
+            return;
+        }
+        locations[1] = bam->getNextLocation(genome);
+        isRC[1] = (bam->FLAG & SAM_NEXT_REVERSED) != 0;
+        if (! isFirstEnd(bam, genome)) {
+            const GenomeLocation t = locations[1];
+            locations[1] = locations[0];
+            locations[0] = t;
+            const bool f = isRC[1];
+            isRC[1] = isRC[0];
+            isRC[0] = f;
         }
     }
 
@@ -1285,17 +2592,16 @@ struct DuplicateReadKey
             (locations[0] == b.locations[0] &&
                 (locations[1] < b.locations[1] ||
                     (locations[1] == b.locations[1] &&
-                        isRC[0] * 2 + isRC[1] <  b.isRC[0] *2 + b.isRC[1])));
+                        isRC[0] * 2 + isRC[1] < b.isRC[0] * 2 + b.isRC[1])));
     }
 
-
     // required for use as a key in VariableSizeMap template
     DuplicateReadKey(int x)
-    { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; }
+    { memset(this, 0, sizeof(DuplicateReadKey)); locations[0] = locations[1] = x; }
     bool operator==(int x) const
-    { return locations[0] == (_uint32) x && locations[1] == (_uint32) x; }
+    { return locations[0] == x && locations[1] == x && ! isRC[0] && ! isRC[1]; }
     bool operator!=(int x) const
-    { return locations[0] != (_uint32) x || locations[1] != (_uint32) x; }
+    { return ! ((*this) == x); }
     operator _uint64()
     { return ((_uint64) (GenomeLocationAsInt64(locations[1]) ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (GenomeLocationAsInt64(locations[0]) ^ (isRC[0] ? 1 : 0)); }
 
@@ -1303,254 +2609,400 @@ struct DuplicateReadKey
     bool isRC[2];
 };
 
-struct DuplicateMateInfo
+//
+// Marks duplicates in sorted BAM output as it comes out of the merge.  It holds onto each run of reads at one location
+// (however many buffers that takes) until the next location comes along, and marks the run then.  A pair's score is the
+// base quality of both ends (the aligner puts the mate's in an ms:i field, which is taken off again here), so it's the
+// same from either end, and ties go to the lower name hash.  The best pair is chosen at whichever end of the set comes
+// first and its name hash is kept in a table that every later read of the set goes by, so the two ends can't disagree.
+// Only sets with more than one pair go in the table, and they're dropped once the merge is past their second end, so it
+// holds about the duplicate sets whose mates haven't been reached yet, rather than anything per read.  A fragment's
+// unmapped mate is placed at the fragment's location, so it's in the same run, and it's marked along with the fragment.
+//
+// Secondary alignments aren't sets of their own: as in Picard, one is a duplicate if the primary alignment of its read
+// (the same name and segment) is.  A secondary can sort before its primary, so when there may be secondaries this asks
+// for a lookahead pass, which does all the same marking without writing anything and notes the names that have
+// secondaries, and for those that come before their primary, whether the primary was a duplicate.  The real pass then
+// fills in the rest as it goes.  This costs a second read of the merge, and a table entry per read with secondaries.
+//
+class BAMDupMarker : public SortedStage
 {
-    DuplicateMateInfo() { memset(this, 0, sizeof(DuplicateMateInfo)); }
+public:
+    BAMDupMarker(const Genome* i_genome, bool i_secondaries);
 
-    size_t firstRunOffset; // first read in duplicate set
-    size_t firstRunEndOffset;
-    size_t bestReadOffset[4]; // file offsets of first/second/new first/old second best reads
-    int bestReadQuality[2]; // total quality of first/both best reads
-    char bestReadId[120];
+    virtual ~BAMDupMarker();
 
-    void setBestReadId(const char* id) { strncpy(bestReadId, id, sizeof(bestReadId)); }
-    const char* getBestReadId() { return bestReadId; }
-};
+    virtual bool needsLookahead()
+    { return secondaries; }
 
-class BAMDupMarkFilter : public BAMFilter
-{
-public:
-    BAMDupMarkFilter(const Genome* i_genome) :
-        BAMFilter(DataWriter::ModifyFilter),
-        genome(i_genome), runOffset(0), runLocation(UINT32_MAX), runCount(0), mates()
-    {}
+    virtual bool onRead(DataWriter* writer, char* data, GenomeDistance bytes);
+
+    virtual bool onDone(DataWriter* writer);
 
-    ~BAMDupMarkFilter()
+private:
+
+    struct RunRead
     {
+        enum Kind {Unmapped, Fragment, FirstEnd, SecondEnd};
+
+        size_t              offset; // in run
+        int                 index; // in run, to keep sort stable
+        Kind                kind;
+        DuplicateReadKey    key;
+        _uint64             name; // hash
+
+        bool operator<(const RunRead& b) const
+        { return key < b.key || (key == b.key && (kind < b.kind || (kind == b.kind && index < b.index))); }
+    };
+
+    // mark the run and write it out
+    bool flushRun(DataWriter* writer);
+
+    // without the ms field
+    static bool writeRead(DataWriter* writer, BAMAlignment* bam);
+
+    void markRun();
+
+    // index in sorted of the best read in [begin, end)
+    _int64 chooseBest(_int64 begin, _int64 end, bool pairs);
+
+    // drop the sets whose second ends are all behind runLocation, if there are enough of them to be worth a pass
+    void retireMates();
+
+    // propagate duplicate flags between the run's primary and secondary alignments
+    void markSecondaries();
+
+    static _int64 getTotalQuality(BAMAlignment* bam);
+
+    static bool hasMateScore(BAMAlignment* bam);
+
+    static _int64 getMateScore(BAMAlignment* bam);
+
+    static _uint64 nameHash(const char* name);
+
+    // name hash & segment, never 0 or -2, so it can be a map key
+    static _uint64 readKey(BAMAlignment* bam);
+
+    static bool isSecondary(BAMAlignment* bam)
+    { return (bam->FLAG & (SAM_SECONDARY | SAM_SUPPLEMENTARY)) != 0; }
+
+    const Genome*                   genome;
+    const bool                      secondaries;
+    GenomeLocation                  runLocation;
+    char*                           run; // copies of the reads at runLocation
+    size_t                          runSize;
+    size_t                          runUsed;
+    VariableSizeVector<RunRead>     runReads;
+    VariableSizeVector<RunRead>     sorted;
+    typedef VariableSizeMap<DuplicateReadKey,_uint64,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
+    MateMap                         mates; // name hash of best pair by set, until the merge is past the set's second end
+    _int64                          matesRetireSize; // size of mates that's worth a pass to drop old sets
+    typedef VariableSizeMap<_uint64,bool,150,MapNumericHash<_uint64>,70,0,-2> SecondaryMap;
+    SecondaryMap                    primaryIsDuplicate; // by readKey, for reads with secondaries
+    SecondaryMap                    unmappedMates; // by name hash | 1, for the run's duplicate fragments with an unmapped mate
+};
+
+BAMDupMarker::BAMDupMarker(
+    const Genome* i_genome,
+    bool i_secondaries)
+    :
+    genome(i_genome),
+    secondaries(i_secondaries),
+    runLocation(UINT32_MAX),
+    run(NULL),
+    runSize(0),
+    runUsed(0),
+    runReads(),
+    sorted(),
+    mates(),
+    matesRetireSize(1024),
+    primaryIsDuplicate(),
+    unmappedMates()
+{}
+
+BAMDupMarker::~BAMDupMarker()
+{
 #ifdef USE_DEVTEAM_OPTIONS
-        if (mates.size() > 0) {
-            WriteErrorMessage("duplicate matching ended with %d unmatched reads:\n", mates.size());
-            for (MateMap::iterator i = mates.begin(); i != mates.end(); i = mates.next(i)) {
-                WriteErrorMessage("%u%s/%u%s\n", i->key.locations[0], i->key.isRC[0] ? "rc" : "", i->key.locations[1], i->key.isRC[1] ? "rc" : "");
-            }
-        }
+    int unseen = 0;
+    for (MateMap::iterator m = mates.begin(); m != mates.end(); m = mates.next(m)) {
+        unseen += m->key.locations[1] > runLocation;
+    }
+    if (unseen > 0) {
+        WriteErrorMessage("duplicate marking ended with %d sets whose mates were never seen\n", unseen);
+    }
 #endif
+    if (run != NULL) {
+        BigDealloc(run);
     }
+}
 
-    static bool isDuplicate(const BAMAlignment* a, const BAMAlignment* b)
-    { return a->pos == b->pos && a->refID == b->refID &&
-        ((a->FLAG ^ b->FLAG) & (SAM_REVERSE_COMPLEMENT | SAM_NEXT_REVERSED)) == 0; }
+    bool
+BAMDupMarker::onRead(
+    DataWriter* writer,
+    char* data,
+    GenomeDistance bytes)
+{
+    GenomeLocation location;
+    FileFormat::BAM[0]->getSortInfo(genome, data, bytes, &location, NULL);
+    if (location != runLocation) {
+        if (! flushRun(writer)) {
+            return false;
+        }
+        runLocation = location;
+    }
+    if (location == UINT32_MAX) {
+        // unmapped at the end, nothing to mark
+        return writer == NULL || writeRead(writer, (BAMAlignment*) data);
+    }
+    // keep it until the run is done
+    if (runUsed + bytes > runSize) {
+        size_t newSize = max(runSize * 2, max((size_t) 1024 * 1024, runUsed + (size_t) bytes));
+        char* newRun = (char*) BigAlloc(newSize);
+        if (run != NULL) {
+            memcpy(newRun, run, runUsed);
+            BigDealloc(run);
+        }
+        run = newRun;
+        runSize = newSize;
+    }
+    memcpy(run + runUsed, data, bytes);
+    RunRead r;
+    r.offset = runUsed;
+    runReads.push_back(r);
+    runUsed += bytes;
+    return true;
+}
 
-protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    bool
+BAMDupMarker::onDone(
+    DataWriter* writer)
+{
+    if (! flushRun(writer)) {
+        return false;
+    }
+    if (writer == NULL) {
+        // end of the lookahead, start over
+        runLocation = UINT32_MAX;
+        mates.clear();
+        matesRetireSize = 1024;
+    }
+    return true;
+}
 
-private:
-    static int getTotalQuality(BAMAlignment* bam);
+    bool
+BAMDupMarker::flushRun(
+    DataWriter* writer)
+{
+    retireMates();
+    if (runReads.size() > 1) {
+        markRun();
+    }
+    markSecondaries();
+    if (writer == NULL) {
+        // lookahead
+        runReads.clear();
+        runUsed = 0;
+        return true;
+    }
+    for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+        if (! writeRead(writer, (BAMAlignment*) (run + r->offset))) {
+            return false;
+        }
+    }
+    runReads.clear();
+    runUsed = 0;
+    return true;
+}
 
-    const Genome* genome;
-    size_t runOffset; // offset in file of first read in run
-    GenomeLocation runLocation; // location in genome
-    int runCount; // number of aligned reads
-    typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
-    static const _uint64 RunKey = 0xffffffffc0000000UL;
-    static const _uint64 RunRC = 0x80000000;
-    static const _uint64 RunNextRC = 0x40000000;
-    static const _uint64 RunOffset = 0x3fffffff;
-    typedef VariableSizeVector<_uint64> RunVector;
-    RunVector run;
-    MateMap mates;
-};
+    bool
+BAMDupMarker::writeRead(
+    DataWriter* writer,
+    BAMAlignment* bam)
+{
+    //
+    // Take off the mate score, it's always the last field.  The record may be in the merge's buffers rather than a copy
+    // of its own, so it's left alone and the size is fixed up in the output.
+    //
+    size_t bytes = bam->size();
+    bool mateScore = hasMateScore(bam);
+    if (mateScore) {
+        bytes -= 7;
+    }
+    char* buffer;
+    size_t size;
+    if (! writer->getBuffer(&buffer, &size) || size < bytes) {
+        if (! (writer->nextBatch() && writer->getBuffer(&buffer, &size)) || size < bytes) {
+            return false;
+        }
+    }
+    memcpy(buffer, bam, bytes);
+    if (mateScore) {
+        ((BAMAlignment*) buffer)->block_size -= 7;
+    }
+    writer->advance(bytes);
+    return true;
+}
 
     void
-BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
+BAMDupMarker::markRun()
 {
-    if ((lastBam->FLAG & SAM_SECONDARY) != 0) {
-        return; // ignore secondary aliignments; todo: mark them as dups too?
+    //
+    // Sort the run by key, keeping the order they came in within a key.  Both ends of every pair in a set have the same
+    // location, so all of a set's first ends are in this run, and all its second ends are in the run at the mate location.
+    //
+    bool pairedEnds[2]; // [isRC], if any pair has an end here
+    memset(pairedEnds, 0, sizeof(pairedEnds));
+    for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+        BAMAlignment* bam = (BAMAlignment*) (run + r->offset);
+        r->key = DuplicateReadKey(bam, genome);
+        r->index = (int) (r - runReads.begin());
+        r->name = nameHash(bam->read_name());
+        r->kind = (bam->FLAG & SAM_UNMAPPED) || isSecondary(bam) ? RunRead::Unmapped // i.e. not marked here
+            : ! hasMappedMate(bam) ? RunRead::Fragment
+            : isFirstEnd(bam, genome) ? RunRead::FirstEnd : RunRead::SecondEnd;
+        if (r->kind == RunRead::FirstEnd || r->kind == RunRead::SecondEnd) {
+            pairedEnds[(bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0] = true;
+        }
     }
-    GenomeLocation location = lastBam->getLocation(genome);
-    GenomeLocation nextLocation = lastBam->getNextLocation(genome);
-    GenomeLocation logicalLocation = location != InvalidGenomeLocation ? location : nextLocation;
-    if (logicalLocation == UINT32_MAX) {
-        return;
+    sorted.clear();
+    for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+        if (r->kind != RunRead::Unmapped) {
+            sorted.push_back(*r);
+        }
     }
-    if (logicalLocation == runLocation) {
-        runCount++;
-    } else {
-        // if there was more than one read with same location, then analyze the run
-        if (runCount > 1) {
-            // partition by duplicate key, find best read in each partition
-            size_t offset = runOffset;
-            run.clear();
-            // sort run by other coordinate & RC flags to get sub-runs
-            for (BAMAlignment* record = getRead(offset); record != NULL && record != lastBam; record = getNextRead(record, &offset)) {
-                // use opposite of logical location to sort records
-                _uint64 entry = record->getLocation(genome) == UINT32_MAX
-                    ? (((_uint64) UINT32_MAX) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunNextRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunRC : 0)
-                    : (((_uint64) GenomeLocationAsInt64(record->getNextLocation(genome))) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunNextRC : 0);
-                entry |= (_uint64) ((offset - runOffset) & RunOffset);
-                _ASSERT(offset - runOffset <= RunOffset);
-                run.push_back(entry);
-            }
-			if (run.size() == 0) {
-				goto done; // todo: handle runs > n buffers (but should be rare!)
-			}
-            // ensure that adjacent half-mapped pairs stay together
-            std::stable_sort(run.begin(), run.end());
-            bool foundRun = false;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                _ASSERT(record->refID >= -1 && record->refID < genome->getNumContigs()); // simple sanity check
-                // skip adjacent half-mapped pairs, they're not really runs
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
+    std::sort(sorted.begin(), sorted.end());
+
+    //
+    // Pairs: keep the one the set has already settled on, or if this is the first of it, the one with the most total base
+    // quality, and mark the rest.  Fragments are duplicates if there's a pair with an end in the same place (as in
+    // Picard), otherwise the best one is kept.
+    //
+    for (_int64 i = 0; i < sorted.size(); ) {
+        _int64 end = i + 1;
+        while (end < sorted.size() && sorted[end].key == sorted[i].key && sorted[end].kind == sorted[i].kind) {
+            end++;
+        }
+        RunRead::Kind kind = sorted[i].kind;
+        if (kind == RunRead::FirstEnd || kind == RunRead::SecondEnd) {
+            _uint64 bestName;
+            if (! mates.tryGet(sorted[i].key, &bestName)) {
+                if (end - i == 1) {
+                    // on its own, and nothing's been decided for it
+                    i = end;
                     continue;
                 }
-                foundRun = true;
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator f = mates.find(key);
-                DuplicateMateInfo* info;
-                if (f == mates.end()) {
-                    mates.put(key, DuplicateMateInfo());
-                    info = &mates[key];
-                    //fprintf(stderr, "add %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                    info->firstRunOffset = runOffset;
-                    info->firstRunEndOffset = lastOffset;
-                } else {
-                    info = &f->value;
-                }
-                int totalQuality = getTotalQuality(record);
-                size_t mateOffset = 0;
-                BAMAlignment* mate = NULL;
-                // optimize case for half-mapped pairs with adjacent reads
-                if ((record->FLAG & SAM_MULTI_SEGMENT) != 0) {
-                    mate = tryFindRead(info->firstRunOffset, info->firstRunEndOffset, record->read_name(), &mateOffset);
-                    if (mate == record) {
-                        mate = NULL;
-                    }
-                }
-                bool isSecond = mate != NULL;
-                if (isSecond) {
-                    totalQuality += getTotalQuality(mate);
-                }
-                if (totalQuality > info->bestReadQuality[isSecond]) {
-                    info->bestReadQuality[isSecond] = totalQuality;
-                    info->bestReadOffset[isSecond] = offset;
-                    if (isSecond) {
-                        info->bestReadOffset[2] = mateOffset;
-                    }
-                    info->setBestReadId(record->read_name());
-                }
-                if (isSecond && readIdsMatch(info->getBestReadId(), record->read_name())) {
-                    info->bestReadOffset[3] = offset;
-                }
-            }
-            if (! foundRun) {
-                goto done; // avoid useless looping
+                bestName = sorted[chooseBest(i, end, true)].name;
+                mates.put(sorted[i].key, bestName);
             }
-            // go back and adjust flags
-            offset = runOffset;
-            VariableSizeVector<DuplicateMateInfo*>* failedBackpatch = NULL;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m == mates.end()) {
-                    continue; // one end in a run, other not
+            for (_int64 j = i; j < end; j++) {
+                if (sorted[j].name != bestName) {
+                    ((BAMAlignment*) (run + sorted[j].offset))->FLAG |= SAM_DUPLICATE;
                 }
-                DuplicateMateInfo* minfo = &m->value;
-                bool pass = minfo->bestReadQuality[1] != 0; // 1 for second pass, 0 for first pass
-                bool isSecond = minfo->firstRunOffset != runOffset;
-                static const int index[2][2] = {{0, 3}, {2, 1}};
-                if (offset != minfo->bestReadOffset[index[pass][isSecond]]) {
-                    // Picard markDuplicates will not mark unmapped reads
-                    if ((record->FLAG & SAM_UNMAPPED) == 0) {
-                        record->FLAG |= SAM_DUPLICATE;
-                    }
-                } else if (pass == 1 && minfo->bestReadOffset[2] != 0 && minfo->bestReadOffset[0] != 0 && minfo->bestReadOffset[2] != minfo->bestReadOffset[0]) {
-                    // backpatch reads in first matelist if they're still in memory
-                    BAMAlignment* oldBest = getRead(minfo->bestReadOffset[0]);
-                    BAMAlignment* newBest = getRead(minfo->bestReadOffset[2]);
-                    if (oldBest != NULL && newBest != NULL) {
-                        oldBest->FLAG &= ~SAM_DUPLICATE;
-                        newBest->FLAG |= SAM_DUPLICATE;
-                    } else {
-                        if (failedBackpatch == NULL) {
-                            failedBackpatch = new VariableSizeVector<DuplicateMateInfo*>();
+            }
+        } else {
+            bool fragmentsAreDups = pairedEnds[sorted[i].key.isRC[0]];
+            if (end - i > 1 || fragmentsAreDups) {
+                _int64 best = chooseBest(i, end, false);
+                for (_int64 j = i; j < end; j++) {
+                    if (j != best || fragmentsAreDups) {
+                        BAMAlignment* bam = (BAMAlignment*) (run + sorted[j].offset);
+                        bam->FLAG |= SAM_DUPLICATE;
+                        if (bam->FLAG & SAM_MULTI_SEGMENT) {
+                            unmappedMates.put(sorted[j].name | 1, true);
                         }
-                        failedBackpatch->push_back(minfo);
                     }
                 }
             }
+        }
+        i = end;
+    }
 
-            // fixup any that failed
-            if (failedBackpatch != NULL) {
-                for (VariableSizeVector<DuplicateMateInfo*>::iterator i = failedBackpatch->begin(); i != failedBackpatch->end(); i++) {
-                    // couldn't go back and patch first set to have correct best for second set
-                    // so patch second set to have same best as first set even though it's not really the best
-                    BAMAlignment* trueBestSecond = getRead((*i)->bestReadOffset[1]);
-                    BAMAlignment* firstBestSecond = getRead((*i)->bestReadOffset[3]);
-                    _ASSERT(trueBestSecond != NULL && firstBestSecond != NULL);
-                    if (trueBestSecond != NULL && firstBestSecond != NULL) {
-                        trueBestSecond->FLAG &= ~SAM_DUPLICATE;
-                        firstBestSecond->FLAG |= ~SAM_DUPLICATE;
-                    }
-                }
+    //
+    // Picard marks a fragment's unmapped mate with it.
+    //
+    if (unmappedMates.size() > 0) {
+        for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+            BAMAlignment* bam = (BAMAlignment*) (run + r->offset);
+            if ((bam->FLAG & SAM_UNMAPPED) && hasMappedMate(bam) && ! isSecondary(bam) && unmappedMates.erase(r->name | 1)) {
+                bam->FLAG |= SAM_DUPLICATE;
             }
+        }
+        unmappedMates.clear();
+    }
+}
 
-            // clean up
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m != mates.end() && m->value.firstRunOffset != runOffset) {
-                    mates.erase(key);
-                    //fprintf(stderr, "erase %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                }
+    _int64
+BAMDupMarker::chooseBest(
+    _int64 begin,
+    _int64 end,
+    bool pairs)
+{
+    _int64 best = -1;
+    _int64 bestScore = -1;
+    for (_int64 j = begin; j < end; j++) {
+        BAMAlignment* bam = (BAMAlignment*) (run + sorted[j].offset);
+        _int64 score = getTotalQuality(bam) + (pairs ? getMateScore(bam) : 0);
+        if (score > bestScore || (score == bestScore && sorted[j].name < sorted[best].name)) {
+            best = j;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+    void
+BAMDupMarker::retireMates()
+{
+    if (mates.size() < matesRetireSize) {
+        return;
+    }
+    for (MateMap::iterator m = mates.begin(); m != mates.end(); m = mates.next(m)) {
+        if (m->key.locations[1] < runLocation) {
+            mates.erase(m->key);
+        }
+    }
+    // keep it amortized over the sets that are still live
+    matesRetireSize = max((_int64) 1024, 2 * (_int64) mates.size());
+}
+
+    void
+BAMDupMarker::markSecondaries()
+{
+    if (! secondaries) {
+        return;
+    }
+    //
+    // Primaries first, so a secondary in the same run as its primary gets its flag.  The lookahead notes every read that
+    // has secondaries; after that a primary is only looked up, so the table doesn't grow with the duplicates.
+    //
+    for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+        BAMAlignment* bam = (BAMAlignment*) (run + r->offset);
+        if ((bam->FLAG & (SAM_DUPLICATE | SAM_UNMAPPED)) == SAM_DUPLICATE && ! isSecondary(bam)) {
+            bool* dup = primaryIsDuplicate.tryFind(readKey(bam));
+            if (dup != NULL) {
+                *dup = true;
+            }
+        }
+    }
+    for (VariableSizeVector<RunRead>::iterator r = runReads.begin(); r != runReads.end(); r++) {
+        BAMAlignment* bam = (BAMAlignment*) (run + r->offset);
+        if (isSecondary(bam)) {
+            _uint64 key = readKey(bam);
+            bool* dup = primaryIsDuplicate.tryFind(key);
+            if (dup == NULL) {
+                primaryIsDuplicate.put(key, false);
+            } else if (*dup) {
+                bam->FLAG |= SAM_DUPLICATE;
             }
         }
-done:
-        runLocation = logicalLocation;
-        runOffset = lastOffset;
-        runCount = 1;
     }
-    // todo: preserve this across batches - need to block-copy entire memory for reads
 }
 
-    int
-BAMDupMarkFilter::getTotalQuality(
+    _int64
+BAMDupMarker::getTotalQuality(
     BAMAlignment* bam)
 {
-    int result = 0;
+    _int64 result = 0;
     _uint8* p = (_uint8*) bam->qual();
     for (int i = 0; i < bam->l_seq; i++) {
         int q = *p++;
@@ -1559,26 +3011,47 @@ BAMDupMarkFilter::getTotalQuality(
     return result;
 }
 
-class BAMDupMarkSupplier : public DataWriter::FilterSupplier
+    bool
+BAMDupMarker::hasMateScore(
+    BAMAlignment* bam)
 {
-public:
-    BAMDupMarkSupplier(const Genome* i_genome) :
-        FilterSupplier(DataWriter::ReadFilter), genome(i_genome) {}
+    if (bam->auxLen() < 7) {
+        return false;
+    }
+    BAMAlignAux* ms = (BAMAlignAux*) ((char*) bam->endAux() - 7);
+    return ms->tag[0] == 'm' && ms->tag[1] == 's' && ms->val_type == INT32_VAL_TYPE;
+}
 
-    virtual DataWriter::Filter* getFilter()
-    { return new BAMDupMarkFilter(genome); }
+    _int64
+BAMDupMarker::getMateScore(
+    BAMAlignment* bam)
+{
+    return hasMateScore(bam) ? *(_int32*) ((BAMAlignAux*) ((char*) bam->endAux() - 7))->value() : 0;
+}
 
-    virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier) {}
+    _uint64
+BAMDupMarker::nameHash(
+    const char* name)
+{
+    // FNV-1a
+    _uint64 hash = 14695981039346656037ULL;
+    for (const char* p = name; *p != 0; p++) {
+        hash = (hash ^ (_uint8) *p) * 1099511628211ULL;
+    }
+    return hash;
+}
 
-private:
-    const Genome* genome;
-};
+    _uint64
+BAMDupMarker::readKey(
+    BAMAlignment* bam)
+{
+    return (nameHash(bam->read_name()) << 2) | ((bam->FLAG & SAM_LAST_SEGMENT) ? 2 : 0) | 1;
+}
 
-    DataWriter::FilterSupplier*
-DataWriterSupplier::markDuplicates(const Genome* genome)
+    SortedStage*
+DataWriterSupplier::markDuplicates(const Genome* genome, bool secondaries)
 {
-    return new BAMDupMarkSupplier(genome);
+    return new BAMDupMarker(genome, secondaries);
 }
 
 class BAMIndexSupplier;
@@ -1590,26 +3063,136 @@ public:
         : BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
 
 protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    virtual void onReads(char* buffer, size_t bufferOffset, VariableSizeVector<size_t>* offsets);
 
 private:
     BAMIndexSupplier* supplier;
 };
 
-class BAMIndexSupplier : public DataWriter::FilterSupplier
+//
+// Consecutive reads on one contig in the same bin, and where a read reaches a linear index window past any before it.
+//
+struct BAMIndexRun
+{
+    int         refId;
+    _uint32     bin;
+    _uint64     start;
+    _uint64     end;
+    _uint64     readCounts[2]; // mapped, unmapped
+};
+
+struct BAMIndexWindow
+{
+    int         refId;
+    int         window;
+    _uint64     offset;
+};
+
+//
+// Works out the bins and linear index windows of a batch of reads, with each thread taking a contiguous part of it.
+//
+class BAMIndexManager : public ParallelWorkerManager
 {
 public:
-    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
-        FilterSupplier(DataWriter::ReadFilter),
-        indexFileName(i_indexFileName),
-        genome(i_genome),
-        gzipSupplier(i_gzipSupplier),
-        lastRefId(-1),
-        lastBin(0), binStart(0), lastBamEnd(0)
+    BAMIndexManager(int i_minShift, int i_depth, int i_numThreads)
+        : minShift(i_minShift), depth(i_depth), numThreads(i_numThreads), buffer(NULL), bufferOffset(0), offsets(NULL)
     {
-        refs = genome ? new RefInfo[genome->getNumContigs()] : NULL;
-        readCounts[0] = readCounts[1] = 0;
+        runs = new VariableSizeVector<BAMIndexRun>[numThreads];
+        windows = new VariableSizeVector<BAMIndexWindow>[numThreads];
+    }
+
+    virtual ~BAMIndexManager()
+    {
+        delete [] runs;
+        delete [] windows;
+    }
+
+    virtual ParallelWorker* createWorker();
+
+    const int                           minShift;
+    const int                           depth;
+    const int                           numThreads;
+    char*                               buffer;
+    size_t                              bufferOffset;
+    VariableSizeVector<size_t>*         offsets;
+    VariableSizeVector<BAMIndexRun>*    runs;       // for each thread's part of the batch
+    VariableSizeVector<BAMIndexWindow>* windows;
+};
+
+class BAMIndexWorker : public ParallelWorker
+{
+public:
+    virtual void step();
+};
+
+    ParallelWorker*
+BAMIndexManager::createWorker()
+{
+    return new BAMIndexWorker();
+}
+
+    void
+BAMIndexWorker::step()
+{
+    BAMIndexManager* manager = (BAMIndexManager*) getManager();
+    size_t n = manager->offsets->size();
+    size_t begin = (getThreadNum() * n) / getNumThreads();
+    size_t end = ((getThreadNum() + 1) * n) / getNumThreads();
+    VariableSizeVector<BAMIndexRun>* runs = &manager->runs[getThreadNum()];
+    VariableSizeVector<BAMIndexWindow>* windows = &manager->windows[getThreadNum()];
+    runs->clear();
+    windows->clear();
+    int windowRefId = -1;
+    int lastWindow = -1;
+    for (size_t i = begin; i < end; i++) {
+        size_t offset = (*manager->offsets)[i];
+        BAMAlignment* bam = (BAMAlignment*) (manager->buffer + offset);
+        _uint64 fileOffset = manager->bufferOffset + offset;
+        bool unmapped = (bam->FLAG & SAM_UNMAPPED) != 0;
+        int refLength = unmapped ? 0 : bam->l_ref();
+        // like samtools, a read that doesn't cover any reference is treated as covering a base
+        _uint32 bin = bam->refID < 0 || bam->pos < 0 ? 0 :
+            BAMAlignment::reg2bin(bam->pos, bam->pos + max(refLength, 1), manager->minShift, manager->depth);
+        if (runs->size() == 0 || (*runs)[runs->size() - 1].refId != bam->refID || (*runs)[runs->size() - 1].bin != bin) {
+            BAMIndexRun run;
+            run.refId = bam->refID;
+            run.bin = bin;
+            run.start = fileOffset;
+            run.readCounts[0] = run.readCounts[1] = 0;
+            runs->push_back(run);
+        }
+        BAMIndexRun* run = &(*runs)[runs->size() - 1];
+        run->end = fileOffset + bam->size();
+        run->readCounts[unmapped ? 1 : 0]++;
+        if (! unmapped) {
+            _ASSERT(bam->pos != -1 && bam->refID != -1);
+            int last = bam->pos + refLength - 1;
+            int window = last <= 0 ? 0 : ((last - 1) >> BAMAlignment::BAI_MIN_SHIFT);
+            if (bam->refID != windowRefId || window > lastWindow) {
+                BAMIndexWindow w;
+                w.refId = bam->refID;
+                w.window = window;
+                w.offset = fileOffset;
+                windows->push_back(w);
+                windowRefId = bam->refID;
+                lastWindow = window;
+            }
+        }
     }
+}
+
+//
+// Builds the .bai (or, for contigs too long for one, the .csi) for sorted output from the reads in each batch as it's
+// written.  Working out each read's bin (which takes walking its CIGAR string) is spread over a ParallelCoworker's
+// threads, and their runs of reads in the same bin are then added to the index in order, which only costs anything
+// when the bin changes.  Small batches aren't worth waking the threads for.
+//
+class BAMIndexSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier, bool i_csi, int i_numThreads);
+
+    virtual ~BAMIndexSupplier();
 
     virtual DataWriter::Filter* getFilter()
     { return new BAMIndexFilter(this); }
@@ -1617,6 +3200,9 @@ public:
     virtual void onClosing(DataWriterSupplier* supplier) {}
     virtual void onClosed(DataWriterSupplier* supplier);
 
+    // the number of levels a .csi needs below the root for bins starting at 2^minShift bases to cover every contig
+    static int csiDepth(const Genome* genome, int minShift);
+
 private:
 
     friend class BAMIndexFilter;
@@ -1635,129 +3221,280 @@ private:
         LinearMap intervals;
     };
 
+    static const size_t MinParallelReads = 4096;
+
     RefInfo* getRefInfo(int refId);
 
-    void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    void onReads(char* buffer, size_t bufferOffset, VariableSizeVector<size_t>* offsets);
+
+    void addRun(const BAMIndexRun& run);
+
+    void finishRef();
 
     void addChunk(int refId, _uint32 bin, _uint64 start, _uint64 end);
 
-    void addInterval(int refId, int begin, int end, _uint64 fileOffset);
+    void addInterval(int refId, int window, _uint64 fileOffset);
+
+    void writeBins(IndexFileWriter* index, RefInfo* info);
 
     const char* indexFileName;
     const Genome* genome;
+    const bool csi;
+    const int minShift;
+    const int depth;
+    const _uint32 metadataBin;
     int lastRefId;
-    _uint32 lastBin;
-    _uint64 binStart;
+    BAMIndexRun current; // the run that's still growing
     _uint64 firstBamStart;
     _uint64 lastBamEnd;
     _uint64 readCounts[2]; // mapped, unmapped
     RefInfo* refs;
     GzipWriterFilterSupplier* gzipSupplier;
+    BAMIndexManager* manager;
+    ParallelCoworker* coworker;
+    ParallelWorker* inlineWorker;
 };
 
+BAMIndexSupplier::BAMIndexSupplier(
+    const char* i_indexFileName,
+    const Genome* i_genome,
+    GzipWriterFilterSupplier* i_gzipSupplier,
+    bool i_csi,
+    int i_numThreads)
+    :
+    FilterSupplier(DataWriter::ReadFilter),
+    indexFileName(i_indexFileName),
+    genome(i_genome),
+    csi(i_csi),
+    minShift(BAMAlignment::BAI_MIN_SHIFT),
+    depth(i_csi ? csiDepth(i_genome, BAMAlignment::BAI_MIN_SHIFT) : BAMAlignment::BAI_DEPTH),
+    metadataBin(BAMAlignment::metadataBin(depth)),
+    lastRefId(-1), firstBamStart(0), lastBamEnd(0),
+    gzipSupplier(i_gzipSupplier)
+{
+    refs = genome ? new RefInfo[genome->getNumContigs()] : NULL;
+    readCounts[0] = readCounts[1] = 0;
+    current.refId = -1;
+    int numThreads = max(1, min(8, i_numThreads));
+    manager = new BAMIndexManager(minShift, depth, numThreads);
+    coworker = new ParallelCoworker(numThreads, false, manager);
+    coworker->start();
+    inlineWorker = manager->createWorker();
+    manager->configure(inlineWorker, 0, 1);
+}
+
+BAMIndexSupplier::~BAMIndexSupplier()
+{
+    delete coworker;
+    delete inlineWorker;
+    delete manager;
+    delete [] refs;
+}
+
+    int
+BAMIndexSupplier::csiDepth(
+    const Genome* genome,
+    int minShift)
+{
+    GenomeDistance longest = 0;
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        longest = max(longest, genome->getContigs()[i].length);
+    }
+    int depth = BAMAlignment::BAI_DEPTH;
+    while (((_int64) 1 << (minShift + 3 * depth)) < (_int64) longest) {
+        depth++;
+    }
+    return depth;
+}
+
     void
-BAMIndexFilter::onRead(
-    BAMAlignment* bam,
-    size_t fileOffset,
-    int batchIndex)
+BAMIndexFilter::onReads(
+    char* buffer,
+    size_t bufferOffset,
+    VariableSizeVector<size_t>* offsets)
 {
-    supplier->onRead(bam, fileOffset, batchIndex);
+    supplier->onReads(buffer, bufferOffset, offsets);
 }
 
     DataWriter::FilterSupplier*
 DataWriterSupplier::bamIndex(
     const char* indexFileName,
     const Genome* genome,
-    GzipWriterFilterSupplier* gzipSupplier)
+    GzipWriterFilterSupplier* gzipSupplier,
+    bool csi,
+    int numThreads)
+{
+    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier, csi, numThreads);
+}
+
+    bool
+DataWriterSupplier::needsCsiIndex(
+    const Genome* genome)
 {
-    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier);
+    return BAMIndexSupplier::csiDepth(genome, BAMAlignment::BAI_MIN_SHIFT) > BAMAlignment::BAI_DEPTH;
 }
 
     void
-BAMIndexSupplier::onRead(
-    BAMAlignment* bam,
-    size_t fileOffset,
-    int batchIndex)
+BAMIndexSupplier::onReads(
+    char* buffer,
+    size_t bufferOffset,
+    VariableSizeVector<size_t>* offsets)
 {
-    //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
-    if (bam->refID != lastRefId) {
-        if (lastRefId != -1) {
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
-            readCounts[0] = readCounts[1] = 0;
+    manager->buffer = buffer;
+    manager->bufferOffset = bufferOffset;
+    manager->offsets = offsets;
+    int parts;
+    if ((size_t) offsets->size() < MinParallelReads) {
+        inlineWorker->step();
+        parts = 1;
+    } else {
+        coworker->step();
+        parts = manager->numThreads;
+    }
+    for (int t = 0; t < parts; t++) {
+        for (int i = 0; i < manager->runs[t].size(); i++) {
+            addRun(manager->runs[t][i]);
+        }
+        for (int i = 0; i < manager->windows[t].size(); i++) {
+            const BAMIndexWindow& w = manager->windows[t][i];
+            addInterval(w.refId, w.window, w.offset);
         }
-        firstBamStart = fileOffset;
     }
-    readCounts[(bam->FLAG & SAM_UNMAPPED) ? 1 : 0]++;
-    if (bam->refID != lastRefId || bam->bin != lastBin || lastRefId == -1) {
-        addChunk(lastRefId, lastBin, binStart, fileOffset);
-        lastBin = bam->bin;
-        lastRefId = bam->refID;
-        binStart = fileOffset;
+}
+
+    void
+BAMIndexSupplier::addRun(
+    const BAMIndexRun& run)
+{
+    // the threads split the batch wherever they like, so a run may carry on from the last one
+    if (current.refId == run.refId && current.bin == run.bin && current.end == run.start && current.refId != -1) {
+        current.end = run.end;
+    } else {
+        if (current.refId != -1) {
+            addChunk(current.refId, current.bin, current.start, current.end);
+        }
+        if (run.refId != lastRefId) {
+            finishRef();
+            firstBamStart = run.start;
+            lastRefId = run.refId;
+        }
+        current = run;
     }
-    if (! (bam->FLAG & SAM_UNMAPPED)) {
-        _ASSERT(bam->pos != -1 && bam->refID != -1);
-        addInterval(bam->refID, bam->pos, bam->pos + bam->l_ref() - 1, fileOffset);
+    readCounts[0] += run.readCounts[0];
+    readCounts[1] += run.readCounts[1];
+    lastBamEnd = run.end;
+}
+
+    void
+BAMIndexSupplier::finishRef()
+{
+    // the metadata bin has where the contig's reads are, and how many of them are mapped and unmapped
+    if (lastRefId != -1) {
+        addChunk(lastRefId, metadataBin, firstBamStart, lastBamEnd);
+        addChunk(lastRefId, metadataBin, readCounts[0], readCounts[1]);
     }
-    lastBamEnd = fileOffset + bam->size();
+    readCounts[0] = readCounts[1] = 0;
 }
 
     void
 BAMIndexSupplier::onClosed(
     DataWriterSupplier* supplier)
 {
+    coworker->stop();
+
     // add final chunk
-    if (lastRefId != -1) {
-        addChunk(lastRefId, lastBin, binStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+    if (current.refId != -1) {
+        addChunk(current.refId, current.bin, current.start, current.end);
     }
+    finishRef();
 
     // write out index file
-    FILE* index = fopen(indexFileName, "wb");
-    char magic[4] = {'B', 'A', 'I', 1};
-    fwrite(magic, sizeof(magic), 1, index);
+    FILE* file = fopen(indexFileName, "wb");
+    if (file == NULL) {
+        WriteErrorMessage("Unable to open index file '%s' for write\n", indexFileName);
+        soft_exit(1);
+    }
+    IndexFileWriter index(file, csi);
+    if (csi) {
+        char magic[4] = {'C', 'S', 'I', 1};
+        index.write(magic, sizeof(magic));
+        _int32 header[3] = {minShift, depth, 0}; // no auxiliary data
+        index.write(header, sizeof(header));
+    } else {
+        char magic[4] = {'B', 'A', 'I', 1};
+        index.write(magic, sizeof(magic));
+    }
     _int32 n_ref = genome->getNumContigs();
-    fwrite(&n_ref, sizeof(n_ref), 1, index);
+    index.write(&n_ref, sizeof(n_ref));
 
     for (int i = 0; i < n_ref; i++) {
         RefInfo* info = getRefInfo(i);
-        _int32 n_bin, n_intv;
-        if (info == NULL) {
-            n_bin = 0;
-            fwrite(&n_bin, sizeof(n_bin), 1, index);
-            n_intv = 0;
-            fwrite(&n_intv, sizeof(n_intv), 1, index);
+        writeBins(&index, info);
+        if (csi) {
             continue;
         }
-        n_bin = info->bins.size();
-        fwrite(&n_bin, sizeof(n_bin), 1, index);
-        for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
-            _uint32 bin = j->key;
-            fwrite(&bin, sizeof(bin), 1, index);
-            _int32 n_chunk = (_int32) j->value.size();
-            fwrite(&n_chunk, sizeof(n_chunk), 1, index);
-            if (bin != BAMAlignment::BAM_EXTRA_BIN) {
-                for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
-                    _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
-                    fwrite(&chunk, sizeof(chunk), 1, index);
+        _int32 n_intv = (_int32) info->intervals.size();
+        index.write(&n_intv, sizeof(n_intv));
+        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
+            index.write(&ioffset, sizeof(ioffset));
+        }
+    }
+    if (! index.finish()) {
+        WriteErrorMessage("Unable to write index file '%s'\n", indexFileName);
+        soft_exit(1);
+    }
+    fclose(file);
+}
+
+    void
+BAMIndexSupplier::writeBins(
+    IndexFileWriter* index,
+    RefInfo* info)
+{
+    //
+    // A .csi has no linear index.  Instead each bin has the offset of the first read that overlaps it, which comes from
+    // the linear index for its first window: the smallest offset there or in any later window, since a read reaching
+    // that window ends in it or after it.
+    //
+    if (csi) {
+        for (_int64 j = info->intervals.size() - 2; j >= 0; j--) {
+            info->intervals[j] = min(info->intervals[j], info->intervals[j + 1]);
+        }
+    }
+    _int32 n_bin = info->bins.size();
+    index->write(&n_bin, sizeof(n_bin));
+    for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
+        _uint32 bin = j->key;
+        index->write(&bin, sizeof(bin));
+        if (csi) {
+            _uint64 loffset = 0;
+            if (bin != metadataBin) {
+                int level = 0;
+                while (bin >= BAMAlignment::binCount(level)) {
+                    level++;
                 }
-            } else {
-                _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
-                fwrite(&chunk, sizeof(chunk), 1, index);
-                chunk[0] = j->value[1].start;
-                chunk[1] = j->value[1].end;
-                fwrite(&chunk, sizeof(chunk), 1, index);
+                _int64 window = (_int64) (bin - (level > 0 ? BAMAlignment::binCount(level - 1) : 0)) << (3 * (depth - level));
+                loffset = window < info->intervals.size() && info->intervals[window] != UINT64_MAX ? info->intervals[window] : j->value[0].start;
+                loffset = gzipSupplier->toVirtualOffset(loffset);
             }
+            index->write(&loffset, sizeof(loffset));
         }
-        n_intv = (_int32) info->intervals.size();
-        fwrite(&n_intv, sizeof(n_intv), 1, index);
-        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
-            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
-            fwrite(&ioffset, sizeof(ioffset), 1, index);
+        _int32 n_chunk = (_int32) j->value.size();
+        index->write(&n_chunk, sizeof(n_chunk));
+        if (bin != metadataBin) {
+            for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
+                _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
+                index->write(chunk, sizeof(chunk));
+            }
+        } else {
+            _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
+            index->write(chunk, sizeof(chunk));
+            chunk[0] = j->value[1].start;
+            chunk[1] = j->value[1].end;
+            index->write(chunk, sizeof(chunk));
         }
     }
-    fclose(index);
 }
 
    BAMIndexSupplier::RefInfo*
@@ -1792,17 +3529,15 @@ BAMIndexSupplier::addChunk(
     void
 BAMIndexSupplier::addInterval(
     int refId,
-    int begin,
-    int end,
+    int window,
     _uint64 fileOffset)
 {
     RefInfo* info = getRefInfo(refId);
     if (info == NULL) {
         return;
     }
-    int slot = end <= 0 ? 0 : ((end - 1) / 16384);
-    if (slot >= info->intervals.size()) {
-        for (_int64 i = info->intervals.size(); i < slot; i++) {
+    if (window >= info->intervals.size()) {
+        for (_int64 i = info->intervals.size(); i < window; i++) {
             info->intervals.push_back(UINT64_MAX);
         }
         info->intervals.push_back(fileOffset);
@@ -1837,5 +3572,3 @@ BgzfHeader::validate(
         BSIZE() + 1 == compressed;
 }
 
-const int BAMReader::MAX_SEQ_LENGTH = MAX_READ_LENGTH;
-const int BAMReader::MAX_RECORD_LENGTH = MAX_READ_LENGTH * 8;
@@ -144,6 +144,7 @@ struct BAMAlignment
     static int GetCigarOpCount(_uint32 op) { return op >> 4; }
     
     static void decodeSeq(char* o_sequence, const _uint8* nibbles, int bases);
+    // o_qual may be the same as quality, to convert in place
     static void decodeQual(char* o_qual, char* quality, int bases);
     static void decodeSeqRC(char* o_sequence, const _uint8* nibbles, int bases);
     static void decodeQualRC(char* o_qual, char* quality, int bases);
@@ -163,9 +164,19 @@ struct BAMAlignment
 
     /* calculate bin given an alignment covering [beg,end) (zero-based, half-close-half-open) */
     static int reg2bin(int beg, int end);
+
+    //
+    // The same for a .csi index, where the smallest bins are 2^minShift bases and there are depth levels below the root.
+    // A .bai is the special case of 14 and 5, which only reaches 2^29 bases.
+    //
+    static const int BAI_MIN_SHIFT = 14;
+    static const int BAI_DEPTH = 5;
+    static _uint32 reg2bin(int beg, int end, int minShift, int depth);
     /* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
-    static const int MAX_BIN = (((1<<18)-1)/7);
-    static int reg2bins(int beg, int end, _uint16* list/*[MAX_BIN]*/);
+    static void reg2bins(int beg, int end, int minShift, int depth, VariableSizeVector<_uint32>* list);
+    // the number of bins in an index of depth levels, and the one after the last that holds each contig's metadata
+    static _uint32 binCount(int depth) { return ((1 << (3 * (depth + 1))) - 1) / 7; }
+    static _uint32 metadataBin(int depth) { return binCount(depth) + 1; }
 
     // absoluate genome locations
 
@@ -361,6 +372,21 @@ struct BgzfHeader
 #pragma pack(pop)
 
 
+class BAMRegionList;
+class BAMIndex;
+
+//
+// A read from a span of a BAMRegionList whose mate starts somewhere else, so the two have to be fetched together.
+//
+struct BAMSplitPair
+{
+    _uint64     key;        // hash of the read name
+    int         refID;
+    int         pos;
+    int         mateRefID;
+    int         matePos;
+};
+
 class BAMReader : public PairedReadReader, public ReadReader {
 public:
 
@@ -414,8 +440,33 @@ public:
         static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, bool quicklyDropUnmatchedReads, 
             const ReaderContext& context, int matchBufferSize = 5000);
 
-        static const int MAX_SEQ_LENGTH;
-        static const int MAX_RECORD_LENGTH;
+        //
+        // A reader that returns only the reads in one span of a BAMRegionList that overlap its regions.
+        //
+        static BAMReader* createForSpan(const char *fileName, int bufferCount, const BAMRegionList* regions, int span,
+            const ReaderContext& context);
+
+        //
+        // For a span, set aside the paired reads whose mates might not be in it, rather than returning them, so they can
+        // be paired up with their mates afterwards.  A pair is returned only when both reads start in the span's regions.
+        //
+        void setAsideSplitPairs(VariableSizeVector<BAMSplitPair>* o_splitPairs)
+        { splitPairs = o_splitPairs; }
+
+        //
+        // The reference sequences in the binary part of the header, which is only read when starting at the beginning
+        // of the file.  getRefID returns -1 if there's no such reference.
+        //
+        int getRefID(const char* name, size_t nameLength);
+
+        int getRefCount()
+        { return (int) refSeqs.size(); }
+
+        int getRefLength(int refID)
+        { return refSeqs[refID].length; }
+
+        static int maxSeqLength() { return (int) MaxReadLength; }
+        static int maxRecordLength() { return (int) MaxReadLength * 8; }
 
 protected:
 
@@ -429,11 +480,112 @@ protected:
 private:
         void readHeader(const char* fileName);
 
+        void skipBytes(const char* fileName, _int64 bytes);
+
+        // whether a read overlaps one of the span's regions; sets *o_pastRegions once the reads are past all of them
+        bool inRegions(BAMAlignment* bam, bool* o_pastRegions);
+
+        // whether a read and its mate (if it has one) both start in the span's regions
+        bool mateInSpan(BAMAlignment* bam);
 
         char* getExtra(_int64 bytes);
 
+        struct RefSeq
+        {
+            char*   name;
+            int     length;
+        };
+
         DataReader*         data;
+        VariableSizeVector<RefSeq> refSeqs;
+        const BAMRegionList* regions; // NULL unless reading a span
+        int                 firstRegion;
+        int                 nextRegion; // first region in the span that this or a later read could overlap
+        int                 endRegion;
+        VariableSizeVector<BAMSplitPair>* splitPairs; // NULL unless setting aside pairs
         //unsigned            n_ref; // number of reference sequences
         //unsigned*           refOffset; // array mapping ref sequence ID to contig location
         _int64              extraOffset; // offset into extra data
 };
+
+//
+// A part of a reference sequence to read from a sorted, indexed BAM file, [begin, end) counting from 0.
+//
+struct BAMRegion
+{
+    int         refID;
+    int         begin;
+    int         end;
+};
+
+//
+// A piece of a BAM file between two BGZF virtual offsets (compressed block offset << 16 | offset within the block) that holds
+// every read overlapping regions [firstRegion, endRegion).  It may also hold reads that don't overlap them.
+//
+struct BAMRegionSpan
+{
+    _uint64     start;
+    _uint64     end;
+    int         firstRegion;
+    int         endRegion;
+};
+
+//
+// The regions given with -region, sorted with overlapping ones merged, and the spans of a sorted BAM file that hold their
+// reads, found using the .bai index next to it.  Threads take spans with getNextSpan and read each one with its own
+// BAMReader::createForSpan, so for a panel or an exome only a small part of the file is ever decompressed.
+//
+class BAMRegionList
+{
+public:
+    //
+    // regionSpec is either a BED file or a comma separated list of contig, contig:begin or contig:begin-end (counting
+    // from 1, inclusive, like samtools).  headerReader supplies the reference names.  Prints an error and exits if the
+    // regions or the index are no good.
+    //
+    static BAMRegionList* create(const char* fileName, const char* regionSpec, BAMReader* headerReader);
+
+    //
+    // A list of single bases, sorted and merged, that uses the index of an existing list.  It's for fetching the reads
+    // that start at them.
+    //
+    static BAMRegionList* createForPositions(const BAMRegionList* other, VariableSizeVector<BAMRegion>* positions);
+
+    ~BAMRegionList();
+
+    // Claim the next span to read, returning false once they've all been taken.
+    bool getNextSpan(int* o_span);
+
+    const BAMRegion& getRegion(int i) const
+    { return regions[i]; }
+
+    int getRegionCount() const
+    { return (int) regions.size(); }
+
+    const BAMRegionSpan& getSpan(int i) const
+    { return spans[i]; }
+
+    int getSpanCount() const
+    { return (int) spans.size(); }
+
+    // Whether pos is in one of regions [firstRegion, endRegion).
+    bool contains(int refID, int pos, int firstRegion, int endRegion) const;
+
+    // Regions whose spans are this close together in the compressed file are read as one span.
+    static const _uint64 MergeGap = 256 * 1024;
+
+private:
+    BAMRegionList() : index(NULL), ownsIndex(false), nextSpan(0) {}
+
+    bool addRegion(const char* name, size_t nameLength, int begin, int end, BAMReader* headerReader);
+    bool parseRegionList(const char* regionSpec, BAMReader* headerReader);
+    bool parseBedFile(const char* bedFileName, FILE* bedFile, BAMReader* headerReader);
+    void sortAndMerge();
+    void findSpans();
+
+    BAMIndex*                           index;
+    bool                                ownsIndex;
+    VariableSizeVector<BAMRegion>       regions;
+    VariableSizeVector<BAMRegionSpan>   spans;
+    volatile int                        nextSpan;
+};
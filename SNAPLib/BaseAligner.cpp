@@ -108,7 +108,7 @@ Arguments:
     seedLen = genomeIndex->getSeedLength();
     doesGenomeIndexHave64BitLocations = genomeIndex->doesGenomeIndexHave64BitLocations();
 
-    probDistance = new ProbabilityDistance(SNP_PROB, GAP_OPEN_PROB, GAP_EXTEND_PROB);  // Match Mason
+    probDistance = new ProbabilityDistance(SNP_PROB, GAP_OPEN_PROB, GAP_EXTEND_PROB, maxReadSize);  // Match Mason
 
     if ((i_landauVishkin == NULL) != (i_reverseLandauVishkin == NULL)) {
         WriteErrorMessage("Must supply both or neither of forward & reverse Landau-Vishkin objects.  You tried exactly one.\n");
@@ -297,8 +297,7 @@ Return Value:
     // A bitvector for used seeds, indexed on the starting location of the seed within the read.
     //
     if (inputRead->getDataLength() > maxReadSize) {
-        WriteErrorMessage("BaseAligner:: got too big read (%d > %d)\n" 
-                          "Increase MAX_READ_LENGTH at the beginning of Read.h and recompile\n", inputRead->getDataLength(), maxReadSize);
+        WriteErrorMessage("BaseAligner:: got too big read (%d > %d)\n", inputRead->getDataLength(), maxReadSize);
         soft_exit(1);
     }
 
@@ -902,7 +901,7 @@ Return Value:
                         } else {
                             score = score1 + score2;
                             // Map probabilities for substrings can be multiplied, but make sure to count seed too
-                            matchProbability = matchProb1 * matchProb2 * pow(1 - SNP_PROB, seedLen);
+                            matchProbability = matchProb1 * matchProb2 * lv_perfectMatchProbability[seedLen];
 
                             //
                             // Adjust the genome location based on any indels that we found.
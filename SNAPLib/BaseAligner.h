@@ -123,11 +123,7 @@ private:
     ProbabilityDistance *probDistance;
 
     // Maximum distance to merge candidates that differ in indels over.
-#ifdef LONG_READS
-    static const unsigned maxMergeDist = 64; // Must be even and <= 64
-#else
     static const unsigned maxMergeDist = 48; // Must be even and <= 64
-#endif
     char rcTranslationTable[256];
 
     _int64 nHashTableLookups;
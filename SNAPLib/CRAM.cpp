@@ -0,0 +1,3258 @@
+/*++
+
+Module Name:
+
+    CRAM.cpp
+
+Abstract:
+
+    CRAM file reader and writer.
+
+Environment:
+
+    User mode service.
+
+    CRAMReader isn't thread safe, except for holdBatch and releaseBatch.  Each thread that encodes CRAM has its own
+    CRAMEncoder.
+
+--*/
+
+#include "stdafx.h"
+#include "CRAM.h"
+#include "CRAMCodecs.h"
+#include "SAM.h"
+#include "Bam.h"
+#include "Genome.h"
+#include "GzipCodec.h"
+#include "DataWriter.h"
+#include "ParallelTask.h"
+#include "AlignerOptions.h"
+#include "ReadSupplierQueue.h"
+#include "Tables.h"
+#include "Util.h"
+#include "exit.h"
+#include "Error.h"
+#include "zlib.h"
+
+using util::strnchr;
+
+//
+// The CRAM 3.0 specification is at https://samtools.github.io/hts-specs/CRAMv3.pdf.  The decoding here follows it
+// (and htslib, where it's vague).
+//
+
+    void
+CRAMMalformed(
+    const char* what)
+{
+    WriteErrorMessage("CRAMReader: malformed CRAM file (%s)\n", what);
+    soft_exit(1);
+}
+
+    static int
+Itf8Length(
+    _uint8 first)
+{
+    return first < 0x80 ? 1 : first < 0xc0 ? 2 : first < 0xe0 ? 3 : first < 0xf0 ? 4 : 5;
+}
+
+    static int
+Ltf8Length(
+    _uint8 first)
+{
+    int length = 1;
+    for (_uint8 bit = 0x80; bit != 0 && (first & bit); bit >>= 1) {
+        length++;
+    }
+    return length;
+}
+
+    bool
+RansDecoder::readFrequencies(
+    const _uint8*&  p,
+    const _uint8*   end,
+    int             context)
+{
+    //
+    // The symbols with non-zero frequencies are in order, and a run of consecutive ones is given by the first two
+    // followed by the number of others.  A zero symbol ends the table.
+    //
+    _uint16* f = freq[context];
+    _uint16* c = cumulative[context];
+    memset(f, 0, sizeof(freq[context]));
+    if (p >= end) {
+        return false;
+    }
+    int symbol = *p++;
+    int run = 0;
+    int total = 0;
+    do {
+        if (symbol > 255 || p >= end) {
+            return false;
+        }
+        int frequency = *p++;
+        if (frequency >= 128) {
+            if (p >= end) {
+                return false;
+            }
+            frequency = ((frequency & 0x7f) << 8) | *p++;
+        }
+        if (total + frequency > (1 << TotalBits)) {
+            return false;
+        }
+        f[symbol] = frequency;
+        c[symbol] = total;
+        memset(lookup[context] + total, symbol, frequency);
+        total += frequency;
+
+        if (run == 0 && p + 1 < end && symbol + 1 == *p) {
+            symbol = *p++;
+            run = *p++;
+        } else if (run > 0) {
+            run--;
+            symbol++;
+        } else {
+            if (p >= end) {
+                return false;
+            }
+            symbol = *p++;
+        }
+    } while (symbol != 0);
+
+    memset(lookup[context] + total, 0, (1 << TotalBits) - total);
+    return total > 0;
+}
+
+    bool
+RansDecoder::decode(
+    const _uint8*   input,
+    size_t          inputSize,
+    _uint8*         output,
+    size_t          outputSize)
+{
+    if (inputSize < 9) {
+        return false;
+    }
+    int order = input[0];
+    _uint32 rawSize = input[5] | (input[6] << 8) | (input[7] << 16) | ((_uint32)input[8] << 24);
+    if (rawSize != outputSize || (order != 0 && order != 1)) {
+        return false;
+    }
+    const _uint8* p = input + 9;
+    const _uint8* end = input + inputSize;
+    const _uint32 mask = (1 << TotalBits) - 1;
+    _uint32 state[4];
+
+    if (order == 0) {
+        if (!readFrequencies(p, end, 0) || end - p < 16) {
+            return false;
+        }
+        for (int j = 0; j < 4; j++, p += 4) {
+            state[j] = p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32)p[3] << 24);
+        }
+        for (size_t i = 0; i < outputSize; i++) {
+            int j = i & 3;
+            _uint32 m = state[j] & mask;
+            _uint8 symbol = lookup[0][m];
+            output[i] = symbol;
+            state[j] = freq[0][symbol] * (state[j] >> TotalBits) + m - cumulative[0][symbol];
+            while (state[j] < LowerBound) {
+                if (p >= end) {
+                    return false;
+                }
+                state[j] = (state[j] << 8) | *p++;
+            }
+        }
+        return true;
+    }
+
+    //
+    // Order 1: a table for each preceding byte.  The output is split into quarters, one per state, each starting with
+    // context 0, and the last state does whatever's left over.
+    //
+    if (p >= end) {
+        return false;
+    }
+    int context = *p++;
+    int run = 0;
+    do {
+        if (context > 255 || !readFrequencies(p, end, context)) {
+            return false;
+        }
+        if (run == 0 && p + 1 < end && context + 1 == *p) {
+            context = *p++;
+            run = *p++;
+        } else if (run > 0) {
+            run--;
+            context++;
+        } else {
+            if (p >= end) {
+                return false;
+            }
+            context = *p++;
+        }
+    } while (context != 0);
+
+    if (end - p < 16) {
+        return false;
+    }
+    for (int j = 0; j < 4; j++, p += 4) {
+        state[j] = p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32)p[3] << 24);
+    }
+    size_t quarter = outputSize / 4;
+    size_t offset[4] = {0, quarter, 2 * quarter, 3 * quarter};
+    _uint8 last[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < outputSize; i++) {
+        //
+        // Round robin through the quarters, and then the rest of the last one.
+        //
+        int j = i < 4 * quarter ? (int)(i & 3) : 3;
+        _uint32 m = state[j] & mask;
+        _uint8 symbol = lookup[last[j]][m];
+        output[offset[j]++] = symbol;
+        state[j] = freq[last[j]][symbol] * (state[j] >> TotalBits) + m - cumulative[last[j]][symbol];
+        last[j] = symbol;
+        while (state[j] < LowerBound) {
+            if (p >= end) {
+                return false;
+            }
+            state[j] = (state[j] << 8) | *p++;
+        }
+    }
+    return true;
+}
+
+//
+// How a data series (or tag) is encoded, either in the core block's bits or in one of the external blocks.
+//
+struct CRAMEncoding
+{
+    enum Codec {Null = 0, External = 1, Huffman = 3, ByteArrayLen = 4, ByteArrayStop = 5, Beta = 6, Subexp = 7, Gamma = 9};
+
+    int             codec;
+    int             contentId;      // External and ByteArrayStop
+    int             offset;         // Beta, Subexp and Gamma
+    int             bits;           // Beta's width and Subexp's k
+    _uint8          stop;           // ByteArrayStop
+    CRAMEncoding*   length;         // ByteArrayLen
+    CRAMEncoding*   value;
+
+    // canonical Huffman codes, sorted by length
+    int             nSymbols;
+    int*            symbols;
+    int*            codeLengths;
+    _uint32*        codes;
+
+    CRAMBytes*      external;       // the block for contentId in the slice being decoded
+
+    CRAMEncoding() : codec(Null), contentId(-1), offset(0), bits(0), stop(0), length(NULL), value(NULL),
+        nSymbols(0), symbols(NULL), codeLengths(NULL), codes(NULL), external(NULL) {}
+
+    ~CRAMEncoding()
+    {
+        delete [] symbols;
+        delete [] codeLengths;
+        delete [] codes;
+    }
+};
+
+//
+// The data series that records are built from, in the order of the enum.
+//
+enum CRAMSeries {BF, CF, RI, RL, AP, RG, RN, MF, NS, NP, TS, NF, TL, FN, FC, FP, DL, BB, QQ, BS, IN, RS, PD, HC, SC, MQ, BA, QS, NumSeries};
+static const char* SeriesNames[NumSeries] = {"BF", "CF", "RI", "RL", "AP", "RG", "RN", "MF", "NS", "NP", "TS", "NF", "TL", "FN", "FC",
+    "FP", "DL", "BB", "QQ", "BS", "IN", "RS", "PD", "HC", "SC", "MQ", "BA", "QS"};
+
+// CF, the CRAM flags
+static const int CRAMQualityArray = 0x1;
+static const int CRAMDetached = 0x2;
+static const int CRAMMateDownstream = 0x4;
+static const int CRAMNoSequence = 0x8;
+
+// MF, the mate flags of a detached record
+static const int CRAMMateReversed = 0x1;
+static const int CRAMMateUnmapped = 0x2;
+
+struct CRAMBlock
+{
+    enum ContentType {FileHeader = 0, CompressionHeader = 1, SliceHeader = 2, ExternalData = 4, CoreData = 5};
+
+    int             method;
+    int             contentType;
+    int             contentId;
+    _int32          compressedSize;
+    _int32          rawSize;
+    const _uint8*   compressed;
+    const _uint8*   data;
+    CRAMBytes       cursor;
+};
+
+struct CRAMTag
+{
+    _uint8          name[3];    // the two letters and the BAM type
+    CRAMEncoding*   encoding;
+};
+
+struct CRAMRecord
+{
+    GenomeLocation  location;
+    size_t          nameOffset;     // into the container's buffer
+    size_t          seqOffset;      // the qualities follow the bases
+    size_t          auxOffset;
+    unsigned        nameLength;
+    unsigned        length;
+    unsigned        auxLength;
+    unsigned        flag;
+    unsigned        mapq;
+    unsigned        frontClipping, backClipping, frontHardClipping, backHardClipping;
+    int             contig;         // in the genome, -1 if unplaced
+    int             position;       // 1-based, in the contig
+    int             mateContig;
+    int             matePosition;
+    int             mateRecord;     // in the slice, for a mate that comes later in it, otherwise -1
+    int             chainStart;     // the first record in the slice of this record's chain of mates
+    bool            hasReadGroup;
+};
+
+//
+// A decoded container: the reads that point into it are one batch.
+//
+struct CRAMContainer
+{
+    DataBatch       batch;
+    int             holds;
+    char*           buffer;
+    size_t          bufferSize;
+    size_t          used;
+    CRAMRecord*     records;
+    int             nRecords;
+    int             recordCapacity;
+
+    CRAMContainer() : holds(0), buffer(NULL), bufferSize(0), used(0), records(NULL), nRecords(0), recordCapacity(0) {}
+
+    ~CRAMContainer()
+    {
+        delete [] buffer;
+        delete [] records;
+    }
+
+    void clear()
+    {
+        used = 0;
+        nRecords = 0;
+    }
+
+    char* append(size_t bytes)
+    {
+        if (used + bytes > bufferSize) {
+            size_t newSize = __max(used + bytes, __max(bufferSize * 2, (size_t)(1 << 20)));
+            char* newBuffer = new char[newSize];
+            memcpy(newBuffer, buffer, used);
+            delete [] buffer;
+            buffer = newBuffer;
+            bufferSize = newSize;
+        }
+        char* result = buffer + used;
+        used += bytes;
+        return result;
+    }
+
+    void reserveRecords(int count)
+    {
+        if (nRecords + count > recordCapacity) {
+            int newCapacity = __max(nRecords + count, recordCapacity * 2);
+            CRAMRecord* newRecords = new CRAMRecord[newCapacity];
+            memcpy(newRecords, records, nRecords * sizeof(CRAMRecord));
+            delete [] records;
+            records = newRecords;
+            recordCapacity = newCapacity;
+        }
+    }
+};
+
+//
+// Everything about decoding a container once its bytes have been read.
+//
+class CRAMDecoder
+{
+public:
+    CRAMDecoder(const Genome* i_genome, const char* i_fileName, int i_majorVersion);
+    ~CRAMDecoder();
+
+    // split a container into its blocks and decompress them
+    void readBlocks(const _uint8* data, size_t size, int nBlocks);
+
+    const CRAMBlock* findBlock(int contentType);
+
+    // decode the blocks of a container of reads
+    void decodeContainer(CRAMContainer* container);
+
+    void addReference(const char* name);
+
+    void addReadGroup(const char* name);
+
+    int getContig(int refId)
+    { return refId >= 0 && refId < refToContig.size() ? refToContig[refId] : -1; }
+
+private:
+    void readCompressionHeader(CRAMBytes in);
+    CRAMEncoding* readEncoding(CRAMBytes& in);
+    void clearEncodings();
+
+    void decodeSlice(CRAMBytes header, int firstBlock, int nBlocks, CRAMContainer* container);
+    void decodeRecord(CRAMRecord* record, int index, int sliceRefId, int* lastPosition, CRAMContainer* container);
+    void decodeName(CRAMRecord* record, CRAMContainer* container);
+    void setReference(int refId);
+    char referenceBase(_int64 position);
+    void copyReference(char* output, _int64 position, int count);
+    void finishRecord(CRAMRecord* record, CRAMContainer* container);
+    void linkMate(CRAMRecord* record, const CRAMRecord* mate);
+
+    CRAMBytes* external(CRAMEncoding* encoding);
+    _uint32 readBits(int count);
+    int decodeHuffman(CRAMEncoding* encoding);
+    int decodeInt(CRAMEncoding* encoding);
+    _uint8 decodeByte(CRAMEncoding* encoding);
+    void decodeBytes(CRAMEncoding* encoding, int count, _uint8* output);
+    const _uint8* decodeArray(CRAMEncoding* encoding, int* o_length);
+    CRAMEncoding* seriesEncoding(CRAMSeries series);
+
+    const Genome*                   genome;
+    const char*                     fileName;
+    int                             majorVersion;
+
+    VariableSizeVector<char*>       refNames;
+    VariableSizeVector<int>         refToContig;
+    VariableSizeVector<char*>       readGroups;
+
+    VariableSizeVector<CRAMBlock>   blocks;
+    _uint8*                         scratch;    // decompressed blocks
+    size_t                          scratchSize;
+    _uint8*                         arrayScratch;   // byte arrays that aren't just in an external block
+    int                             arrayScratchSize;
+    GzipCodec*                      gzip;
+    RansDecoder*                    rans;
+
+    // the compression header
+    bool                            readNames;
+    bool                            apDelta;
+    char                            substitution[5][4];     // the base for each reference base (ACGTN) and BS code
+    CRAMEncoding*                   series[NumSeries];
+    VariableSizeVector<CRAMEncoding*> encodings;            // all of them, for binding and deleting
+    VariableSizeVector<CRAMTag>     tags;
+    VariableSizeVector<int>         tagLists;               // where each tag line starts in tags, plus the end
+
+    // the slice being decoded
+    const _uint8*                   coreNext;
+    const _uint8*                   coreEnd;
+    int                             coreBit;
+    int                             referenceId;
+    const char*                     referenceBases;
+    _int64                          referenceStart;         // 0-based contig positions of referenceBases
+    _int64                          referenceEnd;
+    const _uint8*                   embeddedReference;
+    _int64                          embeddedReferenceStart;
+    _int64                          embeddedReferenceEnd;
+};
+
+CRAMDecoder::CRAMDecoder(
+    const Genome*   i_genome,
+    const char*     i_fileName,
+    int             i_majorVersion)
+    : genome(i_genome), fileName(i_fileName), majorVersion(i_majorVersion), scratch(NULL), scratchSize(0),
+    arrayScratch(NULL), arrayScratchSize(0), gzip(NULL), rans(NULL)
+{
+    memset(series, 0, sizeof(series));
+}
+
+CRAMDecoder::~CRAMDecoder()
+{
+    clearEncodings();
+    for (int i = 0; i < refNames.size(); i++) {
+        delete [] refNames[i];
+    }
+    for (int i = 0; i < readGroups.size(); i++) {
+        delete [] readGroups[i];
+    }
+    delete [] scratch;
+    delete [] arrayScratch;
+    delete gzip;
+    delete rans;
+}
+
+    void
+CRAMDecoder::addReference(
+    const char* name)
+{
+    char* copy = new char[strlen(name) + 1];
+    strcpy(copy, name);
+    refNames.push_back(copy);
+
+    //
+    // getLocationOfContig's index is into the contigs sorted by name, so go from the location instead.
+    //
+    int contig = -1;
+    GenomeLocation location;
+    if (genome != NULL && genome->getLocationOfContig(name, &location)) {
+        contig = (int)(genome->getContigAtLocation(location) - genome->getContigs());
+    }
+    refToContig.push_back(contig);
+}
+
+    void
+CRAMDecoder::addReadGroup(
+    const char* name)
+{
+    char* copy = new char[strlen(name) + 1];
+    strcpy(copy, name);
+    readGroups.push_back(copy);
+}
+
+    void
+CRAMDecoder::readBlocks(
+    const _uint8*   data,
+    size_t          size,
+    int             nBlocks)
+{
+    //
+    // Find the blocks and how much space they need decompressed first, so that the scratch buffer doesn't move once
+    // they're in it.
+    //
+    CRAMBytes in(data, size);
+    blocks.clear();
+    size_t needed = 0;
+    for (int i = 0; i < nBlocks; i++) {
+        CRAMBlock block;
+        block.method = in.byte();
+        block.contentType = in.byte();
+        block.contentId = in.itf8();
+        block.compressedSize = in.itf8();
+        block.rawSize = in.itf8();
+        if (block.compressedSize < 0 || block.rawSize < 0) {
+            CRAMMalformed("negative block size");
+        }
+        block.compressed = in.bytes(block.compressedSize);
+        block.data = NULL;
+        if (majorVersion >= 3) {
+            in.int32();     // CRC32
+        }
+        if (block.method != 0) {
+            needed += block.rawSize;
+        }
+        blocks.push_back(block);
+    }
+
+    if (needed > scratchSize) {
+        delete [] scratch;
+        scratchSize = __max(needed, scratchSize * 2);
+        scratch = new _uint8[scratchSize];
+    }
+
+    _uint8* output = scratch;
+    for (int i = 0; i < blocks.size(); i++) {
+        CRAMBlock* block = &blocks[i];
+        bool ok;
+        switch (block->method) {
+        case 0:
+            ok = block->compressedSize == block->rawSize;
+            block->data = block->compressed;
+            break;
+
+        case 1: {
+            if (gzip == NULL) {
+                gzip = GzipCodec::create();
+            }
+            size_t used;
+            ok = gzip->decompressMember((const char*)block->compressed, block->compressedSize, (char*)output, block->rawSize, &used) &&
+                used == (size_t)block->rawSize;
+            break;
+        }
+
+        case 4:
+            if (rans == NULL) {
+                rans = new RansDecoder;
+            }
+            ok = rans->decode(block->compressed, block->compressedSize, output, block->rawSize);
+            break;
+
+        default: {
+            static const char* MethodNames[] = {"raw", "gzip", "bzip2", "lzma", "rANS", "rANS Nx16", "adaptive arithmetic", "fqzcomp", "name tokenizer"};
+            WriteErrorMessage("CRAMReader: '%s' has blocks compressed with %s, which isn't supported.  Only raw, gzip and rANS (order 0 and 1)\n"
+                "blocks can be read, which is what samtools writes by default for CRAM 3.0.\n",
+                fileName, block->method < (int)(sizeof(MethodNames) / sizeof(MethodNames[0])) ? MethodNames[block->method] : "an unknown method");
+            soft_exit(1);
+            ok = false;
+        }
+        }
+        if (!ok) {
+            CRAMMalformed("a block doesn't decompress to its size");
+        }
+        if (block->method != 0) {
+            block->data = output;
+            output += block->rawSize;
+        }
+        block->cursor = CRAMBytes(block->data, block->rawSize);
+    }
+}
+
+    const CRAMBlock*
+CRAMDecoder::findBlock(
+    int contentType)
+{
+    for (int i = 0; i < blocks.size(); i++) {
+        if (blocks[i].contentType == contentType) {
+            return &blocks[i];
+        }
+    }
+    return NULL;
+}
+
+    void
+CRAMDecoder::clearEncodings()
+{
+    for (int i = 0; i < encodings.size(); i++) {
+        delete encodings[i];
+    }
+    encodings.clear();
+    memset(series, 0, sizeof(series));
+    tags.clear();
+    tagLists.clear();
+}
+
+    CRAMEncoding*
+CRAMDecoder::readEncoding(
+    CRAMBytes&  in)
+{
+    CRAMEncoding* encoding = new CRAMEncoding;
+    encodings.push_back(encoding);
+    encoding->codec = in.itf8();
+    CRAMBytes params = in.sized();
+
+    switch (encoding->codec) {
+    case CRAMEncoding::Null:
+        break;
+
+    case CRAMEncoding::External:
+        encoding->contentId = params.itf8();
+        break;
+
+    case CRAMEncoding::Huffman: {
+        int n = params.itf8();
+        if (n < 1 || n > 65536) {
+            CRAMMalformed("bad Huffman alphabet");
+        }
+        encoding->nSymbols = n;
+        encoding->symbols = new int[n];
+        encoding->codeLengths = new int[n];
+        encoding->codes = new _uint32[n];
+        for (int i = 0; i < n; i++) {
+            encoding->symbols[i] = params.itf8();
+        }
+        if (params.itf8() != n) {
+            CRAMMalformed("Huffman code lengths don't match the alphabet");
+        }
+        for (int i = 0; i < n; i++) {
+            encoding->codeLengths[i] = params.itf8();
+            if (encoding->codeLengths[i] < 0 || encoding->codeLengths[i] > 31) {
+                CRAMMalformed("bad Huffman code length");
+            }
+        }
+
+        //
+        // Canonical codes: sorted by length and then by symbol, each is one more than the last, shifted left when the
+        // length goes up.  There are few enough symbols that insertion sort is fine.
+        //
+        for (int i = 1; i < n; i++) {
+            int symbol = encoding->symbols[i], length = encoding->codeLengths[i];
+            int j = i;
+            while (j > 0 && (encoding->codeLengths[j - 1] > length || (encoding->codeLengths[j - 1] == length && encoding->symbols[j - 1] > symbol))) {
+                encoding->symbols[j] = encoding->symbols[j - 1];
+                encoding->codeLengths[j] = encoding->codeLengths[j - 1];
+                j--;
+            }
+            encoding->symbols[j] = symbol;
+            encoding->codeLengths[j] = length;
+        }
+        _uint32 code = 0;
+        for (int i = 0; i < n; i++) {
+            if (i > 0) {
+                code = (code + 1) << (encoding->codeLengths[i] - encoding->codeLengths[i - 1]);
+            }
+            encoding->codes[i] = code;
+        }
+        break;
+    }
+
+    case CRAMEncoding::ByteArrayLen:
+        encoding->length = readEncoding(params);
+        encoding->value = readEncoding(params);
+        break;
+
+    case CRAMEncoding::ByteArrayStop:
+        encoding->stop = params.byte();
+        encoding->contentId = params.itf8();
+        break;
+
+    case CRAMEncoding::Beta:
+    case CRAMEncoding::Subexp:
+        encoding->offset = params.itf8();
+        encoding->bits = params.itf8();
+        if (encoding->bits < 0 || encoding->bits > 32) {
+            CRAMMalformed("bad bit count");
+        }
+        break;
+
+    case CRAMEncoding::Gamma:
+        encoding->offset = params.itf8();
+        break;
+
+    default:
+        WriteErrorMessage("CRAMReader: '%s' uses encoding %d, which isn't supported\n", fileName, encoding->codec);
+        soft_exit(1);
+    }
+    return encoding;
+}
+
+    void
+CRAMDecoder::readCompressionHeader(
+    CRAMBytes   in)
+{
+    clearEncodings();
+
+    //
+    // The preservation map.  Keys that aren't there have their default values.
+    //
+    readNames = true;
+    apDelta = true;
+    bool sawSubstitution = false;
+    const _uint8* tagDictionary = NULL;
+    int tagDictionarySize = 0;
+
+    CRAMBytes map = in.sized();
+    int n = map.itf8();
+    for (int i = 0; i < n; i++) {
+        const _uint8* key = map.bytes(2);
+        if (key[0] == 'R' && key[1] == 'N') {
+            readNames = map.byte() != 0;
+        } else if (key[0] == 'A' && key[1] == 'P') {
+            apDelta = map.byte() != 0;
+        } else if (key[0] == 'R' && key[1] == 'R') {
+            map.byte();     // Whether the reference is needed; we always use it when it's there
+        } else if (key[0] == 'S' && key[1] == 'M') {
+            //
+            // For each reference base, the code (two bits each, high bits first) of each of the other four in order.
+            //
+            static const char Bases[] = "ACGTN";
+            const _uint8* matrix = map.bytes(5);
+            for (int ref = 0; ref < 5; ref++) {
+                int other = 0;
+                for (int base = 0; base < 5; base++) {
+                    if (base != ref) {
+                        substitution[ref][(matrix[ref] >> (6 - 2 * other)) & 3] = Bases[base];
+                        other++;
+                    }
+                }
+            }
+            sawSubstitution = true;
+        } else if (key[0] == 'T' && key[1] == 'D') {
+            tagDictionarySize = map.itf8();
+            tagDictionary = map.bytes(tagDictionarySize);
+        } else {
+            CRAMMalformed("unknown preservation map key");
+        }
+    }
+    if (!sawSubstitution || tagDictionary == NULL) {
+        CRAMMalformed("the compression header is missing the substitution matrix or tag dictionary");
+    }
+
+    map = in.sized();
+    n = map.itf8();
+    for (int i = 0; i < n; i++) {
+        const _uint8* key = map.bytes(2);
+        CRAMEncoding* encoding = readEncoding(map);
+        for (int s = 0; s < NumSeries; s++) {
+            if (key[0] == SeriesNames[s][0] && key[1] == SeriesNames[s][1]) {
+                series[s] = encoding;
+                break;
+            }
+        }
+    }
+
+    map = in.sized();
+    n = map.itf8();
+    VariableSizeVector<int> tagKeys;
+    VariableSizeVector<CRAMEncoding*> tagEncodings;
+    for (int i = 0; i < n; i++) {
+        tagKeys.push_back(map.itf8());
+        tagEncodings.push_back(readEncoding(map));
+    }
+
+    //
+    // The tag dictionary is a list of lines, each the tags (name and type) of some of the records, terminated by a NUL.
+    //
+    tagLists.push_back(0);
+    for (int i = 0; i < tagDictionarySize; ) {
+        if (tagDictionary[i] == 0) {
+            tagLists.push_back((int)tags.size());
+            i++;
+            continue;
+        }
+        if (i + 3 > tagDictionarySize) {
+            CRAMMalformed("bad tag dictionary");
+        }
+        CRAMTag tag;
+        memcpy(tag.name, tagDictionary + i, 3);
+        int key = (tag.name[0] << 16) | (tag.name[1] << 8) | tag.name[2];
+        tag.encoding = NULL;
+        for (int j = 0; j < tagKeys.size(); j++) {
+            if (tagKeys[j] == key) {
+                tag.encoding = tagEncodings[j];
+                break;
+            }
+        }
+        if (tag.encoding == NULL) {
+            CRAMMalformed("a tag has no encoding");
+        }
+        tags.push_back(tag);
+        i += 3;
+    }
+}
+
+    void
+CRAMDecoder::decodeContainer(
+    CRAMContainer*  container)
+{
+    if (blocks.size() == 0 || blocks[0].contentType != CRAMBlock::CompressionHeader) {
+        CRAMMalformed("container doesn't start with a compression header");
+    }
+    readCompressionHeader(blocks[0].cursor);
+
+    //
+    // Each slice is a header block and then the blocks that it says it has.
+    //
+    for (int i = 1; i < blocks.size(); ) {
+        if (blocks[i].contentType != CRAMBlock::SliceHeader) {
+            CRAMMalformed("expected a slice header");
+        }
+        CRAMBytes header = blocks[i].cursor;
+        CRAMBytes peek = header;
+        for (int field = 0; field < 4; field++) {
+            peek.itf8();
+        }
+        peek.ltf8();
+        int nBlocks = peek.itf8();
+        if (nBlocks < 0 || i + 1 + nBlocks > blocks.size()) {
+            CRAMMalformed("slice has more blocks than its container");
+        }
+        decodeSlice(header, i + 1, nBlocks, container);
+        i += 1 + nBlocks;
+    }
+}
+
+    void
+CRAMDecoder::decodeSlice(
+    CRAMBytes       header,
+    int             firstBlock,
+    int             nBlocks,
+    CRAMContainer*  container)
+{
+    int refId = header.itf8();
+    int start = header.itf8();
+    header.itf8();      // span
+    int nRecords = header.itf8();
+    _int64 recordCounter = header.ltf8();
+    header.itf8();      // number of blocks, which the caller already has
+    int nContentIds = header.itf8();
+    for (int i = 0; i < nContentIds; i++) {
+        header.itf8();
+    }
+    int embeddedReferenceId = header.itf8();
+    // Then the reference MD5 and optional tags, neither of which we need.
+
+    if (nRecords < 0) {
+        CRAMMalformed("negative record count");
+    }
+
+    //
+    // Point the encodings at their blocks.
+    //
+    coreNext = coreEnd = NULL;
+    coreBit = 0;
+    embeddedReference = NULL;
+    for (int i = firstBlock; i < firstBlock + nBlocks; i++) {
+        CRAMBlock* block = &blocks[i];
+        block->cursor = CRAMBytes(block->data, block->rawSize);
+        if (block->contentType == CRAMBlock::CoreData) {
+            coreNext = block->data;
+            coreEnd = block->data + block->rawSize;
+        } else if (block->contentType == CRAMBlock::ExternalData && block->contentId == embeddedReferenceId) {
+            embeddedReference = block->data;
+            embeddedReferenceStart = start - 1;
+            embeddedReferenceEnd = embeddedReferenceStart + block->rawSize;
+        }
+    }
+    for (int e = 0; e < encodings.size(); e++) {
+        CRAMEncoding* encoding = encodings[e];
+        encoding->external = NULL;
+        if (encoding->codec == CRAMEncoding::External || encoding->codec == CRAMEncoding::ByteArrayStop) {
+            for (int i = firstBlock; i < firstBlock + nBlocks; i++) {
+                if (blocks[i].contentType == CRAMBlock::ExternalData && blocks[i].contentId == encoding->contentId) {
+                    encoding->external = &blocks[i].cursor;
+                    break;
+                }
+            }
+        }
+    }
+
+    referenceId = -3;   // not yet set
+    int first = container->nRecords;
+    container->reserveRecords(nRecords);
+    int lastPosition = start;
+    for (int i = 0; i < nRecords; i++) {
+        CRAMRecord* record = &container->records[container->nRecords++];
+        record->chainStart = i;
+        decodeRecord(record, i, refId, &lastPosition, container);
+    }
+
+    //
+    // Fill in what comes from the mates that are in the slice with their records, and make up names for the records
+    // that don't have them.  Mates share a name.
+    //
+    CRAMRecord* records = container->records + first;
+    for (int i = 0; i < nRecords; i++) {
+        CRAMRecord* record = &records[i];
+        if (record->nameLength == 0) {
+            char name[32];
+            record->nameLength = sprintf(name, "%lld", (long long)(recordCounter + i + 1));
+            record->nameOffset = container->used;
+            memcpy(container->append(record->nameLength), name, record->nameLength);
+        }
+        if (record->mateRecord >= 0) {
+            if (record->mateRecord >= nRecords) {
+                CRAMMalformed("a mate is past the end of its slice");
+            }
+            CRAMRecord* mate = &records[record->mateRecord];
+            if (mate->nameLength == 0) {
+                mate->nameOffset = record->nameOffset;
+                mate->nameLength = record->nameLength;
+            }
+            mate->chainStart = record->chainStart;
+            linkMate(record, mate);
+        } else if (record->chainStart != i) {
+            // the last in a chain of mates points back to the first
+            linkMate(record, &records[record->chainStart]);
+        }
+        finishRecord(record, container);
+    }
+}
+
+    void
+CRAMDecoder::linkMate(
+    CRAMRecord*         record,
+    const CRAMRecord*   mate)
+{
+    record->mateContig = mate->contig;
+    record->matePosition = mate->position;
+    if (mate->flag & SAM_REVERSE_COMPLEMENT) {
+        record->flag |= SAM_NEXT_REVERSED;
+    }
+    if (mate->flag & SAM_UNMAPPED) {
+        record->flag |= SAM_NEXT_UNMAPPED;
+    }
+}
+
+    CRAMEncoding*
+CRAMDecoder::seriesEncoding(
+    CRAMSeries  s)
+{
+    if (series[s] == NULL) {
+        WriteErrorMessage("CRAMReader: malformed CRAM file (data series %s is used but has no encoding)\n", SeriesNames[s]);
+        soft_exit(1);
+    }
+    return series[s];
+}
+
+    void
+CRAMDecoder::decodeName(
+    CRAMRecord*     record,
+    CRAMContainer*  container)
+{
+    int length;
+    const _uint8* name = decodeArray(seriesEncoding(RN), &length);
+    // htslib writes a NUL at the end with BYTE_ARRAY_LEN
+    while (length > 0 && name[length - 1] == 0) {
+        length--;
+    }
+    record->nameLength = length;
+    record->nameOffset = container->used;
+    memcpy(container->append(length), name, length);
+}
+
+    void
+CRAMDecoder::decodeRecord(
+    CRAMRecord*     record,
+    int             index,
+    int             sliceRefId,
+    int*            lastPosition,
+    CRAMContainer*  container)
+{
+    unsigned flag = decodeInt(seriesEncoding(BF));
+    int cramFlags = decodeInt(seriesEncoding(CF));
+    int refId = sliceRefId == -2 ? decodeInt(seriesEncoding(RI)) : sliceRefId;
+    int length = decodeInt(seriesEncoding(RL));
+    if (length < 0 || length > (1 << 24)) {
+        CRAMMalformed("bad read length");
+    }
+    int position = decodeInt(seriesEncoding(AP));
+    if (apDelta) {
+        position += *lastPosition;
+        *lastPosition = position;
+    }
+    int readGroup = decodeInt(seriesEncoding(RG));
+
+    record->nameLength = 0;
+    if (readNames) {
+        decodeName(record, container);
+    }
+
+    record->mateContig = -1;
+    record->matePosition = 0;
+    record->mateRecord = -1;
+    if (cramFlags & CRAMDetached) {
+        int mateFlags = decodeInt(seriesEncoding(MF));
+        if (mateFlags & CRAMMateReversed) {
+            flag |= SAM_NEXT_REVERSED;
+        }
+        if (mateFlags & CRAMMateUnmapped) {
+            flag |= SAM_NEXT_UNMAPPED;
+        }
+        if (!readNames) {
+            decodeName(record, container);
+        }
+        record->mateContig = getContig(decodeInt(seriesEncoding(NS)));
+        record->matePosition = decodeInt(seriesEncoding(NP));
+        decodeInt(seriesEncoding(TS));
+    } else if (cramFlags & CRAMMateDownstream) {
+        record->mateRecord = index + 1 + decodeInt(seriesEncoding(NF));
+    }
+
+    //
+    // The tags are BAM's binary aux format already, except for the read group, which has its own data series.
+    //
+    int tagList = decodeInt(seriesEncoding(TL));
+    if (tagList < 0 || tagList + 1 >= tagLists.size()) {
+        CRAMMalformed("bad tag line");
+    }
+    record->hasReadGroup = false;
+    record->auxOffset = container->used;
+    for (int t = tagLists[tagList]; t < tagLists[tagList + 1]; t++) {
+        int valueLength;
+        const _uint8* value = decodeArray(tags[t].encoding, &valueLength);
+        char* aux = container->append(3 + valueLength);
+        memcpy(aux, tags[t].name, 3);
+        memcpy(aux + 3, value, valueLength);
+        record->hasReadGroup |= tags[t].name[0] == 'R' && tags[t].name[1] == 'G' && tags[t].name[2] == 'Z';
+    }
+    if (readGroup >= 0) {
+        if (readGroup >= readGroups.size()) {
+            CRAMMalformed("read group isn't in the header");
+        }
+        size_t nameLength = strlen(readGroups[readGroup]) + 1;
+        char* aux = container->append(3 + nameLength);
+        memcpy(aux, "RGZ", 3);
+        memcpy(aux + 3, readGroups[readGroup], nameLength);
+        record->hasReadGroup = true;
+    }
+    record->auxLength = (unsigned)(container->used - record->auxOffset);
+
+    //
+    // The bases and then the qualities.  Nothing else gets appended to the container until the record is done.
+    //
+    record->seqOffset = container->used;
+    char* seq = container->append(2 * (size_t)length);
+    _uint8* qual = (_uint8*)seq + length;
+    memset(qual, 0xff, length);
+    record->frontClipping = record->backClipping = record->frontHardClipping = record->backHardClipping = 0;
+
+    if (!(flag & SAM_UNMAPPED)) {
+        //
+        // The read is the reference with the differences given by its features, which are in order of where they are
+        // in the read.
+        //
+        setReference(refId);
+        int nFeatures = decodeInt(seriesEncoding(FN));
+        int readPos = 0;
+        _int64 refPos = position - 1;
+        int featurePos = 0;
+        for (int f = 0; f < nFeatures; f++) {
+            _uint8 code = decodeByte(seriesEncoding(FC));
+            featurePos += decodeInt(seriesEncoding(FP));
+            int at = featurePos - 1;
+            if (at < 0 || at > length) {
+                CRAMMalformed("read feature is outside of its read");
+            }
+            if (at > readPos) {
+                copyReference(seq + readPos, refPos, at - readPos);
+                refPos += at - readPos;
+                readPos = at;
+            }
+
+            int count;
+            const _uint8* bases;
+            switch (code) {
+            case 'X': {
+                _uint8 substitutionCode = decodeByte(seriesEncoding(BS));
+                if (readPos >= length) {
+                    CRAMMalformed("substitution past the end of its read");
+                }
+                char ref = referenceBase(refPos);
+                int refIndex = ref == 'A' ? 0 : ref == 'C' ? 1 : ref == 'G' ? 2 : ref == 'T' ? 3 : 4;
+                seq[readPos++] = substitution[refIndex][substitutionCode & 3];
+                refPos++;
+                break;
+            }
+
+            case 'B':
+                if (readPos >= length) {
+                    CRAMMalformed("base past the end of its read");
+                }
+                seq[readPos] = decodeByte(seriesEncoding(BA));
+                qual[readPos] = decodeByte(seriesEncoding(QS));
+                readPos++;
+                refPos++;
+                break;
+
+            case 'b':
+            case 'I':
+            case 'S':
+                bases = decodeArray(seriesEncoding(code == 'b' ? BB : code == 'I' ? IN : SC), &count);
+                if (readPos + count > length) {
+                    CRAMMalformed("bases past the end of their read");
+                }
+                memcpy(seq + readPos, bases, count);
+                if (code == 'S') {
+                    if (readPos == 0) {
+                        record->frontClipping = count;
+                    } else {
+                        record->backClipping = count;
+                    }
+                }
+                readPos += count;
+                if (code == 'b') {
+                    refPos += count;
+                }
+                break;
+
+            case 'i':
+                if (readPos >= length) {
+                    CRAMMalformed("insertion past the end of its read");
+                }
+                seq[readPos++] = decodeByte(seriesEncoding(BA));
+                break;
+
+            case 'D':
+                refPos += decodeInt(seriesEncoding(DL));
+                break;
+
+            case 'N':
+                refPos += decodeInt(seriesEncoding(RS));
+                break;
+
+            case 'P':
+                decodeInt(seriesEncoding(PD));
+                break;
+
+            case 'H':
+                count = decodeInt(seriesEncoding(HC));
+                if (readPos == 0) {
+                    record->frontHardClipping = count;
+                } else {
+                    record->backHardClipping = count;
+                }
+                break;
+
+            case 'q':
+                bases = decodeArray(seriesEncoding(QQ), &count);
+                if (at + count > length) {
+                    CRAMMalformed("qualities past the end of their read");
+                }
+                memcpy(qual + at, bases, count);
+                break;
+
+            case 'Q':
+                if (at >= length) {
+                    CRAMMalformed("quality past the end of its read");
+                }
+                qual[at] = decodeByte(seriesEncoding(QS));
+                break;
+
+            default:
+                CRAMMalformed("unknown read feature");
+            }
+        }
+        if (readPos < length) {
+            copyReference(seq + readPos, refPos, length - readPos);
+        }
+        if (cramFlags & CRAMNoSequence) {
+            memset(seq, 'N', length);
+        }
+        record->mapq = decodeInt(seriesEncoding(MQ));
+    } else {
+        if (cramFlags & CRAMNoSequence) {
+            memset(seq, 'N', length);
+        } else {
+            decodeBytes(seriesEncoding(BA), length, (_uint8*)seq);
+        }
+        record->mapq = 0;
+    }
+
+    if (cramFlags & CRAMQualityArray) {
+        decodeBytes(seriesEncoding(QS), length, qual);
+    }
+
+    record->flag = flag;
+    record->length = length;
+    record->position = position;
+    record->contig = getContig(refId);
+    record->location = !(flag & SAM_UNMAPPED) && record->contig >= 0 && position > 0
+        ? genome->getContigs()[record->contig].beginningLocation + position - 1 : InvalidGenomeLocation;
+}
+
+    void
+CRAMDecoder::finishRecord(
+    CRAMRecord*     record,
+    CRAMContainer*  container)
+{
+    //
+    // Like BAM, the bases are in the reference's direction, so reverse complement the ones that aligned to the reverse
+    // strand to get back to what the sequencer read.  Then the qualities go from phred to SAM.
+    //
+    char* seq = container->buffer + record->seqOffset;
+    _uint8* qual = (_uint8*)seq + record->length;
+    unsigned length = record->length;
+    for (unsigned i = 0; i < length; i++) {
+        seq[i] = TO_UPPER_CASE_DOT_TO_N[(_uint8)seq[i]];
+    }
+    if (record->flag & SAM_REVERSE_COMPLEMENT) {
+        for (unsigned i = 0, j = length - 1; i < length / 2; i++, j--) {
+            char base = seq[i];
+            seq[i] = seq[j];
+            seq[j] = base;
+            _uint8 q = qual[i];
+            qual[i] = qual[j];
+            qual[j] = q;
+        }
+        for (unsigned i = 0; i < length; i++) {
+            char complement = COMPLEMENT[(_uint8)seq[i]];
+            seq[i] = complement != 0 ? complement : 'N';
+        }
+        unsigned clipping = record->frontClipping;
+        record->frontClipping = record->backClipping;
+        record->backClipping = clipping;
+        clipping = record->frontHardClipping;
+        record->frontHardClipping = record->backHardClipping;
+        record->backHardClipping = clipping;
+    }
+    for (unsigned i = 0; i < length; i++) {
+        qual[i] = CIGAR_QUAL_TO_SAM[qual[i]];
+    }
+}
+
+    void
+CRAMDecoder::setReference(
+    int refId)
+{
+    if (refId == referenceId) {
+        return;
+    }
+    referenceId = refId;
+    referenceBases = NULL;
+    referenceStart = referenceEnd = 0;
+    int contig = getContig(refId);
+    if (contig >= 0) {
+        const Genome::Contig* c = &genome->getContigs()[contig];
+        // getSubstring won't hand out a piece that runs right up to the end of a contig, but the whole thing is there
+        referenceBases = genome->getSubstring(c->beginningLocation, 0);
+        referenceEnd = c->length;
+    }
+}
+
+    char
+CRAMDecoder::referenceBase(
+    _int64 position)
+{
+    if (embeddedReference != NULL) {
+        return position >= embeddedReferenceStart && position < embeddedReferenceEnd
+            ? TO_UPPER_CASE_DOT_TO_N[embeddedReference[position - embeddedReferenceStart]] : 'N';
+    }
+    if (referenceBases == NULL) {
+        WriteErrorMessage("CRAMReader: '%s' has reads aligned to %s, which isn't in the index, so they can't be decoded\n", fileName,
+            referenceId >= 0 && referenceId < refNames.size() ? refNames[referenceId] : "an unknown reference");
+        soft_exit(1);
+    }
+    return position >= referenceStart && position < referenceEnd ? referenceBases[position - referenceStart] : 'N';
+}
+
+    void
+CRAMDecoder::copyReference(
+    char*   output,
+    _int64  position,
+    int     count)
+{
+    if (embeddedReference == NULL && referenceBases != NULL && position >= referenceStart && position + count <= referenceEnd) {
+        memcpy(output, referenceBases + (position - referenceStart), count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        output[i] = referenceBase(position + i);
+    }
+}
+
+    CRAMBytes*
+CRAMDecoder::external(
+    CRAMEncoding*   encoding)
+{
+    if (encoding->external == NULL) {
+        CRAMMalformed("an external block that's used isn't in its slice");
+    }
+    return encoding->external;
+}
+
+    _uint32
+CRAMDecoder::readBits(
+    int count)
+{
+    //
+    // The core block is read a bit at a time, most significant first.
+    //
+    _uint32 value = 0;
+    for (int i = 0; i < count; i++) {
+        if (coreNext >= coreEnd) {
+            CRAMMalformed("data runs off the end of the core block");
+        }
+        value = (value << 1) | ((*coreNext >> (7 - coreBit)) & 1);
+        if (++coreBit == 8) {
+            coreBit = 0;
+            coreNext++;
+        }
+    }
+    return value;
+}
+
+    int
+CRAMDecoder::decodeHuffman(
+    CRAMEncoding*   encoding)
+{
+    if (encoding->nSymbols == 1 && encoding->codeLengths[0] == 0) {
+        // One value, which takes no bits at all.  This is what's used for series that are always the same.
+        return encoding->symbols[0];
+    }
+    _uint32 code = 0;
+    int length = 0;
+    for (int i = 0; i < encoding->nSymbols; ) {
+        code = (code << 1) | readBits(1);
+        length++;
+        for (; i < encoding->nSymbols && encoding->codeLengths[i] == length; i++) {
+            if (encoding->codes[i] == code) {
+                return encoding->symbols[i];
+            }
+        }
+    }
+    CRAMMalformed("bad Huffman code");
+    return 0;
+}
+
+    int
+CRAMDecoder::decodeInt(
+    CRAMEncoding*   encoding)
+{
+    switch (encoding->codec) {
+    case CRAMEncoding::External:
+        return external(encoding)->itf8();
+
+    case CRAMEncoding::Huffman:
+        return decodeHuffman(encoding);
+
+    case CRAMEncoding::Beta:
+        return (int)readBits(encoding->bits) - encoding->offset;
+
+    case CRAMEncoding::Gamma: {
+        int zeros = 0;
+        while (readBits(1) == 0) {
+            if (++zeros > 31) {
+                CRAMMalformed("bad gamma code");
+            }
+        }
+        return (int)(((_uint32)1 << zeros) | readBits(zeros)) - encoding->offset;
+    }
+
+    case CRAMEncoding::Subexp: {
+        int ones = 0;
+        while (readBits(1) == 1) {
+            if (++ones > 31) {
+                CRAMMalformed("bad subexponential code");
+            }
+        }
+        int value;
+        if (ones == 0) {
+            value = (int)readBits(encoding->bits);
+        } else {
+            int bits = ones + encoding->bits - 1;
+            if (bits > 31) {
+                CRAMMalformed("bad subexponential code");
+            }
+            value = (int)(((_uint32)1 << bits) | readBits(bits));
+        }
+        return value - encoding->offset;
+    }
+
+    default:
+        CRAMMalformed("a data series has an encoding that doesn't fit its type");
+        return 0;
+    }
+}
+
+    _uint8
+CRAMDecoder::decodeByte(
+    CRAMEncoding*   encoding)
+{
+    if (encoding->codec == CRAMEncoding::External) {
+        return external(encoding)->byte();
+    }
+    return (_uint8)decodeInt(encoding);
+}
+
+    void
+CRAMDecoder::decodeBytes(
+    CRAMEncoding*   encoding,
+    int             count,
+    _uint8*         output)
+{
+    if (encoding->codec == CRAMEncoding::External) {
+        memcpy(output, external(encoding)->bytes(count), count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        output[i] = decodeByte(encoding);
+    }
+}
+
+    const _uint8*
+CRAMDecoder::decodeArray(
+    CRAMEncoding*   encoding,
+    int*            o_length)
+{
+    //
+    // Byte arrays are returned where they are in their external block if they can be, otherwise in arrayScratch.  Either
+    // way they're only good until the next call.
+    //
+    if (encoding->codec == CRAMEncoding::ByteArrayStop) {
+        CRAMBytes* in = external(encoding);
+        const _uint8* stop = (const _uint8*)memchr(in->next, encoding->stop, in->end - in->next);
+        if (stop == NULL) {
+            CRAMMalformed("byte array has no stop byte");
+        }
+        const _uint8* result = in->next;
+        *o_length = (int)(stop - result);
+        in->next = stop + 1;
+        return result;
+    }
+    if (encoding->codec != CRAMEncoding::ByteArrayLen) {
+        CRAMMalformed("a byte array data series has an encoding that doesn't fit its type");
+    }
+    int length = decodeInt(encoding->length);
+    if (length < 0) {
+        CRAMMalformed("negative byte array length");
+    }
+    *o_length = length;
+    if (encoding->value->codec == CRAMEncoding::External) {
+        return external(encoding->value)->bytes(length);
+    }
+    if (length > arrayScratchSize) {
+        delete [] arrayScratch;
+        arrayScratchSize = __max(length, 2 * arrayScratchSize);
+        arrayScratch = new _uint8[arrayScratchSize];
+    }
+    decodeBytes(encoding->value, length, arrayScratch);
+    return arrayScratch;
+}
+
+CRAMReader::CRAMReader(const ReaderContext& i_context)
+    : ReadReader(i_context), fileName(NULL), file(NULL), fileOffset(0), majorVersion(0), decoder(NULL),
+    containerBytes(NULL), containerBytesSize(0), current(NULL), nextRecord(0), nextBatchID(1)
+{
+    InitializeExclusiveLock(&lock);
+}
+
+CRAMReader::~CRAMReader()
+{
+    if (file != NULL && file != stdin) {
+        fclose(file);
+    }
+    delete decoder;
+    delete [] containerBytes;
+    for (int i = 0; i < held.size(); i++) {
+        delete held[i];
+    }
+    for (int i = 0; i < spare.size(); i++) {
+        delete spare[i];
+    }
+    DestroyExclusiveLock(&lock);
+}
+
+    CRAMReader*
+CRAMReader::create(
+    const char*             fileName,
+    const ReaderContext&    context)
+{
+    CRAMReader* reader = new CRAMReader(context);
+    reader->init(fileName);
+    return reader;
+}
+
+    void
+CRAMReader::init(
+    const char* i_fileName)
+{
+    fileName = i_fileName;
+    file = strcmp(fileName, "-") == 0 ? stdin : fopen(fileName, "rb");
+    if (file == NULL) {
+        WriteErrorMessage("CRAMReader: unable to open '%s'\n", fileName);
+        soft_exit(1);
+    }
+    readHeader();
+}
+
+    void
+CRAMReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (startingOffset != 0 || amountOfFileToProcess != 0) {
+        WriteErrorMessage("CRAMReader: CRAM files can only be read from the start\n");
+        soft_exit(1);
+    }
+}
+
+    void
+CRAMReader::readFully(
+    void*   buffer,
+    size_t  bytes)
+{
+    if (fread(buffer, 1, bytes, file) != bytes) {
+        WriteErrorMessage("CRAMReader: '%s' is truncated\n", fileName);
+        soft_exit(1);
+    }
+    fileOffset += bytes;
+}
+
+    _int32
+CRAMReader::readItf8()
+{
+    _uint8 bytes[5];
+    readFully(bytes, 1);
+    int length = Itf8Length(bytes[0]);
+    if (length > 1) {
+        readFully(bytes + 1, length - 1);
+    }
+    return CRAMBytes(bytes, length).itf8();
+}
+
+    _int64
+CRAMReader::readLtf8()
+{
+    _uint8 bytes[9];
+    readFully(bytes, 1);
+    int length = Ltf8Length(bytes[0]);
+    if (length > 1) {
+        readFully(bytes + 1, length - 1);
+    }
+    return CRAMBytes(bytes, length).ltf8();
+}
+
+    bool
+CRAMReader::readContainerHeader(
+    ContainerHeader*    header)
+{
+    _uint8 length[4];
+    size_t read = fread(length, 1, 4, file);
+    if (read == 0) {
+        return false;
+    }
+    if (read != 4) {
+        WriteErrorMessage("CRAMReader: '%s' is truncated\n", fileName);
+        soft_exit(1);
+    }
+    fileOffset += 4;
+    header->length = CRAMBytes(length, 4).int32();
+    readItf8();     // reference ID
+    readItf8();     // start
+    readItf8();     // span
+    header->nRecords = readItf8();
+    readLtf8();     // record counter
+    readLtf8();     // bases
+    header->nBlocks = readItf8();
+    int nLandmarks = readItf8();
+    for (int i = 0; i < nLandmarks; i++) {
+        readItf8();
+    }
+    if (majorVersion >= 3) {
+        _uint8 crc[4];
+        readFully(crc, 4);
+    }
+    if (header->length < 0 || header->nBlocks < 0) {
+        CRAMMalformed("bad container header");
+    }
+
+    if ((size_t)header->length > containerBytesSize) {
+        delete [] containerBytes;
+        containerBytesSize = __max((size_t)header->length, 2 * containerBytesSize);
+        containerBytes = new _uint8[containerBytesSize];
+    }
+    readFully(containerBytes, header->length);
+    return true;
+}
+
+    void
+CRAMReader::readHeader()
+{
+    _uint8 definition[26];
+    readFully(definition, sizeof(definition));
+    if (memcmp(definition, "CRAM", 4) != 0) {
+        WriteErrorMessage("CRAMReader: '%s' isn't a CRAM file\n", fileName);
+        soft_exit(1);
+    }
+    majorVersion = definition[4];
+    if (majorVersion != 3) {
+        WriteErrorMessage("CRAMReader: '%s' is CRAM version %d.%d, and only version 3 can be read\n", fileName, definition[4], definition[5]);
+        soft_exit(1);
+    }
+    decoder = new CRAMDecoder(context.genome, fileName, majorVersion);
+
+    //
+    // The SAM header is in a container of its own.
+    //
+    ContainerHeader header;
+    if (!readContainerHeader(&header)) {
+        WriteErrorMessage("CRAMReader: '%s' is truncated\n", fileName);
+        soft_exit(1);
+    }
+    decoder->readBlocks(containerBytes, header.length, header.nBlocks);
+    const CRAMBlock* block = decoder->findBlock(CRAMBlock::FileHeader);
+    if (block == NULL) {
+        CRAMMalformed("no SAM header");
+    }
+    CRAMBytes in = block->cursor;
+    _int32 textLength = in.int32();
+    if (textLength < 0) {
+        CRAMMalformed("bad SAM header length");
+    }
+    const char* text = (const char*)in.bytes(textLength);
+    textLength = (_int32)strnlen(text, textLength);
+
+    //
+    // Make sure that the last line has a newline and the buffer a NUL after it, so that parseHeader sees the whole thing.
+    //
+    char* p = new char[textLength + 2];
+    memcpy(p, text, textLength);
+    if (textLength > 0 && p[textLength - 1] != '\n') {
+        p[textLength++] = '\n';
+    }
+    p[textLength] = 0;
+
+    _int64 textHeaderSize;
+    bool sawWholeHeader;
+    if (!SAMReader::parseHeader(fileName, p, p + textLength + 1, context.genome, &textHeaderSize, &context.headerMatchesIndex, &sawWholeHeader) ||
+        !sawWholeHeader) {
+        WriteErrorMessage("CRAMReader: failed to parse header on '%s'\n", fileName);
+        soft_exit(1);
+    }
+
+    //
+    // The reference IDs are the @SQ lines in order, and read groups are the @RG lines.
+    //
+    for (char* line = p; line < p + textLength; ) {
+        char* endOfLine = strchr(line, '\n');
+        bool sq = !strncmp(line, "@SQ\t", 4);
+        bool rg = !strncmp(line, "@RG\t", 4);
+        if (sq || rg) {
+            const char* field = sq ? "\tSN:" : "\tID:";
+            char* value = NULL;
+            for (char* f = line; f != NULL && f < endOfLine; f = strchr(f + 1, '\t')) {
+                if (!strncmp(f, field, 4)) {
+                    value = f + 4;
+                    break;
+                }
+            }
+            if (value == NULL) {
+                WriteErrorMessage("CRAMReader: '%s' has an %s line without %s\n", fileName, sq ? "@SQ" : "@RG", field + 1);
+                soft_exit(1);
+            }
+            size_t valueLength = strcspn(value, "\t\n");
+            char* name = new char[valueLength + 1];
+            memcpy(name, value, valueLength);
+            name[valueLength] = 0;
+            if (sq) {
+                decoder->addReference(name);
+            } else {
+                decoder->addReadGroup(name);
+            }
+            delete [] name;
+        }
+        line = endOfLine + 1;
+    }
+
+    context.header = p;
+    context.headerLength = textHeaderSize;
+    context.headerBytes = fileOffset;
+}
+
+    CRAMContainer*
+CRAMReader::readContainer()
+{
+    ContainerHeader header;
+    while (readContainerHeader(&header)) {
+        if (header.nRecords == 0) {
+            // The EOF marker, or some other container without any reads
+            continue;
+        }
+
+        CRAMContainer* container;
+        AcquireExclusiveLock(&lock);
+        if (spare.size() > 0) {
+            container = spare[spare.size() - 1];
+            spare.truncate((int)spare.size() - 1);
+        } else {
+            container = new CRAMContainer;
+        }
+        ReleaseExclusiveLock(&lock);
+
+        container->clear();
+        decoder->readBlocks(containerBytes, header.length, header.nBlocks);
+        decoder->decodeContainer(container);
+        if (container->nRecords == 0) {
+            AcquireExclusiveLock(&lock);
+            spare.push_back(container);
+            ReleaseExclusiveLock(&lock);
+            continue;
+        }
+
+        container->batch = DataBatch(nextBatchID++);
+        container->holds = 1;   // ours, until we're done handing out its reads
+        AcquireExclusiveLock(&lock);
+        held.push_back(container);
+        ReleaseExclusiveLock(&lock);
+        return container;
+    }
+    return NULL;
+}
+
+    bool
+CRAMReader::getNextRead(
+    Read*   read)
+{
+    CRAMRecord* record;
+    do {
+        while (current == NULL || nextRecord >= current->nRecords) {
+            if (current != NULL) {
+                releaseBatch(current->batch);
+            }
+            current = readContainer();
+            nextRecord = 0;
+            if (current == NULL) {
+                return false;
+            }
+        }
+        record = &current->records[nextRecord++];
+    } while ((context.ignoreSecondaryAlignments && (record->flag & SAM_SECONDARY)) ||
+             (context.ignoreSupplementaryAlignments && (record->flag & SAM_SUPPLEMENTARY)));
+
+    const char* rnext = "*";
+    unsigned rnextLength = 1;
+    if (record->mateContig >= 0) {
+        rnext = context.genome->getContigs()[record->mateContig].name;
+        rnextLength = context.genome->getContigs()[record->mateContig].nameLength;
+    }
+    char* seq = current->buffer + record->seqOffset;
+    read->init(current->buffer + record->nameOffset, record->nameLength, seq, seq + record->length, record->length, record->location,
+        record->mapq, record->flag, record->frontClipping, record->backClipping, record->frontHardClipping, record->backHardClipping,
+        rnext, rnextLength, record->matePosition, true);
+    read->setBatch(current->batch);
+    read->clip(context.clipping);
+    read->setReadGroup(record->hasReadGroup ? READ_GROUP_FROM_AUX : context.defaultReadGroup);
+    read->setAuxiliaryData(record->auxLength > 0 ? current->buffer + record->auxOffset : NULL, record->auxLength);
+    return true;
+}
+
+    void
+CRAMReader::holdBatch(
+    DataBatch   batch)
+{
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < held.size(); i++) {
+        if (held[i]->batch == batch) {
+            held[i]->holds++;
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+CRAMReader::releaseBatch(
+    DataBatch   batch)
+{
+    //
+    // Keep a few released containers around so that their buffers can be reused.
+    //
+    const int MaxSpare = 4;
+    CRAMContainer* done = NULL;
+    bool released = false;
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < held.size(); i++) {
+        if (held[i]->batch == batch) {
+            _ASSERT(held[i]->holds > 0);
+            if (--held[i]->holds == 0) {
+                released = true;
+                done = held[i];
+                held.erase(i);
+                if (spare.size() < MaxSpare) {
+                    spare.push_back(done);
+                    done = NULL;
+                }
+            }
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+    delete done;
+    return released;
+}
+
+    ReadSupplierGenerator *
+CRAMReader::createReadSupplierGenerator(
+    const char*             fileName,
+    int                     numThreads,
+    const ReaderContext&    context)
+{
+    CRAMReader* reader = create(fileName, context);
+    ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
+    queue->startReaders();
+    return queue;
+}
+
+    PairedReadSupplierGenerator *
+CRAMReader::createPairedReadSupplierGenerator(
+    const char*             fileName,
+    int                     numThreads,
+    bool                    quicklyDropUnmatchedReads,
+    const ReaderContext&    context)
+{
+    CRAMReader* reader = create(fileName, context);
+    PairedReadReader* matcher = PairedReadReader::ShardedPairMatcher(reader, quicklyDropUnmatchedReads, numThreads);
+    ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
+    queue->startReaders();
+    return queue;
+}
+
+//
+// Writing.  The aligner threads (and the merge of sorted output) fill the writers' buffers with BAM records exactly as
+// they would for BAM output, so sorting, duplicate marking and everything else that looks at the records don't need to
+// know about CRAM.  Each full buffer is then encoded into CRAM containers in place, the same way GzipDataWriter turns
+// BAM records into BGZF blocks: by the writer's own thread for unsorted output, and by a FileEncoder's threads, one
+// container per thread at a time, for sorted output.
+//
+// A container has a single slice of up to RecordsPerSlice reads.  Every data series and tag goes in an external block of
+// its own, which is what lets rANS (or gzip, for names and tags) do well on them; the core block is always empty.  Bases
+// that match the genome aren't stored at all, which is where most of the savings over BAM comes from.
+//
+
+    static int
+Itf8Size(
+    _int32 signedValue)
+{
+    _uint32 value = (_uint32)signedValue;
+    return value < 0x80 ? 1 : value < 0x4000 ? 2 : value < 0x200000 ? 3 : value < 0x10000000 ? 4 : 5;
+}
+
+    _uint32
+CRAMCrc32(
+    const _uint8*   data,
+    size_t          size,
+    _uint32         crc)
+{
+    return (_uint32)crc32(crc, data, (uInt)size);
+}
+
+    void
+CRAMMD5(
+    const _uint8*   data,
+    size_t          size,
+    _uint8*         digest,
+    bool            upperCase)
+{
+    static const _uint32 K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const int Shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+    _uint32 h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+    //
+    // The whole chunks straight from data, and then the one or two that have the rest of it, the padding and the length.
+    //
+    _uint8 tail[128];
+    size_t wholeChunks = size / 64;
+    size_t rest = size - wholeChunks * 64;
+    memcpy(tail, data + wholeChunks * 64, rest);
+    tail[rest] = 0x80;
+    size_t tailSize = rest < 56 ? 64 : 128;
+    memset(tail + rest + 1, 0, tailSize - rest - 1);
+    _uint64 bits = (_uint64)size * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailSize - 8 + i] = (_uint8)(bits >> (8 * i));
+    }
+
+    if (upperCase) {
+        for (size_t i = 0; i < rest; i++) {
+            tail[i] = (_uint8)toupper(tail[i]);
+        }
+    }
+
+    size_t nChunks = wholeChunks + tailSize / 64;
+    for (size_t chunk = 0; chunk < nChunks; chunk++) {
+        const _uint8* p = chunk < wholeChunks ? data + chunk * 64 : tail + (chunk - wholeChunks) * 64;
+        _uint8 upper[64];
+        if (upperCase && chunk < wholeChunks) {
+            for (int i = 0; i < 64; i++) {
+                upper[i] = (_uint8)toupper(p[i]);
+            }
+            p = upper;
+        }
+        _uint32 m[16];
+        for (int i = 0; i < 16; i++) {
+            m[i] = p[4 * i] | (p[4 * i + 1] << 8) | (p[4 * i + 2] << 16) | ((_uint32)p[4 * i + 3] << 24);
+        }
+        _uint32 a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; i++) {
+            _uint32 f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) & 15;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) & 15;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) & 15;
+            }
+            _uint32 x = a + f + K[i] + m[g];
+            int shift = Shifts[(i >> 4) * 4 + (i & 3)];
+            a = d;
+            d = c;
+            c = b;
+            b = b + ((x << shift) | (x >> (32 - shift)));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+    for (int i = 0; i < 16; i++) {
+        digest[i] = (_uint8)(h[i / 4] >> (8 * (i & 3)));
+    }
+}
+
+    bool
+CRAMReferenceMD5(
+    const Genome*   genome,
+    GenomeLocation  location,
+    size_t          size,
+    _uint8*         digest)
+{
+    if (! genome->hasIUPACCodes(location, size)) {
+        CRAMMD5((const _uint8*)genome->getSubstring(location, 0), size, digest, true);
+        return true;
+    }
+
+    // Rare (hg38 has a handful), so it's fine to copy the stretch to put them back
+    char* original = new char[size];
+    bool known = genome->getOriginalBases(location, size, original);
+    if (known) {
+        CRAMMD5((const _uint8*)original, size, digest);
+    }
+    delete [] original;
+    return known;
+}
+
+    void
+RansEncoder::normalize(
+    int context)
+{
+    //
+    // Every symbol that occurs needs a frequency of at least one, so each gets that and a share of the rest in
+    // proportion to its count, and the most common one gets whatever rounding left over.
+    //
+    const _uint32* c = counts[context];
+    _uint16* f = freq[context];
+    _uint64 total = 0;
+    int present = 0;
+    int biggest = 0;
+    for (int s = 0; s < 256; s++) {
+        if (c[s] != 0) {
+            total += c[s];
+            present++;
+            if (c[s] > c[biggest]) {
+                biggest = s;
+            }
+        }
+    }
+    int sum = 0;
+    for (int s = 0; s < 256; s++) {
+        f[s] = c[s] == 0 ? 0 : (_uint16)(1 + c[s] * (_uint64)((1 << TotalBits) - present) / total);
+        sum += f[s];
+    }
+    f[biggest] += (1 << TotalBits) - sum;
+    int next = 0;
+    for (int s = 0; s < 256; s++) {
+        cumulative[context][s] = (_uint16)next;
+        next += f[s];
+    }
+}
+
+    void
+RansEncoder::writeFrequencies(
+    CRAMOutput* output,
+    int         context)
+{
+    // see RansDecoder::readFrequencies for the run length encoding of the symbols
+    const _uint16* f = freq[context];
+    int run = 0;
+    for (int s = 0; s < 256; s++) {
+        if (f[s] == 0) {
+            continue;
+        }
+        if (run > 0) {
+            run--;
+        } else {
+            output->byte((_uint8)s);
+            if (s > 0 && f[s - 1] != 0) {
+                for (run = s + 1; run < 256 && f[run] != 0; run++) {
+                }
+                run -= s + 1;
+                output->byte((_uint8)run);
+            }
+        }
+        if (f[s] < 128) {
+            output->byte((_uint8)f[s]);
+        } else {
+            output->byte((_uint8)(0x80 | (f[s] >> 8)));
+            output->byte((_uint8)f[s]);
+        }
+    }
+    output->byte(0);
+}
+
+    void
+RansEncoder::encode(
+    int             order,
+    const _uint8*   input,
+    size_t          inputSize,
+    CRAMOutput*     output)
+{
+    _ASSERT(order == 0 || order == 1);
+    size_t start = output->used;
+    output->append(9);
+    output->data[start] = (_uint8)order;
+
+    //
+    // For order 1 the input is in quarters, each starting with context 0, with the last one having any extra.
+    //
+    size_t quarter = inputSize / 4;
+    if (order == 0) {
+        memset(counts[0], 0, sizeof(counts[0]));
+        for (size_t i = 0; i < inputSize; i++) {
+            counts[0][input[i]]++;
+        }
+        normalize(0);
+        writeFrequencies(output, 0);
+    } else {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < inputSize; i++) {
+            bool quarterStart = i == 0 || i == quarter || i == 2 * quarter || i == 3 * quarter;
+            counts[quarterStart ? 0 : input[i - 1]][input[i]]++;
+        }
+        bool used[256];
+        for (int context = 0; context < 256; context++) {
+            used[context] = false;
+            for (int s = 0; s < 256 && !used[context]; s++) {
+                used[context] = counts[context][s] != 0;
+            }
+        }
+        // the contexts are run length encoded the same way as the symbols
+        int run = 0;
+        for (int context = 0; context < 256; context++) {
+            if (!used[context]) {
+                continue;
+            }
+            if (run > 0) {
+                run--;
+            } else {
+                output->byte((_uint8)context);
+                if (context > 0 && used[context - 1]) {
+                    for (run = context + 1; run < 256 && used[run]; run++) {
+                    }
+                    run -= context + 1;
+                    output->byte((_uint8)run);
+                }
+            }
+            normalize(context);
+            writeFrequencies(output, context);
+        }
+        output->byte(0);
+    }
+
+    //
+    // No symbol takes more than TotalBits bits, so twice the input is plenty.
+    //
+    size_t needed = 2 * inputSize + 16;
+    if (needed > bodySize) {
+        delete [] body;
+        bodySize = __max(needed, 2 * bodySize);
+        body = new _uint8[bodySize];
+    }
+    _uint8* end = body + bodySize;
+    _uint8* p = end;
+    _uint32 state[4] = {LowerBound, LowerBound, LowerBound, LowerBound};
+    if (order == 0) {
+        for (size_t i = inputSize; i-- > 0; ) {
+            put(&state[i & 3], 0, input[i], &p);
+        }
+    } else {
+        for (size_t i = inputSize; i-- > 0; ) {
+            int j;
+            size_t position;
+            if (i < 4 * quarter) {
+                j = (int)(i & 3);
+                position = j * quarter + (i >> 2);
+            } else {
+                j = 3;
+                position = i;
+            }
+            put(&state[j], position == j * quarter ? 0 : input[position - 1], input[position], &p);
+        }
+    }
+    for (int j = 3; j >= 0; j--) {
+        p -= 4;
+        p[0] = (_uint8)state[j];
+        p[1] = (_uint8)(state[j] >> 8);
+        p[2] = (_uint8)(state[j] >> 16);
+        p[3] = (_uint8)(state[j] >> 24);
+    }
+    output->bytes(p, end - p);
+
+    _uint32 compressedSize = (_uint32)(output->used - start - 9);
+    _uint8* header = output->data + start;
+    for (int i = 0; i < 4; i++) {
+        header[1 + i] = (_uint8)(compressedSize >> (8 * i));
+        header[5 + i] = (_uint8)((_uint32)inputSize >> (8 * i));
+    }
+}
+
+//
+// Encodes a run of BAM records as a container.  Each writer thread (or encoder thread) has its own.
+//
+class CRAMEncoder
+{
+public:
+    CRAMEncoder(const Genome* i_genome);
+    ~CRAMEncoder();
+
+    // appends a container with one slice of the nRecords BAM records in data
+    void encodeContainer(char* data, size_t bytes, int nRecords, _int64 recordCounter, CRAMOutput* output);
+
+    static const int RecordsPerSlice = 10000;   // what samtools uses
+
+private:
+    void encodeRecord(BAMAlignment* bam, int sliceRefId, bool apDelta, int* lastPosition);
+    void encodeFeatures(BAMAlignment* bam, const char* bases, const _uint8* qual);
+    void feature(char code, int readPos);
+    int encodeTags(BAMAlignment* bam);
+    CRAMOutput* tagStream(int key);
+    void setReference(int refId);
+
+    void writeCompressionHeader(CRAMOutput* output, bool apDelta);
+    void writeBlock(CRAMOutput* output, int method, int contentType, int contentId, const _uint8* data, size_t size, size_t rawSize);
+    void writeExternalBlock(CRAMOutput* output, int contentId, const CRAMOutput* raw, bool text);
+
+    // names and inserted or clipped bases are NUL terminated, and NF, BB and QQ are never used
+    static bool IsArraySeries(int s)
+    { return s == RN || s == IN || s == SC; }
+
+    static bool IsWrittenSeries(int s)
+    { return s != NF && s != BB && s != QQ; }
+
+    const Genome*                   genome;
+
+    CRAMOutput                      series[NumSeries];      // the external block of each, with content ID series + 1
+    VariableSizeVector<int>         tagKeys;                // tag name and BAM type, which is also its content ID
+    VariableSizeVector<CRAMOutput*> tagStreams;             // for each of tagKeys, and spares from earlier containers
+    CRAMOutput                      tagDictionary;          // tag lines, each NUL terminated
+    VariableSizeVector<int>         tagLineStarts;
+    CRAMOutput                      tagLine;
+
+    int                             nFeatures;
+    int                             lastFeature;
+
+    int                             referenceId;
+    const char*                     referenceBases;
+    _int64                          referenceLength;
+
+    char*                           bases;
+    int                             basesSize;
+
+    CRAMOutput                      scratch;
+    CRAMOutput                      body;
+    CRAMOutput                      packed[2];
+    GzipCodec*                      gzip;
+    RansEncoder*                    rans;
+};
+
+CRAMEncoder::CRAMEncoder(
+    const Genome*   i_genome)
+    : genome(i_genome), referenceId(-1), referenceBases(NULL), referenceLength(0), bases(NULL), basesSize(0),
+    gzip(GzipCodec::create()), rans(new RansEncoder)
+{}
+
+CRAMEncoder::~CRAMEncoder()
+{
+    for (int i = 0; i < tagStreams.size(); i++) {
+        delete tagStreams[i];
+    }
+    delete [] bases;
+    delete gzip;
+    delete rans;
+}
+
+    static _int64
+ContigLength(
+    const Genome*   genome,
+    int             contig)
+{
+    // without the padding that follows it; the same as the @SQ line
+    const Genome::Contig* contigs = genome->getContigs();
+    GenomeLocation end = contig + 1 < genome->getNumContigs() ? contigs[contig + 1].beginningLocation : genome->getCountOfBases();
+    return (end - genome->getChromosomePadding()) - contigs[contig].beginningLocation;
+}
+
+    void
+CRAMEncoder::encodeContainer(
+    char*       data,
+    size_t      bytes,
+    int         nRecords,
+    _int64      recordCounter,
+    CRAMOutput* output)
+{
+    //
+    // A slice that's all on one contig covers the span of its reads' alignments and has the MD5 of the reference
+    // there.  Anything else is a multiple reference slice, with each read's contig in RI.
+    //
+    int refId = -1;
+    bool multipleRefs = false;
+    bool sorted = true;
+    _int64 start = -1, end = -1;
+    _int64 nBases = 0;
+    size_t offset = 0;
+    for (int i = 0; i < nRecords; i++) {
+        BAMAlignment* bam = (BAMAlignment*)(data + offset);
+        _ASSERT(offset + bam->size() <= bytes);
+        offset += bam->size();
+        if (i == 0) {
+            refId = bam->refID;
+        } else if (bam->refID != refId) {
+            multipleRefs = true;
+        }
+        if (bam->refID >= 0 && bam->pos >= 0) {
+            if (start >= 0 && bam->pos < start) {
+                sorted = false;
+            }
+            _int64 alignmentEnd = bam->pos + __max(1, (bam->FLAG & SAM_UNMAPPED) ? 0 : bam->l_ref());
+            start = start < 0 ? bam->pos : __min(start, (_int64)bam->pos);
+            end = __max(end, alignmentEnd);
+        }
+        nBases += bam->l_seq;
+    }
+    if (multipleRefs) {
+        refId = -2;
+    } else if (refId >= genome->getNumContigs()) {
+        refId = -1;
+    }
+
+    _int32 sliceStart = 0, sliceSpan = 0;
+    _uint8 md5[16];
+    memset(md5, 0, sizeof(md5));
+    if (refId >= 0 && start >= 0) {
+        setReference(refId);
+        end = __min(end, ContigLength(genome, refId));
+        if (end > start) {
+            sliceStart = (_int32)start + 1;
+            sliceSpan = (_int32)(end - start);
+            if (! CRAMReferenceMD5(genome, genome->getContigs()[refId].beginningLocation + start, sliceSpan, md5)) {
+                memset(md5, 0, sizeof(md5));    // all zeros means there's nothing to check
+            }
+        }
+    }
+    bool apDelta = refId != -2 && sorted;
+
+    for (int s = 0; s < NumSeries; s++) {
+        series[s].clear();
+    }
+    tagKeys.clear();
+    tagDictionary.clear();
+    tagLineStarts.clear();
+    int lastPosition = sliceStart;
+    offset = 0;
+    for (int i = 0; i < nRecords; i++) {
+        BAMAlignment* bam = (BAMAlignment*)(data + offset);
+        offset += bam->size();
+        encodeRecord(bam, refId, apDelta, &lastPosition);
+    }
+
+    //
+    // The compression header, the slice header, an empty core block and then the external blocks.  The container's
+    // one landmark is where the slice header starts, right after the compression header.
+    //
+    body.clear();
+    writeCompressionHeader(&scratch, apDelta);
+    writeBlock(&body, 0, CRAMBlock::CompressionHeader, 0, scratch.data, scratch.used, scratch.used);
+    size_t landmark = body.used;
+
+    VariableSizeVector<int> contentIds;
+    for (int s = 0; s < NumSeries; s++) {
+        if (series[s].used > 0) {
+            contentIds.push_back(s + 1);
+        }
+    }
+    for (int t = 0; t < tagKeys.size(); t++) {
+        if (tagStreams[t]->used > 0) {
+            contentIds.push_back(tagKeys[t]);
+        }
+    }
+    scratch.clear();
+    scratch.itf8(refId);
+    scratch.itf8(sliceStart);
+    scratch.itf8(sliceSpan);
+    scratch.itf8(nRecords);
+    scratch.ltf8(recordCounter);
+    scratch.itf8((_int32)contentIds.size() + 1);
+    scratch.itf8((_int32)contentIds.size());
+    for (int i = 0; i < contentIds.size(); i++) {
+        scratch.itf8(contentIds[i]);
+    }
+    scratch.itf8(-1);       // no embedded reference
+    scratch.bytes(md5, sizeof(md5));
+    writeBlock(&body, 0, CRAMBlock::SliceHeader, 0, scratch.data, scratch.used, scratch.used);
+    writeBlock(&body, 0, CRAMBlock::CoreData, 0, NULL, 0, 0);
+    for (int s = 0; s < NumSeries; s++) {
+        if (series[s].used > 0) {
+            writeExternalBlock(&body, s + 1, &series[s], IsArraySeries(s));
+        }
+    }
+    for (int t = 0; t < tagKeys.size(); t++) {
+        if (tagStreams[t]->used > 0) {
+            writeExternalBlock(&body, tagKeys[t], tagStreams[t], true);
+        }
+    }
+
+    size_t headerStart = output->used;
+    output->int32((_int32)body.used);
+    output->itf8(refId);
+    output->itf8(sliceStart);
+    output->itf8(sliceSpan);
+    output->itf8(nRecords);
+    output->ltf8(recordCounter);
+    output->ltf8(nBases);
+    output->itf8((_int32)contentIds.size() + 3);
+    output->itf8(1);
+    output->itf8((_int32)landmark);
+    output->int32(CRAMCrc32(output->data + headerStart, output->used - headerStart));
+    output->bytes(body.data, body.used);
+}
+
+    void
+CRAMEncoder::encodeRecord(
+    BAMAlignment*   bam,
+    int             sliceRefId,
+    bool            apDelta,
+    int*            lastPosition)
+{
+    //
+    // In the order that CRAMDecoder::decodeRecord reads them, although since every series has its own block the order
+    // only matters for the ones that share one (BA and QS).  Every record is detached, so its mate's position is
+    // stored with it rather than found from the mate's record.
+    //
+    unsigned flag = bam->FLAG;
+    int length = bam->l_seq;
+    series[BF].itf8(flag);
+    series[CF].itf8(CRAMQualityArray | CRAMDetached);
+    if (sliceRefId == -2) {
+        series[RI].itf8(bam->refID);
+    }
+    series[RL].itf8(length);
+    int position = bam->pos + 1;
+    series[AP].itf8(apDelta ? position - *lastPosition : position);
+    *lastPosition = position;
+    series[RG].itf8(-1);    // read groups stay in the RG:Z tags
+    series[RN].bytes(bam->read_name(), bam->l_read_name > 0 ? bam->l_read_name - 1 : 0);
+    series[RN].byte(0);
+
+    series[MF].itf8(((flag & SAM_NEXT_REVERSED) ? CRAMMateReversed : 0) | ((flag & SAM_NEXT_UNMAPPED) ? CRAMMateUnmapped : 0));
+    series[NS].itf8(bam->next_refID);
+    series[NP].itf8(bam->next_pos + 1);
+    series[TS].itf8(bam->tlen);
+
+    series[TL].itf8(encodeTags(bam));
+
+    if (length > basesSize) {
+        delete [] bases;
+        basesSize = __max(length, 2 * basesSize);
+        bases = new char[basesSize];
+    }
+    const _uint8* nibbles = bam->seq();
+    for (int i = 0; i < length; i++) {
+        bases[i] = BAMAlignment::CodeToSeq[(i & 1) ? nibbles[i / 2] & 0xf : nibbles[i / 2] >> 4];
+    }
+    const _uint8* qual = (const _uint8*)bam->qual();
+
+    if (!(flag & SAM_UNMAPPED)) {
+        encodeFeatures(bam, bases, qual);
+        series[MQ].itf8(bam->MAPQ);
+    } else {
+        series[BA].bytes(bases, length);
+    }
+    series[QS].bytes(qual, length);
+}
+
+    void
+CRAMEncoder::feature(
+    char    code,
+    int     readPos)
+{
+    series[FC].byte(code);
+    series[FP].itf8(readPos + 1 - lastFeature);
+    lastFeature = readPos + 1;
+    nFeatures++;
+}
+
+    static int
+CRAMBaseIndex(
+    char base)
+{
+    return base == 'A' ? 0 : base == 'C' ? 1 : base == 'G' ? 2 : base == 'T' ? 3 : 4;
+}
+
+    void
+CRAMEncoder::encodeFeatures(
+    BAMAlignment*   bam,
+    const char*     bases,
+    const _uint8*   qual)
+{
+    //
+    // Walk the CIGAR string, comparing the aligned bases to the reference.  A base that differs is a substitution
+    // if both it and the reference base are one of ACGTN, and otherwise (an IUPAC code, say) stored as is.
+    //
+    setReference(bam->refID);
+    int length = bam->l_seq;
+    _int64 refPos = bam->pos;
+    int readPos = 0;
+    nFeatures = 0;
+    lastFeature = 0;
+    const _uint32* cigar = bam->cigar();
+    for (int c = 0; c <= bam->n_cigar_op; c++) {
+        int op, count;
+        if (c < bam->n_cigar_op) {
+            op = BAMAlignment::GetCigarOpCode(cigar[c]);
+            count = BAMAlignment::GetCigarOpCount(cigar[c]);
+        } else {
+            // anything the CIGAR string didn't account for, which shouldn't happen, gets treated as aligned
+            op = 0;
+            count = length - readPos;
+        }
+        switch (op) {
+        case 0:     // M
+        case 7:     // =
+        case 8:     // X
+            count = __min(count, length - readPos);
+            for (int i = 0; i < count; i++, readPos++, refPos++) {
+                char ref = refPos >= 0 && refPos < referenceLength ? referenceBases[refPos] : 'N';
+                char base = bases[readPos];
+                if (TO_UPPER_CASE_DOT_TO_N[(_uint8)ref] == base) {
+                    continue;
+                }
+                int refIndex = CRAMBaseIndex(ref);
+                int baseIndex = CRAMBaseIndex(base);
+                if ((baseIndex < 4 || base == 'N') && baseIndex != refIndex) {
+                    feature('X', readPos);
+                    series[BS].byte((_uint8)(baseIndex - (baseIndex > refIndex ? 1 : 0)));
+                } else {
+                    feature('B', readPos);
+                    series[BA].byte(base);
+                    series[QS].byte(qual[readPos]);
+                }
+            }
+            break;
+
+        case 1:     // I
+        case 4:     // S
+            count = __min(count, length - readPos);
+            feature(op == 1 ? 'I' : 'S', readPos);
+            series[op == 1 ? IN : SC].bytes(bases + readPos, count);
+            series[op == 1 ? IN : SC].byte(0);
+            readPos += count;
+            break;
+
+        case 2:     // D
+            feature('D', readPos);
+            series[DL].itf8(count);
+            refPos += count;
+            break;
+
+        case 3:     // N
+            feature('N', readPos);
+            series[RS].itf8(count);
+            refPos += count;
+            break;
+
+        case 5:     // H
+            feature('H', readPos);
+            series[HC].itf8(count);
+            break;
+
+        case 6:     // P
+            feature('P', readPos);
+            series[PD].itf8(count);
+            break;
+        }
+    }
+    series[FN].itf8(nFeatures);
+}
+
+    int
+CRAMEncoder::encodeTags(
+    BAMAlignment*   bam)
+{
+    //
+    // The values go to each tag's own block as they are in BAM, after their lengths.  The names and types make up the
+    // record's line in the tag dictionary, and the line's index is what gets stored in TL.
+    //
+    tagLine.clear();
+    char* aux = (char*)bam->firstAux();
+    char* endAux = (char*)bam->endAux();
+    while (aux + 3 <= endAux) {
+        BAMAlignAux* field = (BAMAlignAux*)aux;
+        size_t valueSize = field->val_type == HEX_VAL_TYPE ? strlen((const char*)field->value()) + 1 : field->size() - 3;
+        tagLine.bytes(aux, 3);
+        CRAMOutput* stream = tagStream(((_uint8)aux[0] << 16) | ((_uint8)aux[1] << 8) | (_uint8)aux[2]);
+        stream->itf8((_int32)valueSize);
+        stream->bytes(field->value(), valueSize);
+        aux += 3 + valueSize;
+    }
+
+    for (int line = 0; line < tagLineStarts.size(); line++) {
+        size_t lineStart = tagLineStarts[line];
+        size_t lineEnd = line + 1 < tagLineStarts.size() ? tagLineStarts[line + 1] - 1 : tagDictionary.used - 1;
+        if (lineEnd - lineStart == tagLine.used && (tagLine.used == 0 || memcmp(tagDictionary.data + lineStart, tagLine.data, tagLine.used) == 0)) {
+            return line;
+        }
+    }
+    tagLineStarts.push_back((int)tagDictionary.used);
+    tagDictionary.bytes(tagLine.data, tagLine.used);
+    tagDictionary.byte(0);
+    return tagLineStarts.size() - 1;
+}
+
+    CRAMOutput*
+CRAMEncoder::tagStream(
+    int key)
+{
+    for (int t = 0; t < tagKeys.size(); t++) {
+        if (tagKeys[t] == key) {
+            return tagStreams[t];
+        }
+    }
+    tagKeys.push_back(key);
+    if (tagStreams.size() < tagKeys.size()) {
+        tagStreams.push_back(new CRAMOutput);
+    }
+    CRAMOutput* stream = tagStreams[tagKeys.size() - 1];
+    stream->clear();
+    return stream;
+}
+
+    void
+CRAMEncoder::setReference(
+    int refId)
+{
+    if (refId == referenceId) {
+        return;
+    }
+    referenceId = refId;
+    referenceBases = NULL;
+    referenceLength = 0;
+    if (refId >= 0 && refId < genome->getNumContigs()) {
+        // the same bases that CRAMDecoder::setReference reads back
+        const Genome::Contig* contig = &genome->getContigs()[refId];
+        referenceBases = genome->getSubstring(contig->beginningLocation, 0);
+        referenceLength = contig->length;
+    }
+}
+
+    static void
+WriteExternalEncoding(
+    CRAMOutput* output,
+    int         contentId)
+{
+    output->itf8(CRAMEncoding::External);
+    output->itf8(Itf8Size(contentId));
+    output->itf8(contentId);
+}
+
+    void
+CRAMEncoder::writeCompressionHeader(
+    CRAMOutput* output,
+    bool        apDelta)
+{
+    output->clear();
+
+    //
+    // The preservation map.  The substitution matrix gives the other four bases the codes 0-3 in order, whatever the
+    // reference base is.
+    //
+    packed[0].clear();
+    CRAMOutput* map = &packed[0];
+    map->itf8(5);
+    map->bytes("RN", 2);
+    map->byte(1);
+    map->bytes("AP", 2);
+    map->byte(apDelta ? 1 : 0);
+    map->bytes("RR", 2);
+    map->byte(1);
+    map->bytes("SM", 2);
+    for (int i = 0; i < 5; i++) {
+        map->byte(0x1b);
+    }
+    map->bytes("TD", 2);
+    map->itf8((_int32)tagDictionary.used);
+    map->bytes(tagDictionary.data, tagDictionary.used);
+    output->itf8((_int32)map->used);
+    output->bytes(map->data, map->used);
+
+    map->clear();
+    int nSeries = 0;
+    for (int s = 0; s < NumSeries; s++) {
+        nSeries += IsWrittenSeries(s) ? 1 : 0;
+    }
+    map->itf8(nSeries);
+    for (int s = 0; s < NumSeries; s++) {
+        if (!IsWrittenSeries(s)) {
+            continue;
+        }
+        map->bytes(SeriesNames[s], 2);
+        if (IsArraySeries(s)) {
+            map->itf8(CRAMEncoding::ByteArrayStop);
+            map->itf8(1 + Itf8Size(s + 1));
+            map->byte(0);
+            map->itf8(s + 1);
+        } else {
+            WriteExternalEncoding(map, s + 1);
+        }
+    }
+    output->itf8((_int32)map->used);
+    output->bytes(map->data, map->used);
+
+    map->clear();
+    map->itf8(tagKeys.size());
+    for (int t = 0; t < tagKeys.size(); t++) {
+        map->itf8(tagKeys[t]);
+        map->itf8(CRAMEncoding::ByteArrayLen);
+        map->itf8(2 * (2 + Itf8Size(tagKeys[t])));
+        WriteExternalEncoding(map, tagKeys[t]);
+        WriteExternalEncoding(map, tagKeys[t]);
+    }
+    output->itf8((_int32)map->used);
+    output->bytes(map->data, map->used);
+}
+
+    void
+CRAMEncoder::writeBlock(
+    CRAMOutput*     output,
+    int             method,
+    int             contentType,
+    int             contentId,
+    const _uint8*   data,
+    size_t          size,
+    size_t          rawSize)
+{
+    size_t start = output->used;
+    output->byte((_uint8)method);
+    output->byte((_uint8)contentType);
+    output->itf8(contentId);
+    output->itf8((_int32)size);
+    output->itf8((_int32)rawSize);
+    output->bytes(data, size);
+    output->int32(CRAMCrc32(output->data + start, output->used - start));
+}
+
+    void
+CRAMEncoder::writeExternalBlock(
+    CRAMOutput*         output,
+    int                 contentId,
+    const CRAMOutput*   raw,
+    bool                text)
+{
+    //
+    // Try rANS order 0 and 1, and gzip too for names and tags, where repeats farther back than the last byte help, and
+    // keep whichever is smallest.  Small blocks aren't worth the frequency tables.
+    //
+    const size_t MinCompressed = 32;
+    int method = 0;
+    const _uint8* data = raw->data;
+    size_t size = raw->used;
+    if (raw->used >= MinCompressed) {
+        CRAMOutput* trial = &packed[0];
+        CRAMOutput* best = &packed[1];
+        for (int order = 0; order < 2; order++) {
+            trial->clear();
+            rans->encode(order, raw->data, raw->used, trial);
+            if (trial->used < size) {
+                CRAMOutput* t = best; best = trial; trial = t;
+                method = 4;
+                data = best->data;
+                size = best->used;
+            }
+        }
+        if (text) {
+            trial->clear();
+            size_t room = raw->used + raw->used / 8 + 1024;
+            _uint8* p = trial->append(room);
+            size_t compressed = gzip->compressMember((const char*)raw->data, raw->used, (char*)p, room, false);
+            if (compressed > 0 && compressed < size) {
+                trial->used = compressed;
+                method = 1;
+                data = trial->data;
+                size = compressed;
+            }
+        }
+    }
+    writeBlock(output, method, CRAMBlock::ExternalData, contentId, data, size, raw->used);
+}
+
+//
+// Passes the header through, encodes each batch of reads into containers in place if it's for unsorted output, and
+// writes the EOF container at the end.
+//
+class CRAMWriterFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    CRAMWriterFilterSupplier(const Genome* i_genome, bool i_sorted)
+        : FilterSupplier(DataWriter::ResizeFilter), genome(i_genome), sorted(i_sorted), closing(false), headerBytes(0), recordCounter(0)
+    {}
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier);
+    virtual void onClosed(DataWriterSupplier* supplier) {}
+
+    const Genome* const     genome;
+    const bool              sorted;         // a FileEncoder encodes the merged output, rather than each writer its own
+    volatile bool           closing;
+    volatile _int64         headerBytes;    // the batches before this are the file definition and header container
+    volatile _int64         recordCounter;  // for the container headers; unsorted output from several threads can have them out of order
+};
+
+class CRAMEncodeWorkerManager : public ParallelWorkerManager
+{
+public:
+    CRAMEncodeWorkerManager(CRAMWriterFilterSupplier* i_filterSupplier)
+        : filterSupplier(i_filterSupplier), encoder(NULL)
+    {}
+
+    virtual ~CRAMEncodeWorkerManager();
+
+    virtual void initialize(void* i_encoder)
+    { encoder = (FileEncoder*)i_encoder; }
+
+    virtual ParallelWorker* createWorker();
+
+    virtual void beginStep();
+
+    virtual void finishStep();
+
+private:
+    struct Slice
+    {
+        size_t      offset;
+        size_t      bytes;
+        int         nRecords;
+        _int64      recordCounter;
+    };
+
+    CRAMWriterFilterSupplier*       filterSupplier;
+    FileEncoder*                    encoder;
+    char*                           input;
+    size_t                          inputSize;
+    size_t                          inputUsed;
+    bool                            passThrough;
+    VariableSizeVector<Slice>       slices;
+    VariableSizeVector<CRAMOutput*> containers;     // the encoded slices, in order
+
+    friend class CRAMEncodeWorker;
+};
+
+class CRAMEncodeWorker : public ParallelWorker
+{
+public:
+    CRAMEncodeWorker() : cram(NULL) {}
+
+    virtual ~CRAMEncodeWorker()
+    { delete cram; }
+
+    virtual void step();
+
+private:
+    CRAMEncoder* cram;
+};
+
+// used for unsorted output, where each writer encodes its own batches
+class CRAMWriterFilter : public DataWriter::Filter
+{
+public:
+    CRAMWriterFilter(CRAMWriterFilterSupplier* i_supplier)
+        : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), header(false), manager(NULL), worker(NULL), encoder(NULL)
+    {}
+
+    virtual ~CRAMWriterFilter()
+    {
+        delete encoder;
+        delete worker;
+        delete manager;
+    }
+
+    virtual void inHeader(bool flag)
+    { header = flag; }
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location)
+    {
+        if (header) {
+            InterlockedAdd64AndReturnNewValue(&supplier->headerBytes, bytes);
+        }
+    }
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
+
+private:
+    CRAMWriterFilterSupplier*   supplier;
+    bool                        header;
+    CRAMEncodeWorkerManager*    manager;
+    ParallelWorker*             worker;
+    FileEncoder*                encoder;
+};
+
+CRAMEncodeWorkerManager::~CRAMEncodeWorkerManager()
+{
+    for (int i = 0; i < containers.size(); i++) {
+        delete containers[i];
+    }
+}
+
+    ParallelWorker*
+CRAMEncodeWorkerManager::createWorker()
+{
+    return new CRAMEncodeWorker();
+}
+
+    void
+CRAMEncodeWorkerManager::beginStep()
+{
+    slices.clear();
+    passThrough = true;
+    if (filterSupplier->closing) {
+        return;
+    }
+    size_t logicalOffset, physicalOffset;
+    encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
+    encoder->getOffsets(&logicalOffset, &physicalOffset);
+    if ((_int64)logicalOffset < filterSupplier->headerBytes) {
+        return;     // already CRAM
+    }
+    passThrough = false;
+
+    //
+    // Cut the batch into slices, and for sorted output also wherever the contig changes, so that slices are on a
+    // single reference whenever they can be.
+    //
+    Slice slice;
+    slice.offset = 0;
+    slice.nRecords = 0;
+    int sliceRefId = 0;
+    _int64 nRecords = 0;
+    for (size_t offset = 0; offset < inputUsed; ) {
+        BAMAlignment* bam = (BAMAlignment*)(input + offset);
+        if (slice.nRecords == CRAMEncoder::RecordsPerSlice || (slice.nRecords > 0 && filterSupplier->sorted && bam->refID != sliceRefId)) {
+            slice.bytes = offset - slice.offset;
+            slices.push_back(slice);
+            slice.offset = offset;
+            slice.nRecords = 0;
+        }
+        if (slice.nRecords == 0) {
+            sliceRefId = bam->refID;
+        }
+        slice.nRecords++;
+        nRecords++;
+        offset += bam->size();
+    }
+    if (slice.nRecords > 0) {
+        slice.bytes = inputUsed - slice.offset;
+        slices.push_back(slice);
+    }
+
+    _int64 recordCounter = InterlockedAdd64AndReturnNewValue(&filterSupplier->recordCounter, nRecords) - nRecords;
+    for (int i = 0; i < slices.size(); i++) {
+        slices[i].recordCounter = recordCounter;
+        recordCounter += slices[i].nRecords;
+    }
+    while (containers.size() < slices.size()) {
+        containers.push_back(new CRAMOutput);
+    }
+}
+
+    void
+CRAMEncodeWorkerManager::finishStep()
+{
+    if (passThrough) {
+        return;
+    }
+    size_t used = 0;
+    for (int i = 0; i < slices.size(); i++) {
+        if (used + containers[i]->used > inputSize) {
+            WriteErrorMessage("CRAM containers don't fit in the write buffer, try a larger one with -wbs\n");
+            soft_exit(1);
+        }
+        memcpy(input + used, containers[i]->data, containers[i]->used);
+        used += containers[i]->used;
+    }
+    encoder->setEncodedBatchSize(used);
+}
+
+    void
+CRAMEncodeWorker::step()
+{
+    CRAMEncodeWorkerManager* manager = (CRAMEncodeWorkerManager*)getManager();
+    if (cram == NULL) {
+        cram = new CRAMEncoder(manager->filterSupplier->genome);
+    }
+    int begin = (getThreadNum() * manager->slices.size()) / getNumThreads();
+    int end = ((1 + getThreadNum()) * manager->slices.size()) / getNumThreads();
+    for (int i = begin; i < end; i++) {
+        CRAMEncodeWorkerManager::Slice* slice = &manager->slices[i];
+        manager->containers[i]->clear();
+        cram->encodeContainer(manager->input + slice->offset, slice->bytes, slice->nRecords, slice->recordCounter, manager->containers[i]);
+    }
+}
+
+    size_t
+CRAMWriterFilter::onNextBatch(
+    DataWriter* writer,
+    size_t      offset,
+    size_t      bytes)
+{
+    char* fromBuffer;
+    size_t fromSize, fromUsed, physicalOffset, logicalOffset;
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    if (fromUsed == 0 || header || supplier->sorted || supplier->closing) {
+        return fromUsed;
+    }
+    // encode the buffer synchronously in place
+    if (manager == NULL) {
+        manager = new CRAMEncodeWorkerManager(supplier);
+        worker = manager->createWorker();
+        encoder = new FileEncoder(0, false, manager);
+        encoder->initialize((AsyncDataWriter*)writer);
+        manager->initialize(encoder);
+        manager->configure(worker, 0, 1);
+    }
+    encoder->setupEncode(-1);
+    manager->beginStep();
+    worker->step();
+    manager->finishStep();
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    return fromUsed;
+}
+
+    DataWriter::Filter*
+CRAMWriterFilterSupplier::getFilter()
+{
+    return new CRAMWriterFilter(this);
+}
+
+    void
+CRAMWriterFilterSupplier::onClosing(
+    DataWriterSupplier* supplier)
+{
+    closing = true;
+    DataWriter* writer = supplier->getWriter();
+    // the EOF container from the CRAM 3.0 specification
+    static const _uint8 eof[] = {
+        0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+        0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63, 0x01, 0x4b
+    };
+    char* buffer;
+    size_t bytes;
+    if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(eof))) {
+        WriteErrorMessage("no space to write CRAM eof container\n");
+        soft_exit(1);
+    }
+    memcpy(buffer, eof, sizeof(eof));
+    writer->advance(sizeof(eof));
+    writer->close();
+    delete writer;
+}
+
+class CRAMFormat : public FileFormat
+{
+public:
+    CRAMFormat(bool i_useM) : useM(i_useM) {}
+
+    //
+    // The records in the writers' buffers are BAM until they're encoded, so everything that looks at them is BAM's.
+    //
+
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, GenomeDistance* o_readBytes, int* o_refID, int* o_pos) const
+    { FileFormat::BAM[useM]->getSortInfo(genome, buffer, bytes, o_location, o_readBytes, o_refID, o_pos); }
+
+    virtual void setupReaderContext(AlignerOptions* options, ReaderContext* readerContext) const
+    { FileFormat::setupReaderContext(options, readerContext, true); }
+
+    virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+
+    virtual bool writeHeader(
+        const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
+        bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines) const;
+
+    virtual bool writeRead(
+        const ReaderContext& context, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
+        size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction, bool secondaryAlignment, int * o_addFrontClipping,
+        bool hasMate = false, bool firstInPair = false, Read * mate = NULL,
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        bool alignedAsPair = false) const
+    {
+        return FileFormat::BAM[useM]->writeRead(context, lv, buffer, bufferSpace, spaceUsed, qnameLen, read, result, mapQuality,
+            genomeLocation, direction, secondaryAlignment, o_addFrontClipping, hasMate, firstInPair, mate, mateResult, mateLocation,
+            mateDirection, alignedAsPair);
+    }
+
+private:
+    const bool useM;
+};
+
+const FileFormat* FileFormat::CRAM[] = { new CRAMFormat(false), new CRAMFormat(true) };
+
+    ReadWriterSupplier*
+CRAMFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome*   genome) const
+{
+    DataWriterSupplier* dataSupplier;
+    CRAMWriterFilterSupplier* cramSupplier = new CRAMWriterFilterSupplier(genome, options->sortOutput);
+    if (options->sortOutput) {
+        size_t len = strlen(options->outputFile.fileName);
+        char* tempFileName = (char*) malloc(5 + len);
+        strcpy(tempFileName, options->outputFile.fileName);
+        strcpy(tempFileName + len, ".tmp");
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
+            options->sortMemory * (1ULL << 30),
+            options->numThreads, options->outputFile.fileName, cramSupplier, options->writeBufferSize,
+            new FileEncoder(options->numThreads, options->bindToProcessors, new CRAMEncodeWorkerManager(cramSupplier)),
+            options->noDuplicateMarking ? NULL
+                : DataWriterSupplier::markDuplicates(genome, options->maxSecondaryAlignmentAdditionalEditDistance >= 0));
+        free(tempFileName);
+    } else {
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize, cramSupplier);
+    }
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
+}
+
+//
+// Adds an M5 tag (the MD5 of the contig's bases) to each @SQ line of the SAM header text that doesn't have one, which
+// CRAM requires, and which htslib uses to find the reference.  Returns false if the text won't fit in capacity any more,
+// which is checked before computing anything, since the caller tries again with more room.
+//
+// The MD5s are of the contigs as the FASTA file had them, IUPAC codes and all.  Indices built before SNAP kept those
+// codes only have them as N, and there's no right MD5 to give for a contig with one, so that stops SNAP.
+//
+    static bool
+AddReferenceMD5s(
+    const Genome*   genome,
+    char*           text,
+    size_t          textSize,
+    size_t          capacity,
+    size_t*         o_textSize)
+{
+    const size_t TagSize = 4 + 32; // "\tM5:" and the digest in hex
+    VariableSizeVector<int> lineContigs;    // for each line, the contig to add M5 for, or -1
+    size_t needed = textSize;
+    for (const char* p = text; p < text + textSize; ) {
+        const char* newline = strnchr(p, '\n', text + textSize - p);
+        const char* lineEnd = newline != NULL ? newline : text + textSize;
+        int contig = -1;
+        if (genome != NULL && lineEnd - p > 4 && ! strncmp(p, "@SQ\t", 4)) {
+            bool hasM5 = false;
+            const char* name = NULL;
+            size_t nameLength = 0;
+            for (const char* field = p + 3; field < lineEnd; ) {
+                field++; // the tab
+                const char* fieldEnd = strnchr(field, '\t', lineEnd - field);
+                if (fieldEnd == NULL) {
+                    fieldEnd = lineEnd;
+                }
+                hasM5 |= fieldEnd - field >= 3 && ! strncmp(field, "M5:", 3);
+                if (fieldEnd - field >= 3 && ! strncmp(field, "SN:", 3)) {
+                    name = field + 3;
+                    nameLength = fieldEnd - name;
+                }
+                field = fieldEnd;
+            }
+            if (name != NULL && ! hasM5) {
+                char* nameCopy = new char[nameLength + 1];
+                memcpy(nameCopy, name, nameLength);
+                nameCopy[nameLength] = '\0';
+                GenomeLocation location;
+                if (genome->getLocationOfContig(nameCopy, &location)) {
+                    contig = (int)(genome->getContigAtLocation(location) - genome->getContigs());
+                    needed += TagSize;
+                }
+                delete [] nameCopy;
+            }
+        }
+        lineContigs.push_back(contig);
+        p = lineEnd + 1;
+    }
+    if (needed > capacity) {
+        return false;
+    }
+
+    char* result = new char[needed];
+    size_t used = 0;
+    int line = 0;
+    for (const char* p = text; p < text + textSize; line++) {
+        const char* newline = strnchr(p, '\n', text + textSize - p);
+        const char* lineEnd = newline != NULL ? newline : text + textSize;
+        memcpy(result + used, p, lineEnd - p);
+        used += lineEnd - p;
+        int contig = lineContigs[line];
+        if (contig != -1) {
+            const Genome::Contig* c = &genome->getContigs()[contig];
+            _uint8 digest[16];
+            if (! CRAMReferenceMD5(genome, c->beginningLocation, ContigLength(genome, contig), digest)) {
+                WriteErrorMessage("Contig %s had IUPAC codes other than N in the FASTA file, and this index was built before SNAP kept them, so\n"
+                    "CRAM output can't have the right reference MD5 (M5) for it.  Rebuild the index with this version of SNAP to write CRAM.\n", c->name);
+                soft_exit(1);
+            }
+            memcpy(result + used, "\tM5:", 4);
+            used += 4;
+            for (int i = 0; i < 16; i++) {
+                result[used++] = "0123456789abcdef"[digest[i] >> 4];
+                result[used++] = "0123456789abcdef"[digest[i] & 0xf];
+            }
+        }
+        if (newline != NULL) {
+            result[used++] = '\n';
+        }
+        p = lineEnd + 1;
+    }
+    _ASSERT(used == needed);
+    memcpy(text, result, used);
+    delete [] result;
+    *o_textSize = used;
+    return true;
+}
+
+    bool
+CRAMFormat::writeHeader(
+    const ReaderContext& context,
+    char *header,
+    size_t headerBufferSize,
+    size_t *headerActualSize,
+    bool sorted,
+    int argc,
+    const char **argv,
+    const char *version,
+    const char *rgLine,
+    bool omitSQLines) const
+{
+    //
+    // The file definition, and then a container with one raw block of the SAM header's length and text.  The text is
+    // written far enough in to leave room for the biggest container and block headers, and then moved back to where
+    // it goes once they're built.
+    //
+    const size_t DefinitionSize = 26;
+    const size_t Room = 64;
+    if (headerBufferSize < DefinitionSize + Room + 4) {
+        return false;
+    }
+    char* text = header + DefinitionSize + Room;
+    size_t textSize;
+    size_t textCapacity = headerBufferSize - DefinitionSize - Room - 4;
+    if (! (FileFormat::SAM[0]->writeHeader(context, text, textCapacity, &textSize, sorted, argc, argv, version, rgLine, omitSQLines) &&
+            AddReferenceMD5s(context.genome, text, textSize, textCapacity, &textSize))) {
+        return false;
+    }
+
+    CRAMOutput block;
+    block.byte(0);      // raw
+    block.byte(CRAMBlock::FileHeader);
+    block.itf8(0);
+    block.itf8((_int32)textSize + 4);
+    block.itf8((_int32)textSize + 4);
+    block.int32((_int32)textSize);
+
+    CRAMOutput container;
+    container.int32((_int32)(block.used + textSize + 4));
+    container.itf8(0);      // reference
+    container.itf8(0);      // start
+    container.itf8(0);      // span
+    container.itf8(0);      // records
+    container.ltf8(0);      // record counter
+    container.ltf8(0);      // bases
+    container.itf8(1);      // blocks
+    container.itf8(0);      // landmarks
+    container.int32(CRAMCrc32(container.data, container.used));
+    _ASSERT(container.used + block.used <= Room);
+
+    memset(header, 0, DefinitionSize);
+    memcpy(header, "CRAM", 4);
+    header[4] = 3;
+    header[5] = 0;
+    char* blockStart = header + DefinitionSize + container.used;
+    memcpy(header + DefinitionSize, container.data, container.used);
+    memmove(blockStart + block.used, text, textSize);
+    memcpy(blockStart, block.data, block.used);
+    size_t blockSize = block.used + textSize;
+    _uint32 crc = CRAMCrc32((const _uint8*)blockStart, blockSize);
+    for (int i = 0; i < 4; i++) {
+        blockStart[blockSize + i] = (char)(crc >> (8 * i));
+    }
+    *headerActualSize = DefinitionSize + container.used + blockSize + 4;
+    return true;
+}
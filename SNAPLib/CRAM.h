@@ -0,0 +1,113 @@
+/*++
+
+Module Name:
+
+    CRAM.h
+
+Abstract:
+
+    Headers for the CRAM file reader.  The writer is just FileFormat::CRAM.
+
+Environment:
+
+    User mode service.
+
+    CRAMReader isn't thread safe, except for holdBatch and releaseBatch, which can be called from any thread.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "Genome.h"
+#include "DataReader.h"
+#include "VariableSizeVector.h"
+
+class CRAMDecoder;
+struct CRAMContainer;
+
+//
+// Reads reference-based CRAM (version 3) directly, using the index's Genome as the reference, so there's no need to
+// decode it to BAM or FASTQ first.  The @SQ names in the CRAM header are looked up in the genome by name, and the reads
+// mapped to a contig that isn't in it can't be decoded (that's an error).
+//
+// A whole container (normally one slice of 10,000 reads) is decoded at a time into a buffer of its own, and that
+// buffer is the batch that the reads point into.  Blocks can be raw, gzip or rANS (order 0 or 1) compressed, which is
+// what samtools and htslib write by default.  bzip2, lzma and the CRAM 3.1 codecs aren't supported.
+//
+class CRAMReader : public ReadReader {
+public:
+
+        CRAMReader(const ReaderContext& i_context);
+
+        virtual ~CRAMReader();
+
+        virtual bool getNextRead(Read *readToUpdate);
+
+        //
+        // CRAM files can only be read from the beginning, so startingOffset and amountOfFileToProcess must be 0.
+        //
+        virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+        virtual void holdBatch(DataBatch batch);
+
+        virtual bool releaseBatch(DataBatch batch);
+
+        static CRAMReader* create(const char *fileName, const ReaderContext& context);
+
+        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+
+        static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, bool quicklyDropUnmatchedReads,
+            const ReaderContext& context);
+
+private:
+
+        struct ContainerHeader
+        {
+            _int32      length;
+            _int32      nRecords;
+            _int32      nBlocks;
+        };
+
+        void init(const char *fileName);
+
+        void readHeader();
+
+        bool readContainerHeader(ContainerHeader* header);
+
+        void readFully(void* buffer, size_t bytes);
+
+        _int32 readItf8();
+
+        _int64 readLtf8();
+
+        // decode the next container that has reads in it, returns NULL at the end of the file
+        CRAMContainer* readContainer();
+
+        const char*                     fileName;
+        FILE*                           file;
+        _int64                          fileOffset;
+        int                             majorVersion;
+        CRAMDecoder*                    decoder;
+
+        _uint8*                         containerBytes;
+        size_t                          containerBytesSize;
+
+        CRAMContainer*                  current;
+        int                             nextRecord;
+        _uint32                         nextBatchID;
+
+        ExclusiveLock                   lock;
+        VariableSizeVector<CRAMContainer*> held;    // containers with outstanding holds, including the current one
+        VariableSizeVector<CRAMContainer*> spare;   // released, kept for their buffers
+};
+
+//
+// The MD5 of a stretch of the genome as it was in the FASTA file (in upper case, IUPAC codes and all), for the M5 tags
+// and slice headers of CRAM output.  Returns false if there's an IUPAC code in it that the genome doesn't have, because
+// it comes from an index built before SNAP kept them (see Genome::getOriginalBases).
+//
+bool CRAMReferenceMD5(const Genome* genome, GenomeLocation location, size_t size, _uint8* digest);
@@ -0,0 +1,313 @@
+/*++
+
+Module Name:
+
+    CRAMCodecs.h
+
+Abstract:
+
+    The byte level pieces of CRAM that the reader and writer share: ITF8 and LTF8 integers, rANS, CRC32 and MD5.
+
+Environment:
+
+    User mode service.
+
+    The rANS encoder and decoder aren't thread safe.  Each thread should have its own.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+// reports a malformed CRAM file and exits
+void CRAMMalformed(const char* what);
+
+//
+// A cursor over part of a block or of the file, reading CRAM's integer encodings.  ITF8 and LTF8 keep the number of
+// extra bytes in the high bits of the first one, which is all that they have in common with UTF-8.
+//
+struct CRAMBytes
+{
+    const _uint8*   next;
+    const _uint8*   end;
+
+    CRAMBytes() : next(NULL), end(NULL) {}
+    CRAMBytes(const _uint8* data, size_t size) : next(data), end(data + size) {}
+
+    void need(size_t bytes)
+    {
+        if ((size_t)(end - next) < bytes) {
+            CRAMMalformed("data runs off the end of a block");
+        }
+    }
+
+    _uint8 byte()
+    { need(1); return *next++; }
+
+    const _uint8* bytes(size_t count)
+    { need(count); const _uint8* result = next; next += count; return result; }
+
+    _int32 int32()
+    {
+        need(4);
+        _uint32 value = next[0] | (next[1] << 8) | (next[2] << 16) | ((_uint32)next[3] << 24);
+        next += 4;
+        return (_int32)value;
+    }
+
+    _int32 itf8()
+    {
+        need(1);
+        _uint8 first = next[0];
+        _uint32 value;
+        if (first < 0x80) {
+            value = first;
+            next += 1;
+        } else if (first < 0xc0) {
+            need(2);
+            value = ((first & 0x3f) << 8) | next[1];
+            next += 2;
+        } else if (first < 0xe0) {
+            need(3);
+            value = ((first & 0x1f) << 16) | (next[1] << 8) | next[2];
+            next += 3;
+        } else if (first < 0xf0) {
+            need(4);
+            value = ((first & 0x0f) << 24) | (next[1] << 16) | (next[2] << 8) | next[3];
+            next += 4;
+        } else {
+            need(5);
+            value = ((_uint32)(first & 0x0f) << 28) | (next[1] << 20) | (next[2] << 12) | (next[3] << 4) | (next[4] & 0x0f);
+            next += 5;
+        }
+        return (_int32)value;
+    }
+
+    _int64 ltf8()
+    {
+        need(1);
+        _uint8 first = *next;
+        int extra;
+        _uint64 value;
+        if (first < 0x80) {
+            extra = 0; value = first;
+        } else if (first < 0xc0) {
+            extra = 1; value = first & 0x3f;
+        } else if (first < 0xe0) {
+            extra = 2; value = first & 0x1f;
+        } else if (first < 0xf0) {
+            extra = 3; value = first & 0x0f;
+        } else if (first < 0xf8) {
+            extra = 4; value = first & 0x07;
+        } else if (first < 0xfc) {
+            extra = 5; value = first & 0x03;
+        } else if (first < 0xfe) {
+            extra = 6; value = first & 0x01;
+        } else {
+            extra = first == 0xfe ? 7 : 8; value = 0;
+        }
+        need(1 + extra);
+        next++;
+        for (int i = 0; i < extra; i++) {
+            value = (value << 8) | *next++;
+        }
+        return (_int64)value;
+    }
+
+    // a map or parameter list that starts with its size in bytes
+    CRAMBytes sized()
+    {
+        _int32 size = itf8();
+        if (size < 0) {
+            CRAMMalformed("negative size");
+        }
+        return CRAMBytes(bytes(size), size);
+    }
+};
+
+//
+// A growable buffer that blocks and containers are built in, with CRAM's integer encodings.
+//
+struct CRAMOutput
+{
+    _uint8*     data;
+    size_t      used;
+    size_t      size;
+
+    CRAMOutput() : data(NULL), used(0), size(0) {}
+
+    ~CRAMOutput()
+    { delete [] data; }
+
+    void clear()
+    { used = 0; }
+
+    _uint8* append(size_t bytes)
+    {
+        if (used + bytes > size) {
+            size_t newSize = __max(used + bytes, __max(size * 2, (size_t)4096));
+            _uint8* newData = new _uint8[newSize];
+            if (used > 0) {
+                memcpy(newData, data, used);
+            }
+            delete [] data;
+            data = newData;
+            size = newSize;
+        }
+        _uint8* result = data + used;
+        used += bytes;
+        return result;
+    }
+
+    void byte(_uint8 value)
+    { *append(1) = value; }
+
+    void bytes(const void* values, size_t count)
+    {
+        if (count > 0) {
+            memcpy(append(count), values, count);
+        }
+    }
+
+    void int32(_int32 value)
+    {
+        _uint8* p = append(4);
+        p[0] = (_uint8)value;
+        p[1] = (_uint8)(value >> 8);
+        p[2] = (_uint8)(value >> 16);
+        p[3] = (_uint8)(value >> 24);
+    }
+
+    void itf8(_int32 signedValue)
+    {
+        _uint32 value = (_uint32)signedValue;
+        if (value < 0x80) {
+            byte((_uint8)value);
+        } else if (value < 0x4000) {
+            _uint8* p = append(2);
+            p[0] = (_uint8)(0x80 | (value >> 8));
+            p[1] = (_uint8)value;
+        } else if (value < 0x200000) {
+            _uint8* p = append(3);
+            p[0] = (_uint8)(0xc0 | (value >> 16));
+            p[1] = (_uint8)(value >> 8);
+            p[2] = (_uint8)value;
+        } else if (value < 0x10000000) {
+            _uint8* p = append(4);
+            p[0] = (_uint8)(0xe0 | (value >> 24));
+            p[1] = (_uint8)(value >> 16);
+            p[2] = (_uint8)(value >> 8);
+            p[3] = (_uint8)value;
+        } else {
+            // the last byte only has four bits of the value in it
+            _uint8* p = append(5);
+            p[0] = (_uint8)(0xf0 | (value >> 28));
+            p[1] = (_uint8)(value >> 20);
+            p[2] = (_uint8)(value >> 12);
+            p[3] = (_uint8)(value >> 4);
+            p[4] = (_uint8)(value & 0x0f);
+        }
+    }
+
+    void ltf8(_int64 signedValue)
+    {
+        _uint64 value = (_uint64)signedValue;
+        int extra;
+        _uint8 first;
+        if (value < 0x80) {
+            extra = 0; first = (_uint8)value;
+        } else if (value < ((_uint64)1 << 14)) {
+            extra = 1; first = (_uint8)(0x80 | (value >> 8));
+        } else if (value < ((_uint64)1 << 21)) {
+            extra = 2; first = (_uint8)(0xc0 | (value >> 16));
+        } else if (value < ((_uint64)1 << 28)) {
+            extra = 3; first = (_uint8)(0xe0 | (value >> 24));
+        } else if (value < ((_uint64)1 << 35)) {
+            extra = 4; first = (_uint8)(0xf0 | (value >> 32));
+        } else if (value < ((_uint64)1 << 42)) {
+            extra = 5; first = (_uint8)(0xf8 | (value >> 40));
+        } else if (value < ((_uint64)1 << 49)) {
+            extra = 6; first = (_uint8)(0xfc | (value >> 48));
+        } else if (value < ((_uint64)1 << 56)) {
+            extra = 7; first = 0xfe;
+        } else {
+            extra = 8; first = 0xff;
+        }
+        _uint8* p = append(1 + extra);
+        p[0] = first;
+        for (int i = 0; i < extra; i++) {
+            p[1 + i] = (_uint8)(value >> (8 * (extra - 1 - i)));
+        }
+    }
+};
+
+_uint32 CRAMCrc32(const _uint8* data, size_t size, _uint32 crc = 0);
+
+//
+// MD5 (RFC 1321), for the checksum of the reference that each slice covers.  Readers that have the reference check it
+// against what they have before decoding anything.  CRAM's reference MD5s are of the bases in upper case, which
+// upperCase does as it goes.
+//
+void CRAMMD5(const _uint8* data, size_t size, _uint8* digest, bool upperCase = false);
+
+//
+// rANS, order 0 and order 1, as written by htslib.  The frequencies of each context add up to 4096, and there are four
+// interleaved states so that the decoding of consecutive bytes doesn't depend on each other.
+//
+struct RansDecoder
+{
+    static const int TotalBits = 12;
+    static const _uint32 LowerBound = 1 << 23;
+
+    _uint16     freq[256][256];
+    _uint16     cumulative[256][256];
+    _uint8      lookup[256][1 << TotalBits];
+
+    bool decode(const _uint8* input, size_t inputSize, _uint8* output, size_t outputSize);
+
+private:
+    bool readFrequencies(const _uint8*& p, const _uint8* end, int context);
+};
+
+//
+// The encoding side of RansDecoder, producing what htslib's order 0 and order 1 encoders do.  rANS has to run
+// backwards, so each symbol is encoded in exactly the reverse of the order that the decoder gets to it, with the
+// bytes that renormalize the states written from the end of a scratch buffer toward its start.
+//
+struct RansEncoder
+{
+    static const int TotalBits = RansDecoder::TotalBits;
+    static const _uint32 LowerBound = RansDecoder::LowerBound;
+
+    RansEncoder() : body(NULL), bodySize(0) {}
+
+    ~RansEncoder()
+    { delete [] body; }
+
+    // appends input, compressed the way a rANS block's data is, to output
+    void encode(int order, const _uint8* input, size_t inputSize, CRAMOutput* output);
+
+private:
+    void normalize(int context);
+    void writeFrequencies(CRAMOutput* output, int context);
+
+    inline void put(_uint32* state, int context, _uint8 symbol, _uint8** p)
+    {
+        _uint32 f = freq[context][symbol];
+        _uint32 stateMax = ((LowerBound >> TotalBits) << 8) * f;
+        while (*state >= stateMax) {
+            *--*p = (_uint8)*state;
+            *state >>= 8;
+        }
+        *state = ((*state / f) << TotalBits) + (*state % f) + cumulative[context][symbol];
+    }
+
+    _uint32     counts[256][256];
+    _uint16     freq[256][256];
+    _uint16     cumulative[256][256];
+    _uint8*     body;
+    size_t      bodySize;
+};
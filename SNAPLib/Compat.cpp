@@ -31,6 +31,18 @@ Revision History:
 #include <err.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define USE_IO_URING 1
+#endif
+#endif
+#endif  // __linux__
 #endif
 #include "exit.h"
 #ifdef PROFILE_WAIT
@@ -249,6 +261,16 @@ void* InterlockedCompareExchangePointerAndReturnOldValue(void * volatile *valueT
     return InterlockedCompareExchangePointer(valueToUpdate, replacementValue, desiredPreviousValue);
 }
 
+_int64 InterlockedLoad64Acquire(volatile _int64 *valueToLoad)
+{
+    return ReadAcquire64((volatile LONG64 *)valueToLoad);
+}
+
+void InterlockedStore64Release(volatile _int64 *valueToStore, _int64 value)
+{
+    WriteRelease64((volatile LONG64 *)valueToStore, (LONG64)value);
+}
+
 struct WrapperThreadContext {
     ThreadMainFunction      mainFunction;
     void                    *mainFunctionParameter;
@@ -295,6 +317,16 @@ void SleepForMillis(unsigned millis)
   Sleep(millis);
 }
 
+void SpinPause()
+{
+    YieldProcessor();
+}
+
+void YieldThread()
+{
+    SwitchToThread();
+}
+
 unsigned GetNumberOfProcessors()
 {
     SYSTEM_INFO systemInfo[1];
@@ -541,7 +573,7 @@ WindowsAsyncFile::open(
         FILE_FLAG_OVERLAPPED,
         NULL);
     if (INVALID_HANDLE_VALUE == hFile) {
-        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,GetLastError());
+        WriteErrorMessage("Unable to open '%s' for %s, %d\n", filename, write ? "writing" : "reading", GetLastError());
         return NULL;
     }
     return new WindowsAsyncFile(hFile);
@@ -1116,7 +1148,7 @@ public:
         return !timedOut;
     }
 
-    bool destroy() {
+    void destroy() {
         pthread_cond_destroy(&cond);
         pthread_mutex_destroy(&lock);
     }
@@ -1245,6 +1277,16 @@ void* InterlockedCompareExchangePointerAndReturnOldValue(void * volatile *valueT
   return __sync_val_compare_and_swap(valueToUpdate, desiredPreviousValue, replacementValue);
 }
 
+_int64 InterlockedLoad64Acquire(volatile _int64 *valueToLoad)
+{
+  return __atomic_load_n(valueToLoad, __ATOMIC_ACQUIRE);
+}
+
+void InterlockedStore64Release(volatile _int64 *valueToStore, _int64 value)
+{
+  __atomic_store_n(valueToStore, value, __ATOMIC_RELEASE);
+}
+
 namespace {
 
 // POSIX thread functions need to return void*, so we wrap the ThreadMainFunction in our API
@@ -1293,6 +1335,20 @@ void SleepForMillis(unsigned millis)
   usleep(millis*1000);
 }
 
+void SpinPause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+void YieldThread()
+{
+  sched_yield();
+}
+
 _int64 QueryFileSize(const char *fileName)
 {
     int fd = open(fileName, O_RDONLY);
@@ -1500,7 +1556,7 @@ PosixAsyncFile::open(
 {
     int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
     if (fd < 0) {
-        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,errno);
+        WriteErrorMessage("Unable to open '%s' for %s, %d\n", filename, write ? "writing" : "reading", errno);
         return NULL;
     }
     return new PosixAsyncFile(fd);
@@ -1670,6 +1726,437 @@ PosixAsyncFile::Reader::waitForCompletion()
     return true;
 }
 
+#ifdef USE_IO_URING
+
+//
+// glibc's POSIX AIO is emulated with a pool of helper threads, and it serializes the requests for each file descriptor.
+// On kernels that have io_uring we can do real asynchronous I/O instead.  Each Reader and Writer gets its own (tiny) ring,
+// so the threads that write output or sort temp files don't share a submission queue or a lock.
+//
+// We talk to the kernel with the raw system calls rather than liburing, so there's no new build dependency.  The
+// interface here only ever has one I/O outstanding per Reader or Writer, and the buffers come from the caller on each
+// call, so registered buffers and O_DIRECT (which needs sector-aligned buffers, offsets and lengths, and the SAM writer's
+// aren't) wouldn't buy anything; we just use READV/WRITEV, which every io_uring kernel supports.
+//
+
+class IoUring
+{
+public:
+    IoUring() : ringFd(-1), sqRing(NULL), cqRing(NULL), sqes(NULL) {}
+
+    bool initialize(unsigned entries);
+    void destroy();
+
+    // Queue an operation and tell the kernel about it.
+    bool submit(int opcode, int fd, struct iovec *iov, size_t offset);
+
+    // Wait for the one outstanding operation and return its result (bytes or -errno).
+    int waitForCompletion();
+
+    static bool isSupported();
+
+private:
+    int                 ringFd;
+    void               *sqRing;
+    size_t              sqRingSize;
+    void               *cqRing;
+    size_t              cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t              sqesSize;
+
+    unsigned           *sqTail;
+    unsigned           *sqMask;
+    unsigned           *sqArray;
+    unsigned           *cqHead;
+    unsigned           *cqTail;
+    unsigned           *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+    bool
+IoUring::initialize(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0) {
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sqRing) {
+        sqRing = NULL;
+        destroy();
+        return false;
+    }
+
+    if (singleMmap) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cqRing) {
+            cqRing = NULL;
+            destroy();
+            return false;
+        }
+    }
+
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void *)sqes) {
+        sqes = NULL;
+        destroy();
+        return false;
+    }
+
+    sqTail = (unsigned *)((char *)sqRing + params.sq_off.tail);
+    sqMask = (unsigned *)((char *)sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned *)((char *)sqRing + params.sq_off.array);
+    cqHead = (unsigned *)((char *)cqRing + params.cq_off.head);
+    cqTail = (unsigned *)((char *)cqRing + params.cq_off.tail);
+    cqMask = (unsigned *)((char *)cqRing + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cqRing + params.cq_off.cqes);
+
+    return true;
+}
+
+    void
+IoUring::destroy()
+{
+    if (NULL != sqes) {
+        munmap(sqes, sqesSize);
+        sqes = NULL;
+    }
+    if (NULL != cqRing && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    cqRing = NULL;
+    if (NULL != sqRing) {
+        munmap(sqRing, sqRingSize);
+        sqRing = NULL;
+    }
+    if (ringFd >= 0) {
+        ::close(ringFd);
+        ringFd = -1;
+    }
+}
+
+    bool
+IoUring::submit(int opcode, int fd, struct iovec *iov, size_t offset)
+{
+    //
+    // We're the only producer, so a plain read of the tail is fine.  The release store publishes the sqe to the kernel.
+    //
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0);
+        if (ret >= 0) {
+            return true;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            return false;
+        }
+    }
+}
+
+    int
+IoUring::waitForCompletion()
+{
+    for (;;) {
+        unsigned head = *cqHead;
+        if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            int res = cqes[head & *cqMask].res;
+            __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+
+        int ret = (int)syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+    bool
+IoUring::isSupported()
+{
+    //
+    // Kernels without io_uring return ENOSYS, and it can also be disabled by sysctl or blocked by seccomp (as in some
+    // containers).  Just try it once; if two threads get here first they both try, and the first answer sticks.
+    //
+    static volatile _uint32 supported = 2; // not yet known
+    if (2 == supported) {
+        IoUring ring;
+        _uint32 worked = ring.initialize(2) ? 1 : 0;
+        ring.destroy();
+        InterlockedCompareExchange32AndReturnOldValue(&supported, worked, 2);
+    }
+    return supported == 1;
+}
+
+class IoUringAsyncFile : public AsyncFile
+{
+public:
+    static IoUringAsyncFile* open(const char* filename, bool write);
+
+    IoUringAsyncFile(int i_fd);
+
+    virtual bool close();
+
+    //
+    // Readers and writers are the same thing, except for the opcode.
+    //
+    class Operation
+    {
+    public:
+        Operation(IoUringAsyncFile* i_file, int i_opcode);
+
+        // gives back the ring if close() wasn't called
+        ~Operation();
+
+        // false if there's no ring for it, e.g. with many threads each opening files, under RLIMIT_MEMLOCK on older kernels
+        bool initialize();
+
+        bool close();
+
+        bool begin(void* buffer, size_t length, size_t offset, size_t *bytesTransferred);
+
+        bool waitForCompletion();
+
+    private:
+        bool submit();
+
+        IoUringAsyncFile*   file;
+        int                 opcode;
+        IoUring             ring;
+        bool                inProgress;
+        struct iovec        iov;
+        char*               buffer;
+        size_t              length;
+        size_t              offset;
+        size_t              transferred;
+        size_t*             result;
+    };
+
+    class Writer : public AsyncFile::Writer
+    {
+    public:
+        Writer(IoUringAsyncFile* i_file) : operation(i_file, IORING_OP_WRITEV) {}
+
+        bool initialize() {return operation.initialize();}
+
+        virtual bool close() {return operation.close();}
+
+        virtual bool beginWrite(void* buffer, size_t length, size_t offset, size_t *bytesWritten) {return operation.begin(buffer, length, offset, bytesWritten);}
+
+        virtual bool waitForCompletion() {return operation.waitForCompletion();}
+
+    private:
+        Operation           operation;
+    };
+
+    virtual AsyncFile::Writer* getWriter();
+
+    class Reader : public AsyncFile::Reader
+    {
+    public:
+        Reader(IoUringAsyncFile* i_file) : operation(i_file, IORING_OP_READV) {}
+
+        bool initialize() {return operation.initialize();}
+
+        virtual bool close() {return operation.close();}
+
+        virtual bool beginRead(void* buffer, size_t length, size_t offset, size_t *bytesRead) {return operation.begin(buffer, length, offset, bytesRead);}
+
+        virtual bool waitForCompletion() {return operation.waitForCompletion();}
+
+    private:
+        Operation           operation;
+    };
+
+    virtual AsyncFile::Reader* getReader();
+
+private:
+    void noteFallback();
+
+    int             fd;
+
+    // for readers & writers that can't get a ring of their own; it shares fd, and never closes it
+    PosixAsyncFile  posix;
+};
+
+    IoUringAsyncFile*
+IoUringAsyncFile::open(
+    const char* filename,
+    bool write)
+{
+    int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
+    if (fd < 0) {
+        WriteErrorMessage("Unable to open '%s' for %s, %d\n", filename, write ? "writing" : "reading", errno);
+        return NULL;
+    }
+    return new IoUringAsyncFile(fd);
+}
+
+IoUringAsyncFile::IoUringAsyncFile(
+    int i_fd)
+    : fd(i_fd), posix(i_fd)
+{
+}
+
+    bool
+IoUringAsyncFile::close()
+{
+    return ::close(fd) == 0;
+}
+
+    AsyncFile::Writer*
+IoUringAsyncFile::getWriter()
+{
+    Writer* writer = new Writer(this);
+    if (writer->initialize()) {
+        return writer;
+    }
+    delete writer;
+    noteFallback();
+    return posix.getWriter();
+}
+
+    AsyncFile::Reader*
+IoUringAsyncFile::getReader()
+{
+    Reader* reader = new Reader(this);
+    if (reader->initialize()) {
+        return reader;
+    }
+    delete reader;
+    noteFallback();
+    return posix.getReader();
+}
+
+    void
+IoUringAsyncFile::noteFallback()
+{
+    static volatile _uint32 noted = 0;
+    if (0 == InterlockedCompareExchange32AndReturnOldValue(&noted, 1, 0)) {
+        WriteStatusMessage("Could not set up an io_uring (errno %d), using POSIX AIO where that happens\n", errno);
+    }
+}
+
+IoUringAsyncFile::Operation::Operation(
+    IoUringAsyncFile* i_file,
+    int i_opcode)
+    : file(i_file), opcode(i_opcode), inProgress(false), buffer(NULL), length(0), offset(0), transferred(0), result(NULL)
+{
+}
+
+IoUringAsyncFile::Operation::~Operation()
+{
+    //
+    // Let anything in flight finish before the ring that it's in goes away.  Both do nothing after close().
+    //
+    waitForCompletion();
+    ring.destroy();
+}
+
+    bool
+IoUringAsyncFile::Operation::initialize()
+{
+    return ring.initialize(2);
+}
+
+    bool
+IoUringAsyncFile::Operation::close()
+{
+    bool worked = waitForCompletion();
+    ring.destroy();
+    return worked;
+}
+
+    bool
+IoUringAsyncFile::Operation::submit()
+{
+    iov.iov_base = buffer + transferred;
+    iov.iov_len = length - transferred;
+    if (!ring.submit(opcode, file->fd, &iov, offset + transferred)) {
+        warn("IoUringAsyncFile submit failed");
+        return false;
+    }
+    inProgress = true;
+    return true;
+}
+
+    bool
+IoUringAsyncFile::Operation::begin(
+    void* i_buffer,
+    size_t i_length,
+    size_t i_offset,
+    size_t* bytesTransferred)
+{
+    if (! waitForCompletion()) {
+        return false;
+    }
+    buffer = (char*)i_buffer;
+    length = i_length;
+    offset = i_offset;
+    transferred = 0;
+    result = bytesTransferred;
+    return submit();
+}
+
+    bool
+IoUringAsyncFile::Operation::waitForCompletion()
+{
+    while (inProgress) {
+        inProgress = false;
+        int res = ring.waitForCompletion();
+        if (res < 0) {
+            errno = -res;
+            warn("IoUringAsyncFile %s failed", opcode == IORING_OP_WRITEV ? "write" : "read");
+            return false;
+        }
+
+        //
+        // Unlike aio, pick up where a short transfer left off.  A read that returns 0 is at end of file.
+        //
+        transferred += res;
+        if (res > 0 && transferred < length) {
+            if (!submit()) {
+                return false;
+            }
+        }
+    }
+
+    if (result != NULL) {
+        *result = transferred;
+        result = NULL;
+    }
+    return true;
+}
+
+#endif  // USE_IO_URING
+
 #else
 
 // todo: make this actually async!
@@ -1734,7 +2221,7 @@ OsxAsyncFile::open(
 {
     int fd = ::open(filename, write ? O_CREAT | O_RDWR | O_TRUNC : O_RDONLY, write ? S_IRWXU | S_IRGRP : 0);
     if (fd < 0) {
-        WriteErrorMessage("Unable to create SAM file '%s', %d\n",filename,errno);
+        WriteErrorMessage("Unable to open '%s' for %s, %d\n", filename, write ? "writing" : "reading", errno);
         return NULL;
     }
     return new OsxAsyncFile(fd);
@@ -2209,6 +2696,11 @@ AsyncFile* AsyncFile::open(const char* filename, bool write)
     return WindowsAsyncFile::open(filename, write);
 #else
 #ifdef __linux__
+#ifdef USE_IO_URING
+    if (IoUring::isSupported()) {
+        return IoUringAsyncFile::open(filename, write);
+    }
+#endif  // USE_IO_URING
     return PosixAsyncFile::open(filename, write);
 #else
     return OsxAsyncFile::open(filename, write);
@@ -336,6 +336,9 @@ _int64 InterlockedAdd64AndReturnNewValue(volatile _int64 *valueToWhichToAdd, _in
 _uint32 InterlockedCompareExchange32AndReturnOldValue(volatile _uint32 *valueToUpdate, _uint32 replacementValue, _uint32 desiredPreviousValue);
 _uint64 InterlockedCompareExchange64AndReturnOldValue(volatile _uint64 *valueToUpdate, _uint64 replacementValue, _uint64 desiredPreviousValue);
 void* InterlockedCompareExchangePointerAndReturnOldValue(void * volatile *valueToUpdate, void* replacementValue, void* desiredPreviousValue);
+// nothing after an acquire load is done before it, and nothing before a release store is done after it
+_int64 InterlockedLoad64Acquire(volatile _int64 *valueToLoad);
+void InterlockedStore64Release(volatile _int64 *valueToStore, _int64 value);
 
 //
 // Functions for creating and binding threads.
@@ -351,6 +354,11 @@ void BindThreadToProcessor(unsigned processorNumber); // This hard binds a threa
 
 void SleepForMillis(unsigned millis);
 
+// for spin loops: a pause instruction, which is easier on the other hyperthread and on leaving the loop
+void SpinPause();
+// let another thread run, if any is ready
+void YieldThread();
+
 unsigned GetNumberOfProcessors();
 
 _int64 QueryFileSize(const char *fileName);
@@ -390,6 +398,8 @@ class AsyncFile
 {
 public:
 
+    virtual ~AsyncFile() {}
+
     // open a new file for reading and/or writing
     static AsyncFile* open(const char* filename, bool write);
 
@@ -400,6 +410,8 @@ public:
     class Writer
     {
     public:
+        virtual ~Writer() {}
+
         // waits for all writes to complete, frees resources
         virtual bool close() = 0;
 
@@ -417,6 +429,8 @@ public:
     class Reader
     {
     public:
+        virtual ~Reader() {}
+
         // waits for alls reads to complete, frees resources
         virtual bool close() = 0;
 
@@ -22,9 +22,14 @@ Environment:
 #include "Compat.h"
 #include "RangeSplitter.h"
 #include "ParallelTask.h"
+#include "ParallelGzip.h"
+#include "GzipCodec.h"
 #include "DataReader.h"
 #include "Bam.h"
 #include "zlib.h"
+#ifdef SNAP_ZSTD
+#include <zstd.h>
+#endif
 #include "exit.h"
 #include "Error.h"
 
@@ -1289,11 +1294,84 @@ static const int ENABLE_ZLIB_GZIP = 32;
 static const double MIN_FACTOR = 1.2;
 static const double MAX_FACTOR = 10.0;
 
+// largest frame (compressed) that we'll decompress in parallel from a zstd seekable file; it's the inner reader's overflow
+static const int ZSTD_SEEKABLE_MAX_FRAME = 4 * 1024 * 1024;
+
+//
+// The zstd seekable format (contrib/seekable_format in the zstd sources) is a series of independent frames followed by a
+// skippable frame holding a table of their compressed and decompressed sizes, which is just what's needed to decompress
+// them in parallel.  Frames needn't record their own decompressed size, so it has to come from the table.
+//
+struct ZstdSeekTable
+{
+    VariableSizeVector<_uint32> compressedSizes;
+    VariableSizeVector<_uint32> decompressedSizes;
+    _int64 tableFrameSize; // the skippable frame at the end of the file
+
+    // false if the file isn't in the seekable format, or if any frame (or the table) is bigger than maxFrameSize
+    bool load(const char* fileName, _int64 maxFrameSize);
+};
+
+    static _uint32
+readLittleEndian32(
+    const _uint8* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((_uint32) p[3] << 24);
+}
+
+    bool
+ZstdSeekTable::load(
+    const char* fileName,
+    _int64 maxFrameSize)
+{
+    static const _uint32 SkippableMagic = 0x184D2A5E;
+    static const _uint32 SeekableMagic = 0x8F92EAB1;
+    static const int FooterSize = 9;
+
+    compressedSizes.clear();
+    decompressedSizes.clear();
+    _int64 fileSize = QueryFileSize(fileName);
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    _uint8 footer[FooterSize];
+    if (fileSize < 8 + FooterSize || _fseek64bit(file, fileSize - FooterSize, SEEK_SET) != 0 || fread(footer, 1, FooterSize, file) != FooterSize ||
+            readLittleEndian32(footer + 5) != SeekableMagic || (footer[4] & 0x7c) != 0) {
+        fclose(file);
+        return false;
+    }
+    _int64 nFrames = readLittleEndian32(footer);
+    int entrySize = (footer[4] & 0x80) ? 12 : 8; // with or without a checksum, which we don't need
+    tableFrameSize = 8 + nFrames * entrySize + FooterSize;
+    if (tableFrameSize > maxFrameSize || tableFrameSize > fileSize) {
+        fclose(file);
+        return false;
+    }
+    _uint8* table = new _uint8[tableFrameSize];
+    bool ok = _fseek64bit(file, fileSize - tableFrameSize, SEEK_SET) == 0 && fread(table, 1, tableFrameSize, file) == (size_t) tableFrameSize &&
+        readLittleEndian32(table) == SkippableMagic && readLittleEndian32(table + 4) == tableFrameSize - 8;
+    fclose(file);
+    _int64 dataSize = 0;
+    for (_int64 i = 0; ok && i < nFrames; i++) {
+        _uint32 compressedSize = readLittleEndian32(table + 8 + i * entrySize);
+        compressedSizes.push_back(compressedSize);
+        decompressedSizes.push_back(readLittleEndian32(table + 8 + i * entrySize + 4));
+        dataSize += compressedSize;
+        ok = compressedSize > 0 && compressedSize <= maxFrameSize;
+    }
+    delete [] table;
+    return ok && dataSize + tableFrameSize == fileSize;
+}
+
 class DecompressDataReader : public DataReader
 {
 public:
 
-    DecompressDataReader(DataReader* i_inner, int i_count, _int64 totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes, int i_chunkSize = BAM_BLOCK);
+    enum DecompressFormat { GzipFormat, ZstdFormat };
+
+    DecompressDataReader(DataReader* i_inner, int i_count, _int64 totalExtra, _int64 i_extraBytes, _int64 i_overflowBytes, int i_chunkSize = BAM_BLOCK,
+        DecompressFormat i_format = GzipFormat);
 
     virtual ~DecompressDataReader();
 
@@ -1329,6 +1407,12 @@ public:
     static bool decompress(z_stream* zstream, ThreadHeap* heap, char* input, _int64 inputSize, _int64* o_inputUsed,
         char* output, _int64 outputSize, _int64* o_outputUsed, DecompressMode mode);
 
+#ifdef SNAP_ZSTD
+    // continues a stream across calls; returns false if output filled up before all the input was used
+    static bool decompressZstd(ZSTD_DStream* zstream, char* input, _int64 inputSize, _int64* o_inputUsed,
+        char* output, _int64 outputSize, _int64* o_outputUsed);
+#endif
+
     // debugging
     char* findPointer(void* p);
 
@@ -1362,6 +1446,7 @@ private:
         _int64 decompressedStart;
         _int64 decompressedValid;
         bool allocated; // if decompressed has been allocated specially, not from inner extra data
+        int holds; // only with parallelInflater, whose batches aren't the inner reader's
     };
 
     // use only these routines to manipulate the linked  lists
@@ -1376,11 +1461,15 @@ private:
     const _int64 overflowBytes; // overflow between batches
     const _int64 totalExtra; // total extra data
     const int chunkSize; // max size of decompressed data
+    const DecompressFormat format;
+    ZstdSeekTable* seekTable; // frame sizes for zstd with chunkSize > 0
     _int64 offset; // into current entry
     bool threadStarted; // whether thread has been started
     bool eof; // true when we've read to eof of previous
     volatile bool stopping; // set to stop everything
     EventObject decompressThreadDone; // signalled by background thread on exit
+    ParallelGzipInflater* parallelInflater; // decompresses ordinary gzip in parallel, NULL to use zlib
+    _uint32 inflaterBatchID; // last batch numbered for parallelInflater
 
     // entry lists
     Entry* entries; // ring buffer of batches from inner reader
@@ -1400,10 +1489,12 @@ DecompressDataReader::DecompressDataReader(
     _int64 i_totalExtra,
     _int64 i_extraBytes,
     _int64 i_overflowBytes,
-    int i_chunkSize)
+    int i_chunkSize,
+    DecompressFormat i_format)
     : DataReader(), inner(i_inner), count(i_count), offset(i_overflowBytes),
     totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
-    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false)
+    chunkSize(i_chunkSize), format(i_format), seekTable(NULL), threadStarted(false), eof(false), stopping(false), parallelInflater(NULL),
+    inflaterBatchID(0)
 {
     entries = new Entry[count];
     for (int i = 0; i < count; i++) {
@@ -1412,6 +1503,7 @@ DecompressDataReader::DecompressDataReader(
         entry->next = i < count - 1 ? &entries[i + 1] : NULL;
         entry->decompressed = NULL;
         entry->allocated = false;
+        entry->holds = 0;
         entry->batch = DataBatch(0, 0);
     }
     available = entries;
@@ -1438,6 +1530,8 @@ DecompressDataReader::~DecompressDataReader()
         }
     }
     DestroyExclusiveLock(&lock);
+    delete parallelInflater;
+    delete seekTable;
     delete inner;
 }
 
@@ -1445,7 +1539,21 @@ DecompressDataReader::~DecompressDataReader()
 DecompressDataReader::init(
     const char* fileName)
 {
-    return inner->init(fileName);
+    if (! inner->init(fileName)) {
+        return false;
+    }
+    if (format == ZstdFormat && chunkSize > 0) {
+        seekTable = new ZstdSeekTable();
+        if (! seekTable->load(fileName, chunkSize)) {
+            WriteErrorMessage("%s isn't a zstd seekable file\n", fileName);
+            soft_exit(1);
+        }
+    }
+    // BGZF blocks are already decompressed in parallel; ordinary gzip needs to be split up speculatively
+    if (format == GzipFormat && chunkSize == 0 && DataSupplier::ThreadCount > 1 && strcmp(fileName, "-") != 0) {
+        parallelInflater = ParallelGzipInflater::create(fileName, min(8, DataSupplier::ThreadCount));
+    }
+    return true;
 }
 
     char*
@@ -1461,6 +1569,16 @@ DecompressDataReader::readHeader(
     inner->getExtra(&header, &total);
     _ASSERT(total >= totalExtra);
     _int64 headerSize = 0;
+#ifdef SNAP_ZSTD
+    if (format == ZstdFormat) {
+        ZSTD_DStream* zstream = ZSTD_createDCtx();
+        _int64 compressedUsed;
+        decompressZstd(zstream, compressed, compressedBytes, &compressedUsed, header, totalExtra, &headerSize);
+        ZSTD_freeDCtx(zstream);
+        *io_headerSize = headerSize;
+        return header;
+    }
+#endif
     while (headerSize < *io_headerSize && compressedBytes > 0) {
         _int64 compressedBlockSize, decompressedBlockSize;
         //fprintf(stderr,"decompress chunkSize %d compressedBytes %d headerSize %d totalExtra %d\n", chunkSize, compressedBytes, headerSize, totalExtra);
@@ -1487,7 +1605,16 @@ DecompressDataReader::reinit(
         soft_exit(1);
     }
     // todo: transform start/amount to add for compression? I don't think so...
-    inner->reinit(startingOffset, amountOfFileToProcess);
+    _ASSERT(seekTable == NULL || startingOffset == 0); // frames are counted from the start of the file
+    if (startingOffset != 0 && parallelInflater != NULL) {
+        // the parallel inflater always starts at the beginning of the file
+        delete parallelInflater;
+        parallelInflater = NULL;
+    }
+    if (parallelInflater == NULL) {
+        // the parallel inflater reads the file itself, so the inner reader is only used for the header
+        inner->reinit(startingOffset, amountOfFileToProcess);
+    }
     threadStarted = true;
     if (! StartNewThread(chunkSize > 0 ? decompressThread : decompressThreadContinuous, this)) {
         WriteErrorMessage("failed to start decompressThread\n");
@@ -1545,7 +1672,7 @@ DecompressDataReader::nextBatch()
     releaseBatch(old->batch); // holdBatch was called in decompress thread, release now if no customers added holds
     if (offset == next->decompressedValid) {
         eof = true;
-        _ASSERT(inner->isEOF());
+        _ASSERT(parallelInflater != NULL || inner->isEOF());
     }
 }
 
@@ -1564,13 +1691,24 @@ DecompressDataReader::getBatch()
     void
 DecompressDataReader::holdBatch(DataBatch batch)
 {
-    inner->holdBatch(batch);
+    if (parallelInflater == NULL) {
+        inner->holdBatch(batch);
+        return;
+    }
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < count; i++) {
+        if (entries[i].batch == batch) {
+            entries[i].holds++;
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&lock);
 }
 
     bool
 DecompressDataReader::releaseBatch(DataBatch batch)
 {
-    if (! inner->releaseBatch(batch)) {
+    if (parallelInflater == NULL && ! inner->releaseBatch(batch)) {
         return false;
     }
     // truly released, find matching entry & put back on available list
@@ -1579,6 +1717,10 @@ DecompressDataReader::releaseBatch(DataBatch batch)
         Entry* entry = &entries[i];
         if (entry->batch == batch) {
 			//fprintf(stderr,"DecompressDataReader releaseBatch %d:0x%x #%d\n", batch.fileID, batch.batchID, i);
+            if (parallelInflater != NULL && entry->holds > 0 && --entry->holds > 0) {
+                ReleaseExclusiveLock(&lock);
+                return false;
+            }
             if (entry->state == EntryHeld) {
                 enqueueAvailable(entry);
             } else {
@@ -1594,7 +1736,7 @@ DecompressDataReader::releaseBatch(DataBatch batch)
     _int64
 DecompressDataReader::getFileOffset()
 {
-    return inner->getFileOffset();
+    return parallelInflater != NULL ? parallelInflater->getCompressedOffset() : inner->getFileOffset();
 }
 
     void
@@ -1672,6 +1814,33 @@ DecompressDataReader::decompress(
     }
     return zstream->avail_in == 0;
 }
+
+#ifdef SNAP_ZSTD
+    bool
+DecompressDataReader::decompressZstd(
+    ZSTD_DStream* zstream,
+    char* input,
+    _int64 inputBytes,
+    _int64* o_inputRead,
+    char* output,
+    _int64 outputBytes,
+    _int64* o_outputWritten)
+{
+    ZSTD_inBuffer in = {input, (size_t) inputBytes, 0};
+    ZSTD_outBuffer out = {output, (size_t) outputBytes, 0};
+    while (in.pos < in.size && out.pos < out.size) {
+        size_t status = ZSTD_decompressStream(zstream, &out, &in);
+        if (ZSTD_isError(status)) {
+            WriteErrorMessage("ZstdDataReader: decompression failed: %s\n", ZSTD_getErrorName(status));
+            soft_exit(1);
+        }
+    }
+    *o_inputRead = in.pos;
+    *o_outputWritten = out.pos;
+    // if there's room left in output, zstd has flushed everything it has
+    return in.pos == in.size && out.pos < out.size;
+}
+#endif
   
     char*
 DecompressDataReader::findPointer(
@@ -1702,20 +1871,34 @@ typedef VariableSizeVector<_int64> OffsetVector;
 class DecompressWorker : public ParallelWorker
 {
 public:
-    DecompressWorker();
+    DecompressWorker() : codec(NULL)
+#ifdef SNAP_ZSTD
+        , zstd(NULL)
+#endif
+    {}
+
+    virtual ~DecompressWorker()
+    {
+        delete codec;
+#ifdef SNAP_ZSTD
+        ZSTD_freeDCtx(zstd);
+#endif
+    }
 
     virtual void step();
 
 private:
-    z_stream zstream;
-    ThreadHeap heap;
+    GzipCodec* codec;
+#ifdef SNAP_ZSTD
+    ZSTD_DCtx* zstd;
+#endif
 };
     
 class DecompressManager: public ParallelWorkerManager
 {
 public:
-    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
-        : inputs(i_inputs), outputs(i_outputs)
+    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs, DecompressDataReader::DecompressFormat i_format)
+        : inputs(i_inputs), outputs(i_outputs), format(i_format)
     {}
 
     virtual ParallelWorker* createWorker()
@@ -1723,36 +1906,53 @@ public:
 
     OffsetVector* inputs;
     OffsetVector* outputs;
+    const DecompressDataReader::DecompressFormat format;
     DecompressDataReader::Entry* entry;
 
     friend class DecompressWorker;
 };
 
-DecompressWorker::DecompressWorker()
-    : heap(BAM_BLOCK)
-{
-    zstream.zalloc = zalloc;
-    zstream.zfree = zfree;
-    zstream.opaque = &heap;
-}
-
     void
 DecompressWorker::step()
 {
     DecompressManager* manager = (DecompressManager*) getManager();
+#ifdef SNAP_ZSTD
+    if (manager->format == DecompressDataReader::ZstdFormat) {
+        if (zstd == NULL) {
+            zstd = ZSTD_createDCtx();
+        }
+        for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
+            // each frame is independent, and the seek table said how big it is compressed and decompressed
+            size_t outputSize = (*manager->outputs)[i + 1] - (*manager->outputs)[i];
+            size_t outputUsed = ZSTD_decompressDCtx(zstd,
+                manager->entry->decompressed + (*manager->outputs)[i],
+                outputSize,
+                manager->entry->compressed + (*manager->inputs)[i],
+                (*manager->inputs)[i + 1] - (*manager->inputs)[i]);
+            if (ZSTD_isError(outputUsed) || outputUsed != outputSize) {
+                WriteErrorMessage("ZstdDataReader: corrupt frame: %s\n", ZSTD_isError(outputUsed) ? ZSTD_getErrorName(outputUsed) : "wrong size");
+                soft_exit(1);
+            }
+        }
+        return;
+    }
+#endif
+    if (codec == NULL) {
+        codec = GzipCodec::create();
+    }
     for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
-        _int64 inputUsed, outputUsed;
-        DecompressDataReader::decompress(&zstream,
-            &heap,
-            manager->entry->compressed + (*manager->inputs)[i],
-            (*manager->inputs)[i + 1] - (*manager->inputs)[i],
-            &inputUsed,
-            manager->entry->decompressed + (*manager->outputs)[i],
-            (*manager->outputs)[i + 1] - (*manager->outputs)[i],
-            &outputUsed,
-            DecompressDataReader::SingleBlock);
-        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
-            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+        // each BGZF block is a whole gzip member, and the header said how big it is compressed and decompressed
+        size_t outputSize = (*manager->outputs)[i + 1] - (*manager->outputs)[i];
+        size_t outputUsed;
+        if (! codec->decompressMember(manager->entry->compressed + (*manager->inputs)[i],
+                (*manager->inputs)[i + 1] - (*manager->inputs)[i],
+                manager->entry->decompressed + (*manager->outputs)[i],
+                outputSize,
+                &outputUsed) ||
+            outputUsed != outputSize) {
+            WriteErrorMessage("GzipDataReader: corrupt BGZF block\n");
+            soft_exit(1);
+        }
     }
 }
 
@@ -1762,9 +1962,10 @@ DecompressDataReader::decompressThread(
 {
     DecompressDataReader* reader = (DecompressDataReader*) context;
     OffsetVector inputs, outputs;
-    DecompressManager manager(&inputs, &outputs);
+    DecompressManager manager(&inputs, &outputs, reader->format);
     ParallelCoworker coworker(min(8, DataSupplier::ThreadCount), false, &manager);
     coworker.start();
+    _int64 frame = 0; // next zstd frame in the seek table
     // keep reading & decompressing entries until stopped
     bool stop = false;
     while (! stop) {
@@ -1801,18 +2002,34 @@ DecompressDataReader::decompressThread(
             do {
                 inputs.push_back(input);
                 outputs.push_back(output);
-                BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
-                input += zip->BSIZE() + 1;
-                output += zip->ISIZE();
+                if (reader->format == ZstdFormat) {
+                    // the last frame is the (skippable) seek table, which decompresses to nothing
+                    ZstdSeekTable* table = reader->seekTable;
+                    if (frame > table->compressedSizes.size()) {
+                        fprintf(stderr, "error reading zstd file at offset %lld\n", reader->getFileOffset());
+                        soft_exit(1);
+                    }
+                    input += frame < table->compressedSizes.size() ? table->compressedSizes[frame] : table->tableFrameSize;
+                    output += frame < table->decompressedSizes.size() ? table->decompressedSizes[frame] : 0;
+                    frame++;
+                    if (input > entry->compressedValid) {
+                        fprintf(stderr, "error reading zstd file at offset %lld\n", reader->getFileOffset());
+                        soft_exit(1);
+                    }
+                } else {
+                    BgzfHeader* zip = (BgzfHeader*) (entry->compressed + input);
+                    input += zip->BSIZE() + 1;
+                    output += zip->ISIZE();
+                    if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
+                        fprintf(stderr, "error reading BAM file at offset %lld\n", reader->getFileOffset());
+                        soft_exit(1);
+                    }
+                }
 
                 if (output > reader->extraBytes) {
                     fprintf(stderr, "insufficient decompression space, increase -xf parameter\n");
                     soft_exit(1);
                 }
-                if (input > entry->compressedValid || zip->BSIZE() >= BAM_BLOCK || zip->ISIZE() > BAM_BLOCK) {
-                    fprintf(stderr, "error reading BAM file at offset %lld\n", reader->getFileOffset());
-                    soft_exit(1);
-                }
             } while (input < entry->compressedStart);
             // append final offsets
             inputs.push_back(input);
@@ -1842,6 +2059,9 @@ DecompressDataReader::decompressThreadContinuous(
 {
     DecompressDataReader* reader = (DecompressDataReader*) context;
     z_stream zstream;
+#ifdef SNAP_ZSTD
+    ZSTD_DStream* zstdStream = reader->format == ZstdFormat ? ZSTD_createDCtx() : NULL;
+#endif
     bool first = true;
     bool stop = false;
     while (! stop) {
@@ -1849,6 +2069,31 @@ DecompressDataReader::decompressThreadContinuous(
         if (reader->stopping) {
             break;
         }
+        if (reader->parallelInflater != NULL) {
+            //
+            // The inflater reads the file itself, so nothing comes from the inner reader: the entry gets a buffer of its own
+            // and the next batch number, and its holds are counted here rather than by the inner reader.
+            //
+            if (! entry->allocated) {
+                entry->decompressed = (char*) BigAlloc(reader->totalExtra);
+                entry->allocated = true;
+            }
+            AcquireExclusiveLock(&reader->lock);
+            entry->batch = DataBatch(++reader->inflaterBatchID);
+            entry->holds = 1; // released by nextBatch
+            ReleaseExclusiveLock(&reader->lock);
+            _int64 decompressedWritten = reader->parallelInflater->read(entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes);
+            if (decompressedWritten == 0) {
+                // mark as eof - no data
+                entry->decompressedValid = entry->decompressedStart = reader->overflowBytes;
+                stop = true;
+            } else {
+                entry->decompressedValid = reader->overflowBytes + decompressedWritten;
+                entry->decompressedStart = decompressedWritten;
+            }
+            reader->enqueueReady(entry);
+            continue;
+        }
         // always starts with a fresh batch - advances after reading it all
         bool ok = reader->inner->getData(&entry->compressed, &entry->compressedValid, &entry->compressedStart);
         int index = (int) (entry - reader->entries);
@@ -1875,11 +2120,22 @@ DecompressDataReader::decompressThreadContinuous(
             reader->holdBatch(entry->batch); // hold batch while decompressing
             reader->inner->advance(entry->compressedValid);
             reader->inner->nextBatch(); // start reading next batch
-            decompress(&zstream, NULL,
-                entry->compressed, entry->compressedValid, &compressedRead,
-                entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten,
-                first ? StartMultiBlock : ContinueMultiBlock);
-            _ASSERT(compressedRead == entry->compressedValid && decompressedWritten <= reader->extraBytes - reader->overflowBytes);
+#ifdef SNAP_ZSTD
+            if (zstdStream != NULL) {
+                if (! decompressZstd(zstdStream, entry->compressed, entry->compressedValid, &compressedRead,
+                        entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten)) {
+                    WriteErrorMessage("insufficient decompression buffer space - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+                    soft_exit(1);
+                }
+            } else
+#endif
+            {
+                decompress(&zstream, NULL,
+                    entry->compressed, entry->compressedValid, &compressedRead,
+                    entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten,
+                    first ? StartMultiBlock : ContinueMultiBlock);
+                _ASSERT(compressedRead == entry->compressedValid && decompressedWritten <= reader->extraBytes - reader->overflowBytes);
+            }
             entry->decompressedValid = reader->overflowBytes + decompressedWritten;
             entry->decompressedStart = decompressedWritten;
             first = false;
@@ -1888,6 +2144,11 @@ DecompressDataReader::decompressThreadContinuous(
         //fprintf(stderr, "decompressThreadContinuous#%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
         reader->enqueueReady(entry);
     }
+#ifdef SNAP_ZSTD
+    if (zstdStream != NULL) {
+        ZSTD_freeDCtx(zstdStream);
+    }
+#endif
     AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
 
@@ -1984,8 +2245,9 @@ DecompressDataReader::enqueueAvailable(Entry* entry)
 class DecompressDataReaderSupplier : public DataSupplier
 {
 public:
-    DecompressDataReaderSupplier(DataSupplier* i_inner, int i_blockSize = BAM_BLOCK)
-        : DataSupplier(), inner(i_inner), blockSize(i_blockSize)
+    DecompressDataReaderSupplier(DataSupplier* i_inner, int i_blockSize = BAM_BLOCK,
+            DecompressDataReader::DecompressFormat i_format = DecompressDataReader::GzipFormat)
+        : DataSupplier(), inner(i_inner), blockSize(i_blockSize), format(i_format)
     {}
 
     virtual DataReader* getDataReader(int bufferCount, _int64 overflowBytes, double extraFactor, size_t bufferSpace);
@@ -1993,6 +2255,7 @@ public:
 private:
     DataSupplier* inner;
     const int blockSize;
+    const DecompressDataReader::DecompressFormat format;
 };
 
     DataReader*
@@ -2015,7 +2278,7 @@ DecompressDataReaderSupplier::getDataReader(
     _int64 mine = (_int64)(totalExtra * expand / totalFactor);
     // create new reader, telling it how many bytes it owns
     // it will subtract overflow off the end of each batch
-    return new DecompressDataReader(data, bufferCount, totalExtra, mine, overflowBytes, blockSize);
+    return new DecompressDataReader(data, bufferCount, totalExtra, mine, overflowBytes, blockSize, format);
 }
     
     DataSupplier*
@@ -2031,6 +2294,77 @@ DataSupplier::Gzip(
 {
     return new DecompressDataReaderSupplier(inner, 0);
 }
+
+    DataSupplier*
+DataSupplier::Zstd(
+    DataSupplier* inner)
+{
+    return new DecompressDataReaderSupplier(inner, 0, DecompressDataReader::ZstdFormat);
+}
+
+    DataSupplier*
+DataSupplier::ZstdSeekable(
+    DataSupplier* inner)
+{
+    return new DecompressDataReaderSupplier(inner, ZSTD_SEEKABLE_MAX_FRAME, DecompressDataReader::ZstdFormat);
+}
+
+    DataSupplier*
+DataSupplier::GzipDefaultForFile(
+    const char* fileName)
+{
+    //
+    // A BGZF file is a series of gzip members, each of which has a "BC" extra subfield giving its compressed size.
+    // Look for that in the first member; bgzip writes every member that way.  Plain gzip files either don't have
+    // FEXTRA set or don't have the BC subfield.
+    //
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return GzipDefault;
+    }
+    _uint8 header[sizeof(BgzfHeader) + 64];
+    size_t bytes = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    BgzfHeader* zip = (BgzfHeader*) header;
+    if (bytes < sizeof(BgzfHeader) || zip->ID1 != 0x1f || zip->ID2 != 0x8b || zip->CM != 8 || (zip->FLG & 4) == 0 ||
+            sizeof(BgzfHeader) + zip->XLEN > bytes) {
+        return GzipDefault;
+    }
+    for (BgzfExtra* x = zip->firstExtra(); (char*) x + 4 <= (char*) zip->firstExtra() + zip->XLEN; x = x->nextExtra()) {
+        if (x->SI1 == 'B' && x->SI2 == 'C' && x->SLEN == 2) {
+            return GzipBamDefault;
+        }
+    }
+    return GzipDefault;
+}
+
+    DataSupplier*
+DataSupplier::DecompressDefaultForFile(
+    const char* fileName)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return GzipDefault;
+    }
+    _uint8 magic[4];
+    size_t bytes = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    // a zstd frame, or a skippable frame (which some zstd writers put first)
+    _uint32 value = readLittleEndian32(magic);
+    if (bytes < sizeof(magic) || (value != 0xFD2FB528 && (value & 0xFFFFFFF0) != 0x184D2A50)) {
+        return GzipDefaultForFile(fileName);
+    }
+    if (ZstdDefault == NULL) {
+        WriteErrorMessage("'%s' is compressed with zstd, and this SNAP wasn't built with zstd (see ZSTD_HOME in the Makefile).\n"
+            "Either rebuild it, or use zstd -dc to decompress the file and have SNAP read it from stdin.\n", fileName);
+        soft_exit(1);
+    }
+    ZstdSeekTable table;
+    return table.load(fileName, ZSTD_SEEKABLE_MAX_FRAME) ? ZstdSeekableDefault : ZstdDefault;
+}
+
     DataSupplier* 
 DataSupplier::StdioSupplier()
 {
@@ -2526,6 +2860,16 @@ DataSupplier* DataSupplier::GzipStdio = DataSupplier::Gzip(DataSupplier::Stdio);
 
 DataSupplier* DataSupplier::GzipBamStdio = DataSupplier::GzipBam(DataSupplier::Stdio);
 
+#ifdef SNAP_ZSTD
+DataSupplier* DataSupplier::ZstdDefault = DataSupplier::Zstd(DataSupplier::Default);
+
+DataSupplier* DataSupplier::ZstdSeekableDefault = DataSupplier::ZstdSeekable(DataSupplier::Default);
+#else
+DataSupplier* DataSupplier::ZstdDefault = NULL;
+
+DataSupplier* DataSupplier::ZstdSeekableDefault = NULL;
+#endif
+
 
 int DataSupplier::ThreadCount = 1;
 
@@ -163,6 +163,8 @@ public:
     // 
     static DataSupplier* GzipBam(DataSupplier* inner);
     static DataSupplier* Gzip(DataSupplier* inner);
+    static DataSupplier* Zstd(DataSupplier* inner);
+    static DataSupplier* ZstdSeekable(DataSupplier* inner);
     static DataSupplier* StdioSupplier();
 
     // memmap works on both platforms (but better on Linux)
@@ -178,6 +180,19 @@ public:
     static DataSupplier* GzipDefault;
     static DataSupplier* GzipBamDefault;
 
+    // GzipBamDefault if the file is BGZF (blocked gzip, as written by bgzip), so that its blocks
+    // can be decompressed in parallel, otherwise GzipDefault
+    static DataSupplier* GzipDefaultForFile(const char* fileName);
+
+    // zstd, if SNAP was built with it (see ZSTD_HOME in the Makefile); otherwise NULL.
+    // ZstdSeekableDefault decompresses the frames of a file in the zstd seekable format in parallel,
+    // ZstdDefault streams anything else on one thread
+    static DataSupplier* ZstdDefault;
+    static DataSupplier* ZstdSeekableDefault;
+
+    // the right one of the above for a compressed file, based on its magic number
+    static DataSupplier* DecompressDefaultForFile(const char* fileName);
+
     static DataSupplier* GzipStdio;
     static DataSupplier* Stdio;
     static DataSupplier* GzipBamStdio;
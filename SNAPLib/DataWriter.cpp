@@ -49,10 +49,23 @@ private:
     FileEncoder* encoder;
     const int bufferCount;
     const size_t bufferSize;
-    ExclusiveLock lock;
-    size_t sharedOffset;
-    size_t sharedLogical;
     bool closing;
+
+    // how the two offsets move, which decides how much advance has to do to keep them consistent
+    enum ReserveMode
+    {
+        SameOffsets, // no encoder or resizing filter, so the two are always the same
+        SeparateOffsets, // the encoder reserves physical space on its own, after the logical space it was handed
+        PairedOffsets, // a resizing filter on the writing thread moves both, by different amounts
+    };
+    ReserveMode reserveMode;
+
+    volatile _int64 sharedOffset;
+    volatile _int64 sharedLogical;
+
+    // for PairedOffsets, callers go in the order of their tickets
+    volatile _int64 nextTicket;
+    volatile _int64 servingTicket;
 };
 
 class AsyncDataWriter : public DataWriter
@@ -207,6 +220,8 @@ FileEncoder::checkForInput()
             coworker->step();
             break;
         }
+        // nothing to encode (e.g. the last batch of a file with no reads), so it's already done
+        AllowEventWaitersToProceed(&encode->encoded);
     }
 }
 
@@ -372,6 +387,9 @@ AsyncDataWriter::nextBatch()
     _int64 start = timeInNanos();
     if (encoder != NULL) {
         WaitForEvent(&batches[(current + 1) % count].encoded);
+        _int64 encoded = timeInNanos();
+        InterlockedAdd64AndReturnNewValue(&EncodeWaitTime, encoded - start);
+        start = encoded;
     }
     acquireLock();
     int written = current;
@@ -409,6 +427,10 @@ AsyncDataWriter::nextBatch()
             batches[current].logicalUsed = 0;
         }
     }
+    if (encoder != NULL) {
+        // before the encoder can see the batch, or it could finish with it (or skip it, if it's empty) first
+        PreventEventWaitersFromProceeding(&write->encoded);
+    }
     _int64 start2 = timeInNanos();
     releaseLock();
 
@@ -421,7 +443,6 @@ AsyncDataWriter::nextBatch()
             soft_exit(1);
         }
     } else {
-        PreventEventWaitersFromProceeding(&write->encoded);
         encoder->inputReady();
     }
     if (! batches[current].file->waitForCompletion()) {
@@ -459,16 +480,20 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     encoder(i_encoder),
     bufferCount(i_bufferCount),
     bufferSize(i_bufferSize),
+    closing(false),
+    reserveMode(i_encoder != NULL ? SeparateOffsets
+        : i_filterSupplier != NULL && i_filterSupplier->filterType >= DataWriter::TransformFilter ? PairedOffsets
+        : SameOffsets),
     sharedOffset(0),
     sharedLogical(0),
-    closing(false)
+    nextTicket(0),
+    servingTicket(0)
 {
     file = AsyncFile::open(filename, true);
     if (file == NULL) {
         WriteErrorMessage("failed to open %s for write\n", filename);
         soft_exit(1);
     }
-    InitializeExclusiveLock(&lock);
 }
 
     DataWriter*
@@ -490,8 +515,18 @@ AsyncDataWriterSupplier::close()
     if (filterSupplier != NULL) {
         filterSupplier->onClosed(this);
     }
-    DestroyExclusiveLock(&lock);
 }
+
+//
+// Reserves space in the file for a batch, which every thread writing to it does once per batch, so it doesn't take a
+// lock.  When the two offsets are the same, or the encoder moves them separately (one of them is always 0), a fetch-add
+// on each is all it takes.  A filter that compresses on the writing thread moves both by different amounts, and they
+// have to be reserved together or a logical offset could end up paired with the wrong physical one, so each caller
+// takes a ticket with a fetch-add and waits for the one ahead of it, which is only ever a few instructions from done.
+// The wait backs off with more and more pauses between looks, and if the one ahead still isn't done it must have lost
+// its processor, so the waiter yields its own.  Serving the next ticket is a release store that the waiter's acquire
+// load pairs with, so the waiter sees the offsets the one ahead of it left.
+//
     void
 AsyncDataWriterSupplier::advance(
     size_t physical,
@@ -499,13 +534,46 @@ AsyncDataWriterSupplier::advance(
     size_t* o_physical,
     size_t* o_logical)
 {
-    AcquireExclusiveLock(&lock);
-    *o_physical = sharedOffset;
-    sharedOffset += physical;
-    *o_logical = sharedLogical;
-    sharedLogical += logical;
+    InterlockedAdd64AndReturnNewValue(&DataWriter::ReserveCount, 1);
+    switch (reserveMode) {
+    case SameOffsets:
+        _ASSERT(physical == logical);
+        *o_physical = *o_logical = InterlockedAdd64AndReturnNewValue(&sharedOffset, physical) - physical;
+        break;
+
+    case SeparateOffsets:
+        *o_physical = InterlockedAdd64AndReturnNewValue(&sharedOffset, physical) - physical;
+        *o_logical = InterlockedAdd64AndReturnNewValue(&sharedLogical, logical) - logical;
+        break;
+
+    case PairedOffsets:
+    {
+        const int MaxPauses = 64;
+        _int64 ticket = InterlockedAdd64AndReturnNewValue(&nextTicket, 1) - 1;
+        if (InterlockedLoad64Acquire(&servingTicket) != ticket) {
+            _int64 start = timeInNanos();
+            for (int pauses = 1; InterlockedLoad64Acquire(&servingTicket) != ticket; ) {
+                if (pauses <= MaxPauses) {
+                    for (int i = 0; i < pauses; i++) {
+                        SpinPause();
+                    }
+                    pauses *= 2;
+                } else {
+                    YieldThread();
+                }
+            }
+            InterlockedAdd64AndReturnNewValue(&DataWriter::ReserveWaits, 1);
+            InterlockedAdd64AndReturnNewValue(&DataWriter::ReserveWaitTime, timeInNanos() - start);
+        }
+        *o_physical = sharedOffset;
+        sharedOffset += physical;
+        *o_logical = sharedLogical;
+        sharedLogical += logical;
+        InterlockedStore64Release(&servingTicket, ticket + 1);
+        break;
+    }
+    }
     //fprintf(stderr, "advance %lld + %lld = %lld, logical %lld + %lld = %lld\n", *o_physical, physical, sharedOffset, *o_logical, logical, sharedLogical);
-    ReleaseExclusiveLock(&lock);
 }
 
     DataWriterSupplier*
@@ -588,8 +656,41 @@ DataWriter::FilterSupplier::compose(
     return new ComposeFilterSupplier(this, other);
 }
 
+    bool
+DataWriter::write(
+    const char* data,
+    GenomeDistance bytes,
+    GenomeLocation location)
+{
+    char* buffer;
+    size_t size;
+    if (! getBuffer(&buffer, &size) || size < (size_t) bytes) {
+        if (! (nextBatch() && getBuffer(&buffer, &size)) || size < (size_t) bytes) {
+            return false;
+        }
+    }
+    memcpy(buffer, data, bytes);
+    advance(bytes, location);
+    return true;
+}
+
 volatile _int64 DataWriter::WaitTime = 0;
 volatile _int64 DataWriter::FilterTime = 0;
+volatile _int64 DataWriter::EncodeWaitTime = 0;
+volatile _int64 DataWriter::ReserveCount = 0;
+volatile _int64 DataWriter::ReserveWaits = 0;
+volatile _int64 DataWriter::ReserveWaitTime = 0;
+
+    void
+DataWriter::getContention(
+    Contention* o_contention)
+{
+    o_contention->writeWaitTime = WaitTime;
+    o_contention->encodeWaitTime = EncodeWaitTime;
+    o_contention->reservations = ReserveCount;
+    o_contention->reserveWaits = ReserveWaits;
+    o_contention->reserveWaitTime = ReserveWaitTime;
+}
 
 
 StdoutAsyncFile::StdoutAsyncFile()
@@ -26,6 +26,7 @@ Revision History:
 #include "Read.h"
 #include "ParallelTask.h"
 #include "Genome.h"
+#include "VariableSizeVector.h"
 
 class DataWriterSupplier;
 
@@ -89,7 +90,7 @@ public:
 
     virtual ~DataWriter() {}
 
-	void inHeader(bool flag)
+	virtual void inHeader(bool flag)
 	{ if (filter != NULL) { filter->inHeader(flag); } }
 
     // get remaining space in current buffer for writing
@@ -110,9 +111,29 @@ public:
     // this thread is complete
     virtual void close() = 0;
 
+    // copy a read into the current buffer, or the next one if it doesn't fit
+    bool write(const char* data, GenomeDistance bytes, GenomeLocation location = 0);
+
     // nanosecond timers
     static volatile _int64 FilterTime;
     static volatile _int64 WaitTime;
+    static volatile _int64 EncodeWaitTime; // for the encoder to finish with the next batch
+
+    // file offset reservations, and how many had to wait for another thread's (and for how long)
+    static volatile _int64 ReserveCount;
+    static volatile _int64 ReserveWaits;
+    static volatile _int64 ReserveWaitTime;
+
+    // snapshot of the counters above, for the run summary
+    struct Contention
+    {
+        _int64 writeWaitTime;
+        _int64 encodeWaitTime;
+        _int64 reservations;
+        _int64 reserveWaits;
+        _int64 reserveWaitTime;
+    };
+    static void getContention(Contention* o_contention);
 
 protected:
     Filter* filter;
@@ -123,6 +144,79 @@ class Genome;
 class GzipWriterFilterSupplier;
 class FileEncoder;
 
+//
+// Sits between the merge of sorted output and the writer, seeing every read in order, and passes them on to the writer,
+// possibly after holding onto them for a while (e.g. duplicate marking, which has to see all the reads at a location).
+// Unlike a filter, it isn't tied to the writer's buffers.  A stage that needs to know about reads further on can ask for
+// a lookahead pass, where the whole merge goes through it once with a NULL writer before the real one.
+//
+class SortedStage
+{
+public:
+    virtual ~SortedStage() {}
+
+    // run the merge through onRead & onDone with a NULL writer first
+    virtual bool needsLookahead()
+    { return false; }
+
+    // next read from the merge, only valid until this returns
+    virtual bool onRead(DataWriter* writer, char* data, GenomeDistance bytes) = 0;
+
+    // all reads have been merged, write any that are being held
+    virtual bool onDone(DataWriter* writer) = 0;
+};
+
+//
+// Splits sorted output into a file per contig, or per interval of a list, for pipelines that go on to work on one region
+// at a time.  The merge hands each read to the shard its sort location is in (so an unmapped read goes with its mapped
+// mate), and what's left -- unmapped reads and, with intervals, reads outside all of them -- goes to a shard of its own.
+// Every shard gets a file, even if nothing lands in it.  The format supplies the writer for each file, which is where
+// the compression and index come from.
+//
+class SortedShards
+{
+public:
+    SortedShards() : restFileName(NULL) {}
+
+    virtual ~SortedShards();
+
+    // a shard for each contig, in a file named after fileName with the contig's name before its extension; false if
+    // two contigs' names come out the same (ignoring case) once they're made safe for a file name
+    bool addContigs(const Genome* genome, const char* fileName);
+
+    // a shard for each interval of a BED file, named for its contig & 1-based range; false if the file's no good
+    bool addIntervals(const Genome* genome, const char* fileName, const char* bedFileName);
+
+    // writer for one shard's file, and the filters it uses, which get deleted once it's closed
+    virtual DataWriterSupplier* createWriterSupplier(const char* fileName, DataWriter::FilterSupplier** o_filterSupplier) = 0;
+
+private:
+
+    friend class ShardedDataWriter;
+
+    struct Shard
+    {
+        Shard() : begin(0), end(0), fileName(NULL) {}
+        Shard(GenomeLocation i_begin, GenomeLocation i_end, char* i_fileName) : begin(i_begin), end(i_end), fileName(i_fileName) {}
+        GenomeLocation      begin;
+        GenomeLocation      end;
+        char*               fileName;
+
+        bool operator<(const Shard& other) const { return begin < other.begin; }
+    };
+
+    // fileName with name (made safe for a file name) before its extension
+    static char* shardFileName(const char* fileName, const char* name);
+
+    void addShard(GenomeLocation begin, GenomeLocation end, const char* fileName, const char* name);
+
+    // sort the shards and make sure they don't overlap or share a file name
+    bool finish(const char* fileName);
+
+    VariableSizeVector<Shard>   shards;
+    char*                       restFileName;
+};
+
 // creates writers for multiple threads
 class DataWriterSupplier
 {
@@ -144,20 +238,30 @@ public:
     static DataWriterSupplier* sorted(
         const FileFormat* format,
         const Genome* genome,
-        const char* tempFileName,
+        const char* tempFileName, // copied
         size_t tempBufferMemory,
         int numThreads,
         const char* sortedFileName,
         DataWriter::FilterSupplier* sortedFilterSupplier,
         size_t maxBufferSize,
-        FileEncoder* encoder = NULL);
+        FileEncoder* encoder = NULL,
+        SortedStage* sortedStage = NULL,
+        SortedShards* shards = NULL); // if not NULL, sortedFileName, sortedFilterSupplier & encoder aren't used
+
+    // routes the merged output of a sort to its shards
+    static DataWriterSupplier* sharded(const FileFormat* format, const Genome* genome, SortedShards* shards, size_t bufferSize);
 
     // defaults follow BAM output spec
     static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded);
 
-    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome);
+    // secondaries if there may be secondary alignments, which take their duplicate flag from their primary
+    static SortedStage* markDuplicates(const Genome* genome, bool secondaries);
+
+    // a .csi rather than a .bai if csi; numThreads work out the bins of each batch of reads
+    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier, bool csi, int numThreads);
 
-    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
+    // whether the genome has contigs too long for a .bai
+    static bool needsCsiIndex(const Genome* genome);
 };
 
 class AsyncDataWriter;
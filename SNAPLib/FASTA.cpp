@@ -158,6 +158,10 @@ ReadFASTAGenome(
                         WriteErrorMessage("\nFASTA file contained a character that's not a valid base (or N): '%c', full line '%s'; \nconverting to 'N'.  This may happen again, but there will be no more warnings.\n", lineBuffer[i], lineBuffer);
                         warningIssued = true;
                     }
+                    if (lineBuffer[i] > ' ' && lineBuffer[i] <= '~') {
+                        // Remember what it was, for the reference MD5s in CRAM output
+                        genome->addIUPACCode(genome->getCountOfBases() + i, lineBuffer[i]);
+                    }
                     lineBuffer[i] = 'N';
                 }
             }
@@ -34,9 +34,64 @@ Revision History:
 #include "exit.h"
 #include "Error.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FASTQ_USE_SSE2 1
+#endif
+
 using std::min;
 using util::strnchr;
 
+//
+// Looking for all of the newlines in a record at once lets us check 16 bytes per step rather than calling strnchr on each
+// line, which otherwise is most of the time spent parsing.  Like strnchr, it stops at a NUL, so a record with one in it
+// comes up short of newlines and is rejected.
+//
+// Records are still parsed one per getNextRead: ReadSupplierQueue checks each read's DataBatch as it goes into a
+// ReadQueueElement, holding new batches and stopping the element at BatchesPerElement, so a reader filling a whole
+// element itself would have to take that over for every format.
+//
+    unsigned
+FASTQReader::findNewlines(char *buffer, _int64 validBytes, char **newlines, unsigned nToFind)
+{
+    unsigned nFound = 0;
+    _int64 offset = 0;
+
+#if FASTQ_USE_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i nul = _mm_setzero_si128();
+    for (; offset + 16 <= validBytes; offset += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(buffer + offset));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, nul)));
+        while (0 != mask) {
+            unsigned long bit;
+            CountTrailingZeroes(mask, bit);
+            if (0 == buffer[offset + bit]) {
+                return nFound;
+            }
+            newlines[nFound] = buffer + offset + bit;
+            nFound++;
+            if (nFound == nToFind) {
+                return nFound;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif  // FASTQ_USE_SSE2
+
+    for (; offset < validBytes && 0 != buffer[offset]; offset++) {
+        if ('\n' == buffer[offset]) {
+            newlines[nFound] = buffer + offset;
+            nFound++;
+            if (nFound == nToFind) {
+                break;
+            }
+        }
+    }
+
+    return nFound;
+}
+
 FASTQReader::FASTQReader(
     DataReader* i_data,
     const ReaderContext& i_context)
@@ -62,7 +117,7 @@ FASTQReader::create(
     _int64 amountOfFileToProcess,
     const ReaderContext& context)
 {
-    DataReader* data = supplier->getDataReader(bufferCount, maxReadSizeInBytes, 0.0, 0);
+    DataReader* data = supplier->getDataReader(bufferCount, maxReadSizeInBytes(), 0.0, 0);
     FASTQReader* fastq = new FASTQReader(data, context);
     if (! fastq->init(fileName)) {
         WriteErrorMessage("Unable to initialize FASTQReader for file %s\n", fileName);
@@ -233,11 +288,14 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
     //
     char* lines[nLinesPerFastqQuery];
     unsigned lineLengths[nLinesPerFastqQuery];
+    char* newLines[nLinesPerFastqQuery];
     char* scan = buffer;
 
+    unsigned nNewLines = findNewlines(buffer, validBytes, newLines, nLinesPerFastqQuery);
+
     for (unsigned i = 0; i < nLinesPerFastqQuery; i++) {
 
-        char *newLine = strnchr(scan, '\n', validBytes - (scan - buffer));
+        char *newLine = i < nNewLines ? newLines[i] : NULL;
         if (NULL == newLine) {
             if (validBytes - (scan - buffer) == 1 && *scan == 0x1a && data->isEOF()) {
                 // sometimes DOS files will have extra ^Z at end
@@ -347,7 +405,7 @@ PairedInterleavedFASTQReader::PairedInterleavedFASTQReader(
 PairedInterleavedFASTQReader::create(DataSupplier* supplier, const char *fileName, int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess,
                                         const ReaderContext& context)
 {
-    DataReader* data = supplier->getDataReader(bufferCount, 2 * maxReadSizeInBytes, 0.0, 0); // 2* because we read in pairs
+    DataReader* data = supplier->getDataReader(bufferCount, 2 * maxReadSizeInBytes(), 0.0, 0); // 2* because we read in pairs
     PairedInterleavedFASTQReader* fastq = new PairedInterleavedFASTQReader(data, context);
     if (! fastq->init(fileName)) {
         WriteErrorMessage("Unable to initialize PairedInterleavedFASTQReader for file %s\n", fileName);
@@ -568,7 +626,7 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
             } else {
                 fileSize[i] = QueryFileSize(fileNames[i]);
                 if (gzip) {
-                    dataSupplier[i] = DataSupplier::GzipDefault;
+                    dataSupplier[i] = DataSupplier::DecompressDefaultForFile(fileNames[i]);
                 } else {
                     dataSupplier[i] = DataSupplier::Default;
                 }
@@ -618,7 +676,7 @@ FASTQReader::createReadSupplierGenerator(
                 fastq = FASTQReader::create(DataSupplier::Stdio, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, 0, context);
             }
         } else {
-            fastq = FASTQReader::create(DataSupplier::GzipDefault, fileName, ReadSupplierQueue::BufferCount(numThreads), 0, QueryFileSize(fileName), context);
+            fastq = FASTQReader::create(DataSupplier::DecompressDefaultForFile(fileName), fileName, ReadSupplierQueue::BufferCount(numThreads), 0, QueryFileSize(fileName), context);
         }
         if (fastq == NULL) {
             delete fastq;
@@ -649,7 +707,7 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
                 dataSupplier = DataSupplier::Stdio;
             }
         } else {
-            dataSupplier = DataSupplier::GzipDefault;
+            dataSupplier = DataSupplier::DecompressDefaultForFile(fileName);
         }
         
         PairedReadReader *reader = PairedInterleavedFASTQReader::create(dataSupplier, fileName,
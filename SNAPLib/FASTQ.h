@@ -68,14 +68,16 @@ public:
 
         static bool skipPartialRecord(DataReader *data);
 
+        // Find up to nToFind newlines in buffer, stopping at a NUL; returns the number found
+        static unsigned findNewlines(char *buffer, _int64 validBytes, char **newlines, unsigned nToFind);
+
 private:
 
-        static const int maxReadSizeInBytes = MAX_READ_LENGTH * 2 + 1000;    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
+        static int maxReadSizeInBytes() { return (int) MaxReadLength * 2 + 1000; }    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
 
         DataReader*         data;
         const char*         fileName;
 
-        static const unsigned maxLineLen = MAX_READ_LENGTH + 500;
         static const unsigned nLinesPerFastqQuery = 4;
 
         static bool isValidStartingCharacterForNextLine[nLinesPerFastqQuery][256];
@@ -123,7 +125,7 @@ public:
 
 private:
 
-    static const int maxReadSizeInBytes = MAX_READ_LENGTH * 2 + 1000;    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
+    static int maxReadSizeInBytes() { return (int) MaxReadLength * 2 + 1000; }    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
 
         DataReader*             data;
         const char*             fileName;
@@ -51,6 +51,10 @@ Genome::Genome(GenomeDistance i_maxBases, GenomeDistance nBasesStored, unsigned
     nContigs = 0;
     contigs = new Contig[maxContigs];
     contigsByName = NULL;
+
+    iupacCodes = NULL;
+    nIUPACCodes = maxIUPACCodes = 0;
+    iupacCodesKnown = true;     // Until loadFromFile says otherwise, every base that was added is what it says
 }
 
     void
@@ -120,6 +124,8 @@ Genome::~Genome()
     }
     contigs = NULL;
 
+    delete [] iupacCodes;
+
 	if (NULL != mappedFile) {
 		mappedFile->close();
 		delete mappedFile;
@@ -282,10 +288,131 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLoc
 	
 	genome->fillInContigLengths();
     genome->sortContigsByName();
+    genome->iupacCodesKnown = false;    // Until loadIUPACCodes finds them
     delete[] contigNameBuffer;
     return genome;
 }
 
+    void
+Genome::addIUPACCode(GenomeLocation location, char code)
+{
+    _ASSERT(nIUPACCodes == 0 || iupacCodes[nIUPACCodes - 1].location < location);
+    if (nIUPACCodes == maxIUPACCodes) {
+        int newMaxIUPACCodes = __max(32, maxIUPACCodes * 2);
+        IUPACCode *newIUPACCodes = new IUPACCode[newMaxIUPACCodes];
+        for (int i = 0; i < nIUPACCodes; i++) {
+            newIUPACCodes[i] = iupacCodes[i];
+        }
+        delete [] iupacCodes;
+        iupacCodes = newIUPACCodes;
+        maxIUPACCodes = newMaxIUPACCodes;
+    }
+    iupacCodes[nIUPACCodes].location = location;
+    iupacCodes[nIUPACCodes].code = code;
+    nIUPACCodes++;
+}
+
+    bool
+Genome::saveIUPACCodes(const char *fileName) const
+{
+    //
+    // The number of codes, then a line per code with its location and the code itself.  It's always written, even
+    // with no codes, so that loading it says the genome knows what all of its bases were.
+    //
+    FILE *saveFile = fopen(fileName, "w");
+    if (saveFile == NULL) {
+        WriteErrorMessage("Genome::saveIUPACCodes: unable to open file '%s'\n", fileName);
+        return false;
+    }
+
+    fprintf(saveFile, "%d\n", nIUPACCodes);
+    for (int i = 0; i < nIUPACCodes; i++) {
+        fprintf(saveFile, "%lld %c\n", GenomeLocationAsInt64(iupacCodes[i].location), iupacCodes[i].code);
+    }
+
+    bool worked = !ferror(saveFile);
+    fclose(saveFile);
+    if (!worked) {
+        WriteErrorMessage("Genome::saveIUPACCodes: write failed\n");
+    }
+    return worked;
+}
+
+    bool
+Genome::loadIUPACCodes(const char *fileName)
+{
+    FILE *loadFile = fopen(fileName, "r");
+    if (loadFile == NULL) {
+        return true;
+    }
+
+    int count;
+    if (1 != fscanf(loadFile, "%d", &count) || count < 0) {
+        WriteErrorMessage("Genome::loadIUPACCodes: unable to read header of '%s'\n", fileName);
+        fclose(loadFile);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        _int64 location;
+        char code;
+        if (2 != fscanf(loadFile, "%lld %c", &location, &code) || location < 0 || location >= nBases ||
+                (nIUPACCodes > 0 && iupacCodes[nIUPACCodes - 1].location >= location)) {
+            WriteErrorMessage("Genome::loadIUPACCodes: bad entry %d in '%s'\n", i, fileName);
+            fclose(loadFile);
+            return false;
+        }
+        addIUPACCode(location, code);
+    }
+
+    fclose(loadFile);
+    iupacCodesKnown = true;
+    return true;
+}
+
+    const Genome::IUPACCode *
+Genome::firstIUPACCodeAtOrAfter(GenomeLocation location) const
+{
+    int low = 0, high = nIUPACCodes;
+    while (low < high) {
+        int probe = (low + high) / 2;
+        if (iupacCodes[probe].location < location) {
+            low = probe + 1;
+        } else {
+            high = probe;
+        }
+    }
+    return iupacCodes + low;
+}
+
+    bool
+Genome::hasIUPACCodes(GenomeLocation location, GenomeDistance length) const
+{
+    if (!iupacCodesKnown) {
+        return memchr(getSubstring(location, 0), 'N', length) != NULL;
+    }
+    const IUPACCode *code = firstIUPACCodeAtOrAfter(location);
+    return code < iupacCodes + nIUPACCodes && code->location < location + length;
+}
+
+    bool
+Genome::getOriginalBases(GenomeLocation location, GenomeDistance length, char *buffer) const
+{
+    const char *data = getSubstring(location, 0);
+    for (GenomeDistance i = 0; i < length; i++) {
+        buffer[i] = toupper(data[i]);
+    }
+
+    if (!iupacCodesKnown) {
+        return memchr(data, 'N', length) == NULL;
+    }
+
+    for (const IUPACCode *code = firstIUPACCodeAtOrAfter(location); code < iupacCodes + nIUPACCodes && code->location < location + length; code++) {
+        buffer[code->location - location] = code->code;
+    }
+    return true;
+}
+
     bool
 contigComparator(
     const Genome::Contig& a,
@@ -364,7 +491,15 @@ Genome::getLocationOfContig(const char *contigName, GenomeLocation *location, in
                     *location = contigsByName[mid].beginningLocation;
                 }
                 if (index != NULL) {
-                    *index = mid;
+                    //
+                    // mid is in contigsByName, a sorted copy.  The index in contigs is for the one that starts here,
+                    // or an empty one before it that starts at the same place.
+                    //
+                    int i = getContigNumAtLocation(contigsByName[mid].beginningLocation);
+                    while (i > 0 && strcmp(contigs[i].name, contigName) != 0) {
+                        i--;
+                    }
+                    *index = i;
                 }
                 return true;
             } else if (c < 0) {
@@ -202,6 +202,27 @@ public:
 
         bool saveToFile(const char *fileName) const;
 
+        //
+        // The FASTA loader keeps IUPAC codes other than N as 'N' in the bases (and N as 'n').  It records the codes
+        // here, and they're saved alongside the genome, so that CRAM output can give the MD5 of the reference as the
+        // FASTA file had it.  Genomes loaded without them (from indices built before SNAP kept them) don't know what
+        // their 'N's were.
+        //
+        void addIUPACCode(GenomeLocation location, char code);
+        bool saveIUPACCodes(const char *fileName) const;
+        bool loadIUPACCodes(const char *fileName);  // A missing file isn't an error, just an older index
+
+        //
+        // Copies length bases from location into buffer in upper case, with the IUPAC codes as they were in the FASTA
+        // file.  Returns false if there was an IUPAC code there and the genome doesn't know what it was.
+        //
+        bool getOriginalBases(GenomeLocation location, GenomeDistance length, char *buffer) const;
+
+        //
+        // Whether any of these bases was an IUPAC code other than N.  getOriginalBases isn't needed if not.
+        //
+        bool hasIUPACCodes(GenomeLocation location, GenomeDistance length) const;
+
         //
         // Methods to read the genome.
         //
@@ -300,6 +321,18 @@ private:
         const unsigned chromosomePadding;
 
 		GenericFile_map *mappedFile;
+
+        struct IUPACCode {
+            GenomeLocation  location;
+            char            code;
+        };
+
+        IUPACCode   *iupacCodes;        // In location order
+        int          nIUPACCodes;
+        int          maxIUPACCodes;
+        bool         iupacCodesKnown;   // True if built from FASTA or loaded with the IUPAC codes file
+
+        const IUPACCode *firstIUPACCodeAtOrAfter(GenomeLocation location) const;
 };
 
 GenomeDistance DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB);
@@ -51,6 +51,7 @@ const char *GenomeIndexFileName = "GenomeIndex";
 const char *OverflowTableFileName = "OverflowTable";
 const char *GenomeIndexHashFileName = "GenomeIndexHash";
 const char *GenomeFileName = "Genome";
+const char *IUPACCodesFileName = "IUPACCodes";
 
 static void usage()
 {
@@ -282,7 +283,7 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         return false;
     }
 
-    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), strlen(GenomeFileName)))) + 1);
+    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), __max(strlen(GenomeFileName), strlen(IUPACCodesFileName))))) + 1);
     char *filenameBuffer = new char[filenameBufferSize];
     
 	fprintf(stderr,"Saving genome...");
@@ -292,6 +293,12 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save the genome itself\n");
         delete[] filenameBuffer;
         return false;
+    }
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IUPACCodesFileName);
+    if (!genome->saveIUPACCodes(filenameBuffer)) {
+        WriteErrorMessage("GenomeIndex::saveToDirectory: Failed to save the genome's IUPAC codes\n");
+        delete[] filenameBuffer;
+        return false;
     }
 	fprintf(stderr,"%llds\n", (timeInMillis() + 500 - start) / 1000);
 
@@ -1608,7 +1615,7 @@ GenomeIndex::printBiasTables()
         GenomeIndex *
 GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 {
-    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), strlen(GenomeFileName)))) + 1);
+    int filenameBufferSize = (int)(strlen(directoryName) + 1 + __max(strlen(GenomeIndexFileName), __max(strlen(OverflowTableFileName), __max(strlen(GenomeIndexHashFileName), __max(strlen(GenomeFileName), strlen(IUPACCodesFileName))))) + 1);
     char *filenameBuffer = new char[filenameBufferSize];
     
     snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeIndexFileName);
@@ -1830,12 +1837,22 @@ GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch)
 	}
 
     snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, GenomeFileName);
-    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map))) {
+    Genome *genome = (Genome *)Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, map);
+    if (NULL == genome) {
         WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
         delete[] filenameBuffer;
         delete index;
         return NULL;
     }
+    index->genome = genome;
+
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IUPACCodesFileName);
+    if (!genome->loadIUPACCodes(filenameBuffer)) {
+        WriteErrorMessage("GenomeIndex::loadFromDirectory: Failed to load the genome's IUPAC codes\n");
+        delete[] filenameBuffer;
+        delete index;
+        return NULL;
+    }
 
     if ((_int64)index->genome->getCountOfBases() + (_int64)index->overflowTableSize > 0xfffffff0 && locationSize == 4) {
         WriteErrorMessage("\nThis index has too many overflow entries to be valid.  Some early versions of SNAP\n"
@@ -0,0 +1,410 @@
+/*++
+
+Module Name:
+
+    GzipCodec.cpp
+
+Abstract:
+
+    Compressing and decompressing whole gzip members with zlib or a faster library.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+--*/
+
+#include "stdafx.h"
+#include "GzipCodec.h"
+#include "zlib.h"
+#ifdef SNAP_LIBDEFLATE
+#include "libdeflate.h"
+#endif
+#ifdef SNAP_ISAL
+#include <isa-l.h>
+#endif
+#include "exit.h"
+#include "Error.h"
+
+GzipCodec::Backend GzipCodec::DefaultBackend = GzipCodec::Zlib;
+
+static const char* BackendNames[GzipCodec::NumBackends] = {"zlib", "libdeflate", "isal"};
+
+static const size_t GzipHeaderSize = 10;
+static const size_t BgzfHeaderSize = 18;    // Plus the 6 byte BC extra field
+static const size_t GzipTrailerSize = 8;
+static const _uint8 GzipOsUnix = 3;         // What zlib writes on Unix when it's not given a header
+
+class ZlibGzipCodec : public GzipCodec
+{
+public:
+    ZlibGzipCodec(int level) : GzipCodec(Zlib, level), deflateReady(false), inflateReady(false) {
+        memset(&deflater, 0, sizeof(deflater));
+        memset(&inflater, 0, sizeof(inflater));
+    }
+
+    virtual ~ZlibGzipCodec() {
+        if (deflateReady) {
+            deflateEnd(&deflater);
+        }
+        if (inflateReady) {
+            inflateEnd(&inflater);
+        }
+    }
+
+protected:
+    virtual size_t compressRaw(const char* input, size_t inputSize, char* output, size_t outputSize);
+    virtual bool decompressRaw(const char* input, size_t inputSize, char* output, size_t outputSize, size_t* o_outputUsed);
+    virtual unsigned crc32(const char* data, size_t size) {
+        return (unsigned)::crc32(0, (const Bytef*)data, (uInt)size);
+    }
+
+private:
+    //
+    // Set up once and reset for each member, rather than allocating zlib's state every time.
+    //
+    z_stream    deflater;
+    bool        deflateReady;
+    z_stream    inflater;
+    bool        inflateReady;
+};
+
+    size_t
+ZlibGzipCodec::compressRaw(
+    const char* input,
+    size_t      inputSize,
+    char*       output,
+    size_t      outputSize)
+{
+    int status;
+    if (!deflateReady) {
+        status = deflateInit2(&deflater, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);     // negative window bits means raw deflate
+        if (status != Z_OK) {
+            WriteErrorMessage("GzipCodec: deflateInit2 failed with %d\n", status);
+            soft_exit(1);
+        }
+        deflateReady = true;
+    } else {
+        deflateReset(&deflater);
+    }
+
+    deflater.next_in = (Bytef*)input;
+    deflater.avail_in = (uInt)inputSize;
+    deflater.next_out = (Bytef*)output;
+    deflater.avail_out = (uInt)outputSize;
+    status = deflate(&deflater, Z_FINISH);
+    if (status != Z_STREAM_END) {
+        if (status != Z_OK && status != Z_BUF_ERROR) {
+            WriteErrorMessage("GzipCodec: deflate failed with %d\n", status);
+            soft_exit(1);
+        }
+        return 0;   // Out of space
+    }
+    return outputSize - deflater.avail_out;
+}
+
+    bool
+ZlibGzipCodec::decompressRaw(
+    const char* input,
+    size_t      inputSize,
+    char*       output,
+    size_t      outputSize,
+    size_t*     o_outputUsed)
+{
+    int status;
+    if (!inflateReady) {
+        status = inflateInit2(&inflater, -15);
+        if (status != Z_OK) {
+            WriteErrorMessage("GzipCodec: inflateInit2 failed with %d\n", status);
+            soft_exit(1);
+        }
+        inflateReady = true;
+    } else {
+        inflateReset(&inflater);
+    }
+
+    inflater.next_in = (Bytef*)input;
+    inflater.avail_in = (uInt)inputSize;
+    inflater.next_out = (Bytef*)output;
+    inflater.avail_out = (uInt)outputSize;
+    status = inflate(&inflater, Z_FINISH);
+    *o_outputUsed = outputSize - inflater.avail_out;
+    return status == Z_STREAM_END;
+}
+
+#ifdef SNAP_LIBDEFLATE
+class LibdeflateGzipCodec : public GzipCodec
+{
+public:
+    LibdeflateGzipCodec(int level) : GzipCodec(Libdeflate, level), compressor(NULL), decompressor(NULL) {}
+
+    virtual ~LibdeflateGzipCodec() {
+        if (NULL != compressor) {
+            libdeflate_free_compressor(compressor);
+        }
+        if (NULL != decompressor) {
+            libdeflate_free_decompressor(decompressor);
+        }
+    }
+
+protected:
+    virtual size_t compressRaw(const char* input, size_t inputSize, char* output, size_t outputSize) {
+        if (NULL == compressor) {
+            compressor = libdeflate_alloc_compressor(level);
+            if (NULL == compressor) {
+                WriteErrorMessage("GzipCodec: libdeflate_alloc_compressor failed\n");
+                soft_exit(1);
+            }
+        }
+        return libdeflate_deflate_compress(compressor, input, inputSize, output, outputSize);
+    }
+
+    virtual bool decompressRaw(const char* input, size_t inputSize, char* output, size_t outputSize, size_t* o_outputUsed) {
+        if (NULL == decompressor) {
+            decompressor = libdeflate_alloc_decompressor();
+            if (NULL == decompressor) {
+                WriteErrorMessage("GzipCodec: libdeflate_alloc_decompressor failed\n");
+                soft_exit(1);
+            }
+        }
+        return LIBDEFLATE_SUCCESS == libdeflate_deflate_decompress(decompressor, input, inputSize, output, outputSize, o_outputUsed);
+    }
+
+    virtual unsigned crc32(const char* data, size_t size) {
+        return libdeflate_crc32(0, data, size);
+    }
+
+private:
+    struct libdeflate_compressor   *compressor;
+    struct libdeflate_decompressor *decompressor;
+};
+#endif  // SNAP_LIBDEFLATE
+
+#ifdef SNAP_ISAL
+class IsalGzipCodec : public GzipCodec
+{
+public:
+    IsalGzipCodec(int level) : GzipCodec(Isal, level), levelBuffer(NULL) {}
+
+    virtual ~IsalGzipCodec() {
+        delete [] levelBuffer;
+    }
+
+protected:
+    virtual size_t compressRaw(const char* input, size_t inputSize, char* output, size_t outputSize) {
+        if (NULL == levelBuffer) {
+            levelBuffer = new _uint8[ISAL_DEF_LVL1_DEFAULT];
+        }
+        struct isal_zstream stream;
+        isal_deflate_stateless_init(&stream);
+        stream.level = 1;   // ISA-L's default; its levels don't line up with zlib's
+        stream.level_buf = levelBuffer;
+        stream.level_buf_size = ISAL_DEF_LVL1_DEFAULT;
+        stream.gzip_flag = IGZIP_DEFLATE;
+        stream.end_of_stream = 1;
+        stream.flush = NO_FLUSH;
+        stream.next_in = (_uint8*)input;
+        stream.avail_in = (_uint32)inputSize;
+        stream.next_out = (_uint8*)output;
+        stream.avail_out = (_uint32)outputSize;
+        if (COMP_OK != isal_deflate_stateless(&stream)) {
+            return 0;
+        }
+        return stream.total_out;
+    }
+
+    virtual bool decompressRaw(const char* input, size_t inputSize, char* output, size_t outputSize, size_t* o_outputUsed) {
+        struct inflate_state state;
+        isal_inflate_init(&state);
+        state.crc_flag = ISAL_DEFLATE;
+        state.next_in = (_uint8*)input;
+        state.avail_in = (_uint32)inputSize;
+        state.next_out = (_uint8*)output;
+        state.avail_out = (_uint32)outputSize;
+        int status = isal_inflate_stateless(&state);
+        *o_outputUsed = state.total_out;
+        return ISAL_DECOMP_OK == status;
+    }
+
+    virtual unsigned crc32(const char* data, size_t size) {
+        return crc32_gzip_refl(0, (const _uint8*)data, size);
+    }
+
+private:
+    _uint8     *levelBuffer;
+};
+#endif  // SNAP_ISAL
+
+    GzipCodec*
+GzipCodec::create(
+    Backend backend,
+    int level)
+{
+    switch (backend) {
+#ifdef SNAP_LIBDEFLATE
+    case Libdeflate:
+        return new LibdeflateGzipCodec(level);
+#endif
+#ifdef SNAP_ISAL
+    case Isal:
+        return new IsalGzipCodec(level);
+#endif
+    case Zlib:
+        return new ZlibGzipCodec(level);
+    default:
+        WriteErrorMessage("GzipCodec: %s support isn't compiled into this build\n", BackendName(backend));
+        soft_exit(1);
+        return NULL;
+    }
+}
+
+    bool
+GzipCodec::IsAvailable(
+    Backend backend)
+{
+    switch (backend) {
+    case Zlib:
+        return true;
+#ifdef SNAP_LIBDEFLATE
+    case Libdeflate:
+        return true;
+#endif
+#ifdef SNAP_ISAL
+    case Isal:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+    const char*
+GzipCodec::BackendName(
+    Backend backend)
+{
+    return backend >= 0 && backend < NumBackends ? BackendNames[backend] : "unknown";
+}
+
+    bool
+GzipCodec::ParseBackend(
+    const char* name,
+    Backend*    o_backend)
+{
+    for (int i = 0; i < NumBackends; i++) {
+        if (!_stricmp(name, BackendNames[i])) {
+            *o_backend = (Backend)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+    size_t
+GzipCodec::compressMember(
+    const char* input,
+    size_t      inputSize,
+    char*       output,
+    size_t      outputSize,
+    bool        bgzf)
+{
+    if (inputSize > 0xffffffff || outputSize > 0xffffffff) {
+        WriteErrorMessage("GzipCodec: inputSize or outputSize too big\n");
+        soft_exit(1);
+    }
+
+    //
+    // The same header that zlib writes: a BGZF header for deflateSetHeader() with a zero time and OS, or zlib's default one
+    // otherwise.  The extra flags are always 0; they're only a hint about the compression level.
+    //
+    size_t headerSize = bgzf ? BgzfHeaderSize : GzipHeaderSize;
+    if (outputSize < headerSize + GzipTrailerSize) {
+        return 0;
+    }
+    _uint8* header = (_uint8*)output;
+    memset(header, 0, headerSize);
+    header[0] = 0x1f;
+    header[1] = 0x8b;
+    header[2] = 8;      // Deflate
+    if (bgzf) {
+        header[3] = 4;  // FEXTRA
+        header[10] = 6; // XLEN
+        header[12] = 'B';
+        header[13] = 'C';
+        header[14] = 2; // SLEN; BSIZE goes in bytes 16 and 17 once we know it
+    } else {
+        header[9] = GzipOsUnix;
+    }
+
+    size_t compressedSize = compressRaw(input, inputSize, output + headerSize, outputSize - headerSize - GzipTrailerSize);
+    if (0 == compressedSize) {
+        return 0;
+    }
+
+    size_t memberSize = headerSize + compressedSize + GzipTrailerSize;
+    if (bgzf) {
+        if (memberSize > 0x10000) {
+            return 0;
+        }
+        header[16] = (_uint8)(memberSize - 1);
+        header[17] = (_uint8)((memberSize - 1) >> 8);
+    }
+
+    unsigned crc = crc32(input, inputSize);
+    _uint8* trailer = (_uint8*)output + headerSize + compressedSize;
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (_uint8)(crc >> (8 * i));
+        trailer[4 + i] = (_uint8)(inputSize >> (8 * i));
+    }
+    return memberSize;
+}
+
+    bool
+GzipCodec::decompressMember(
+    const char* input,
+    size_t      inputSize,
+    char*       output,
+    size_t      outputSize,
+    size_t*     o_outputUsed)
+{
+    const _uint8* member = (const _uint8*)input;
+    if (inputSize < GzipHeaderSize + GzipTrailerSize || member[0] != 0x1f || member[1] != 0x8b || member[2] != 8) {
+        return false;
+    }
+
+    _uint8 flags = member[3];
+    size_t headerSize = GzipHeaderSize;
+    if (flags & 4) {    // FEXTRA
+        headerSize += 2 + (member[10] | (member[11] << 8));
+    }
+    for (int field = 8; field <= 16; field <<= 1) {     // FNAME and FCOMMENT are NUL terminated
+        if (flags & field) {
+            while (headerSize < inputSize && member[headerSize] != 0) {
+                headerSize++;
+            }
+            headerSize++;
+        }
+    }
+    if (flags & 2) {    // FHCRC
+        headerSize += 2;
+    }
+    if (headerSize + GzipTrailerSize > inputSize) {
+        return false;
+    }
+
+    size_t outputUsed;
+    if (!decompressRaw(input + headerSize, inputSize - headerSize - GzipTrailerSize, output, outputSize, &outputUsed)) {
+        return false;
+    }
+
+    const _uint8* trailer = member + inputSize - GzipTrailerSize;
+    unsigned crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((unsigned)trailer[3] << 24);
+    unsigned isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((unsigned)trailer[7] << 24);
+    if (crc != crc32(output, outputUsed) || isize != (unsigned)outputUsed) {
+        return false;
+    }
+
+    *o_outputUsed = outputUsed;
+    return true;
+}
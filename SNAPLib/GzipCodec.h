@@ -0,0 +1,85 @@
+/*++
+
+Module Name:
+
+    GzipCodec.h
+
+Abstract:
+
+    Header for compressing and decompressing whole gzip members with zlib or a faster library.
+
+Environment:
+
+    User mode service.
+
+    A GzipCodec is NOT thread safe.  Each thread should create its own.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// BGZF blocks (and the chunks that GzipDataWriter compresses) are at most 64KB and are always compressed or decompressed
+// whole, which is the case that libraries like libdeflate and ISA-L are built for.  They're several times faster than zlib,
+// which has to be able to stop and restart anywhere in a stream.
+//
+// GzipCodec does the gzip framing itself and leaves only the raw deflate data to the backend, so the headers and trailers
+// are byte for byte the same whichever one is used.  The compressed data itself differs between backends, but any of them
+// can read what the others write.  zlib is always available.  The others are compiled in only when their library is (see
+// the Makefile), and the one to use is chosen at run time with -gzc.
+//
+class GzipCodec
+{
+public:
+    enum Backend {Zlib, Libdeflate, Isal, NumBackends};
+
+    //
+    // level is zlib's compression level (1-9).  libdeflate takes the same ones, and ISA-L always uses its own level 1.
+    //
+    static GzipCodec* create(Backend backend, int level = CompressionLevel);
+    static GzipCodec* create() {return create(DefaultBackend);}
+
+    virtual ~GzipCodec() {}
+
+    //
+    // Compress input into a single gzip member, with a BGZF extra field if bgzf is set.  Returns the size of the member, or 0
+    // if it doesn't fit in output (or, for BGZF, is bigger than 64KB).
+    //
+    size_t compressMember(const char* input, size_t inputSize, char* output, size_t outputSize, bool bgzf);
+
+    //
+    // Decompress a single gzip member that takes up all of input, checking its CRC and length.  Returns false if it's not
+    // valid or doesn't fit in output.
+    //
+    bool decompressMember(const char* input, size_t inputSize, char* output, size_t outputSize, size_t* o_outputUsed);
+
+    Backend getBackend() const {return backend;}
+
+    static bool IsAvailable(Backend backend);
+    static const char* BackendName(Backend backend);
+    static bool ParseBackend(const char* name, Backend* o_backend);
+
+    static Backend DefaultBackend;
+
+    static const int CompressionLevel = 6;     // zlib's default
+    static const int FastestLevel = 1;         // for data that's only kept for a little while, like sort temp files
+
+protected:
+    GzipCodec(Backend i_backend, int i_level) : level(i_level), backend(i_backend) {}
+
+    //
+    // Raw deflate data, with no header or trailer.  compressRaw returns 0 if the result doesn't fit.
+    //
+    virtual size_t compressRaw(const char* input, size_t inputSize, char* output, size_t outputSize) = 0;
+    virtual bool decompressRaw(const char* input, size_t inputSize, char* output, size_t outputSize, size_t* o_outputUsed) = 0;
+    virtual unsigned crc32(const char* data, size_t size) = 0;
+
+    const int level;
+
+private:
+    const Backend backend;
+};
@@ -18,6 +18,7 @@ Environment:
 
 #include "stdafx.h"
 #include "GzipDataWriter.h"
+#include "GzipCodec.h"
 #include "BigAlloc.h"
 #include "VariableSizeVector.h"
 #include "ParallelTask.h"
@@ -70,17 +71,16 @@ private:
 class GzipCompressWorker : public ParallelWorker
 {
 public:
-    GzipCompressWorker() : heap(NULL) {}
+    GzipCompressWorker() : codec(NULL) {}
 
-    virtual ~GzipCompressWorker() { delete heap; }
+    virtual ~GzipCompressWorker() { delete codec; }
 
     virtual void step();
 
-    static size_t compressChunk(z_stream& zstream, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+    static size_t compressChunk(GzipCodec* codec, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
 
 private:
-    z_stream zstream;
-    ThreadHeap* heap;
+    GzipCodec* codec;
 };
 
 // used for case where each thread compresses by itself
@@ -168,11 +168,8 @@ GzipCompressWorkerManager::finishStep()
 GzipCompressWorker::step()
 {
     GzipCompressWorkerManager* supplier = (GzipCompressWorkerManager*) getManager();
-    if (heap == NULL) {
-        heap = new ThreadHeap(supplier->chunkSize * 8); // appears to use 4*chunkSize per run
-        zstream.zalloc = zalloc;
-        zstream.zfree = zfree;
-        zstream.opaque = heap;
+    if (codec == NULL) {
+        codec = GzipCodec::create();
     }
     //fprintf(stderr, "zip task thread %d begin\n", GetCurrentThreadId());
     _int64 start = timeInMillis();
@@ -180,7 +177,7 @@ GzipCompressWorker::step()
     int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
     for (int i = begin; i < end; i++) {
         size_t bytes = min(supplier->chunkSize, supplier->inputUsed - i * supplier->chunkSize);
-        supplier->sizes[i] = compressChunk(zstream, supplier->bam,
+        supplier->sizes[i] = compressChunk(codec, supplier->bam,
             supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
             supplier->input + i * supplier->chunkSize, bytes);
         _ASSERT(supplier->sizes[i] <= supplier->chunkSize); // can't grow!
@@ -190,7 +187,7 @@ GzipCompressWorker::step()
 
     size_t
 GzipCompressWorker::compressChunk(
-    z_stream& zstream,
+    GzipCodec* codec,
     bool bamFormat,
     char* toBuffer,
     size_t toSize,
@@ -201,91 +198,16 @@ GzipCompressWorker::compressChunk(
         WriteErrorMessage("exceeded BAM chunk size\n");
         soft_exit(1);
     }
-    if (zstream.opaque != NULL) {
-        ((ThreadHeap*)zstream.opaque)->reset();
-    }
-    // set up BAM header structure
-    gz_header header;
-    _uint8 bamExtraData[6];
-    if (bamFormat) {
-        header.text = false;
-        header.time = 0;
-        header.xflags = 0;
-        header.os = 0;
-        header.extra = bamExtraData;
-        header.extra_len = 6;
-        header.extra_max = 6;
-        header.name = NULL;
-        header.name_max = 0;
-        header.comment = NULL;
-        header.comm_max = 0;
-        header.hcrc = false;
-        header.done = true;
-        bamExtraData[0] = 'B';
-        bamExtraData[1] = 'C';
-        bamExtraData[2] = 2;
-        bamExtraData[3] = 0;
-        bamExtraData[4] = 3; // will be filled in later
-        bamExtraData[5] = 7; // will be filled in later
-    }
 
-    if (fromUsed > 0xffffffff || toSize > 0xffffffff) {
-        WriteErrorMessage("GZipDataWriter: fromUsed or toSize too big\n");
-        soft_exit(1);
-    }
-
-    // based on sample code at http://www.lemoda.net/c/zlib-open-write/index.html
-    const int windowBits = 15;
-    const int GZIP_ENCODING = 16;
-    zstream.next_in = (Bytef*) fromBuffer;
-    zstream.avail_in = (uInt)fromUsed;
-    zstream.next_out = (Bytef*) toBuffer;
-    zstream.avail_out = (uInt)toSize;
-    uInt oldAvail;
-    int status;
-
-    status = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
-    if (status < 0) {
-        WriteErrorMessage("GzipWriterFilter: deflateInit2 failed with %d\n", status);
-        soft_exit(1);
-    }
-    if (bamFormat) {
-        status = deflateSetHeader(&zstream, &header);
-        if (status != Z_OK) {
-            WriteErrorMessage("GzipWriterFilter: defaultSetHeader failed with %d\n", status);
-            soft_exit(1);
-        }
-    }
-    oldAvail = zstream.avail_out;
-    status = deflate(&zstream, Z_FINISH);
-    if (status < 0 && status != Z_BUF_ERROR) {
-        WriteErrorMessage("GzipWriterFilter: deflate failed with %d\n", status);
-        soft_exit(1);
-    }
-
-    // make sure it all got written out in a single compressed block
-    if (zstream.avail_in != 0) {
-        WriteErrorMessage("GzipWriterFilter: default failed to read all input\n");
-        soft_exit(1);
-    }
-    if (zstream.avail_out == oldAvail) {
-        WriteErrorMessage("GzipWriterFilter: default failed to write output\n");
-        soft_exit(1);
-    }
-    status = deflateEnd(&zstream);
-    if (status < 0) {
-        WriteErrorMessage("GzipWriterFilter: deflateEnd failed with %d\n", status);
-        soft_exit(1);
-    }
-
-    size_t toUsed = toSize - zstream.avail_out;
-    if (bamFormat) {
-        // backpatch compressed block size into gzip header
-        if (toUsed >= BAM_BLOCK) {
+    // the codec writes the BAM header structure, including the compressed block size
+    size_t toUsed = codec->compressMember(fromBuffer, fromUsed, toBuffer, toSize, bamFormat);
+    if (toUsed == 0) {
+        if (bamFormat) {
             WriteErrorMessage("exceeded BAM chunk size\n");
-            soft_exit(1);
+        } else {
+            WriteErrorMessage("GzipWriterFilter: compressed chunk didn't fit in its buffer\n");
         }
-        * (_uint16*) (toBuffer + 16) = (_uint16) (toUsed - 1);
+        soft_exit(1);
     }
     return toUsed;
 }
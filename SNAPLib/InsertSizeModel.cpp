@@ -0,0 +1,224 @@
+/*++
+
+Module Name:
+
+    InsertSizeModel.cpp
+
+Abstract:
+
+    Insert size model that the paired-end aligner learns from the first pairs of a run.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+--*/
+
+#include "stdafx.h"
+#include "InsertSizeModel.h"
+#include "Error.h"
+
+const double InsertSizeDistribution::MinRelativeLikelihood = 0.001;
+
+const double InsertSizeModel::WindowStdDevs = 6.0;
+const double InsertSizeModel::WindowTailFraction = 0.001;
+const double InsertSizeModel::MinStdDev = 10.0;
+
+InsertSizeModel::InsertSizeModel(unsigned i_nPairsToLearnFrom, unsigned i_minSpacing, unsigned i_maxSpacing) :
+    nPairsToLearnFrom(__max(i_nPairsToLearnFrom, MinPairsToLearnFrom)), nPairsRecorded(0), minSpacing(i_minSpacing), maxSpacing(i_maxSpacing),
+    nReadGroups(0), learned(false)
+{
+    _ASSERT(minSpacing <= maxSpacing);
+    histogramSize = maxSpacing - minSpacing + 1;
+
+    allSamples.readGroup = NULL;
+    allSamples.histogram = new unsigned[histogramSize];
+    memset(allSamples.histogram, 0, histogramSize * sizeof(*allSamples.histogram));
+
+    InitializeExclusiveLock(&lock);
+}
+
+InsertSizeModel::~InsertSizeModel()
+{
+    delete [] allSamples.histogram;
+    for (int i = 0; i < nReadGroups; i++) {
+        delete [] readGroups[i].readGroup;
+        delete [] readGroups[i].histogram;
+    }
+
+    DestroyExclusiveLock(&lock);
+}
+
+    InsertSizeModel::ReadGroupSamples *
+InsertSizeModel::findOrAddReadGroup(const char *readGroup)
+{
+    if (NULL == readGroup) {
+        return NULL;
+    }
+
+    for (int i = 0; i < nReadGroups; i++) {
+        if (!strcmp(readGroups[i].readGroup, readGroup)) {
+            return &readGroups[i];
+        }
+    }
+
+    if (nReadGroups >= MaxReadGroups) {
+        return NULL;
+    }
+
+    ReadGroupSamples *samples = &readGroups[nReadGroups];
+    size_t readGroupLength = strlen(readGroup);
+    samples->readGroup = new char[readGroupLength + 1];
+    memcpy(samples->readGroup, readGroup, readGroupLength + 1);
+    samples->histogram = new unsigned[histogramSize];
+    memset(samples->histogram, 0, histogramSize * sizeof(*samples->histogram));
+
+    nReadGroups++;
+    return samples;
+}
+
+    void
+InsertSizeModel::recordPair(const char *readGroup, GenomeDistance spacing)
+{
+    if (learned || spacing < minSpacing || spacing > maxSpacing) {
+        return;
+    }
+
+    AcquireExclusiveLock(&lock);
+    if (learned) {
+        //
+        // Someone else finished learning while we were waiting for the lock.
+        //
+        ReleaseExclusiveLock(&lock);
+        return;
+    }
+
+    unsigned bucket = (unsigned)(spacing - minSpacing);
+    allSamples.histogram[bucket]++;
+
+    ReadGroupSamples *samples = findOrAddReadGroup(readGroup);
+    if (NULL != samples) {
+        samples->histogram[bucket]++;
+    }
+
+    nPairsRecorded++;
+    if (nPairsRecorded >= nPairsToLearnFrom) {
+        learn();
+        learned = true;
+    }
+
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+InsertSizeModel::estimateDistribution(ReadGroupSamples *samples)
+{
+    InsertSizeDistribution *distribution = &samples->distribution;
+    const unsigned *histogram = samples->histogram;
+
+    unsigned nSamples = 0;
+    for (unsigned i = 0; i < histogramSize; i++) {
+        nSamples += histogram[i];
+    }
+    distribution->nSamples = nSamples;
+
+    if (0 == nSamples) {
+        distribution->minSpacing = minSpacing;
+        distribution->maxSpacing = maxSpacing;
+        distribution->median = (minSpacing + maxSpacing) / 2.0;
+        distribution->stdDev = __max(MinStdDev, (double)(maxSpacing - minSpacing));
+        return;
+    }
+
+    //
+    // Find the median and the spacings that cut off WindowTailFraction of the samples on each end.
+    //
+    unsigned tailSamples = (unsigned)(nSamples * WindowTailFraction);
+    unsigned lowTail = 0, medianBucket = 0, highTail = 0;
+    bool foundLowTail = false, foundMedian = false, foundHighTail = false;
+    unsigned samplesSoFar = 0;
+    for (unsigned i = 0; i < histogramSize; i++) {
+        samplesSoFar += histogram[i];
+        if (!foundLowTail && samplesSoFar > tailSamples) {
+            lowTail = i;
+            foundLowTail = true;
+        }
+        if (!foundMedian && samplesSoFar >= (nSamples + 1) / 2) {
+            medianBucket = i;
+            foundMedian = true;
+        }
+        if (!foundHighTail && samplesSoFar >= nSamples - tailSamples) {
+            highTail = i;
+            foundHighTail = true;
+        }
+    }
+
+    //
+    // The median absolute deviation, from a histogram of distances from the median.
+    //
+    unsigned *deviations = new unsigned[histogramSize];
+    memset(deviations, 0, histogramSize * sizeof(*deviations));
+    for (unsigned i = 0; i < histogramSize; i++) {
+        deviations[i > medianBucket ? i - medianBucket : medianBucket - i] += histogram[i];
+    }
+
+    unsigned medianAbsoluteDeviation = 0;
+    samplesSoFar = 0;
+    for (unsigned i = 0; i < histogramSize; i++) {
+        samplesSoFar += deviations[i];
+        if (samplesSoFar >= (nSamples + 1) / 2) {
+            medianAbsoluteDeviation = i;
+            break;
+        }
+    }
+    delete [] deviations;
+
+    distribution->median = (double)(minSpacing + medianBucket);
+    distribution->stdDev = __max(MinStdDev, 1.4826 * medianAbsoluteDeviation);   // 1.4826 * MAD is the standard deviation of a normal distribution
+
+    double windowMin = __min((double)(minSpacing + lowTail), distribution->median - WindowStdDevs * distribution->stdDev);
+    double windowMax = __max((double)(minSpacing + highTail), distribution->median + WindowStdDevs * distribution->stdDev);
+
+    distribution->minSpacing = (unsigned)__max((double)minSpacing, windowMin);
+    distribution->maxSpacing = (unsigned)__min((double)maxSpacing, windowMax);
+}
+
+    void
+InsertSizeModel::learn()
+{
+    estimateDistribution(&allSamples);
+    WriteStatusMessage("Learned insert size from %u pairs: median %.0f, standard deviation %.1f, searching spacing %u-%u\n",
+        allSamples.distribution.nSamples, allSamples.distribution.median, allSamples.distribution.stdDev,
+        allSamples.distribution.minSpacing, allSamples.distribution.maxSpacing);
+
+    for (int i = 0; i < nReadGroups; i++) {
+        ReadGroupSamples *samples = &readGroups[i];
+        estimateDistribution(samples);
+
+        if (samples->distribution.nSamples < MinSamplesPerReadGroup) {
+            samples->distribution = allSamples.distribution;
+        } else if (nReadGroups > 1) {
+            WriteStatusMessage("    read group %s (%u pairs): median %.0f, standard deviation %.1f, searching spacing %u-%u\n",
+                samples->readGroup, samples->distribution.nSamples, samples->distribution.median, samples->distribution.stdDev,
+                samples->distribution.minSpacing, samples->distribution.maxSpacing);
+        }
+    }
+}
+
+    const InsertSizeDistribution *
+InsertSizeModel::getDistribution(const char *readGroup) const
+{
+    _ASSERT(learned);
+
+    if (NULL != readGroup) {
+        for (int i = 0; i < nReadGroups; i++) {
+            if (!strcmp(readGroups[i].readGroup, readGroup)) {
+                return &readGroups[i].distribution;
+            }
+        }
+    }
+
+    return &allSamples.distribution;
+}
@@ -0,0 +1,110 @@
+/*++
+
+Module Name:
+
+    InsertSizeModel.h
+
+Abstract:
+
+    Header for the insert size model that the paired-end aligner learns from the first pairs of a run.
+
+Environment:
+
+    User mode service.
+
+    recordPair() is thread safe.  Once isLearned() returns true the model never changes again, so
+    getDistribution() and the distributions it returns can be used from any thread without locking.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include <math.h>
+#include "Compat.h"
+#include "Genome.h"
+
+//
+// What the model knows about the spacing between the ends of one library.  "Spacing" is the same quantity that
+// -s bounds: the distance between the genome locations of the two ends of a pair.
+//
+struct InsertSizeDistribution {
+    unsigned    minSpacing;     // The window that the aligner should search, always within the -s window
+    unsigned    maxSpacing;
+    double      median;
+    double      stdDev;         // Estimated from the median absolute deviation, so outliers don't inflate it
+    unsigned    nSamples;
+
+    //
+    // How likely a pair with this spacing is relative to one at the median (so 1.0 at the median).  The aligner multiplies
+    // the pair probability by this, which is how the distribution affects MAPQ and the choice between equally scoring pairs.
+    //
+    double relativeLikelihood(GenomeDistance spacing) const {
+        double z = ((double)spacing - median) / stdDev;
+        return __max(MinRelativeLikelihood, exp(-0.5 * z * z));
+    }
+
+    static const double MinRelativeLikelihood;
+};
+
+//
+// The spacing window for the paired aligner is a command line parameter, and it has to be wide enough to cover any library
+// the user might throw at it.  Most libraries have a much tighter insert size distribution than the default window, and
+// the time in the intersecting aligner grows with the width of the window (there are more mate candidates to look at).
+//
+// InsertSizeModel collects the spacing of confidently aligned, concordant pairs until it has seen nPairsToLearnFrom of them,
+// and then estimates the distribution for each read group (libraries in different read groups can have very different
+// insert sizes).  Read groups that didn't get enough samples, or that show up only after learning, use the estimate from
+// all of the samples together.  The pairs that were aligned while learning aren't realigned.
+//
+class InsertSizeModel {
+public:
+    InsertSizeModel(unsigned i_nPairsToLearnFrom, unsigned i_minSpacing, unsigned i_maxSpacing);
+    ~InsertSizeModel();
+
+    //
+    // Record the spacing of a pair.  The caller should only pass in pairs that it's confident of.  Pairs that arrive after
+    // the model has been learned are ignored.
+    //
+    void recordPair(const char *readGroup, GenomeDistance spacing);
+
+    bool isLearned() const {return learned;}
+
+    //
+    // Only call this once isLearned() is true.  Never returns NULL.
+    //
+    const InsertSizeDistribution *getDistribution(const char *readGroup) const;
+
+    static const unsigned MinPairsToLearnFrom = 100;
+
+private:
+    struct ReadGroupSamples {
+        char                   *readGroup;      // NULL for the entry that holds all of the samples
+        unsigned               *histogram;      // Count of samples at each spacing from minSpacing to maxSpacing
+        InsertSizeDistribution  distribution;
+    };
+
+    ReadGroupSamples *findOrAddReadGroup(const char *readGroup);
+    void estimateDistribution(ReadGroupSamples *samples);
+    void learn();
+
+    static const int MaxReadGroups = 32;                // Any beyond this just contribute to the overall estimate
+    static const unsigned MinSamplesPerReadGroup = 100;
+    static const double WindowStdDevs;                  // Window extends at least this many standard deviations from the median
+    static const double WindowTailFraction;             // ...and covers all but this fraction of the samples on each side
+    static const double MinStdDev;
+
+    unsigned            nPairsToLearnFrom;
+    unsigned            nPairsRecorded;
+    unsigned            minSpacing;
+    unsigned            maxSpacing;
+    unsigned            histogramSize;
+
+    ReadGroupSamples    allSamples;
+    int                 nReadGroups;
+    ReadGroupSamples    readGroups[MaxReadGroups];
+
+    ExclusiveLock       lock;
+    volatile bool       learned;
+};
@@ -29,6 +29,11 @@ Revision History:
 #include "BigAlloc.h"
 #include "AlignerOptions.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HIT_SET_USE_SSE2
+#endif
+
 #ifdef  _DEBUG
 extern bool _DumpAlignments;    // From BaseAligner.cpp
 #endif  // _DEBUG
@@ -51,6 +56,7 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
         bool          noOrderedEvaluation_,
 		bool          noTruncation_) :
     index(index_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
+    constructorMinSpacing(minSpacing_), constructorMaxSpacing(maxSpacing_), insertSizeDistribution(NULL),
 	landauVishkin(NULL), reverseLandauVishkin(NULL), maxBigHits(maxBigHits_), seedCoverage(seedCoverage_),
     extraSearchDepth(extraSearchDepth_), nLocationsScored(0), noUkkonen(noUkkonen_), noOrderedEvaluation(noOrderedEvaluation_), noTruncation(noTruncation_), 
     maxSecondaryAlignmentsPerContig(maxSecondaryAlignmentsPerContig_)
@@ -236,8 +242,7 @@ IntersectingPairedEndAligner::align(
         }
 
         if (readLen[whichRead] > maxReadSize) {
-            WriteErrorMessage("IntersectingPairedEndAligner:: got too big read (%d > %d)\n"
-                              "Change MAX_READ_LENTH at the beginning of Read.h and recompile.\n", readLen[whichRead], maxReadSize);
+            WriteErrorMessage("IntersectingPairedEndAligner:: got too big read (%d > %d)\n", readLen[whichRead], maxReadSize);
             soft_exit(1);
         }
 
@@ -653,6 +658,11 @@ IntersectingPairedEndAligner::align(
 
                     if (mate->score != -1) {
                         double pairProbability = mate->matchProbability * fewerEndMatchProbability;
+                        if (NULL != insertSizeDistribution) {
+                            _int64 spacing = GenomeLocationAsInt64(mate->readWithMoreHitsGenomeLocation + mate->genomeOffset) -
+                                GenomeLocationAsInt64(candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset);
+                            pairProbability *= insertSizeDistribution->relativeLikelihood(spacing < 0 ? -spacing : spacing);
+                        }
                         unsigned pairScore = mate->score + fewerEndScore;
                         //
                         // See if this should be ignored as a merge, or if we need to back out a previously scored location
@@ -1043,7 +1053,7 @@ IntersectingPairedEndAligner::scoreLocation(
             *score = score1 + score2;
             _ASSERT(*score <= scoreLimit);
             // Map probabilities for substrings can be multiplied, but make sure to count seed too
-            *matchProbability = matchProb1 * matchProb2 * pow(1 - SNP_PROB, seedLen);
+            *matchProbability = matchProb1 * matchProb2 * lv_perfectMatchProbability[seedLen];
         }
     }
 
@@ -1180,6 +1190,101 @@ IntersectingPairedEndAligner::HashTableHitSet::computeBestPossibleScoreForCurren
 	return bestPossibleScoreSoFar;
 }
 
+//
+// Helpers for getNextHitLessThanOrEqualTo, public so that they can be tested.  Hit lists are sorted from largest to smallest, and each lookup's
+// currentHitForIntersection only ever moves forward, so what we want is the first hit at or after the current one that's
+// <= the target.  How far that is depends on the ratio of the sizes of the two reads' hit sets: when this set has many more
+// hits than the one driving the intersection, it's usually far ahead; when they're about the same size, it's usually
+// within a few hits.  Galloping (probing 1, 2, 4, 8... ahead and then binary searching the last interval) costs
+// O(log distance) either way, rather than O(log nHits) for a binary search over the whole remaining list.  Once the
+// interval is small, a linear scan (four hits at a time with SSE2 for 32 bit indices) beats more binary search steps.
+//
+static const _int64 HitScanLimit = 16;
+
+    template<class GL> _int64
+IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(const GL *hits, _int64 first, _int64 limit, GenomeLocation target)
+{
+    for (; first < limit; first++) {
+        if (hits[first] <= target) {
+            return first;
+        }
+    }
+    return limit;
+}
+
+    template<> _int64
+IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo<unsigned>(const unsigned *hits, _int64 first, _int64 limit, GenomeLocation genomeLocationTarget)
+{
+    _int64 target = GenomeLocationAsInt64(genomeLocationTarget);
+    if (target < 0) {
+        return limit;
+    }
+    if (target >= 0xffffffff) {
+        return first;
+    }
+
+#ifdef HIT_SET_USE_SSE2
+    //
+    // SSE2 only has signed compares, so flip the high bits of both sides to get an unsigned one.
+    //
+    const __m128i bias = _mm_set1_epi32(0x80000000);
+    const __m128i biasedTarget = _mm_set1_epi32((int)((unsigned)target ^ 0x80000000));
+    for (; first + 4 <= limit; first += 4) {
+        __m128i biasedHits = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(hits + first)), bias);
+        if (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(biasedHits, biasedTarget))) != 0xf) {
+            break;  // At least one of these four is <= target; the scalar loop finds which
+        }
+    }
+#endif // HIT_SET_USE_SSE2
+
+    for (; first < limit; first++) {
+        if (hits[first] <= target) {
+            return first;
+        }
+    }
+    return limit;
+}
+
+    template<class GL> _int64
+IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(const GL *hits, _int64 first, _int64 nHits, GenomeLocation target)
+{
+    if (nHits - first <= HitScanLimit) {
+        return scanForHitLessThanOrEqualTo(hits, first, nHits, target);
+    }
+
+    if (hits[first] <= target) {
+        return first;
+    }
+
+    //
+    // Gallop.  Invariant: everything before low is > target, and hits[high] (if high < nHits) is <= target.
+    //
+    _int64 low = first + 1;
+    _int64 step = 1;
+    _int64 high = first + step;
+    while (high < nHits && hits[high] > target) {
+        low = high + 1;
+        step *= 2;
+        high = first + step;
+    }
+    high = __min(high, nHits);
+
+    while (high - low > HitScanLimit) {
+        _int64 probe = (low + high) / 2;
+        if (hits[probe] > target) {
+            low = probe + 1;
+        } else {
+            high = probe;
+        }
+    }
+
+    return scanForHitLessThanOrEqualTo(hits, low, high, target);
+}
+
+template _int64 IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo<unsigned>(const unsigned *hits, _int64 first, _int64 nHits, GenomeLocation target);
+template _int64 IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo<GenomeLocation>(const GenomeLocation *hits, _int64 first, _int64 nHits, GenomeLocation target);
+template _int64 IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo<GenomeLocation>(const GenomeLocation *hits, _int64 first, _int64 limit, GenomeLocation target);
+
 	bool
 IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(GenomeLocation maxGenomeLocationToFind, GenomeLocation *actualGenomeLocationFound, unsigned *seedOffsetFound)
 {
@@ -1187,82 +1292,33 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(Genom
     bool anyFound = false;
     GenomeLocation bestLocationFound = 0;
     for (unsigned i = 0; i < nLookupsUsed; i++) {
-        //
-        // Binary search from the current starting offset to either the right place or the end.
-        //
-        _int64 limit[2];
-        GenomeLocation maxGenomeLocationToFindThisSeed;
+        GenomeLocation hitFound;
+        unsigned seedOffset;
 
         if (doesGenomeIndexHave64BitLocations) {
-            limit[0] = (_int64)lookups64[i].currentHitForIntersection;
-            limit[1] = (_int64)lookups64[i].nHits - 1;
-            maxGenomeLocationToFindThisSeed = maxGenomeLocationToFind + lookups64[i].seedOffset;
-        } else {
-            limit[0] = (_int64)lookups32[i].currentHitForIntersection;
-            limit[1] = (_int64)lookups32[i].nHits - 1;
-            maxGenomeLocationToFindThisSeed = maxGenomeLocationToFind + lookups32[i].seedOffset;
-        }
- 
-        while (limit[0] <= limit[1]) {
-            _int64 probe = (limit[0] + limit[1]) / 2;
-            if (doAlignerPrefetch) { // not clear this helps.  We're probably not far enough ahead.
-                if (doesGenomeIndexHave64BitLocations) {
-                    _mm_prefetch((const char *)&lookups64[i].hits[(limit[0] + probe) / 2 - 1], _MM_HINT_T2);
-                    _mm_prefetch((const char *)&lookups64[i].hits[(limit[1] + probe) / 2 + 1], _MM_HINT_T2);
-                } else {
-                    _mm_prefetch((const char *)&lookups32[i].hits[(limit[0] + probe) / 2 - 1], _MM_HINT_T2);
-                    _mm_prefetch((const char *)&lookups32[i].hits[(limit[1] + probe) / 2 + 1], _MM_HINT_T2);
-                }
-            }
-            //
-            // Recall that the hit sets are sorted from largest to smallest, so the strange looking logic is actually right.
-            // We're evaluating the expression "lookups[i].hits[probe] <= maxGenomeOffsetToFindThisSeed && (probe == 0 || lookups[i].hits[probe-1] > maxGenomeOffsetToFindThisSeed)"
-            // It's written in this strange way just so the profile tool will show us where the time's going.
-            //
-            GenomeLocation probeHit;
-            GenomeLocation probeMinusOneHit;
-            unsigned seedOffset;
-            if (doesGenomeIndexHave64BitLocations) {
-                probeHit = lookups64[i].hits[probe];
-                probeMinusOneHit = lookups64[i].hits[probe-1];
-                seedOffset = lookups64[i].seedOffset;
-            } else {
-                probeHit = lookups32[i].hits[probe];
-                probeMinusOneHit = lookups32[i].hits[probe-1];
-                seedOffset = lookups32[i].seedOffset;
-            }
-            unsigned clause1 =  probeHit <= maxGenomeLocationToFindThisSeed;
-            unsigned clause2 = probe == 0;
-
-            if (clause1 && (clause2 || probeMinusOneHit > maxGenomeLocationToFindThisSeed)) {
-                if (probeHit - seedOffset > bestLocationFound) {
-					anyFound = true;
-                    mostRecentLocationReturned = *actualGenomeLocationFound = bestLocationFound = probeHit - seedOffset;
-                    *seedOffsetFound = seedOffset;
-                }
-
-                if (doesGenomeIndexHave64BitLocations) {
-                    lookups64[i].currentHitForIntersection = probe;
-                } else {
-                    lookups32[i].currentHitForIntersection = probe;
-                }
-                break;
+            HashTableLookup<GenomeLocation> *lookup = &lookups64[i];
+            lookup->currentHitForIntersection = findFirstHitLessThanOrEqualTo(lookup->hits, lookup->currentHitForIntersection, lookup->nHits,
+                maxGenomeLocationToFind + lookup->seedOffset);
+            if (lookup->currentHitForIntersection == lookup->nHits) {
+                continue;   // We're done with this lookup.
             }
-
-            if (probeHit > maxGenomeLocationToFindThisSeed) {   // Recode this without the if to avoid the hard-to-predict branch.
-                limit[0] = probe + 1;
-            } else {
-                limit[1] = probe - 1;
+            hitFound = lookup->hits[lookup->currentHitForIntersection];
+            seedOffset = lookup->seedOffset;
+        } else {
+            HashTableLookup<unsigned> *lookup = &lookups32[i];
+            lookup->currentHitForIntersection = findFirstHitLessThanOrEqualTo(lookup->hits, lookup->currentHitForIntersection, lookup->nHits,
+                maxGenomeLocationToFind + lookup->seedOffset);
+            if (lookup->currentHitForIntersection == lookup->nHits) {
+                continue;   // We're done with this lookup.
             }
-        } // While we're looking
+            hitFound = lookup->hits[lookup->currentHitForIntersection];
+            seedOffset = lookup->seedOffset;
+        }
 
-        if (limit[0] > limit[1]) {
-            // We're done with this lookup.
-            if (doesGenomeIndexHave64BitLocations) {
-                lookups64[i].currentHitForIntersection = lookups64[i].nHits;    
-            } else {
-                lookups32[i].currentHitForIntersection = lookups32[i].nHits;
-            }
+        if (hitFound - seedOffset > bestLocationFound) {
+            anyFound = true;
+            mostRecentLocationReturned = *actualGenomeLocationFound = bestLocationFound = hitFound - seedOffset;
+            *seedOffsetFound = seedOffset;
         }
     } // For each lookup
 
@@ -28,6 +28,7 @@ Revision History:
 #include "directions.h"
 #include "LandauVishkin.h"
 #include "FixedSizeMap.h"
+#include "InsertSizeModel.h"
 
 const unsigned DEFAULT_INTERSECTING_ALIGNER_MAX_HITS = 2000;
 const unsigned DEFAULT_MAX_CANDIDATE_POOL_SIZE = 1000000;
@@ -77,6 +78,19 @@ public:
         reverseLandauVishkin = reverseLandauVishkin_;
     }
     
+    //
+    // Narrow the spacing window for subsequent calls to align(), and (if distribution isn't NULL) weight the probability of each
+    // pair by how likely its spacing is.  The window must lie within the one passed to the constructor, because that's what the
+    // candidate pools were sized for.
+    //
+    void setSpacing(unsigned minSpacing_, unsigned maxSpacing_, const InsertSizeDistribution *distribution_)
+    {
+        _ASSERT(minSpacing_ >= constructorMinSpacing && maxSpacing_ <= constructorMaxSpacing && minSpacing_ <= maxSpacing_);
+        minSpacing = minSpacing_;
+        maxSpacing = maxSpacing_;
+        insertSizeDistribution = distribution_;
+    }
+
     virtual ~IntersectingPairedEndAligner();
     
     virtual void align(
@@ -108,6 +122,14 @@ public:
          return nLocationsScored;
      }
 
+    //
+    // The index of the first hit at or after first that's <= target, in a list of nHits hits sorted from largest to
+    // smallest, or nHits if there isn't one.  scanForHitLessThanOrEqualTo does the same for hits up to limit by looking
+    // at each in turn; findFirstHitLessThanOrEqualTo gallops and then uses it for the last few.
+    //
+    template<class GL> static _int64 findFirstHitLessThanOrEqualTo(const GL *hits, _int64 first, _int64 nHits, GenomeLocation target);
+    template<class GL> static _int64 scanForHitLessThanOrEqualTo(const GL *hits, _int64 first, _int64 limit, GenomeLocation target);
+
 
 private:
 
@@ -132,6 +154,9 @@ private:
     static const unsigned MAX_MAX_SEEDS = 30;
     unsigned        minSpacing;
     unsigned        maxSpacing;
+    unsigned        constructorMinSpacing;
+    unsigned        constructorMaxSpacing;
+    const InsertSizeDistribution *insertSizeDistribution;  // NULL unless we're using a learned insert size model
     unsigned        seedLen;
     bool            doesGenomeIndexHave64BitLocations;
     _int64          nLocationsScored;
@@ -474,3 +499,5 @@ private:
     int maxSecondaryAlignmentsPerContig;
     _int64 contigCountEpoch;
 };
+
+template<> _int64 IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo<unsigned>(const unsigned *hits, _int64 first, _int64 limit, GenomeLocation target);
@@ -5,6 +5,8 @@
 #include "Read.h"
 #include "BaseAligner.h"
 #include "Bam.h"
+#include "AffineGap.h"
+#include "SAMEmitter.h"
 #include "exit.h"
 #include "Error.h"
 
@@ -12,7 +14,7 @@ using std::make_pair;
 using std::min;
 
  
-LandauVishkinWithCigar::LandauVishkinWithCigar()
+LandauVishkinWithCigar::LandauVishkinWithCigar() : affineGap(NULL)
 {
     for (int i = 0; i < MAX_K+1; i++) {
         for (int j = 0; j < 2*MAX_K+1; j++) {
@@ -49,11 +51,15 @@ bool writeCigar(char** o_buf, int* o_buflen, int count, char code, CigarFormat f
             *(*o_buf - 1) = '\0';
             return false;
         }
-        int written = snprintf(*o_buf, *o_buflen, "%d%c", count, code);
+        char digits[SAMEmitter::MaxDigits];
+        int written = SAMEmitter::FormatUnsigned(digits, count) + 1;
         if (written > *o_buflen - 1) {
-            *o_buf = '\0';
+            **o_buf = '\0';
             return false;
         } else {
+            memcpy(*o_buf, digits, written - 1);
+            (*o_buf)[written - 1] = code;
+            (*o_buf)[written] = '\0';
             *o_buf += written;
             *o_buflen -= written;
             return true;
@@ -521,6 +527,12 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
     int bamBufUsed, textUsed;
     int score = computeEditDistance(text, (int)textLen, pattern, (int)patternLen, k, bamBuf, bamBufLen,
         useM, BAM_CIGAR_OPS, &bamBufUsed, &textUsed, o_netIndel);
+    if (-1 == score && patternLen > ChunkLength) {
+        int bamOpsUsed;
+        score = computeEditDistanceInChunks(text, (int)textLen, pattern, (int)patternLen, k, (_uint32 *)bamBuf, bamBufLen / sizeof(_uint32),
+            useM, &bamOpsUsed, &textUsed, o_netIndel);
+        bamBufUsed = bamOpsUsed * sizeof(_uint32);
+    }
     if (score < 0) {
         return score;
     }
@@ -528,6 +540,39 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
     _uint32* bamOps = (_uint32*)bamBuf;
     int bamOpCount = bamBufUsed / sizeof(_uint32);
 
+    if (NULL != affineGap && score > 0 && score < MAX_K) {
+        //
+        // LV minimizes edit distance, which splits long indels and doesn't care where it puts them.  If this
+        // alignment has any indels, realign it with affine gap penalties.  If that fails (or wants to start or end
+        // with an indel) we just keep the LV version.
+        //
+        bool hasIndels = false;
+        for (int i = 0; i < bamOpCount; i++) {
+            char c = BAMAlignment::CodeToCigar[BAMAlignment::GetCigarOpCode(bamOps[i])];
+            if (c == 'I' || c == 'D') {
+                hasIndels = true;
+                break;
+            }
+        }
+
+        if (hasIndels) {
+            _uint32 *affineOps = (_uint32 *)alloca(bamBufLen);
+            int affineOpCount, affineTextUsed, affineNetIndel;
+            int affineScore = affineGap->computeCigarOps(text, textLen, pattern, patternLen, __min(MAX_K - 1, score + 8), useM,
+                affineOps, bamBufLen / sizeof(_uint32), &affineOpCount, &affineTextUsed, &affineNetIndel);
+            if (affineScore >= 0) {
+                bamOps = affineOps;
+                bamOpCount = affineOpCount;
+                bamBufUsed = affineOpCount * sizeof(_uint32);
+                textUsed = affineTextUsed;
+                score = affineScore;
+                if (NULL != o_netIndel) {
+                    *o_netIndel = affineNetIndel;
+                }
+            }
+        }
+    }
+
 #if  0 // Not sure this is necessary, and it seems to cause problems with the new LV that won't put indels at the end
 	bool hasIndels = false;
     for (int i = 0; i < bamOpCount; i++) {
@@ -647,6 +692,66 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
     return score;
 }
 
+    int
+LandauVishkinWithCigar::computeEditDistanceInChunks(
+    const char* text, int textLen,
+    const char* pattern, int patternLen,
+    int k,
+    _uint32 *bamOps, int maxBamOps, bool useM,
+    int *o_bamOpsUsed,
+    int *o_textUsed,
+    int *o_netIndel)
+{
+    int patternOffset = 0;
+    int textOffset = 0;
+    int score = 0;
+    int bamOpsUsed = 0;
+    int netIndel = 0;
+
+    while (patternOffset < patternLen) {
+        int chunkLen = patternLen - patternOffset;
+        if (chunkLen > ChunkLength) {
+            //
+            // Split what's left evenly rather than leaving a tiny last chunk, which wouldn't have much to align against.
+            //
+            chunkLen = chunkLen < 2 * ChunkLength ? chunkLen / 2 : ChunkLength;
+        }
+
+        int chunkBufUsed, chunkTextUsed, chunkNetIndel;
+        int chunkScore = computeEditDistance(text + textOffset, textLen - textOffset, pattern + patternOffset, chunkLen, k,
+            (char *)(bamOps + bamOpsUsed), (maxBamOps - bamOpsUsed) * sizeof(_uint32), useM, BAM_CIGAR_OPS, &chunkBufUsed, &chunkTextUsed, &chunkNetIndel);
+        if (chunkScore < 0) {
+            return chunkScore;
+        }
+
+        //
+        // Merge the first op of this chunk into the last op of the previous one if they're the same kind.
+        //
+        int chunkOps = chunkBufUsed / sizeof(_uint32);
+        if (bamOpsUsed > 0 && chunkOps > 0 && BAMAlignment::GetCigarOpCode(bamOps[bamOpsUsed - 1]) == BAMAlignment::GetCigarOpCode(bamOps[bamOpsUsed])) {
+            int count = BAMAlignment::GetCigarOpCount(bamOps[bamOpsUsed - 1]) + BAMAlignment::GetCigarOpCount(bamOps[bamOpsUsed]);
+            bamOps[bamOpsUsed - 1] = (count << 4) | BAMAlignment::GetCigarOpCode(bamOps[bamOpsUsed]);
+            memmove(bamOps + bamOpsUsed, bamOps + bamOpsUsed + 1, (chunkOps - 1) * sizeof(_uint32));
+            chunkOps--;
+        }
+
+        bamOpsUsed += chunkOps;
+        score += chunkScore;
+        netIndel += chunkNetIndel;
+        patternOffset += chunkLen;
+        textOffset += chunkTextUsed;
+    }
+
+    *o_bamOpsUsed = bamOpsUsed;
+    if (NULL != o_textUsed) {
+        *o_textUsed = textOffset;
+    }
+    if (NULL != o_netIndel) {
+        *o_netIndel = netIndel;
+    }
+    return score;
+}
+
     int
 LandauVishkinWithCigar::linearizeCompactBinary(
     _uint16* o_linear,
@@ -752,9 +857,9 @@ initializeLVProbabilitiesToPhredPlus33()
     }
 
     _ASSERT(NULL == lv_perfectMatchProbability);
-    lv_perfectMatchProbability = new double[MaxReadLength+1];
+    lv_perfectMatchProbability = new double[MAX_READ_LENGTH+1];
     lv_perfectMatchProbability[0] = 1.0;
-    for (unsigned i = 1; i <= MaxReadLength; i++) {
+    for (unsigned i = 1; i <= MAX_READ_LENGTH; i++) {
         lv_perfectMatchProbability[i] = lv_perfectMatchProbability[i - 1] * (1 - SNP_PROB);
     }
 
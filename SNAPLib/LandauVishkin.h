@@ -464,10 +464,18 @@ enum LinearCigarFlags
     CigarDelete      = 0x05,    // delete
 };
 
+class AffineGapWithCigar;
+
 class LandauVishkinWithCigar {
 public:
     LandauVishkinWithCigar();
 
+    //
+    // If set, computeEditDistanceNormalized realigns any result containing indels with affine gap penalties (see AffineGap.h),
+    // which gives longer, left-normalized indels.  The caller owns the realigner, which must be used by only one thread.
+    //
+    void setAffineGapRealigner(AffineGapWithCigar *i_affineGap) {affineGap = i_affineGap;}
+
     // Compute the edit distance between two strings and write the CIGAR string in cigarBuf.
     // Returns -1 if the edit distance exceeds k or -2 if we run out of space in cigarBuf.
     int computeEditDistance(const char* text, int textLen, const char* pattern, int patternLen, int k,
@@ -494,6 +502,18 @@ public:
 
     static void printLinear(char* buffer, int bufferSize, unsigned variant);
 private:
+    AffineGapWithCigar *affineGap;
+
+    //
+    // computeEditDistance can't find more than MAX_K edits, which isn't enough for long reads.  If it fails on a long
+    // pattern, computeEditDistanceNormalized aligns the pattern ChunkLength bases at a time instead, each chunk starting
+    // where the previous one ended in the text, and concatenates the results.  Only each chunk is limited to k edits.
+    //
+    static const int ChunkLength = 4 * MAX_K;
+
+    int computeEditDistanceInChunks(const char* text, int textLen, const char* pattern, int patternLen, int k,
+                            _uint32 *bamOps, int maxBamOps, bool useM, int *o_bamOpsUsed, int *o_textUsed, int *o_netIndel);
+
     int L[MAX_K+1][2 * MAX_K + 1];
     
     // Action we did to get to each position: 'D' = deletion, 'I' = insertion, 'X' = substitution.
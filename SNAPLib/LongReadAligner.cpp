@@ -0,0 +1,527 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.cpp
+
+Abstract:
+
+    Chained-seed aligner for long and high error rate reads.  See LongReadAligner.h for the approach.
+
+Environment:
+
+    User mode service.
+
+    This class is NOT thread safe.  It's the caller's responsibility to ensure that
+    at most one thread uses an instance at any time.
+
+Revision History:
+
+--*/
+
+#include "stdafx.h"
+#include "LongReadAligner.h"
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "Seed.h"
+#include "Util.h"
+#include "AlignerOptions.h"
+#include "Error.h"
+
+using std::min;
+using std::max;
+
+const double LongReadAligner::DefaultMaxEditDistanceFraction = 0.15;
+
+LongReadAligner::LongReadAligner(
+    GenomeIndex    *i_genomeIndex,
+    unsigned        i_maxHitsToConsider,
+    unsigned        i_maxReadSize,
+    double          i_maxEditDistanceFraction) :
+        genomeIndex(i_genomeIndex), maxHitsToConsider(i_maxHitsToConsider), maxReadSize(i_maxReadSize),
+        maxEditDistanceFraction(i_maxEditDistanceFraction), nHashTableLookups(0)
+/*++
+
+Routine Description:
+
+    Constructor for the LongReadAligner class.
+
+Arguments:
+
+    i_genomeIndex               - The index against which to do the alignments
+    i_maxHitsToConsider         - The maximum number of hits to use from a seed lookup.  Seeds with more hits (or more than
+                                  MaxHitsPerSeed) are ignored.
+    i_maxReadSize               - The read length to size the buffers for.  They grow if a longer read comes along.
+    i_maxEditDistanceFraction   - The largest edit distance to accept, as a fraction of the read length.
+
+--*/
+{
+    genome = genomeIndex->getGenome();
+    seedLen = genomeIndex->getSeedLength();
+    doesGenomeIndexHave64BitLocations = genomeIndex->doesGenomeIndexHave64BitLocations();
+
+    //
+    // Overlapping the seeds by half gives twice as many chances for an error-free seed, which matters a lot more
+    // than the extra lookups at high error rates.
+    //
+    seedSpacing = __max(1u, seedLen / 2);
+
+    allocateReadBuffers();
+    bandRows = (int *)BigAlloc(sizeof(int) * BandedEditDistanceRowBufferSize(MaxChainIndel, GapBandSlack));
+
+    for (unsigned i = 0; i < 256; i++) {
+        rcTranslationTable[i] = 'N';
+    }
+    rcTranslationTable['A'] = 'T';
+    rcTranslationTable['G'] = 'C';
+    rcTranslationTable['C'] = 'G';
+    rcTranslationTable['T'] = 'A';
+}
+
+LongReadAligner::~LongReadAligner()
+{
+    freeReadBuffers();
+    BigDealloc(bandRows);
+}
+
+    void
+LongReadAligner::allocateReadBuffers()
+{
+    unsigned maxSeeds = maxReadSize / seedSpacing + 1;
+    maxAnchorsPerDirection = maxSeeds * __min(maxHitsToConsider, MaxHitsPerSeed);
+
+    for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+        anchors[direction] = (Anchor *)BigAlloc(sizeof(Anchor) * maxAnchorsPerDirection);
+        reversedRead[direction] = (char *)BigAlloc(maxReadSize);
+        nAnchors[direction] = 0;
+    }
+
+    chain = (int *)BigAlloc(sizeof(int) * (maxSeeds + 1));
+    rcReadData = (char *)BigAlloc(maxReadSize);
+    rcReadQuality = (char *)BigAlloc(maxReadSize);
+}
+
+    void
+LongReadAligner::freeReadBuffers()
+{
+    for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+        BigDealloc(anchors[direction]);
+        BigDealloc(reversedRead[direction]);
+    }
+    BigDealloc(chain);
+    BigDealloc(rcReadData);
+    BigDealloc(rcReadQuality);
+}
+
+    void
+LongReadAligner::AlignRead(
+    Read                    *read,
+    SingleAlignmentResult   *result)
+{
+    result->location = InvalidGenomeLocation;
+    result->direction = FORWARD;
+    result->score = 0;
+    result->mapq = 0;
+    result->status = NotFound;
+
+    unsigned readLen = read->getDataLength();
+    if (readLen < seedLen) {
+        return;
+    }
+
+    if (readLen > maxReadSize) {
+        //
+        // Grow by at least half, so a run of ever so slightly longer reads doesn't reallocate every time.
+        //
+        freeReadBuffers();
+        maxReadSize = __max(readLen, maxReadSize + maxReadSize / 2);
+        allocateReadBuffers();
+    }
+
+    int maxEditDistance = getMaxEditDistance(readLen);
+
+    const char *data = read->getData();
+    const char *quality = read->getQuality();
+    unsigned countOfNs = 0;
+    for (unsigned i = 0; i < readLen; i++) {
+        char complement = rcTranslationTable[data[i]];
+        rcReadData[readLen - i - 1] = complement;
+        rcReadQuality[readLen - i - 1] = quality[i];
+        reversedRead[FORWARD][readLen - i - 1] = data[i];
+        reversedRead[RC][i] = complement;
+        countOfNs += 'N' == data[i];
+    }
+
+    if ((int)countOfNs > maxEditDistance) {
+        return;
+    }
+
+    readData[FORWARD] = data;
+    readData[RC] = rcReadData;
+    readQuality[FORWARD] = quality;
+    readQuality[RC] = rcReadQuality;
+
+    //
+    // Look up the seeds and turn the hits into anchors.
+    //
+    nAnchors[FORWARD] = nAnchors[RC] = 0;
+    unsigned hitLimit = __min(maxHitsToConsider, MaxHitsPerSeed);
+
+    for (unsigned offset = 0; offset + seedLen <= readLen; offset += seedSpacing) {
+        if (!Seed::DoesTextRepresentASeed(data + offset, seedLen)) {
+            continue;
+        }
+
+        Seed seed(data + offset, seedLen);
+
+        _int64 nHits[NUM_DIRECTIONS];
+        const GenomeLocation *hits[NUM_DIRECTIONS];
+        const unsigned *hits32[NUM_DIRECTIONS];
+        GenomeLocation singletonHits[NUM_DIRECTIONS];
+
+        if (doesGenomeIndexHave64BitLocations) {
+            genomeIndex->lookupSeed(seed, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &singletonHits[FORWARD], &singletonHits[RC]);
+        } else {
+            genomeIndex->lookupSeed32(seed, &nHits[FORWARD], &hits32[FORWARD], &nHits[RC], &hits32[RC]);
+        }
+        nHashTableLookups++;
+
+        for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+            if (nHits[direction] == 0 || nHits[direction] > hitLimit) {
+                continue;
+            }
+
+            //
+            // The RC seed is at offset readLen - seedLen - offset in the RC read (see the explanation in BaseAligner::AlignRead).
+            //
+            unsigned readOffset = (FORWARD == direction) ? offset : readLen - seedLen - offset;
+
+            for (unsigned i = 0; i < nHits[direction] && nAnchors[direction] < maxAnchorsPerDirection; i++) {
+                Anchor *anchor = &anchors[direction][nAnchors[direction]];
+                anchor->genomeLocation = doesGenomeIndexHave64BitLocations ? GenomeLocationAsInt64(hits[direction][i]) : hits32[direction][i];
+                anchor->readOffset = readOffset;
+                nAnchors[direction]++;
+            }
+        }
+    }
+
+    int bestAnchor[NUM_DIRECTIONS];
+    for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+        bestAnchor[direction] = chainAnchors(direction);
+    }
+
+    Direction bestDirection;
+    if (-1 == bestAnchor[FORWARD] && -1 == bestAnchor[RC]) {
+        return;
+    } else if (-1 == bestAnchor[RC]) {
+        bestDirection = FORWARD;
+    } else if (-1 == bestAnchor[FORWARD]) {
+        bestDirection = RC;
+    } else {
+        bestDirection = anchors[FORWARD][bestAnchor[FORWARD]].chainScore >= anchors[RC][bestAnchor[RC]].chainScore ? FORWARD : RC;
+    }
+
+    GenomeLocation location;
+    int anchorsInChain;
+    int editDistance = scoreChain(bestDirection, bestAnchor[bestDirection], readLen, maxEditDistance, &location, &anchorsInChain);
+    if (-1 == editDistance) {
+        return;
+    }
+
+    //
+    // The second best chain is the best one that ends anywhere the best chain couldn't have reached.  It's used for MAPQ.
+    //
+    int bestChainScore = anchors[bestDirection][bestAnchor[bestDirection]].chainScore;
+    int secondBestChainScore = 0;
+    _int64 bestChainStart = GenomeLocationAsInt64(location) - readLen;
+    _int64 bestChainEnd = GenomeLocationAsInt64(location) + 2 * readLen;
+    for (Direction direction = 0; direction < NUM_DIRECTIONS; direction++) {
+        for (unsigned i = 0; i < nAnchors[direction]; i++) {
+            const Anchor *anchor = &anchors[direction][i];
+            if (direction != bestDirection || anchor->genomeLocation < bestChainStart || anchor->genomeLocation > bestChainEnd) {
+                secondBestChainScore = __max(secondBestChainScore, anchor->chainScore);
+            }
+        }
+    }
+
+    //
+    // MAPQ from the ratio of the best two chain scores, discounted for chains with only a few anchors (this is the
+    // approach minimap2 uses).  SNAP's MAPQ tops out at 70, but there's no real probability model behind this one, so
+    // it stops at 60.
+    //
+    double mapq = 40.0 * (1.0 - (double)secondBestChainScore / bestChainScore) * __min(1.0, anchorsInChain / 10.0) * log((double)bestChainScore);
+
+    result->location = location;
+    result->direction = bestDirection;
+    result->score = editDistance;
+    result->mapq = __max(0, __min(60, (int)mapq));
+    result->status = result->mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+}
+
+    int
+LongReadAligner::compareAnchors(const void *first, const void *second)
+{
+    const Anchor *a = (const Anchor *)first;
+    const Anchor *b = (const Anchor *)second;
+
+    if (a->genomeLocation != b->genomeLocation) {
+        return a->genomeLocation < b->genomeLocation ? -1 : 1;
+    }
+
+    if (a->readOffset != b->readOffset) {
+        return a->readOffset < b->readOffset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+    int
+LongReadAligner::chainAnchors(Direction direction)
+{
+    Anchor *a = anchors[direction];
+    int n = (int)nAnchors[direction];
+    if (0 == n) {
+        return -1;
+    }
+
+    qsort(a, n, sizeof(Anchor), compareAnchors);
+
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        a[i].chainScore = seedLen;
+        a[i].predecessor = -1;
+
+        for (int j = i - 1; j >= 0 && j >= i - MaxChainLookback; j--) {
+            _int64 genomeDistance = a[i].genomeLocation - a[j].genomeLocation;
+            if (genomeDistance > MaxChainGap) {
+                break;  // They're sorted by genome location, so everything else is even farther away
+            }
+
+            int readDistance = (int)a[i].readOffset - (int)a[j].readOffset;
+            if (readDistance <= 0 || genomeDistance <= 0) {
+                continue;
+            }
+
+            int gapDifference = abs(readDistance - (int)genomeDistance);
+            if (gapDifference > MaxChainIndel) {
+                continue;
+            }
+
+            //
+            // Consecutive anchors on the same diagonal cost nothing.  Otherwise, charge roughly linearly in the size
+            // of the implied indel, plus a log term so that one big indel is better than several small ones.
+            //
+            int matchedBases = __min(__min(readDistance, (int)genomeDistance), (int)seedLen);
+            int gapCost = 0 == gapDifference ? 0 : (gapDifference * seedLen) / 100 + cheezyLogBase2(gapDifference) / 2 + 1;
+            int score = a[j].chainScore + matchedBases - gapCost;
+
+            if (score > a[i].chainScore) {
+                a[i].chainScore = score;
+                a[i].predecessor = j;
+            }
+        }
+
+        if (-1 == best || a[i].chainScore > a[best].chainScore) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+    int
+LongReadAligner::scoreChain(
+    Direction       direction,
+    int             lastAnchor,
+    unsigned        readLen,
+    int             maxEditDistance,
+    GenomeLocation *o_location,
+    int            *o_anchorsInChain)
+{
+    const Anchor *a = anchors[direction];
+    const char *data = readData[direction];
+
+    int n = 0;
+    for (int i = lastAnchor; -1 != i; i = a[i].predecessor) {
+        chain[n++] = i;
+    }
+    for (int i = 0; i < n / 2; i++) {
+        int temp = chain[i];
+        chain[i] = chain[n - i - 1];
+        chain[n - i - 1] = temp;
+    }
+    *o_anchorsInChain = n;
+
+    int editDistance = 0;
+    double matchProbability;
+
+    //
+    // The part of the read before the first anchor.  Run LV backward from the anchor, which lets the start of the
+    // alignment move to absorb indels.  If that fails (it's limited to MAX_K), fall back to the banded aligner without
+    // moving the start.
+    //
+    const Anchor *first = &a[chain[0]];
+    unsigned headLen = first->readOffset;
+    _int64 startLocation = first->genomeLocation - headLen;
+    if (headLen > 0) {
+        int score = -1;
+        _int64 textLen = __min((_int64)headLen + MAX_K, first->genomeLocation);
+        const char *text = genome->getSubstring(first->genomeLocation - textLen, textLen);
+        if (NULL != text) {
+            int netIndel;
+            score = reverseLandauVishkin.computeEditDistance(text + textLen, (int)textLen, reversedRead[direction] + readLen - headLen,
+                readQuality[OppositeDirection(direction)] + readLen - headLen, headLen, __min(MAX_K - 1, maxEditDistance), &matchProbability, &netIndel);
+            if (-1 != score) {
+                startLocation += netIndel;
+            }
+        }
+
+        if (-1 == score) {
+            text = genome->getSubstring(startLocation, headLen);
+            if (NULL == text) {
+                return -1;
+            }
+            score = BandedEditDistance(text, headLen, data, headLen, GapBandSlack, maxEditDistance, bandRows);
+            if (-1 == score) {
+                return -1;
+            }
+        }
+        editDistance += score;
+    }
+
+    //
+    // The gaps between anchors.  Consecutive anchors can overlap (in the read, the genome or both), in which case we
+    // only take as much of the earlier one as fits.
+    //
+    for (int i = 1; i < n; i++) {
+        const Anchor *previous = &a[chain[i - 1]];
+        const Anchor *current = &a[chain[i]];
+
+        int readDistance = (int)(current->readOffset - previous->readOffset);
+        int genomeDistance = (int)(current->genomeLocation - previous->genomeLocation);
+        int used = __min(__min(readDistance, genomeDistance), (int)seedLen);
+        int readGapLen = readDistance - used;
+        int genomeGapLen = genomeDistance - used;
+
+        if (0 == readGapLen || 0 == genomeGapLen) {
+            editDistance += readGapLen + genomeGapLen;
+        } else {
+            const char *text = genome->getSubstring(previous->genomeLocation + used, genomeGapLen);
+            if (NULL == text) {
+                return -1;
+            }
+            int score = BandedEditDistance(text, genomeGapLen, data + previous->readOffset + used, readGapLen, GapBandSlack,
+                maxEditDistance - editDistance, bandRows);
+            if (-1 == score) {
+                return -1;
+            }
+            editDistance += score;
+        }
+
+        if (editDistance > maxEditDistance) {
+            return -1;
+        }
+    }
+
+    //
+    // The part of the read after the last anchor, which is just like BaseAligner's tail.
+    //
+    const Anchor *last = &a[chain[n - 1]];
+    unsigned tailStart = last->readOffset + seedLen;
+    unsigned tailLen = readLen - tailStart;
+    _int64 tailLocation = last->genomeLocation + seedLen;
+    if (tailLen > 0) {
+        int score = -1;
+        const char *text = genome->getSubstring(tailLocation, tailLen + MAX_K);
+        if (NULL != text) {
+            score = landauVishkin.computeEditDistance(text, tailLen + MAX_K, data + tailStart, readQuality[direction] + tailStart, tailLen,
+                __min(MAX_K - 1, maxEditDistance - editDistance), &matchProbability);
+        }
+
+        if (-1 == score) {
+            text = genome->getSubstring(tailLocation, tailLen);
+            if (NULL == text) {
+                return -1;
+            }
+            score = BandedEditDistance(text, tailLen, data + tailStart, tailLen, GapBandSlack, maxEditDistance - editDistance, bandRows);
+            if (-1 == score) {
+                return -1;
+            }
+        }
+        editDistance += score;
+    }
+
+    if (editDistance > maxEditDistance) {
+        return -1;
+    }
+
+    //
+    // Don't return alignments that span contigs.
+    //
+    if (startLocation < 0 || genome->getContigAtLocation(startLocation) != genome->getContigAtLocation(tailLocation + tailLen - 1)) {
+        return -1;
+    }
+
+    *o_location = startLocation;
+    return editDistance;
+}
+
+    int
+BandedEditDistance(
+    const char     *text,
+    int             textLen,
+    const char     *pattern,
+    int             patternLen,
+    int             bandSlack,
+    int             limit,
+    int            *rowBuffer)
+{
+    const int Infinity = 0x3fffffff;
+
+    //
+    // Cell k of row i is the distance between the first i bases of the pattern and the first i + minDiagonal + k bases of
+    // the text.  Each row has one extra cell on the right so the insertion term can always read k + 1.
+    //
+    int minDiagonal = __min(0, textLen - patternLen) - bandSlack;
+    int maxDiagonal = __max(0, textLen - patternLen) + bandSlack;
+    int width = maxDiagonal - minDiagonal + 1;
+
+    int *previous = rowBuffer;
+    int *current = rowBuffer + width + 1;
+
+    for (int k = 0; k < width; k++) {
+        int j = minDiagonal + k;
+        previous[k] = (j >= 0 && j <= textLen) ? j : Infinity;
+    }
+    previous[width] = current[width] = Infinity;
+
+    for (int i = 1; i <= patternLen; i++) {
+        int rowMin = Infinity;
+        for (int k = 0; k < width; k++) {
+            int j = i + minDiagonal + k;
+            int value = Infinity;
+            if (j >= 0 && j <= textLen) {
+                if (j > 0) {
+                    value = previous[k] + (pattern[i - 1] != text[j - 1]);  // Match or substitution, from (i-1, j-1)
+                    if (k > 0) {
+                        value = __min(value, current[k - 1] + 1);            // Deletion, from (i, j-1)
+                    }
+                }
+                value = __min(value, previous[k + 1] + 1);                  // Insertion, from (i-1, j)
+            }
+            current[k] = __min(value, Infinity);
+            rowMin = __min(rowMin, current[k]);
+        }
+
+        if (rowMin > limit) {
+            return -1;
+        }
+
+        int *temp = previous;
+        previous = current;
+        current = temp;
+    }
+
+    int result = previous[textLen - patternLen - minDiagonal];
+    return result > limit ? -1 : result;
+}
@@ -0,0 +1,148 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.h
+
+Abstract:
+
+    Header for the chained-seed aligner used for long and high error rate reads.
+
+Environment:
+
+    User mode service.
+
+    This class is NOT thread safe.  It's the caller's responsibility to ensure that
+    at most one thread uses an instance at any time.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "AlignmentResult.h"
+#include "LandauVishkin.h"
+#include "GenomeIndex.h"
+#include "BigAlloc.h"
+#include "Read.h"
+#include "directions.h"
+
+//
+// BaseAligner scores every candidate with Landau-Vishkin, which is bounded by MAX_K edits for the whole read.
+// That's fine for short reads, but a long read (or a short one with lots of errors) can have far more edits
+// than that and still be placed confidently.
+//
+// LongReadAligner looks up seeds spaced along the read, turns each hit into an anchor (an exact match of
+// seedLen bases at a read offset and genome location), and chains the anchors co-linearly with a DP that
+// rewards matched bases and penalizes the difference in read and genome distance between consecutive anchors.
+// The gaps between the anchors of the best chain are filled with a banded global edit distance, and the
+// unanchored ends of the read with Landau-Vishkin, so the total edit distance isn't limited by MAX_K.
+//
+class LongReadAligner {
+public:
+    LongReadAligner(
+        GenomeIndex    *i_genomeIndex,
+        unsigned        i_maxHitsToConsider,
+        unsigned        i_maxReadSize,
+        double          i_maxEditDistanceFraction);
+
+    ~LongReadAligner();
+
+    //
+    // Align a read, filling in result.  The score is the total edit distance.  There are never any secondary
+    // results from this aligner.
+    //
+        void
+    AlignRead(
+        Read                    *read,
+        SingleAlignmentResult   *result);
+
+    int getMaxEditDistance(unsigned readLength) const {return (int)(readLength * maxEditDistanceFraction);}
+
+    _int64 getNHashTableLookups() const {return nHashTableLookups;}
+
+    static const double DefaultMaxEditDistanceFraction;
+
+    void *operator new(size_t size) {return BigAlloc(size);}
+    void operator delete(void *ptr) {BigDealloc(ptr);}
+
+private:
+    struct Anchor {
+        _int64      genomeLocation; // Where the seed starts in the genome
+        unsigned    readOffset;     // Where the seed starts in the read (in the direction's read, i.e., RC for RC anchors)
+        int         chainScore;     // Best score of any chain ending in this anchor
+        int         predecessor;    // Previous anchor in that chain, or -1
+    };
+
+    static int compareAnchors(const void *first, const void *second);
+
+    //
+    // The buffers whose size depends on the read length, which are reallocated for longer reads.
+    //
+    void allocateReadBuffers();
+    void freeReadBuffers();
+
+    //
+    // Chain anchors[direction], returning the index of the anchor that ends the best chain (or -1 if there are no anchors).
+    //
+    int chainAnchors(Direction direction);
+
+    //
+    // Compute the edit distance and starting location for the chain ending in anchor lastAnchor.  Returns -1 if it exceeds
+    // maxEditDistance.
+    //
+    int scoreChain(Direction direction, int lastAnchor, unsigned readLen, int maxEditDistance, GenomeLocation *o_location, int *o_anchorsInChain);
+
+    const Genome       *genome;
+    GenomeIndex        *genomeIndex;
+    unsigned            seedLen;
+    unsigned            seedSpacing;
+    unsigned            maxHitsToConsider;
+    unsigned            maxReadSize;
+    double              maxEditDistanceFraction;
+    bool                doesGenomeIndexHave64BitLocations;
+
+    //
+    // Parameters for chaining.  Anchors farther apart than MaxChainGap in the genome are never chained, nor are anchors
+    // whose read and genome distances differ by more than MaxChainIndel.  Each anchor looks back at most MaxChainLookback
+    // anchors for a predecessor, which keeps the DP linear in practice.
+    //
+    static const int MaxChainGap = 5000;
+    static const int MaxChainIndel = 400;
+    static const int MaxChainLookback = 50;
+    static const unsigned MaxHitsPerSeed = 16;  // More popular seeds than this are repeats, and just slow down chaining
+    static const int GapBandSlack = 16;         // Extra diagonals on each side of the band when filling gaps
+
+    unsigned maxAnchorsPerDirection;
+    unsigned nAnchors[NUM_DIRECTIONS];
+    Anchor *anchors[NUM_DIRECTIONS];
+
+    int *chain;         // Indices into anchors of the best chain, in read order
+    int *bandRows;      // Scratch for BandedEditDistance
+
+    const char *readData[NUM_DIRECTIONS];   // The read in each direction, for the current call to AlignRead
+    const char *readQuality[NUM_DIRECTIONS];
+    char *rcReadData;
+    char *rcReadQuality;
+    char *reversedRead[NUM_DIRECTIONS];
+
+    LandauVishkin<1> landauVishkin;
+    LandauVishkin<-1> reverseLandauVishkin;
+
+    char rcTranslationTable[256];
+
+    _int64 nHashTableLookups;
+};
+
+//
+// Global edit distance between text and pattern (both ends of both strings are aligned), restricted to the diagonals
+// between 0 and textLen - patternLen, widened by bandSlack on each side.  Returns -1 if the distance exceeds limit.
+// rowBuffer must have room for BandedEditDistanceRowBufferSize(textLen - patternLen, bandSlack) ints.
+//
+int BandedEditDistance(const char *text, int textLen, const char *pattern, int patternLen, int bandSlack, int limit, int *rowBuffer);
+
+inline int BandedEditDistanceRowBufferSize(int lengthDifference, int bandSlack)
+{
+    return 2 * (abs(lengthDifference) + 2 * bandSlack + 3);
+}
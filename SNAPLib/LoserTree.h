@@ -0,0 +1,157 @@
+/*++
+
+Module Name:
+
+    LoserTree.h
+
+Abstract:
+
+    Tournament tree for k-way merging.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Merges k sorted streams, keeping the current key of each one in the tree itself.  Each internal node holds the loser of
+// the match played there and node 0 holds the overall winner, so replacing the winner's key only replays the matches on
+// the path from its leaf to the root: log2(k) comparisons, against about twice that for a heap, and the nodes are all in
+// one array rather than scattered through the streams.
+//
+// Equal keys go to the lower numbered stream, so the merge is stable if the streams are numbered in order.
+//
+// Usage: set() or setEmpty() each stream, start(), then until isEmpty(), consume winner() and either replace() its key
+// or finish() it.
+//
+    template <class K>
+class LoserTree
+{
+public:
+    LoserTree(int i_nStreams) : nStreams(i_nStreams)
+    {
+        _ASSERT(nStreams > 0);
+        nodes = new Node[nStreams];
+        leaves = new Node[nStreams];
+    }
+
+    ~LoserTree()
+    {
+        delete [] nodes;
+        delete [] leaves;
+    }
+
+    void set(int stream, K key)
+    {
+        leaves[stream].key = key;
+        leaves[stream].stream = stream;
+        leaves[stream].done = false;
+    }
+
+    void setEmpty(int stream)
+    {
+        leaves[stream].key = K();
+        leaves[stream].stream = stream;
+        leaves[stream].done = true;
+    }
+
+    // play the whole tournament once all the streams have been set
+    void start()
+    {
+        nodes[0] = play(1);
+    }
+
+    bool isEmpty() const
+    { return nodes[0].done; }
+
+    int winner() const
+    { return nodes[0].stream; }
+
+    K winnerKey() const
+    { return nodes[0].key; }
+
+    // the winning stream has moved on to key
+    void replace(K key)
+    {
+        Node node;
+        node.key = key;
+        node.stream = nodes[0].stream;
+        node.done = false;
+        replay(node);
+    }
+
+    // the winning stream has no more keys
+    void finish()
+    {
+        Node node;
+        node.key = K();
+        node.stream = nodes[0].stream;
+        node.done = true;
+        replay(node);
+    }
+
+private:
+
+    struct Node
+    {
+        K       key;
+        int     stream;
+        bool    done;
+    };
+
+    static bool beats(const Node& a, const Node& b)
+    {
+        if (a.done != b.done) {
+            return b.done;
+        }
+        if (a.key < b.key) {
+            return true;
+        }
+        if (b.key < a.key) {
+            return false;
+        }
+        return a.stream < b.stream;
+    }
+
+    //
+    // The tree is laid out like a heap with the leaves at nStreams...2*nStreams-1, so the internal nodes are 1...nStreams-1,
+    // which works for any number of streams.  Returns the winner of the subtree at index, leaving the losers behind.
+    //
+    Node play(int index)
+    {
+        if (index >= nStreams) {
+            return leaves[index - nStreams];
+        }
+        Node left = play(2 * index);
+        Node right = play(2 * index + 1);
+        if (beats(left, right)) {
+            nodes[index] = right;
+            return left;
+        }
+        nodes[index] = left;
+        return right;
+    }
+
+    void replay(Node candidate)
+    {
+        for (int index = (candidate.stream + nStreams) / 2; index > 0; index /= 2) {
+            if (beats(nodes[index], candidate)) {
+                Node t = nodes[index];
+                nodes[index] = candidate;
+                candidate = t;
+            }
+        }
+        nodes[0] = candidate;
+    }
+
+    const int   nStreams;
+    Node*       nodes;      // nodes[0] is the winner, the rest are losers
+    Node*       leaves;     // only used by start()
+};
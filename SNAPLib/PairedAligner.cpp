@@ -229,9 +229,12 @@ PairedAlignerOptions::PairedAlignerOptions(const char* i_commandLine)
     minSpacing(DEFAULT_MIN_SPACING),
     maxSpacing(DEFAULT_MAX_SPACING),
     forceSpacing(false),
+    insertSizeSamplePairs(0),
     intersectingAlignerMaxHits(DEFAULT_INTERSECTING_ALIGNER_MAX_HITS),
     maxCandidatePoolSize(DEFAULT_MAX_CANDIDATE_POOL_SIZE),
-    quicklyDropUnpairedReads(true)
+    quicklyDropUnpairedReads(true),
+    matcherMemory(PairedReadReader::DefaultMatcherMemory),
+    spillDirectory(NULL)
 {
 }
 
@@ -242,6 +245,9 @@ void PairedAlignerOptions::usageMessage()
         "\n"
         "  -s   min and max spacing to allow between paired ends (default: %d %d).\n"
         "  -fs  force spacing to lie between min and max.\n"
+        "  -is  learn the insert size distribution (per read group) from the first N confidently aligned pairs,\n"
+        "       then narrow the spacing window to fit it and use it in scoring pairs for the rest of the run.\n"
+        "       The window never extends beyond the one given by -s.  N must be at least %d.\n"
         "  -H   max hits for intersecting aligner (default: %d).\n"
         "  -mcp specifies the maximum candidate pool size (An internal data structure. \n"
         "       Only increase this if you get an error message saying to do so. If you're running\n"
@@ -253,11 +259,17 @@ void PairedAlignerOptions::usageMessage()
         "       discard it.  Specifying this flag may cause large memory usage for some input files,\n"
         "       but may be necessary for some strangely formatted input files.  You'll also need to specify this\n"
         "       flag for SAM/BAM files that were aligned by a single-end aligner.\n"
+        "  -pmm Memory (in MB) for the reads in SAM/BAM/CRAM input whose mates haven't shown up yet.  Past it, they're\n"
+        "       spilled to temp files and matched at the end of the input (default: %lld)\n"
+        "  -pmt Directory for those temp files (default: next to the output file, or the system temp directory\n"
+        "       if there isn't one)\n"
         ,
         DEFAULT_MIN_SPACING,
         DEFAULT_MAX_SPACING,
+        InsertSizeModel::MinPairsToLearnFrom,
         DEFAULT_INTERSECTING_ALIGNER_MAX_HITS,
-        DEFAULT_MAX_CANDIDATE_POOL_SIZE);
+        DEFAULT_MAX_CANDIDATE_POOL_SIZE,
+        PairedReadReader::DefaultMatcherMemory / (1024 * 1024));
 }
 
 bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done)
@@ -282,9 +294,36 @@ bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done
     } else if (strcmp(argv[n], "-fs") == 0) {
         forceSpacing = true;
         return true;    
+    } else if (strcmp(argv[n], "-is") == 0) {
+        if (n + 1 < argc) {
+            int pairs = atoi(argv[n+1]);
+            if (pairs <= 0 || pairs < (int)InsertSizeModel::MinPairsToLearnFrom) {
+                WriteErrorMessage("-is must be at least %d\n", InsertSizeModel::MinPairsToLearnFrom);
+                return false;
+            }
+            insertSizeSamplePairs = pairs;
+            n += 1;
+            return true;
+        }
+        return false;
     } else if (strcmp(argv[n], "-ku") == 0) {
         quicklyDropUnpairedReads = false;
         return true;
+    } else if (strcmp(argv[n], "-pmm") == 0) {
+        if (n + 1 < argc && argv[n + 1][0] >= '0' && argv[n + 1][0] <= '9' && atoi(argv[n + 1]) > 0) {
+            matcherMemory = (_int64)atoi(argv[n + 1]) * 1024 * 1024;
+            n += 1;
+            return true;
+        }
+        WriteErrorMessage("-pmm requires a positive number of MB\n");
+        return false;
+    } else if (strcmp(argv[n], "-pmt") == 0) {
+        if (n + 1 < argc) {
+            spillDirectory = argv[n + 1];
+            n += 1;
+            return true;
+        }
+        return false;
     } else if (strcmp(argv[n], "-mcp") == 0) {
         if (n + 1 < argc) {
             maxCandidatePoolSize = atoi(argv[n+1]);
@@ -301,7 +340,7 @@ bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done
 }
 
 PairedAlignerContext::PairedAlignerContext(AlignerExtension* i_extension)
-    : AlignerContext( 0,  NULL, NULL, i_extension)
+    : AlignerContext( 0,  NULL, NULL, i_extension), insertSizeModel(NULL)
 {
 }
 
@@ -312,6 +351,7 @@ bool PairedAlignerContext::initialize()
     minSpacing = options2->minSpacing;
     maxSpacing = options2->maxSpacing;
     forceSpacing = options2->forceSpacing;
+    insertSizeSamplePairs = options2->insertSizeSamplePairs;
     maxCandidatePoolSize = options2->maxCandidatePoolSize;
     intersectingAlignerMaxHits = options2->intersectingAlignerMaxHits;
     ignoreMismatchedIDs = options2->ignoreMismatchedIDs;
@@ -392,56 +432,20 @@ void PairedAlignerContext::runIterationThread()
         return;
     }
 
-    int maxReadSize = MAX_READ_LENGTH;
-    size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
-                                                                numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize,
-                                                                maxSecondaryAlignmentsPerContig);
-
-    memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
-        extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
-
+    //
+    // Start out sized for ordinary short reads, and grow when a longer one comes along, so that a run of short
+    // reads doesn't pay for the memory the longest possible read would need.
+    //
+    unsigned maxReadSize = INITIAL_MAX_READ_LENGTH;
+    BigAllocator *allocator;
+    IntersectingPairedEndAligner *intersectingAligner;
+    PairedAlignmentResult *results;
     unsigned maxPairedSecondaryHits;
+    SingleAlignmentResult *singleSecondaryResults;
     unsigned maxSingleSecondaryHits;
-
-    if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
-        maxPairedSecondaryHits = 0;
-        maxSingleSecondaryHits = 0;
-    } else {
-        maxPairedSecondaryHits = IntersectingPairedEndAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength(), minSpacing, maxSpacing);
-        maxSingleSecondaryHits = ChimericPairedEndAligner::getMaxSingleEndSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength());
-    }
-
-    memoryPoolSize += (1 + maxPairedSecondaryHits) * sizeof(PairedAlignmentResult) + maxSingleSecondaryHits * sizeof(SingleAlignmentResult);
-
-    BigAllocator *allocator = new BigAllocator(memoryPoolSize);
-    
-    IntersectingPairedEndAligner *intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
-                                                                seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth, 
-                                                                maxCandidatePoolSize, maxSecondaryAlignmentsPerContig ,allocator, noUkkonen, noOrderedEvaluation, noTruncation);
-
-
-    ChimericPairedEndAligner *aligner = new (allocator) ChimericPairedEndAligner(
-        index,
-        maxReadSize,
-        maxHits,
-        maxDist,
-        numSeedsFromCommandLine,
-        seedCoverage,
-		minWeightToCheck,
-        forceSpacing,
-        extraSearchDepth,
-        noUkkonen,
-        noOrderedEvaluation,
-		noTruncation,
-        intersectingAligner,
-		minReadLength,
-        maxSecondaryAlignmentsPerContig,
-        allocator);
-
-    allocator->checkCanaries();
-
-    PairedAlignmentResult *results = (PairedAlignmentResult *)allocator->allocate((1 + maxPairedSecondaryHits) * sizeof(*results)); // 1 + is for the primary result
-    SingleAlignmentResult *singleSecondaryResults = (SingleAlignmentResult *)allocator->allocate(maxSingleSecondaryHits * sizeof(*singleSecondaryResults));
+    ChimericPairedEndAligner *aligner = newAligner(maxReadSize, &allocator, &intersectingAligner, &results, &maxPairedSecondaryHits,
+        &singleSecondaryResults, &maxSingleSecondaryHits);
+    _int64 lvCallsInOldAligners = 0;
 
     ReadWriter *readWriter = this->readWriter;
 
@@ -506,6 +510,17 @@ void PairedAlignerContext::runIterationThread()
 
 
 
+        unsigned longerReadLength = __max(reads[0]->getDataLength(), reads[1]->getDataLength());
+        if (longerReadLength > maxReadSize) {
+            lvCallsInOldAligners += aligner->getLocationsScored();
+            aligner->~ChimericPairedEndAligner();
+            intersectingAligner->~IntersectingPairedEndAligner();
+            delete allocator;
+            maxReadSize = __min(MaxReadLength, __max(longerReadLength, 2 * maxReadSize));
+            aligner = newAligner(maxReadSize, &allocator, &intersectingAligner, &results, &maxPairedSecondaryHits,
+                &singleSecondaryResults, &maxSingleSecondaryHits);
+        }
+
 #if     TIME_HISTOGRAM
         _int64 startTime = timeInNanos();
 #endif // TIME_HISTOGRAM
@@ -513,6 +528,23 @@ void PairedAlignerContext::runIterationThread()
         int nSecondaryResults;
         int nSingleSecondaryResults[2];
 
+        //
+        // SAM, BAM and CRAM input leave the read group in the RG:Z field, so look up its name for the insert size model.
+        //
+        char readGroupBuffer[256];
+        const char *readGroup = NULL;
+        if (NULL != insertSizeModel) {
+            readGroup = reads[0]->getReadGroupName(readGroupBuffer, sizeof(readGroupBuffer));
+            if (NULL == readGroup) {
+                readGroup = options->defaultReadGroup;
+            }
+        }
+
+        if (NULL != insertSizeModel && insertSizeModel->isLearned()) {
+            const InsertSizeDistribution *distribution = insertSizeModel->getDistribution(readGroup);
+            intersectingAligner->setSpacing(distribution->minSpacing, distribution->maxSpacing, distribution);
+        }
+
         aligner->align(reads[0], reads[1], results, maxSecondaryAlignmentAdditionalEditDistance, maxPairedSecondaryHits, &nSecondaryResults, results + 1,
             maxSingleSecondaryHits, maxSecondaryAlignments, &nSingleSecondaryResults[0], &nSingleSecondaryResults[1], singleSecondaryResults);
 
@@ -523,6 +555,16 @@ void PairedAlignerContext::runIterationThread()
         stats->nanosByTimeBucket[timeBucket] += runTime;
 #endif // TIME_HISTOGRAM
 
+        if (NULL != insertSizeModel && !insertSizeModel->isLearned() && results[0].alignedAsPair &&
+            results[0].status[0] == SingleHit && results[0].status[1] == SingleHit && results[0].direction[0] != results[0].direction[1] &&
+            results[0].mapq[0] >= MAPQ_LIMIT_FOR_SINGLE_HIT && results[0].mapq[1] >= MAPQ_LIMIT_FOR_SINGLE_HIT) {
+            //
+            // Only confident, concordant pairs tell us anything about the library.
+            //
+            _int64 spacing = GenomeLocationAsInt64(results[0].location[0]) - GenomeLocationAsInt64(results[0].location[1]);
+            insertSizeModel->recordPair(readGroup, spacing < 0 ? -spacing : spacing);
+        }
+
         if (forceSpacing && isOneLocation(results[0].status[0]) != isOneLocation(results[0].status[1])) {
             // either both align or neither do
             results[0].status[0] = results[0].status[1] = NotFound;
@@ -575,7 +617,7 @@ void PairedAlignerContext::runIterationThread()
         }
     }   // while we have a read pair
 
-    stats->lvCalls = aligner->getLocationsScored();
+    stats->lvCalls = lvCallsInOldAligners + aligner->getLocationsScored();
 
     allocator->checkCanaries();
 
@@ -587,6 +629,66 @@ void PairedAlignerContext::runIterationThread()
 }
 
 
+    ChimericPairedEndAligner *
+PairedAlignerContext::newAligner(
+    unsigned                        maxReadSize,
+    BigAllocator                  **allocator,
+    IntersectingPairedEndAligner  **intersectingAligner,
+    PairedAlignmentResult         **results,
+    unsigned                       *maxPairedSecondaryHits,
+    SingleAlignmentResult         **singleSecondaryResults,
+    unsigned                       *maxSingleSecondaryHits)
+{
+    size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
+                                                                numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize,
+                                                                maxSecondaryAlignmentsPerContig);
+
+    memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
+        extraSearchDepth, maxCandidatePoolSize, maxSecondaryAlignmentsPerContig);
+
+    if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
+        *maxPairedSecondaryHits = 0;
+        *maxSingleSecondaryHits = 0;
+    } else {
+        *maxPairedSecondaryHits = IntersectingPairedEndAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength(), minSpacing, maxSpacing);
+        *maxSingleSecondaryHits = ChimericPairedEndAligner::getMaxSingleEndSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength());
+    }
+
+    memoryPoolSize += (1 + *maxPairedSecondaryHits) * sizeof(PairedAlignmentResult) + *maxSingleSecondaryHits * sizeof(SingleAlignmentResult);
+
+    *allocator = new BigAllocator(memoryPoolSize);
+    
+    *intersectingAligner = new (*allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
+                                                                seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth, 
+                                                                maxCandidatePoolSize, maxSecondaryAlignmentsPerContig, *allocator, noUkkonen, noOrderedEvaluation, noTruncation);
+
+
+    ChimericPairedEndAligner *aligner = new (*allocator) ChimericPairedEndAligner(
+        index,
+        maxReadSize,
+        maxHits,
+        maxDist,
+        numSeedsFromCommandLine,
+        seedCoverage,
+		minWeightToCheck,
+        forceSpacing,
+        extraSearchDepth,
+        noUkkonen,
+        noOrderedEvaluation,
+		noTruncation,
+        *intersectingAligner,
+		minReadLength,
+        maxSecondaryAlignmentsPerContig,
+        *allocator);
+
+    (*allocator)->checkCanaries();
+
+    *results = (PairedAlignmentResult *)(*allocator)->allocate((1 + *maxPairedSecondaryHits) * sizeof(**results)); // 1 + is for the primary result
+    *singleSecondaryResults = (SingleAlignmentResult *)(*allocator)->allocate(*maxSingleSecondaryHits * sizeof(**singleSecondaryResults));
+
+    return aligner;
+}
+
 void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, bool useful0, bool useful1)
 {
 	bool useful[2] = { useful0, useful1 };
@@ -635,6 +737,11 @@ void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, R
     void 
 PairedAlignerContext::typeSpecificBeginIteration()
 {
+    PairedAlignerOptions* pairedOptions = (PairedAlignerOptions*)options;
+    readerContext.matcherMemory = pairedOptions->matcherMemory;
+    readerContext.spillDirectory = pairedOptions->spillDirectory;
+    readerContext.outputFileName = options->outputFile.fileName;
+
     if (1 == options->nInputs) {
         //
         // We've only got one input, so just connect it directly to the consumer.
@@ -652,6 +759,10 @@ PairedAlignerContext::typeSpecificBeginIteration()
         }
         pairedReadSupplierGenerator = new MultiInputPairedReadSupplierGenerator(options->nInputs,generators);
     }
+    if (0 != insertSizeSamplePairs) {
+        insertSizeModel = new InsertSizeModel(insertSizeSamplePairs, minSpacing, maxSpacing);
+    }
+
     ReaderContext* context = pairedReadSupplierGenerator->getContext();
     readerContext.header = context->header;
     readerContext.headerBytes = context->headerBytes;
@@ -669,4 +780,7 @@ PairedAlignerContext::typeSpecificNextIteration()
     }
     delete pairedReadSupplierGenerator;
     pairedReadSupplierGenerator = NULL;
+
+    delete insertSizeModel;
+    insertSizeModel = NULL;
 }
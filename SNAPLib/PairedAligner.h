@@ -26,8 +26,12 @@ Revision History:
 #include "stdafx.h"
 #include "AlignerContext.h"
 #include "ReadSupplierQueue.h"
+#include "InsertSizeModel.h"
 
 struct PairedAlignerStats;
+class BigAllocator;
+class IntersectingPairedEndAligner;
+class ChimericPairedEndAligner;
 
 class PairedAlignerContext : public AlignerContext
 {
@@ -51,6 +55,13 @@ protected:
 
     virtual void updateStats(PairedAlignerStats* stats, Read* read0, Read* read1, PairedAlignmentResult* result, bool useful0, bool useful1);
 
+    //
+    // Make a thread's aligners, with room for reads of up to maxReadSize bases and their secondary results, all in
+    // one new allocator.  They're rebuilt bigger when a longer read comes along.
+    //
+    ChimericPairedEndAligner *newAligner(unsigned maxReadSize, BigAllocator **allocator, IntersectingPairedEndAligner **intersectingAligner,
+        PairedAlignmentResult **results, unsigned *maxPairedSecondaryHits, SingleAlignmentResult **singleSecondaryResults, unsigned *maxSingleSecondaryHits);
+
     bool isPaired() {return true;}
 
 protected:
@@ -63,6 +74,8 @@ protected:
     int                 minSpacing;
     int                 maxSpacing;
     bool                forceSpacing;
+    unsigned            insertSizeSamplePairs;
+    InsertSizeModel    *insertSizeModel;       // NULL unless -is was specified.  Shared by all of the threads.
     unsigned            intersectingAlignerMaxHits;
     unsigned            maxCandidatePoolSize;
     const char         *fastqFile1;
@@ -85,7 +98,10 @@ struct PairedAlignerOptions : public AlignerOptions
     int         minSpacing;
     int         maxSpacing;
     bool        forceSpacing;
+    unsigned    insertSizeSamplePairs;
     unsigned    intersectingAlignerMaxHits;
     unsigned    maxCandidatePoolSize;
     bool        quicklyDropUnpairedReads;
+    _int64      matcherMemory;          // -pmm, in bytes
+    const char *spillDirectory;         // -pmt, or NULL to spill next to the output
 };
@@ -31,6 +31,7 @@ Revision History:
 #include "PairedEndAligner.h"
 #include "SAM.h"
 #include "Error.h"
+#include "ParallelTask.h"
 
 // turn on to debug matching process
 //#define VALIDATE_MATCH
@@ -174,6 +175,8 @@ PairedReadMatcher::allocOverflowRead()
 PairedReadMatcher::freeOverflowRead(
     ReadWithOwnMemory* read)
 {
+    read->dispose();
+    read->~ReadWithOwnMemory();
     while (true) {
         ReadWithOwnMemory* head = freeList;
         *(ReadWithOwnMemory**)read = head;
@@ -422,6 +425,971 @@ PairedReadMatcher::releaseBatch(
     }
 }
 
+//
+// PairedReadMatcher keeps every read whose mate hasn't shown up within two batches in its overflow table, each in a
+// ReadWithOwnMemory of a few KB, and does all of the matching on the one thread that's reading.  For input that isn't in
+// name order, like a big coordinate-sorted BAM file, the overflow table gets huge and the matching can't keep up with the
+// aligners.
+//
+// ShardedPairedReadMatcher works in rounds of up to RoundSize reads, all from the same batch.  The reads in a round are
+// hashed by name into shards, and the shards are matched in parallel, each against its own tables.  Reads that are still
+// unmatched a round later are packed into their shard's arena (the read and a small header, rather than a whole
+// ReadWithOwnMemory), and when a shard's arena grows past its part of the matcher's memory (-pmm), the oldest half of it is
+// written to a spill file.  At EOF each shard's spill file is read back in and matched against what's left, one shard at a
+// time.  A shard that's bigger than its part of the memory is first split by read id into part files that aren't, which are
+// matched one at a time, so that EOF doesn't need any more memory than the rounds did.  Pairs come out in the same order
+// as from PairedReadMatcher, except for ones that had been spilled, which come out at the end.
+//
+class ShardedPairedReadMatcher : public PairedReadReader, public ParallelWorkerManager
+{
+public:
+    ShardedPairedReadMatcher(ReadReader* i_single, bool i_quicklyDropUnpairedReads, int i_nShards);
+
+    virtual ~ShardedPairedReadMatcher();
+
+    // PairedReadReader
+
+    virtual bool getNextReadPair(Read *read1, Read *read2);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    { single->reinit(startingOffset, amountOfFileToProcess); }
+
+    virtual void holdBatch(DataBatch batch);
+
+    virtual bool releaseBatch(DataBatch batch);
+
+    virtual ReaderContext* getContext()
+    { return single->getContext(); }
+
+    // ParallelWorkerManager
+
+    virtual ParallelWorker* createWorker();
+
+    static const int MaxShards = 16;
+    static const int RoundSize = 10000;
+    static const int ThreadsPerShard = 4;           // Aligner threads that one shard can keep up with
+    static const int MaxEofParts = 64;              // That one shard is split into at EOF
+    static const int SpillChunkSize = 4 * 1024 * 1024;  // Read from a spill file at a time when splitting it
+
+private:
+
+    friend class ShardedMatchWorker;
+
+    typedef _uint64 StringHash;
+
+    //
+    // An unmatched read packed into an arena or a spill file.  It's followed by the id, the unclipped data and quality and
+    // the auxiliary data, and padded to a multiple of 8 bytes.  Like ReadWithOwnMemory, it doesn't keep the original
+    // alignment.
+    //
+    struct PackedRead {
+        StringHash      key;
+        const char     *readGroup;
+        unsigned        size;           // Of the whole record
+        unsigned        idLength;
+        unsigned        unclippedLength;
+        unsigned        auxLength;
+        int             clippingState;
+        int             firstSegment;
+    };
+
+    static unsigned packedSize(const Read* read);
+    static void pack(char* record, StringHash key, bool firstSegment, const Read* read);
+    static void unpack(char* record, Read* read, DataBatch batch);
+
+    //
+    // A growable run of PackedReads.  Offsets into it stay good when it grows, pointers don't.
+    //
+    struct RecordBuffer {
+        RecordBuffer() : buffer(NULL), used(0), capacity(0) {}
+
+        char* append(_int64 size);
+
+        char       *buffer;
+        _int64      used;
+        _int64      capacity;
+    };
+
+    enum MateSource {NoMate, CurrentRound, PreviousRound, Restored};
+
+    struct RoundRead {
+        StringHash      key;
+        int             shard;
+        bool            firstSegment;
+        MateSource      mateSource;     // Set on the second read of a pair to say where its mate is
+        _int64          mateIndex;      // Index in the round, or offset in the shard's restored buffer
+    };
+
+    struct Round {
+        Read           *reads;         // RoundSize of them
+        RoundRead      *info;
+        int             count;
+        DataBatch       batch;
+    };
+
+    typedef VariableSizeMap<StringHash,int> IndexMap;
+    typedef VariableSizeMapBig<StringHash,_int64> OffsetMap;
+
+    struct Shard {
+        VariableSizeVector<int> reads;          // Indices of this round's reads that hash here, in order
+        IndexMap                unmatched[2];   // 0 = this round, 1 = previous round; read id -> index in round
+        RecordBuffer            arena;          // Packed reads from older rounds, oldest first
+        OffsetMap               overflow;       // read id -> offset in arena
+        _int64                  liveBytes;      // Of arena that's still in overflow
+        RecordBuffer            restored;       // Reads matched out of arena this round
+        FILE                   *spillFile;
+        char                   *spillFileName;  // NULL for an anonymous temp file
+        _int64                  spillBytes;
+    };
+
+    struct EofPart {
+        FILE           *file;
+        char           *fileName;
+        _int64          bytes;
+    };
+
+    struct EofBuffer {
+        char           *buffer;         // One part of a shard, freed when the last pair from it is released
+        volatile int    holds;
+    };
+
+    struct EofPair {
+        _int64          earlier;        // Offsets in the EOF buffer
+        _int64          later;
+    };
+
+    static const _uint32 EofFileID = 0xffffffff;    // For the batches that pairs matched at EOF are in
+
+    bool readRound();
+    void matchRound();
+    void workerStep(int threadNum);
+    void matchShard(Shard* shard);
+    void repackShard(Shard* shard, bool spillOldest);
+    void finishRounds();
+    void splitShardAtEof(Shard* shard);
+    bool matchNextShardAtEof();
+    bool getNextUsableRead(Read* read);
+    FILE* openSpillFile(int shard, int part, char** o_fileName);
+    static void closeSpillFile(FILE* file, char* fileName);
+
+    ReadReader         *single;
+    bool                quicklyDropUnpairedReads;
+    _uint64             nReadsQuicklyDropped;
+    const int           nShards;
+    const _int64        memory;         // For all of the shards' arenas, before they spill
+    const int           matcherNumber;  // For spill file names, since there's a matcher for each input file
+    char               *spillFilePrefix;    // What spill file names start with, or NULL for anonymous temp files
+    static volatile int nMatchers;
+    Shard              *shards;
+    ParallelCoworker   *coworker;
+
+    Round               rounds[2];
+    int                 current;        // Index in rounds; the other one is the previous round
+    int                 nextOutput;     // Next read in the current round to look at for a pair
+    Read                pendingRead;    // First read of the next round
+    bool                hasPendingRead;
+    bool                inputDone;
+    _int64              nReads;
+    _int64              nPairs;
+
+    //
+    // Not every reader counts holds (a memory mapped file never frees anything, so it always says a batch is released), so
+    // the matcher keeps its own count for each batch, to know when the restored reads that went out in it can be freed.
+    //
+    typedef VariableSizeVector<char*> BufferVector;
+    struct HeldBatch {
+        int             holds;
+        BufferVector   *restored;
+    };
+    typedef VariableSizeMap<_uint64,HeldBatch> HeldBatchMap;
+    ExclusiveLock       heldBatchLock;
+    HeldBatchMap        heldBatches;
+
+    bool                atEof;
+    int                 eofShard;       // Next shard to match at EOF
+    EofPart             eofParts[MaxEofParts];  // Of the shard before it
+    int                 nEofParts;
+    int                 eofPart;        // Next one to match
+    int                 eofBuffer;      // Index in eofBuffers of the part whose pairs are being handed out, or -1
+    bool                reportedEof;
+    EofBuffer           eofBuffers[MaxShards * MaxEofParts];  // For shard * MaxEofParts + part; the batch ID is one more
+    VariableSizeVector<EofPair> eofPairs;
+    int                 nextEofPair;
+    _int64              nUnpairedAtEof;
+};
+
+class ShardedMatchWorker : public ParallelWorker
+{
+public:
+    virtual void step()
+    {
+        ((ShardedPairedReadMatcher*)getManager())->workerStep(getThreadNum());
+    }
+};
+
+ShardedPairedReadMatcher::ShardedPairedReadMatcher(
+    ReadReader* i_single,
+    bool i_quicklyDropUnpairedReads,
+    int i_nShards)
+    : single(i_single), quicklyDropUnpairedReads(i_quicklyDropUnpairedReads), nReadsQuicklyDropped(0),
+    nShards(i_nShards), memory(i_single->getContext()->matcherMemory > 0 ? i_single->getContext()->matcherMemory : PairedReadReader::DefaultMatcherMemory),
+    matcherNumber(InterlockedIncrementAndReturnNewValue(&nMatchers)), spillFilePrefix(NULL), coworker(NULL), current(0), nextOutput(0), hasPendingRead(false),
+    inputDone(false), nReads(0), nPairs(0), atEof(false), eofShard(0), nEofParts(0), eofPart(0), eofBuffer(-1), reportedEof(false),
+    nextEofPair(0), nUnpairedAtEof(0)
+{
+    _ASSERT(nShards > 0 && nShards <= MaxShards);
+
+    //
+    // Spill files are named for the output file, and go next to it unless -pmt says otherwise.
+    //
+    const ReaderContext* context = single->getContext();
+    const char* outputFileName = context->outputFileName;
+    bool haveOutputFile = NULL != outputFileName && strcmp(outputFileName, "-") != 0;
+    if (NULL != context->spillDirectory) {
+        const char* baseName = haveOutputFile ? outputFileName : "snap";
+        for (const char* p = baseName; *p != '\0'; p++) {
+            if (*p == '/' || *p == '\\') {
+                baseName = p + 1;
+            }
+        }
+        spillFilePrefix = new char[strlen(context->spillDirectory) + strlen(baseName) + 2];
+        sprintf(spillFilePrefix, "%s/%s", context->spillDirectory, baseName);
+    } else if (haveOutputFile) {
+        spillFilePrefix = new char[strlen(outputFileName) + 1];
+        strcpy(spillFilePrefix, outputFileName);
+    }
+
+    shards = new Shard[nShards];
+    for (int i = 0; i < nShards; i++) {
+        shards[i].liveBytes = 0;
+        shards[i].spillFile = NULL;
+        shards[i].spillFileName = NULL;
+        shards[i].spillBytes = 0;
+    }
+    for (int i = 0; i < MaxShards * MaxEofParts; i++) {
+        eofBuffers[i].buffer = NULL;
+        eofBuffers[i].holds = 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        rounds[i].reads = new Read[RoundSize];
+        rounds[i].info = new RoundRead[RoundSize];
+        rounds[i].count = 0;
+    }
+    InitializeExclusiveLock(&heldBatchLock);
+    if (nShards > 1) {
+        coworker = new ParallelCoworker(nShards, false, this);
+        coworker->start();
+    }
+}
+
+ShardedPairedReadMatcher::~ShardedPairedReadMatcher()
+{
+    if (coworker != NULL) {
+        coworker->stop();
+        delete coworker;
+    }
+    for (int i = 0; i < nShards; i++) {
+        delete [] shards[i].arena.buffer;
+        delete [] shards[i].restored.buffer;
+        if (shards[i].spillFile != NULL) {
+            closeSpillFile(shards[i].spillFile, shards[i].spillFileName);
+        }
+    }
+    delete [] shards;
+    for (int i = eofPart; i < nEofParts; i++) {
+        closeSpillFile(eofParts[i].file, eofParts[i].fileName);
+    }
+    for (int i = 0; i < MaxShards * MaxEofParts; i++) {
+        delete [] eofBuffers[i].buffer;
+    }
+    for (int i = 0; i < 2; i++) {
+        delete [] rounds[i].reads;
+        delete [] rounds[i].info;
+    }
+    for (HeldBatchMap::iterator i = heldBatches.begin(); i != heldBatches.end(); i = heldBatches.next(i)) {
+        if (i->value.restored != NULL) {
+            for (BufferVector::iterator b = i->value.restored->begin(); b != i->value.restored->end(); b++) {
+                delete [] *b;
+            }
+            delete i->value.restored;
+        }
+    }
+    DestroyExclusiveLock(&heldBatchLock);
+    delete [] spillFilePrefix;
+    delete single;
+}
+
+    ParallelWorker*
+ShardedPairedReadMatcher::createWorker()
+{
+    return new ShardedMatchWorker();
+}
+
+    char*
+ShardedPairedReadMatcher::RecordBuffer::append(
+    _int64 size)
+{
+    if (used + size > capacity) {
+        _int64 newCapacity = __max(__max(capacity * 2, used + size), (_int64)1024 * 1024);
+        char* newBuffer = new char[newCapacity];
+        if (used > 0) {
+            memcpy(newBuffer, buffer, used);
+        }
+        delete [] buffer;
+        buffer = newBuffer;
+        capacity = newCapacity;
+    }
+    char* result = buffer + used;
+    used += size;
+    return result;
+}
+
+    unsigned
+ShardedPairedReadMatcher::packedSize(
+    const Read* read)
+{
+    unsigned auxLength;
+    bool isSAM;
+    read->getAuxiliaryData(&auxLength, &isSAM);
+    return (unsigned)((sizeof(PackedRead) + read->getIdLength() + 2 * read->getUnclippedLength() + auxLength + 7) & ~7);
+}
+
+    void
+ShardedPairedReadMatcher::pack(
+    char* record,
+    StringHash key,
+    bool firstSegment,
+    const Read* read)
+{
+    PackedRead* packed = (PackedRead*)record;
+    unsigned auxLength;
+    bool isSAM;
+    char* aux = read->getAuxiliaryData(&auxLength, &isSAM);
+    packed->key = key;
+    packed->readGroup = read->getReadGroup();
+    packed->size = packedSize(read);
+    packed->idLength = read->getIdLength();
+    packed->unclippedLength = read->getUnclippedLength();
+    packed->auxLength = aux != NULL ? auxLength : 0;
+    packed->clippingState = read->getClippingState();
+    packed->firstSegment = firstSegment;
+
+    char* p = record + sizeof(PackedRead);
+    memcpy(p, read->getId(), packed->idLength);
+    p += packed->idLength;
+    memcpy(p, read->getUnclippedData(), packed->unclippedLength);
+    p += packed->unclippedLength;
+    memcpy(p, read->getUnclippedQuality(), packed->unclippedLength);
+    p += packed->unclippedLength;
+    if (packed->auxLength > 0) {
+        memcpy(p, aux, packed->auxLength);
+    }
+}
+
+    void
+ShardedPairedReadMatcher::unpack(
+    char* record,
+    Read* read,
+    DataBatch batch)
+{
+    PackedRead* packed = (PackedRead*)record;
+    char* id = record + sizeof(PackedRead);
+    char* data = id + packed->idLength;
+    char* quality = data + packed->unclippedLength;
+    char* aux = quality + packed->unclippedLength;
+    read->init(id, packed->idLength, data, quality, packed->unclippedLength);
+    read->clip((ReadClippingType)packed->clippingState);
+    read->setReadGroup(packed->readGroup);
+    read->setAuxiliaryData(packed->auxLength > 0 ? aux : NULL, packed->auxLength);
+    read->setBatch(batch);
+}
+
+    bool
+ShardedPairedReadMatcher::getNextUsableRead(
+    Read* read)
+{
+    while (single->getNextRead(read)) {
+        if (quicklyDropUnpairedReads &&
+            ((read->getOriginalSAMFlags() & SAM_NEXT_UNMAPPED) == 0) && (read->getOriginalPNEXT() == 0 || read->getOriginalRNEXTLength() == 1 && read->getOriginalRNEXT()[0] == '*')) {
+            nReadsQuicklyDropped++;
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+//
+// Read the next round into the one that's two rounds old, and match it.  By now every pair from that round has been handed
+// out and its leftover reads have been packed, so its hold on its batch can go.
+//
+    bool
+ShardedPairedReadMatcher::readRound()
+{
+    if (inputDone) {
+        return false;
+    }
+    current = 1 - current;
+    Round* round = &rounds[current];
+    if (round->batch.asKey() != 0) {
+        releaseBatch(round->batch);
+    }
+    round->count = 0;
+    round->batch = DataBatch();
+    nextOutput = 0;
+
+    if (hasPendingRead) {
+        round->reads[0] = pendingRead;
+        hasPendingRead = false;
+    } else if (! getNextUsableRead(&round->reads[0])) {
+        // leave the last round as the current one for finishRounds
+        inputDone = true;
+        current = 1 - current;
+        return false;
+    }
+    round->batch = round->reads[0].getBatch();
+    holdBatch(round->batch);
+
+    while (true) {
+        Read* read = &round->reads[round->count];
+        if (round->count > 0) {
+            if (! getNextUsableRead(read)) {
+                inputDone = true;
+                break;
+            }
+            if (read->getBatch() != round->batch) {
+                pendingRead = *read;
+                hasPendingRead = true;
+                break;
+            }
+        }
+
+        // build key for pending read table, removing /1 or /2 at end
+        const char* id = read->getId();
+        unsigned idLength = read->getIdLength();
+        // truncate at space or slash
+        char* slash = (char*) memchr((void*)id, '/', idLength);
+        if (slash != NULL) {
+            idLength = (unsigned)(slash - id);
+        }
+        char* space = (char*) memchr((void*)id, ' ', idLength);
+        if (space != NULL) {
+            idLength = (unsigned)(space - id);
+        }
+        RoundRead* info = &round->info[round->count];
+        info->key = util::hash64(id, idLength);
+        info->shard = (int)((info->key >> 32) % nShards);   // Not the low bits, which the shard's own tables use
+        info->firstSegment = (read->getOriginalSAMFlags() & SAM_FIRST_SEGMENT) != 0;
+        info->mateSource = NoMate;
+        shards[info->shard].reads.push_back(round->count);
+
+        round->count++;
+        if (round->count == RoundSize) {
+            break;
+        }
+    }
+    nReads += round->count;
+
+    matchRound();
+    return true;
+}
+
+    void
+ShardedPairedReadMatcher::matchRound()
+{
+    // the reads that the last round matched out of the arena went out in its batch, so they're freed with it
+    Round* previous = &rounds[1 - current];
+    for (int i = 0; i < nShards; i++) {
+        if (shards[i].restored.used > 0) {
+            AcquireExclusiveLock(&heldBatchLock);
+            HeldBatch* held = heldBatches.tryFind(previous->batch.asKey());
+            _ASSERT(held != NULL);  // This matcher still holds it
+            if (held->restored == NULL) {
+                held->restored = new BufferVector();
+            }
+            held->restored->push_back(shards[i].restored.buffer);
+            ReleaseExclusiveLock(&heldBatchLock);
+            shards[i].restored = RecordBuffer();
+        }
+    }
+
+    if (coworker != NULL) {
+        coworker->step();
+    } else {
+        matchShard(&shards[0]);
+    }
+
+    for (int i = 0; i < nShards; i++) {
+        shards[i].reads.clear();
+    }
+}
+
+    void
+ShardedPairedReadMatcher::workerStep(
+    int threadNum)
+{
+    matchShard(&shards[threadNum]);
+}
+
+    void
+ShardedPairedReadMatcher::matchShard(
+    Shard* shard)
+{
+    Round* round = &rounds[current];
+    Round* previous = &rounds[1 - current];
+    for (VariableSizeVector<int>::iterator r = shard->reads.begin(); r != shard->reads.end(); r++) {
+        RoundRead* info = &round->info[*r];
+        int* index = shard->unmatched[0].tryFind(info->key);
+        if (index != NULL) {
+            info->mateSource = CurrentRound;
+            info->mateIndex = *index;
+            shard->unmatched[0].erase(info->key);
+            continue;
+        }
+        index = shard->unmatched[1].tryFind(info->key);
+        if (index != NULL) {
+            info->mateSource = PreviousRound;
+            info->mateIndex = *index;
+            shard->unmatched[1].erase(info->key);
+            continue;
+        }
+        _int64* offset = shard->overflow.tryFind(info->key);
+        if (offset != NULL) {
+            unsigned size = ((PackedRead*)(shard->arena.buffer + *offset))->size;
+            char* copy = shard->restored.append(size);
+            memcpy(copy, shard->arena.buffer + *offset, size);
+            info->mateSource = Restored;
+            info->mateIndex = copy - shard->restored.buffer;
+            shard->liveBytes -= size;
+            shard->overflow.erase(info->key);
+            continue;
+        }
+        shard->unmatched[0].put(info->key, *r);
+    }
+
+    // the previous round is about to be reused, so pack its leftover reads
+    for (IndexMap::iterator i = shard->unmatched[1].begin(); i != shard->unmatched[1].end(); i = shard->unmatched[1].next(i)) {
+        Read* read = &previous->reads[i->value];
+        unsigned size = packedSize(read);
+        char* record = shard->arena.append(size);
+        pack(record, i->key, previous->info[i->value].firstSegment, read);
+        shard->overflow.put(i->key, record - shard->arena.buffer);
+        shard->liveBytes += size;
+    }
+    shard->unmatched[1].exchange(shard->unmatched[0]);
+    shard->unmatched[0].clear();
+
+    if (shard->liveBytes > memory / nShards) {
+        repackShard(shard, true);
+    } else if (shard->arena.used > 2 * shard->liveBytes + 16 * 1024 * 1024) {
+        repackShard(shard, false);
+    }
+}
+
+//
+// Squeeze the reads that have been matched out of the arena, and maybe write the older half of it to the spill file.
+//
+    void
+ShardedPairedReadMatcher::repackShard(
+    Shard* shard,
+    bool spillOldest)
+{
+    if (spillOldest && shard->spillFile == NULL) {
+        shard->spillFile = openSpillFile((int)(shard - shards), -1, &shard->spillFileName);
+    }
+    _int64 spillBefore = spillOldest ? shard->arena.used / 2 : 0;
+    _int64 newUsed = 0;
+    for (_int64 offset = 0; offset < shard->arena.used; ) {
+        PackedRead* packed = (PackedRead*)(shard->arena.buffer + offset);
+        unsigned size = packed->size;
+        _int64* where = shard->overflow.tryFind(packed->key);
+        if (where != NULL && *where == offset) {
+            if (offset < spillBefore) {
+                if (1 != fwrite(packed, size, 1, shard->spillFile)) {
+                    WriteErrorMessage("PairedReadMatcher: error writing unmatched reads to temp file\n");
+                    soft_exit(1);
+                }
+                shard->spillBytes += size;
+                shard->liveBytes -= size;
+                shard->overflow.erase(packed->key);
+            } else {
+                memmove(shard->arena.buffer + newUsed, packed, size);
+                *where = newUsed;
+                newUsed += size;
+            }
+        }
+        offset += size;
+    }
+    shard->arena.used = newUsed;
+}
+
+//
+// At EOF, pack whatever is left in the last two rounds and let go of their batches.
+//
+    void
+ShardedPairedReadMatcher::finishRounds()
+{
+    // an empty round makes the shards pack the last real one
+    current = 1 - current;
+    Round* round = &rounds[current];
+    if (round->batch.asKey() != 0) {
+        releaseBatch(round->batch);
+    }
+    round->count = 0;
+    round->batch = DataBatch();
+    matchRound();
+    Round* last = &rounds[1 - current];
+    if (last->batch.asKey() != 0) {
+        releaseBatch(last->batch);
+        last->batch = DataBatch();
+    }
+    last->count = 0;
+}
+
+//
+// Spill files go next to the output (or wherever -pmt says), named for the shard and the part, or are anonymous temp files
+// when there's no output file to put them by.  Either way they're gone once they've been read back in.
+//
+    FILE*
+ShardedPairedReadMatcher::openSpillFile(
+    int shard,
+    int part,
+    char** o_fileName)
+{
+    if (NULL == spillFilePrefix) {
+        *o_fileName = NULL;
+        FILE* file = tmpfile();
+        if (NULL == file) {
+            WriteErrorMessage("PairedReadMatcher: unable to create a temp file for unmatched reads\n");
+            soft_exit(1);
+        }
+        return file;
+    }
+
+    size_t nameSize = strlen(spillFilePrefix) + 40;
+    *o_fileName = new char[nameSize];
+    if (part < 0) {
+        sprintf(*o_fileName, "%s.pairs%d-%d.tmp", spillFilePrefix, matcherNumber, shard);
+    } else {
+        sprintf(*o_fileName, "%s.pairs%d-%d-%d.tmp", spillFilePrefix, matcherNumber, shard, part);
+    }
+    FILE* file = fopen(*o_fileName, "w+b");
+    if (NULL == file) {
+        WriteErrorMessage("PairedReadMatcher: unable to create %s for unmatched reads.  Use -pmt to put them somewhere else.\n", *o_fileName);
+        soft_exit(1);
+    }
+    return file;
+}
+
+    void
+ShardedPairedReadMatcher::closeSpillFile(
+    FILE* file,
+    char* fileName)
+{
+    fclose(file);
+    if (NULL != fileName) {
+        DeleteSingleFile(fileName);
+        delete [] fileName;
+    }
+}
+
+//
+// Get the next shard that spilled ready to be read back.  When its spill file and what's left in its arena fit in its part
+// of the memory, that's the one part.  Otherwise the spill file is read back a chunk at a time and split by read id (so that
+// mates stay together) into part files, along with the arena, so that each part fits.
+//
+    void
+ShardedPairedReadMatcher::splitShardAtEof(
+    Shard* shard)
+{
+    _int64 budget = memory / nShards;
+    _int64 size = shard->spillBytes + shard->liveBytes;
+    nEofParts = (int)__min((_int64)MaxEofParts, (size + budget - 1) / budget);
+    eofPart = 0;
+    if (nEofParts <= 1) {
+        nEofParts = 1;
+        eofParts[0].file = shard->spillFile;
+        eofParts[0].fileName = shard->spillFileName;
+        eofParts[0].bytes = shard->spillBytes;
+        shard->spillFile = NULL;
+        shard->spillFileName = NULL;
+        return;
+    }
+
+    for (int i = 0; i < nEofParts; i++) {
+        eofParts[i].file = openSpillFile((int)(shard - shards), i, &eofParts[i].fileName);
+        eofParts[i].bytes = 0;
+    }
+
+    _int64 chunkSize = SpillChunkSize;
+    char* chunk = new char[chunkSize];
+    _int64 valid = 0;
+    _int64 remaining = shard->spillBytes;
+    rewind(shard->spillFile);
+    while (valid > 0 || remaining > 0) {
+        _int64 amountToRead = __min(chunkSize - valid, remaining);
+        if (amountToRead > 0 && 1 != fread(chunk + valid, amountToRead, 1, shard->spillFile)) {
+            WriteErrorMessage("PairedReadMatcher: error reading unmatched reads back from temp file\n");
+            soft_exit(1);
+        }
+        valid += amountToRead;
+        remaining -= amountToRead;
+
+        _int64 offset = 0;
+        while (offset + (_int64)sizeof(PackedRead) <= valid && offset + ((PackedRead*)(chunk + offset))->size <= valid) {
+            PackedRead* packed = (PackedRead*)(chunk + offset);
+            EofPart* part = &eofParts[(packed->key >> 16) % nEofParts];    // Not the bits that chose the shard
+            if (1 != fwrite(packed, packed->size, 1, part->file)) {
+                WriteErrorMessage("PairedReadMatcher: error writing unmatched reads to temp file\n");
+                soft_exit(1);
+            }
+            part->bytes += packed->size;
+            offset += packed->size;
+        }
+
+        if (0 == offset) {
+            if (0 == remaining) {
+                WriteErrorMessage("PairedReadMatcher: temp file of unmatched reads is truncated\n");
+                soft_exit(1);
+            }
+            // one record that's bigger than the chunk
+            char* newChunk = new char[2 * chunkSize];
+            memcpy(newChunk, chunk, valid);
+            delete [] chunk;
+            chunk = newChunk;
+            chunkSize *= 2;
+        } else {
+            memmove(chunk, chunk + offset, valid - offset);
+            valid -= offset;
+        }
+    }
+    delete [] chunk;
+    closeSpillFile(shard->spillFile, shard->spillFileName);
+    shard->spillFile = NULL;
+    shard->spillFileName = NULL;
+
+    for (OffsetMap::iterator o = shard->overflow.begin(); o != shard->overflow.end(); o = shard->overflow.next(o)) {
+        PackedRead* packed = (PackedRead*)(shard->arena.buffer + o->value);
+        EofPart* part = &eofParts[(packed->key >> 16) % nEofParts];
+        if (1 != fwrite(packed, packed->size, 1, part->file)) {
+            WriteErrorMessage("PairedReadMatcher: error writing unmatched reads to temp file\n");
+            soft_exit(1);
+        }
+        part->bytes += packed->size;
+    }
+    shard->overflow.clear();
+    delete [] shard->arena.buffer;
+    shard->arena = RecordBuffer();
+    shard->liveBytes = 0;
+}
+
+//
+// Read back the next part of a shard that spilled (along with what's left in its arena, if it's the only part), and pair
+// up what can be.
+//
+    bool
+ShardedPairedReadMatcher::matchNextShardAtEof()
+{
+    if (eofBuffer >= 0) {
+        // drop this matcher's own hold on the last part's buffer
+        releaseBatch(DataBatch(eofBuffer + 1, EofFileID));
+        eofBuffer = -1;
+    }
+    while (true) {
+        if (eofPart == nEofParts) {
+            if (eofShard == nShards) {
+                return false;
+            }
+            Shard* shard = &shards[eofShard];
+            eofShard++;
+            if (shard->spillFile == NULL) {
+                nUnpairedAtEof += shard->overflow.size();
+                continue;
+            }
+            splitShardAtEof(shard);
+        }
+
+        Shard* shard = &shards[eofShard - 1];
+        int whichBuffer = (eofShard - 1) * MaxEofParts + eofPart;
+        EofPart* part = &eofParts[eofPart];
+        EofBuffer* eof = &eofBuffers[whichBuffer];
+        eofPart++;
+
+        _int64 size = part->bytes + shard->liveBytes;   // The arena is empty unless this is the only part
+        eof->buffer = new char[__max(size, (_int64)1)];
+        eof->holds = 1;
+        rewind(part->file);
+        if (part->bytes > 0 && 1 != fread(eof->buffer, part->bytes, 1, part->file)) {
+            WriteErrorMessage("PairedReadMatcher: error reading unmatched reads back from temp file\n");
+            soft_exit(1);
+        }
+        closeSpillFile(part->file, part->fileName);
+        _int64 used = part->bytes;
+        for (OffsetMap::iterator o = shard->overflow.begin(); o != shard->overflow.end(); o = shard->overflow.next(o)) {
+            unsigned recordSize = ((PackedRead*)(shard->arena.buffer + o->value))->size;
+            memcpy(eof->buffer + used, shard->arena.buffer + o->value, recordSize);
+            used += recordSize;
+        }
+        _ASSERT(used == size);
+        shard->overflow.clear();
+        delete [] shard->arena.buffer;
+        shard->arena = RecordBuffer();
+        shard->liveBytes = 0;
+
+        VariableSizeMapBig<StringHash,_int64> unmatched;
+        eofPairs.clear();
+        nextEofPair = 0;
+        for (_int64 offset = 0; offset < size; offset += ((PackedRead*)(eof->buffer + offset))->size) {
+            StringHash key = ((PackedRead*)(eof->buffer + offset))->key;
+            _int64* earlier = unmatched.tryFind(key);
+            if (earlier != NULL) {
+                EofPair pair;
+                pair.earlier = *earlier;
+                pair.later = offset;
+                eofPairs.push_back(pair);
+                unmatched.erase(key);
+            } else {
+                unmatched.put(key, offset);
+            }
+        }
+        nUnpairedAtEof += unmatched.size();
+        if (eofPairs.size() > 0) {
+            eofBuffer = whichBuffer;
+            return true;
+        }
+        releaseBatch(DataBatch(whichBuffer + 1, EofFileID));
+    }
+}
+
+    bool
+ShardedPairedReadMatcher::getNextReadPair(
+    Read *read1,
+    Read *read2)
+{
+    Read *outputReads[NUM_READS_PER_PAIR];
+    outputReads[0] = read1;
+    outputReads[1] = read2;
+
+    while (! atEof) {
+        Round* round = &rounds[current];
+        while (nextOutput < round->count) {
+            int i = nextOutput++;
+            RoundRead* info = &round->info[i];
+            if (info->mateSource == NoMate) {
+                continue;
+            }
+            // as in PairedReadMatcher, the read that completes the pair says which is first
+            int readOneToOutputRead = info->firstSegment ? 0 : 1;
+            *outputReads[readOneToOutputRead] = round->reads[i];
+            Read* mate = outputReads[1 - readOneToOutputRead];
+            if (info->mateSource == CurrentRound) {
+                *mate = round->reads[info->mateIndex];
+            } else if (info->mateSource == PreviousRound) {
+                *mate = rounds[1 - current].reads[info->mateIndex];
+            } else {
+                unpack(shards[info->shard].restored.buffer + info->mateIndex, mate, round->batch);
+            }
+            nPairs++;
+            return true;
+        }
+        if (nPairs == 0 && nReads >= 10000 && nReads - round->count < 10000) {
+            WriteErrorMessage( "warning: no matching read pairs in 10,000 reads, input file might be unsorted or have unexpected read id format\n");
+        }
+        if (! readRound()) {
+            finishRounds();
+            atEof = true;
+            if (! matchNextShardAtEof()) {
+                break;
+            }
+        }
+    }
+
+    while (atEof) {
+        if (nextEofPair < eofPairs.size()) {
+            EofPair* pair = &eofPairs[nextEofPair++];
+            char* buffer = eofBuffers[eofBuffer].buffer;
+            DataBatch batch(eofBuffer + 1, EofFileID);
+            int readOneToOutputRead = ((PackedRead*)(buffer + pair->later))->firstSegment ? 0 : 1;
+            unpack(buffer + pair->later, outputReads[readOneToOutputRead], batch);
+            unpack(buffer + pair->earlier, outputReads[1 - readOneToOutputRead], batch);
+            return true;
+        }
+        if (! matchNextShardAtEof()) {
+            break;
+        }
+    }
+
+    if (atEof && ! reportedEof) {
+        reportedEof = true;
+        if (nUnpairedAtEof > 0) {
+            WriteErrorMessage( " warning: PairedReadMatcher discarding %lld unpaired reads at eof\n", nUnpairedAtEof);
+        }
+        if (nReadsQuicklyDropped > 0) {
+            WriteErrorMessage(" warning: PairedReadMatcher dropped %lld reads because they didn't have RNEXT and PNEXT filled in.\n"
+                           " If your input file was generated by a single-end alignment (or this seems too big), use the -ku flag\n",
+                nReadsQuicklyDropped);
+        }
+    }
+    return false;
+}
+
+    void
+ShardedPairedReadMatcher::holdBatch(
+    DataBatch batch)
+{
+    if (batch.fileID == EofFileID) {
+        InterlockedIncrementAndReturnNewValue(&eofBuffers[batch.batchID - 1].holds);
+    } else {
+        AcquireExclusiveLock(&heldBatchLock);
+        HeldBatch* held = heldBatches.tryFind(batch.asKey());
+        if (held == NULL) {
+            HeldBatch newHeld = {1, NULL};
+            heldBatches.put(batch.asKey(), newHeld);
+        } else {
+            held->holds++;
+        }
+        ReleaseExclusiveLock(&heldBatchLock);
+        single->holdBatch(batch);
+    }
+}
+
+    bool
+ShardedPairedReadMatcher::releaseBatch(
+    DataBatch batch)
+{
+    if (batch.asKey() == 0) {
+        return true;
+    } else if (batch.fileID == EofFileID) {
+        EofBuffer* eof = &eofBuffers[batch.batchID - 1];
+        if (0 == InterlockedDecrementAndReturnNewValue(&eof->holds)) {
+            delete [] eof->buffer;
+            eof->buffer = NULL;
+            return true;
+        }
+        return false;
+    }
+
+    BufferVector* v = NULL;
+    AcquireExclusiveLock(&heldBatchLock);
+    HeldBatch* held = heldBatches.tryFind(batch.asKey());
+    if (held != NULL && --held->holds == 0) {
+        v = held->restored;
+        heldBatches.erase(batch.asKey());
+    }
+    ReleaseExclusiveLock(&heldBatchLock);
+    if (v != NULL) {
+        for (BufferVector::iterator i = v->begin(); i != v->end(); i++) {
+            delete [] *i;
+        }
+        delete v;
+    }
+    return single->releaseBatch(batch);
+}
+
+volatile int ShardedPairedReadMatcher::nMatchers = 0;
+
+const _int64 PairedReadReader::DefaultMatcherMemory = (_int64)2 * 1024 * 1024 * 1024;
+
 // define static factory function
 
     PairedReadReader*
@@ -431,3 +1399,13 @@ PairedReadReader::PairMatcher(
 {
     return new PairedReadMatcher(single, quicklyDropUnpairedReads);
 }
+
+    PairedReadReader*
+PairedReadReader::ShardedPairMatcher(
+    ReadReader* single,
+    bool quicklyDropUnpairedReads,
+    int nThreads)
+{
+    int nShards = __min(ShardedPairedReadMatcher::MaxShards, __max(1, nThreads / ShardedPairedReadMatcher::ThreadsPerShard));
+    return new ShardedPairedReadMatcher(single, quicklyDropUnpairedReads, nShards);
+}
@@ -0,0 +1,748 @@
+/*++
+
+Module Name:
+
+    ParallelGzip.cpp
+
+Abstract:
+
+    Multithreaded decompressor for ordinary (non-BGZF) gzip files.
+
+Environment:
+
+    User mode service.
+
+Revision History:
+
+--*/
+
+#include "stdafx.h"
+#include "ParallelGzip.h"
+#include "zlib.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::min;
+using std::max;
+
+//
+// The deflate format is RFC 1951, and the gzip wrapper is RFC 1952.
+//
+
+static const _uint16 LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const _uint8 LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const _uint16 DistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const _uint8 DistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const _uint8 CodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const int MaxCodeLength = 15;
+static const int MaxMatchLength = 258;
+static const int SpeculativeExpansionLimit = 32;    // A guessed start that expands more than this is probably wrong
+
+//
+// Parse a gzip member header starting at byte *io_offset, leaving *io_offset at the start of the deflate data.
+//
+    static bool
+ParseGzipHeader(
+    const _uint8   *contents,
+    _int64          fileSize,
+    _int64         *io_offset)
+{
+    _int64 offset = *io_offset;
+    if (offset + 10 > fileSize || contents[offset] != 0x1f || contents[offset + 1] != 0x8b || contents[offset + 2] != 8) {
+        return false;
+    }
+    _uint8 flags = contents[offset + 3];
+    if (flags & 0xe0) {
+        return false;   // Reserved flags
+    }
+    offset += 10;
+
+    if (flags & 4) {    // FEXTRA
+        if (offset + 2 > fileSize) {
+            return false;
+        }
+        offset += 2 + (contents[offset] | (contents[offset + 1] << 8));
+    }
+    for (int field = 8; field <= 16; field <<= 1) {     // FNAME and FCOMMENT are NUL terminated
+        if (flags & field) {
+            while (offset < fileSize && contents[offset] != 0) {
+                offset++;
+            }
+            offset++;
+        }
+    }
+    if (flags & 2) {    // FHCRC
+        offset += 2;
+    }
+    if (offset >= fileSize) {
+        return false;
+    }
+
+    *io_offset = offset;
+    return true;
+}
+
+//
+// Decodes deflate blocks into a chunk.  There's one of these for each call to decodeChunk, so it doesn't need to be thread safe.
+//
+class DeflateDecoder
+{
+public:
+    DeflateDecoder(const _uint8* i_contents, _int64 i_fileSize) : contents(i_contents), fileSize(i_fileSize), fileBits(i_fileSize * 8) {}
+
+    //
+    // Decode from startBit until the first dynamic block boundary at or after endBit, or the end of the gzip stream.
+    // Returns false if the data isn't valid deflate.
+    //
+    bool decode(ParallelGzipInflater::Chunk* chunk, _int64 startBit, _int64 nominalEndBit, int validWindowSize, _int64 maxSymbols);
+
+    //
+    // Quick check for the start of a dynamic block at bit, to rule out most candidates before trying to decode.
+    //
+    bool mightBeDynamicBlock(_int64 bit) {
+        pos = bit;
+        _uint64 bits = peek();
+        return ((bits >> 1) & 3) == 2 && ((bits >> 3) & 31) <= 29 && ((bits >> 8) & 31) <= 29;
+    }
+
+private:
+    struct HuffmanTable {
+        static const int FastBits = 10;
+
+        _uint16     fast[1 << FastBits];    // symbol << 4 | length for codes of up to FastBits bits, 0 for longer ones
+        _uint16     count[MaxCodeLength + 1];
+        _uint16     symbol[288];
+
+        bool build(const _uint8* lengths, int nSymbols, bool allowIncomplete);
+    };
+
+    //
+    // At least 56 valid bits starting at pos.  Bits beyond the end of the file are zero.
+    //
+    _uint64 peek() {
+        _int64 byte = pos >> 3;
+        _uint64 value = 0;
+        if (byte + 8 <= fileSize) {
+            memcpy(&value, contents + byte, 8);
+        } else {
+            for (_int64 i = byte; i < fileSize; i++) {
+                value |= (_uint64)contents[i] << ((i - byte) * 8);
+            }
+        }
+        return value >> (pos & 7);
+    }
+
+    unsigned getBits(int n) {
+        unsigned value = (unsigned)(peek() & ((1 << n) - 1));
+        pos += n;
+        return value;
+    }
+
+    int decodeSymbol(const HuffmanTable* table);
+    bool readDynamicTables();
+    bool decodeHuffmanBlock(ParallelGzipInflater::Chunk* chunk, int validWindowSize, _int64 maxSymbols);
+    bool decodeStoredBlock(ParallelGzipInflater::Chunk* chunk, _int64 maxSymbols);
+    bool ensureCapacity(ParallelGzipInflater::Chunk* chunk, _int64 nMoreSymbols, _int64 maxSymbols);
+
+    const _uint8   *contents;
+    _int64          fileSize;
+    _int64          fileBits;
+    _int64          pos;
+
+    HuffmanTable    lengthTable;
+    HuffmanTable    distanceTable;
+};
+
+    bool
+DeflateDecoder::HuffmanTable::build(
+    const _uint8   *lengths,
+    int             nSymbols,
+    bool            allowIncomplete)
+{
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i < nSymbols; i++) {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+
+    int maxLength = 0;
+    int left = 1;
+    for (int length = 1; length <= MaxCodeLength; length++) {
+        left <<= 1;
+        left -= count[length];
+        if (left < 0) {
+            return false;   // Over-subscribed
+        }
+        if (count[length] > 0) {
+            maxLength = length;
+        }
+    }
+    //
+    // Like zlib, allow an incomplete code only when it's a single one bit code.  A code with no symbols at all is fine (for
+    // distances); it just can't decode anything.
+    //
+    if (left > 0 && maxLength > 0 && !(allowIncomplete && maxLength == 1)) {
+        return false;
+    }
+
+    _uint16 offsets[MaxCodeLength + 2];
+    _uint16 nextCode[MaxCodeLength + 1];
+    offsets[1] = 0;
+    nextCode[0] = 0;
+    int code = 0;
+    for (int length = 1; length <= MaxCodeLength; length++) {
+        offsets[length + 1] = offsets[length] + count[length];
+        code = (code + count[length - 1]) << 1;
+        nextCode[length] = (_uint16)code;
+    }
+
+    memset(fast, 0, sizeof(fast));
+    for (int i = 0; i < nSymbols; i++) {
+        int length = lengths[i];
+        if (length == 0) {
+            continue;
+        }
+        symbol[offsets[length]++] = (_uint16)i;
+
+        int symbolCode = nextCode[length]++;
+        if (length <= FastBits) {
+            //
+            // Huffman codes are packed starting with their most significant bit, so reverse the code to index the table.
+            //
+            int reversed = 0;
+            for (int bit = 0; bit < length; bit++) {
+                reversed |= ((symbolCode >> bit) & 1) << (length - 1 - bit);
+            }
+            for (int entry = reversed; entry < (1 << FastBits); entry += 1 << length) {
+                fast[entry] = (_uint16)(i << 4 | length);
+            }
+        }
+    }
+    return true;
+}
+
+    int
+DeflateDecoder::decodeSymbol(
+    const HuffmanTable *table)
+{
+    _uint64 bits = peek();
+    _uint16 entry = table->fast[bits & ((1 << HuffmanTable::FastBits) - 1)];
+    if (entry != 0) {
+        pos += entry & 15;
+        return entry >> 4;
+    }
+
+    //
+    // A longer code (or an invalid one).  Decode it a bit at a time the canonical way.
+    //
+    int code = 0, first = 0, index = 0;
+    for (int length = 1; length <= MaxCodeLength; length++) {
+        code |= (int)(bits >> (length - 1)) & 1;
+        int count = table->count[length];
+        if (code - count < first) {
+            pos += length;
+            return table->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+    bool
+DeflateDecoder::readDynamicTables()
+{
+    int nLengthCodes = getBits(5) + 257;
+    int nDistanceCodes = getBits(5) + 1;
+    int nCodeLengthCodes = getBits(4) + 4;
+    if (nLengthCodes > 286 || nDistanceCodes > 30) {
+        return false;
+    }
+
+    _uint8 lengths[286 + 30];
+    memset(lengths, 0, 19);
+    for (int i = 0; i < nCodeLengthCodes; i++) {
+        lengths[CodeLengthOrder[i]] = (_uint8)getBits(3);
+    }
+    HuffmanTable *codeLengthTable = &lengthTable;  // Just scratch until the real length table is built
+    if (!codeLengthTable->build(lengths, 19, false)) {
+        return false;
+    }
+
+    int nLengths = nLengthCodes + nDistanceCodes;
+    int i = 0;
+    while (i < nLengths) {
+        int symbol = decodeSymbol(codeLengthTable);
+        if (symbol < 0) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[i++] = (_uint8)symbol;
+            continue;
+        }
+
+        _uint8 value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (i == 0) {
+                return false;
+            }
+            value = lengths[i - 1];
+            repeat = 3 + getBits(2);
+        } else if (symbol == 17) {
+            repeat = 3 + getBits(3);
+        } else {
+            repeat = 11 + getBits(7);
+        }
+        if (i + repeat > nLengths) {
+            return false;
+        }
+        while (repeat-- > 0) {
+            lengths[i++] = value;
+        }
+    }
+
+    if (lengths[256] == 0) {
+        return false;   // No end of block code
+    }
+    return lengthTable.build(lengths, nLengthCodes, true) && distanceTable.build(lengths + nLengthCodes, nDistanceCodes, true);
+}
+
+    bool
+DeflateDecoder::ensureCapacity(
+    ParallelGzipInflater::Chunk    *chunk,
+    _int64                          nMoreSymbols,
+    _int64                          maxSymbols)
+{
+    _int64 needed = chunk->nSymbols + nMoreSymbols;
+    if (needed <= chunk->symbolCapacity) {
+        return true;
+    }
+    if (needed > maxSymbols) {
+        return false;
+    }
+
+    _int64 newCapacity = max(needed, chunk->symbolCapacity * 2);
+    _uint16 *newSymbols = new _uint16[newCapacity];
+    memcpy(newSymbols, chunk->symbols, chunk->nSymbols * sizeof(_uint16));
+    delete [] chunk->symbols;
+    chunk->symbols = newSymbols;
+    chunk->symbolCapacity = newCapacity;
+    return true;
+}
+
+    bool
+DeflateDecoder::decodeHuffmanBlock(
+    ParallelGzipInflater::Chunk    *chunk,
+    int                             validWindowSize,
+    _int64                          maxSymbols)
+{
+    for (;;) {
+        if (pos > fileBits || !ensureCapacity(chunk, MaxMatchLength, maxSymbols)) {
+            return false;
+        }
+
+        int symbol = decodeSymbol(&lengthTable);
+        if (symbol < 256) {
+            if (symbol < 0) {
+                return false;
+            }
+            chunk->symbols[chunk->nSymbols++] = (_uint16)symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            return pos <= fileBits;
+        }
+        if (symbol > 285) {
+            return false;
+        }
+
+        int length = LengthBase[symbol - 257] + getBits(LengthExtra[symbol - 257]);
+        int distanceSymbol = decodeSymbol(&distanceTable);
+        if (distanceSymbol < 0 || distanceSymbol >= 30) {
+            return false;
+        }
+        _int64 distance = DistanceBase[distanceSymbol] + getBits(DistanceExtra[distanceSymbol]);
+        if (distance > chunk->nSymbols + validWindowSize) {
+            return false;
+        }
+
+        _uint16 *out = chunk->symbols + chunk->nSymbols;
+        if (distance <= chunk->nSymbols) {
+            const _uint16 *from = out - distance;
+            for (int i = 0; i < length; i++) {
+                out[i] = from[i];   // May overlap, which is how deflate does runs
+            }
+        } else {
+            //
+            // Some or all of the match is before the start of the chunk, so write placeholders for those bytes.
+            //
+            for (int i = 0; i < length; i++) {
+                _int64 from = chunk->nSymbols + i - distance;
+                if (from >= 0) {
+                    out[i] = chunk->symbols[from];
+                } else {
+                    int windowIndex = (int)(ParallelGzipInflater::WindowSize + from);
+                    chunk->minWindowIndex = min(chunk->minWindowIndex, windowIndex);
+                    out[i] = (_uint16)(256 + windowIndex);
+                }
+            }
+        }
+        chunk->nSymbols += length;
+    }
+}
+
+    bool
+DeflateDecoder::decodeStoredBlock(
+    ParallelGzipInflater::Chunk    *chunk,
+    _int64                          maxSymbols)
+{
+    pos = (pos + 7) & ~(_int64)7;
+    _int64 byte = pos >> 3;
+    if (byte + 4 > fileSize) {
+        return false;
+    }
+    unsigned length = contents[byte] | (contents[byte + 1] << 8);
+    unsigned complement = contents[byte + 2] | (contents[byte + 3] << 8);
+    byte += 4;
+    if ((length ^ 0xffff) != complement || byte + length > fileSize || !ensureCapacity(chunk, length, maxSymbols)) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < length; i++) {
+        chunk->symbols[chunk->nSymbols++] = contents[byte + i];
+    }
+    pos = (byte + length) * 8;
+    return true;
+}
+
+    bool
+DeflateDecoder::decode(
+    ParallelGzipInflater::Chunk    *chunk,
+    _int64                          startBit,
+    _int64                          nominalEndBit,
+    int                             validWindowSize,
+    _int64                          maxSymbols)
+{
+    pos = startBit;
+    chunk->startBit = startBit;
+    chunk->nSymbols = 0;
+    chunk->streamEnded = false;
+    chunk->minWindowIndex = ParallelGzipInflater::WindowSize;
+    chunk->memberEnds.clear();
+
+    for (;;) {
+        if (pos + 3 > fileBits) {
+            return false;
+        }
+        bool finalBlock = getBits(1) != 0;
+        int blockType = getBits(2);
+        bool ok;
+        if (blockType == 0) {
+            ok = decodeStoredBlock(chunk, maxSymbols);
+        } else if (blockType == 1) {
+            _uint8 lengths[288 + 32];
+            memset(lengths, 8, 144);
+            memset(lengths + 144, 9, 112);
+            memset(lengths + 256, 7, 24);
+            memset(lengths + 280, 8, 8);
+            memset(lengths + 288, 5, 32);
+            ok = lengthTable.build(lengths, 288, false) && distanceTable.build(lengths + 288, 32, false) &&
+                decodeHuffmanBlock(chunk, validWindowSize, maxSymbols);
+        } else if (blockType == 2) {
+            ok = readDynamicTables() && decodeHuffmanBlock(chunk, validWindowSize, maxSymbols);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+
+        if (finalBlock) {
+            //
+            // End of a gzip member.  The trailer is the CRC and size of its output, and then there's either another member or
+            // the end of the file.
+            //
+            _int64 byte = (pos + 7) >> 3;
+            if (byte + 8 > fileSize) {
+                return false;
+            }
+            ParallelGzipInflater::MemberEnd memberEnd;
+            memberEnd.outputOffset = chunk->nSymbols;
+            memberEnd.crc = contents[byte] | (contents[byte + 1] << 8) | (contents[byte + 2] << 16) | ((unsigned)contents[byte + 3] << 24);
+            memberEnd.isize = contents[byte + 4] | (contents[byte + 5] << 8) | (contents[byte + 6] << 16) | ((unsigned)contents[byte + 7] << 24);
+            chunk->memberEnds.push_back(memberEnd);
+            byte += 8;
+
+            if (!ParseGzipHeader(contents, fileSize, &byte)) {
+                chunk->streamEnded = true;
+                chunk->endBit = byte * 8;
+                return true;
+            }
+            pos = byte * 8;
+        }
+
+        if (pos >= nominalEndBit && pos + 3 <= fileBits && ((peek() >> 1) & 3) == 2) {
+            chunk->endBit = pos;
+            return true;
+        }
+    }
+}
+
+class ParallelGzipWorker : public ParallelWorker
+{
+public:
+    virtual void step()
+    {
+        ((ParallelGzipInflater*)getManager())->workerStep(getThreadNum(), getNumThreads());
+    }
+};
+
+    ParallelGzipInflater*
+ParallelGzipInflater::create(
+    const char     *fileName,
+    int             nThreads,
+    _int64          chunkSize)
+{
+    _int64 fileSize = QueryFileSize(fileName);
+    if (nThreads < 2 || fileSize < 2 * chunkSize) {
+        return NULL;
+    }
+
+    void *contents;
+    MemoryMappedFile *mappedFile = OpenMemoryMappedFile(fileName, 0, (size_t)fileSize, &contents, false, true);
+    if (NULL == mappedFile) {
+        return NULL;
+    }
+
+    _int64 firstBlock = 0;
+    if (!ParseGzipHeader((const _uint8*)contents, fileSize, &firstBlock)) {
+        CloseMemoryMappedFile(mappedFile);
+        return NULL;
+    }
+
+    return new ParallelGzipInflater(fileName, mappedFile, (const _uint8*)contents, fileSize, firstBlock * 8, nThreads, chunkSize);
+}
+
+ParallelGzipInflater::ParallelGzipInflater(
+    const char         *i_fileName,
+    MemoryMappedFile   *i_mappedFile,
+    const _uint8       *i_contents,
+    _int64              i_fileSize,
+    _int64              i_firstBlockBit,
+    int                 i_nThreads,
+    _int64              i_chunkSize) :
+    fileName(i_fileName), mappedFile(i_mappedFile), contents(i_contents), fileSize(i_fileSize), chunkBits(i_chunkSize * 8),
+    nThreads(i_nThreads), nChunksInRound(0), nextChunkToRead(0), offsetInChunk(0), nextBit(i_firstBlockBit),
+    validWindowSize(0), streamEnded(false), memberCrc(0), memberLength(0)
+{
+    nNominalChunks = (fileSize * 8 + chunkBits - 1) / chunkBits;
+    chunks = new Chunk[nThreads];
+    memset(window, 0, sizeof(window));
+
+    coworker = new ParallelCoworker(nThreads, false, this);
+    coworker->start();
+}
+
+ParallelGzipInflater::~ParallelGzipInflater()
+{
+    coworker->stop();
+    delete coworker;
+    delete [] chunks;
+    CloseMemoryMappedFile(mappedFile);
+}
+
+    ParallelWorker*
+ParallelGzipInflater::createWorker()
+{
+    return new ParallelGzipWorker();
+}
+
+    void
+ParallelGzipInflater::corrupt(
+    const char *what)
+{
+    WriteErrorMessage("ParallelGzipInflater: %s is not a valid gzip file (%s)\n", fileName, what);
+    soft_exit(1);
+}
+
+    void
+ParallelGzipInflater::workerStep(
+    int threadNum,
+    int numThreads)
+{
+    for (int i = threadNum; i < nChunksInRound; i += numThreads) {
+        if (phase == DecodePhase) {
+            decodeChunk(&chunks[i], chunks[i].startBit, i != 0, i == 0 ? validWindowSize : WindowSize);
+        } else {
+            translateChunk(&chunks[i]);
+        }
+    }
+}
+
+    void
+ParallelGzipInflater::decodeChunk(
+    Chunk  *chunk,
+    _int64  startBit,
+    bool    speculative,
+    int     chunkValidWindowSize)
+{
+    DeflateDecoder decoder(contents, fileSize);
+    chunk->speculative = speculative;
+    chunk->nSymbols = 0;
+    if (!speculative) {
+        chunk->ok = decoder.decode(chunk, startBit, chunk->nominalEndBit, chunkValidWindowSize, INT64_MAX);
+        return;
+    }
+
+    //
+    // Try every bit in the chunk that might be the start of a dynamic block until one decodes.  A real block boundary always
+    // decodes, and random data almost never gets through the checks on the tables, so this usually only takes one decode.
+    //
+    _int64 maxSymbols = SpeculativeExpansionLimit * (chunkBits / 8);
+    for (_int64 bit = startBit; bit < chunk->nominalEndBit; bit++) {
+        if (decoder.mightBeDynamicBlock(bit) && decoder.decode(chunk, bit, chunk->nominalEndBit, chunkValidWindowSize, maxSymbols)) {
+            chunk->ok = true;
+            return;
+        }
+    }
+    chunk->ok = false;
+}
+
+    void
+ParallelGzipInflater::translateChunk(
+    Chunk  *chunk)
+{
+    //
+    // In place: byte i never overwrites a symbol that hasn't been translated yet.
+    //
+    _uint8 *bytes = (_uint8 *)chunk->symbols;
+    for (_int64 i = 0; i < chunk->nSymbols; i++) {
+        _uint16 symbol = chunk->symbols[i];
+        bytes[i] = symbol < 256 ? (_uint8)symbol : chunk->window[symbol - 256];
+    }
+
+    chunk->segmentCrcs.clear();
+    _int64 segmentStart = 0;
+    for (_int64 i = 0; i <= chunk->memberEnds.size(); i++) {
+        _int64 segmentEnd = i < chunk->memberEnds.size() ? chunk->memberEnds[i].outputOffset : chunk->nSymbols;
+        chunk->segmentCrcs.push_back((unsigned)crc32(0, bytes + segmentStart, (uInt)(segmentEnd - segmentStart)));
+        segmentStart = segmentEnd;
+    }
+}
+
+    void
+ParallelGzipInflater::runRound()
+{
+    if (nextBit >= fileSize * 8) {
+        corrupt("truncated");
+    }
+
+    _int64 firstNominalChunk = nextBit / chunkBits;
+    nChunksInRound = (int)min((_int64)nThreads, nNominalChunks - firstNominalChunk);
+    for (int i = 0; i < nChunksInRound; i++) {
+        chunks[i].nominalEndBit = min((firstNominalChunk + i + 1) * chunkBits, fileSize * 8);
+        chunks[i].startBit = i == 0 ? nextBit : (firstNominalChunk + i) * chunkBits;
+    }
+
+    phase = DecodePhase;
+    coworker->step();
+
+    //
+    // Check that each chunk started where the one before it ended, redoing the ones that didn't, and pass the window along.
+    //
+    for (int i = 0; i < nChunksInRound; i++) {
+        Chunk *chunk = &chunks[i];
+        if (streamEnded) {
+            nChunksInRound = i;     // Anything after the end of the stream is ignored, just like zlib
+            break;
+        }
+        if (!chunk->ok || chunk->startBit != nextBit || chunk->minWindowIndex < WindowSize - validWindowSize) {
+            decodeChunk(chunk, nextBit, false, validWindowSize);
+            if (!chunk->ok) {
+                corrupt("bad deflate data");
+            }
+        }
+
+        memcpy(chunk->window, window, WindowSize);
+        _int64 nSymbols = chunk->nSymbols;
+        if (nSymbols >= WindowSize) {
+            for (int j = 0; j < WindowSize; j++) {
+                _uint16 symbol = chunk->symbols[nSymbols - WindowSize + j];
+                window[j] = symbol < 256 ? (_uint8)symbol : chunk->window[symbol - 256];
+            }
+        } else {
+            memmove(window, window + nSymbols, WindowSize - nSymbols);
+            for (int j = 0; j < nSymbols; j++) {
+                _uint16 symbol = chunk->symbols[j];
+                window[WindowSize - nSymbols + j] = symbol < 256 ? (_uint8)symbol : chunk->window[symbol - 256];
+            }
+        }
+        validWindowSize = (int)min((_int64)WindowSize, validWindowSize + nSymbols);
+
+        nextBit = chunk->endBit;
+        streamEnded = chunk->streamEnded;
+    }
+
+    phase = TranslatePhase;
+    coworker->step();
+
+    for (int i = 0; i < nChunksInRound; i++) {
+        Chunk *chunk = &chunks[i];
+        _int64 segmentStart = 0;
+        for (_int64 j = 0; j < chunk->segmentCrcs.size(); j++) {
+            bool memberEnded = j < chunk->memberEnds.size();
+            _int64 segmentEnd = memberEnded ? chunk->memberEnds[j].outputOffset : chunk->nSymbols;
+            memberCrc = (unsigned)crc32_combine(memberCrc, chunk->segmentCrcs[j], segmentEnd - segmentStart);
+            memberLength += segmentEnd - segmentStart;
+            segmentStart = segmentEnd;
+
+            if (memberEnded) {
+                if (memberCrc != chunk->memberEnds[j].crc || (unsigned)memberLength != chunk->memberEnds[j].isize) {
+                    corrupt("CRC or length mismatch");
+                }
+                memberCrc = 0;
+                memberLength = 0;
+            }
+        }
+    }
+
+    nextChunkToRead = 0;
+    offsetInChunk = 0;
+}
+
+    _int64
+ParallelGzipInflater::read(
+    char   *output,
+    _int64  outputSize)
+{
+    _int64 written = 0;
+    while (written < outputSize) {
+        if (nextChunkToRead >= nChunksInRound) {
+            if (streamEnded) {
+                break;
+            }
+            runRound();
+            continue;
+        }
+
+        Chunk *chunk = &chunks[nextChunkToRead];
+        _int64 bytes = min(outputSize - written, chunk->nSymbols - offsetInChunk);
+        memcpy(output + written, (char *)chunk->symbols + offsetInChunk, bytes);
+        written += bytes;
+        offsetInChunk += bytes;
+        if (offsetInChunk == chunk->nSymbols) {
+            nextChunkToRead++;
+            offsetInChunk = 0;
+        }
+    }
+    return written;
+}
@@ -0,0 +1,146 @@
+/*++
+
+Module Name:
+
+    ParallelGzip.h
+
+Abstract:
+
+    Header for a multithreaded decompressor for ordinary (non-BGZF) gzip files.
+
+Environment:
+
+    User mode service.
+
+    This class is NOT thread safe.  One thread calls read(); it uses its own worker threads internally.
+
+Revision History:
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "ParallelTask.h"
+#include "VariableSizeVector.h"
+
+//
+// BGZF files can be decompressed in parallel because every block is a separate gzip member that says how big it is.
+// An ordinary gzip file is one deflate stream, which has no index and where every block can refer back to the 32KB
+// of output before it, so it has always been decompressed on one thread, and for FASTQ that's usually the bottleneck.
+//
+// ParallelGzipInflater does what pugz and rapidgzip do.  It splits the compressed file into chunks of chunkSize bytes,
+// and in each round decompresses one chunk per thread:
+//
+//  1. Every chunk but the first one in the round starts from a guess: the first bit in the chunk that looks like the
+//     start of a dynamic Huffman block and whose block decodes cleanly.  Back references to the (unknown) 32KB before the
+//     chunk are written as placeholders rather than bytes.  A chunk stops at the first dynamic block boundary after its
+//     nominal end, so if the guess for the next chunk was right, it started where this one stops.
+//  2. Sequentially, check that each chunk started where its predecessor stopped (and redo it from there if not, which
+//     only costs the parallelism for that chunk), and pass the last 32KB of output from one chunk to the next.
+//  3. In parallel, replace the placeholders with the bytes from the window and compute the CRCs.
+//  4. Sequentially, check the CRC and size of each gzip member.
+//
+// Multi-member files work, since a chunk just keeps going across member boundaries.  Anything that looks corrupt is a fatal
+// error, just like it is with zlib.
+//
+class ParallelGzipInflater : public ParallelWorkerManager
+{
+public:
+    //
+    // Returns NULL if the file isn't gzip, can't be mapped, or is too small to be worth decompressing in parallel, in which
+    // case the caller should just use zlib.
+    //
+    static ParallelGzipInflater* create(const char* fileName, int nThreads, _int64 chunkSize = DefaultChunkSize);
+
+    virtual ~ParallelGzipInflater();
+
+    //
+    // Fill output with up to outputSize bytes of decompressed data.  Returns the number of bytes written, which is less than
+    // outputSize only at the end of the file (and 0 after that).
+    //
+    _int64 read(char* output, _int64 outputSize);
+
+    bool isDone() const {return streamEnded && nextChunkToRead >= nChunksInRound;}
+
+    // Roughly how far into the compressed file read() has gotten, for error messages
+    _int64 getCompressedOffset() const {return nextBit / 8;}
+
+    virtual ParallelWorker* createWorker();
+
+    static const _int64 DefaultChunkSize = 1024 * 1024;
+    static const int WindowSize = 32768;
+
+private:
+    ParallelGzipInflater(const char* i_fileName, MemoryMappedFile* i_mappedFile, const _uint8* i_contents, _int64 i_fileSize,
+        _int64 i_firstBlockBit, int i_nThreads, _int64 i_chunkSize);
+
+    struct MemberEnd {
+        _int64      outputOffset;   // Within the chunk
+        unsigned    crc;            // From the gzip trailer
+        unsigned    isize;
+    };
+
+    struct Chunk {
+        Chunk() : symbols(NULL), symbolCapacity(0) {}
+        ~Chunk() {delete [] symbols;}
+
+        _int64      nominalEndBit;
+        _int64      startBit;
+        _int64      endBit;
+        bool        speculative;    // startBit was a guess
+        bool        ok;             // Decoded without any errors
+        bool        streamEnded;    // The last gzip member ended in this chunk
+        int         minWindowIndex; // Lowest byte of window that a placeholder refers to
+
+        //
+        // Decoded output.  Values below 256 are bytes, and 256 + i is byte i of window.  Translating turns them into bytes
+        // in place, so after that symbols is really a char array.
+        //
+        _uint16    *symbols;
+        _int64      nSymbols;
+        _int64      symbolCapacity;
+
+        _uint8      window[WindowSize];     // The output just before the chunk, right aligned
+
+        VariableSizeVector<MemberEnd>   memberEnds;
+        VariableSizeVector<unsigned>    segmentCrcs;    // Of the output between member ends
+    };
+
+    friend class ParallelGzipWorker;
+    friend class DeflateDecoder;
+
+    enum Phase {DecodePhase, TranslatePhase};
+
+    void workerStep(int threadNum, int numThreads);
+    void decodeChunk(Chunk* chunk, _int64 startBit, bool speculative, int validWindowSize);
+    void translateChunk(Chunk* chunk);
+    void runRound();
+    void corrupt(const char* what);
+
+    const char             *fileName;
+    MemoryMappedFile       *mappedFile;
+    const _uint8           *contents;
+    _int64                  fileSize;
+    _int64                  chunkBits;
+    _int64                  nNominalChunks;
+    int                     nThreads;
+    ParallelCoworker       *coworker;
+    Phase                   phase;
+
+    Chunk                  *chunks;         // nThreads of them, reused every round
+    int                     nChunksInRound;
+    int                     nextChunkToRead;
+    _int64                  offsetInChunk;
+
+    //
+    // State carried from one round to the next.
+    //
+    _int64                  nextBit;            // Where the next chunk starts
+    _uint8                  window[WindowSize]; // The last WindowSize bytes of output, right aligned
+    int                     validWindowSize;    // Less than WindowSize only near the start of the file
+    bool                    streamEnded;
+    unsigned                memberCrc;          // CRC and length of the output of the current member so far
+    _int64                  memberLength;
+};
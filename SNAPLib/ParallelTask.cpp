@@ -67,8 +67,11 @@ void ParallelCoworker::start()
 void ParallelCoworker::step()
 {
     manager->beginStep();
+    // reset all of them before starting any, or thread 0 could see a stale workDone from the last step and call back early
     for (int i = 0; i < numThreads; i++) {
         PreventEventWaitersFromProceeding(&workDone[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
         AllowEventWaitersToProceed(&workReady[i]);
     }
     // if async, thread 0 will callback when all workers finish
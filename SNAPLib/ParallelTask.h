@@ -154,11 +154,17 @@ ParallelTask<TContext>::run()
     DestroyEventObject(&memoryAllocationCompleteBarrier);
 #endif  // _MSC_VER
 
-    for (int i = 0; i < common->totalThreads; i++) {
-        contexts[i].finishThread(common);
-    }
-
     common->time = timeInMillis() - start;
+
+    //
+    // Once the last thread has finished, a forked task's owner can delete this object and common (see ParallelCoworker::stop),
+    // so don't touch either of them after that.
+    //
+    int totalThreads = common->totalThreads;
+    TContext* threadContexts = contexts;
+    for (int i = 0; i < totalThreads; i++) {
+        threadContexts[i].finishThread(common);
+    }
 }
 
     template <class TContext>
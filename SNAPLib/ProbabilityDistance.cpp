@@ -21,8 +21,12 @@ namespace {
 }
 
 
-ProbabilityDistance::ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb)
+ProbabilityDistance::ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb, int i_maxReadLength)
+    : maxReadLength(i_maxReadLength)
 {
+    d = new double[maxReadLength + 1][2*MAX_SHIFT+1][3];
+    prev = new State[maxReadLength + 1][2*MAX_SHIFT+1][3];
+
     snpLogProb = log(snpProb);
     gapOpenLogProb = log(gapOpenProb);
     gapExtensionLogProb = log(gapExtensionProb);
@@ -50,6 +54,13 @@ ProbabilityDistance::ProbabilityDistance(double snpProb, double gapOpenProb, dou
 }
 
 
+ProbabilityDistance::~ProbabilityDistance()
+{
+    delete [] d;
+    delete [] prev;
+}
+
+
 int ProbabilityDistance::compute(
         const char *reference,
         const char *read,
@@ -62,6 +73,7 @@ int ProbabilityDistance::compute(
     _ASSERT(maxStartShift < MAX_SHIFT);
     _ASSERT(maxShift < MAX_SHIFT);
     _ASSERT(maxStartShift <= maxShift);
+    _ASSERT(readLen <= maxReadLength);
 
     // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift
     for (int s = -maxShift-1; s <= maxShift+1; s++) {
@@ -12,10 +12,13 @@
 //
 class ProbabilityDistance {
 public:
-    static const int MAX_READ = MAX_READ_LENGTH;
     static const int MAX_SHIFT = 20;
 
-    ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb);
+    //
+    // maxReadLength bounds readLen in compute().  The tables below are sized from it.
+    //
+    ProbabilityDistance(double snpProb, double gapOpenProb, double gapExtensionProb, int maxReadLength);
+    ~ProbabilityDistance();
 
     int compute(
             const char *reference,
@@ -27,6 +30,7 @@ public:
             double *matchProbability);
 
 private:
+    int maxReadLength;
     double snpLogProb;
     double gapOpenLogProb;
     double gapExtensionLogProb;
@@ -42,7 +46,7 @@ private:
     // substring read[0..readPos] to reference[?..readPos + shift]. The "?" in reference is
     // because we allow starting an alignment from reference[-maxStartShift..maxStartShift]
     // instead of just reference[0], to deal with indels toward the start of the read.
-    double d[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    double (*d)[2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus], maxReadLength + 1 of them
 
     // A state in the D array, used for backtracking pointers
     struct State {
@@ -52,5 +56,5 @@ private:
     };
 
     // Previous state in our dynamic program, for backtracking to print CIGAR strings
-    State prev[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    State (*prev)[2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
 };
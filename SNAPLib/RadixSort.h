@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+    RadixSort.h
+
+Abstract:
+
+    Stable LSD radix sort by 64 bit keys.
+
+Environment:
+
+    User mode service.
+
+    Thread safe; it only touches the arrays it's given.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include <algorithm>
+
+    template <class T, class GetKey>
+struct RadixSortCompare
+{
+    RadixSortCompare(GetKey i_getKey) : getKey(i_getKey) {}
+    bool operator()(const T& a, const T& b) const { return getKey(a) < getKey(b); }
+    GetKey getKey;
+};
+
+//
+// Sorts n items by an unsigned 64 bit key that getKey (a functor, _uint64 operator()(const T&) const) gets from each one,
+// keeping items with equal keys in the order they came in.  It makes one pass to count all the digits at once and then
+// one pass per 11 bit digit, skipping any digit that's the same for every item, so genome locations (which never use
+// the top 30 or so bits) take 3 passes, each a sequential read and 2048 sequential writes.  That's much cheaper than the
+// n log n compares and the merging buffer of std::stable_sort for the size of batches SortedDataWriter sorts.
+//
+// scratch has to have room for n items.  Returns whichever of items or scratch the result ended up in.
+//
+    template <class T, class GetKey>
+    T*
+RadixSort(
+    T*      items,
+    T*      scratch,
+    size_t  n,
+    GetKey  getKey)
+{
+    const int DigitBits = 11;
+    const int Buckets = 1 << DigitBits;
+    const int Digits = (64 + DigitBits - 1) / DigitBits;
+    const _uint64 DigitMask = Buckets - 1;
+
+    //
+    // The histograms cost about as much as sorting a few thousand items, so leave small batches to std::stable_sort.
+    //
+    const size_t MinItems = 4096;
+    if (n < MinItems) {
+        std::stable_sort(items, items + n, RadixSortCompare<T, GetKey>(getKey));
+        return items;
+    }
+
+    size_t* counts = new size_t[Digits * Buckets];
+    memset(counts, 0, Digits * Buckets * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        _uint64 key = getKey(items[i]);
+        for (int d = 0; d < Digits; d++) {
+            counts[d * Buckets + ((key >> (d * DigitBits)) & DigitMask)]++;
+        }
+    }
+
+    T* from = items;
+    T* to = scratch;
+    for (int d = 0; d < Digits; d++) {
+        size_t* digitCounts = counts + d * Buckets;
+        _uint64 firstDigit = (getKey(items[0]) >> (d * DigitBits)) & DigitMask;
+        if (digitCounts[firstDigit] == n) {
+            continue; // all the same
+        }
+        // turn counts into where each bucket starts
+        size_t next = 0;
+        for (int b = 0; b < Buckets; b++) {
+            size_t count = digitCounts[b];
+            digitCounts[b] = next;
+            next += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            to[digitCounts[(getKey(from[i]) >> (d * DigitBits)) & DigitMask]++] = from[i];
+        }
+        T* t = from;
+        from = to;
+        to = t;
+    }
+    delete [] counts;
+    return from;
+}
@@ -130,7 +130,7 @@ RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
 		headerSize = 0;
 	}
 
-	splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 5, headerSize, 200, 10 * MAX_READ_LENGTH);
+	splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 5, headerSize, 200, 10 * INITIAL_MAX_READ_LENGTH);
 }
 
 ReadSupplier *
@@ -24,6 +24,7 @@ Revision History:
 #include "stdafx.h"
 #include "Read.h"
 #include "SAM.h"
+#include "Bam.h"
 #include "Error.h"
 
 	bool
@@ -48,6 +49,62 @@ Read::checkIdMatch(
     }
 }
 
-    
-const unsigned Read::localBufferLength = 3 * MAX_READ_LENGTH;
+    void
+Read::readTooLong(
+    const char* id,
+    unsigned idLength,
+    unsigned length)
+{
+    if (MaxReadLength < MAX_READ_LENGTH) {
+        WriteErrorMessage("Read '%.*s' is %u bases long, but this run only takes reads of up to %u bases.  Use -xrl to raise that (up to %d).\n",
+            (int) min(idLength, 200u), id, length, MaxReadLength, MAX_READ_LENGTH);
+    } else {
+        WriteErrorMessage("Read '%.*s' is %u bases long, but SNAP only handles reads of up to %d bases (MAX_READ_LENGTH in Read.h).\n",
+            (int) min(idLength, 200u), id, length, MAX_READ_LENGTH);
+    }
+    soft_exit(1);
+}
+
+    const char*
+Read::getReadGroupName(
+    char* buffer,
+    unsigned bufferSize) const
+{
+    if (readGroup != READ_GROUP_FROM_AUX) {
+        return readGroup;
+    }
+
+    const char* name = NULL;
+    size_t nameLength = 0;
+    if (auxiliaryData != NULL && auxiliaryDataLength >= 5 && auxiliaryData[2] == ':') {
+        for (char* p = auxiliaryData; p != NULL && p < auxiliaryData + auxiliaryDataLength;
+                p = SAMReader::skipToBeyondNextFieldSeparator(p, auxiliaryData + auxiliaryDataLength)) {
+            if (strncmp(p, "RG:Z:", 5) == 0) {
+                size_t fieldLength;
+                SAMReader::skipToBeyondNextFieldSeparator(p, auxiliaryData + auxiliaryDataLength, &fieldLength);
+                name = p + 5;
+                nameLength = fieldLength - 5;
+                break;
+            }
+        }
+    } else if (auxiliaryData != NULL) {
+        for (BAMAlignAux* aux = (BAMAlignAux*) auxiliaryData; (char*) aux < auxiliaryData + auxiliaryDataLength; aux = aux->next()) {
+            if (aux->tag[0] == 'R' && aux->tag[1] == 'G' && aux->val_type == 'Z') {
+                name = (char*) aux->value();
+                nameLength = strnlen(name, auxiliaryData + auxiliaryDataLength - name);
+                break;
+            }
+        }
+    }
+
+    if (name == NULL || bufferSize == 0) {
+        return NULL;
+    }
+    nameLength = min(nameLength, (size_t) bufferSize - 1);
+    memcpy(buffer, name, nameLength);
+    buffer[nameLength] = '\0';
+    return buffer;
+}
+
 const unsigned DEFAULT_MIN_READ_LENGTH = 50;
+unsigned MaxReadLength = DEFAULT_MAX_READ_LENGTH;
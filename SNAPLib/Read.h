@@ -42,12 +42,15 @@ struct PairedAlignmentResult;
 
 
 
-//#define LONG_READS
-#ifdef LONG_READS
+//
+// The longest read SNAP takes at all.  Nothing is sized for it up front: the buffers that hold a read are sized from the read
+// itself, and each aligner thread starts out sized for reads of INITIAL_MAX_READ_LENGTH bases and grows the first time
+// it sees a longer one.  The readers' overflow and line buffers can't grow, so they're sized from MaxReadLength, the
+// longest read this run accepts.  That's DEFAULT_MAX_READ_LENGTH unless -xrl or -lr raise it.
+//
 #define MAX_READ_LENGTH 400000
-#else
-#define MAX_READ_LENGTH 400
-#endif
+#define DEFAULT_MAX_READ_LENGTH 10000
+#define INITIAL_MAX_READ_LENGTH 400
 
 //
 // Here's a brief description of the classes for input in SNAP:
@@ -81,7 +84,7 @@ struct PairedAlignmentResult;
 //      The paired version of a ReadSupplier.
 //
 
-const int MaxReadLength = MAX_READ_LENGTH;
+extern unsigned MaxReadLength;
 
 class Read;
 
@@ -101,6 +104,11 @@ struct ReaderContext
     size_t              headerLength; // length of string
     size_t              headerBytes; // bytes used for header in file
     bool                headerMatchesIndex; // header refseq matches current index
+    const char*         regions; // -region: only read these parts of a sorted, indexed BAM file (NULL for all of it)
+    bool                writeMateScores; // add ms:i (mate's total base quality) to paired BAM output for duplicate marking
+    _int64              matcherMemory; // -pmm: how much a sharded pair matcher's unmatched reads may take before they spill
+    const char*         spillDirectory; // -pmt: where the pair matcher spills to, or NULL for next to the output
+    const char*         outputFileName; // what spill files are named for, or NULL (or "-") for anonymous temp files
 };
 
 class ReadReader {
@@ -143,6 +151,14 @@ public:
 
     // wrap a single read source with a matcher that buffers reads until their mate is found
     static PairedReadReader* PairMatcher(ReadReader* single, bool quicklyDropUnpairedReads);
+
+    // the same, for big inputs that aren't in name order; matches on several threads (depending on how many aligner
+    // threads it has to keep up with), and spills reads whose mates are far away to temp files
+    static PairedReadReader* ShardedPairMatcher(ReadReader* single, bool quicklyDropUnpairedReads, int nThreads);
+
+    // how much memory ShardedPairMatcher's unmatched reads may take before they spill, unless -pmm says otherwise
+    static const _int64 DefaultMatcherMemory;
+
     static const int MatchBuffers = 2;
 };
 
@@ -214,8 +230,9 @@ public:
 
     virtual void close() = 0;
 
+    // gapOpenPenalty is from -G; if non-zero, CIGAR strings for alignments with indels are realigned with affine gap penalties
     static ReadWriterSupplier* create(const FileFormat* format, DataWriterSupplier* dataSupplier,
-        const Genome* genome);
+        const Genome* genome, unsigned gapOpenPenalty = 0);
 };
 
 #define READ_GROUP_FROM_AUX     ((const char*) -1)
@@ -224,7 +241,7 @@ class Read {
 public:
         Read() :    
             id(NULL), data(NULL), quality(NULL), 
-            localBufferAllocationOffset(0),
+            localBuffer(NULL), localBufferLength(0), localBufferAllocationOffset(0),
             clippingState(NoClipping), currentReadDirection(FORWARD),
             upcaseForwardRead(NULL), auxiliaryData(NULL), auxiliaryDataLength(0),
             readGroup(NULL), originalAlignedLocation(-1), originalMAPQ(-1), originalSAMFlags(0),
@@ -232,13 +249,14 @@ public:
             originalRNEXT(NULL), originalRNEXTLength(0), originalPNEXT(0), additionalFrontClipping(0)
         {}
 
-        Read(const Read& other) :  localBufferAllocationOffset(0)
+        Read(const Read& other) :  localBuffer(NULL), localBufferLength(0), localBufferAllocationOffset(0)
         {
             copyFromOtherRead(other);
         }
 
         ~Read()
         {
+            delete [] localBuffer;
         }
 
         void dispose()
@@ -390,6 +408,10 @@ public:
                 unsigned            i_originalPNEXT,
                 bool                allUpper = false)
         {
+            if (i_dataLength > MaxReadLength) {
+                readTooLong(i_id, i_idLength, i_dataLength);
+            }
+
             id = i_id;
             idLength = i_idLength;
             data = unclippedData = externalData = i_data;
@@ -456,6 +478,12 @@ public:
         inline void setBatch(DataBatch b) { batch = b; }
         inline const char* getReadGroup() const { return readGroup; }
         inline void setReadGroup(const char* rg) { readGroup = rg; }
+
+        //
+        // The name of the read's group, even when the reader left READ_GROUP_FROM_AUX and the group in the RG:Z field.
+        // SAM fields aren't null terminated, so the name is copied into buffer (truncated to fit).  NULL if there's no group.
+        //
+        const char* getReadGroupName(char* buffer, unsigned bufferSize) const;
         inline GenomeLocation getOriginalAlignedLocation() {return originalAlignedLocation;}
         inline unsigned getOriginalMAPQ() {return originalMAPQ;}
         inline unsigned getOriginalSAMFlags() {return originalSAMFlags;}
@@ -621,6 +649,12 @@ public:
 
 		static void checkIdMatch(Read* read0, Read* read1);
 
+        //
+        // Reads longer than MaxReadLength don't fit in the readers' buffers, so init stops SNAP with this rather than
+        // let them overflow.
+        //
+        static void readTooLong(const char* id, unsigned idLength, unsigned length);
+
         static void computeClippingFromCigar(const char *cigarBuffer, unsigned *originalFrontClipping, unsigned *originalBackClipping, unsigned *originalFrontHardClipping, unsigned *originalBackHardClipping)
         {
             size_t cigarSize;
@@ -683,10 +717,11 @@ private:
 
         //
         // Memory that's local to this read and that is used to contain an upcased version of the read as well as 
-        // RC read & quality strings.  It survives init() so as to avoid memory allocation overhead.
+        // RC read & quality strings.  It survives init() so as to avoid memory allocation overhead, and only grows when
+        // a longer read comes along.
         //
-        char localBuffer[MAX_READ_LENGTH * 3];
-        static const unsigned localBufferLength;
+        char *localBuffer;
+        unsigned localBufferLength;
         unsigned localBufferAllocationOffset;   // The next location to allocate in the local buffer.
         char *upcaseForwardRead;                // Either NULL or points into localBuffer.  Used when the incoming read isn't all capitalized.  Unclipped.
         char *rcData;                           // Either NULL or points into localBuffer.  Used when we've computed a reverse complement of the read, whether we're using it or not.  Unclipped.
@@ -697,17 +732,12 @@ private:
 
         inline void assureLocalBufferLargeEnough()
         {
-#if 0   // Always true with static allocation
             if (localBufferLength < 3 * unclippedLength) {
                 _ASSERT(0 == localBufferAllocationOffset);  // Can only do this when the buffer is empty
-                if (NULL != localBuffer) {
-                    BigDealloc(localBuffer);
-                }
-                localBufferLength = RoundUpToPageSize(3 * unclippedLength);
-                localBuffer = (char *)BigAlloc(localBufferLength);
+                delete [] localBuffer;
+                localBufferLength = 3 * __max(unclippedLength, (unsigned) INITIAL_MAX_READ_LENGTH);
+                localBuffer = new char[localBufferLength];
             }
-
-#endif // 0
         }
 
         // batch for managing lifetime during input
@@ -790,39 +820,21 @@ private:
 
     void set(const Read &baseRead)
     {
-        // allocate space in ownBuffer if possible; id/aux might need extraBuffer
-        dataBuffer = ownBuffer;
-        int ownBufferUsed = baseRead.getUnclippedLength() + 1;
-        qualityBuffer = ownBuffer + ownBufferUsed;
-        ownBufferUsed += baseRead.getUnclippedLength() + 1;
+        // everything goes in ownBuffer if it fits, otherwise (long reads, or long ids or aux data) in extraBuffer
         unsigned auxLen;
         bool auxSam;
         char* aux = baseRead.getAuxiliaryData(&auxLen, &auxSam);
-        if (baseRead.getIdLength() + 1 < sizeof(ownBuffer) - ownBufferUsed) {
-            idBuffer = ownBuffer + ownBufferUsed;
-            ownBufferUsed += baseRead.getIdLength() + 1;
-        } else {
-            idBuffer = NULL;
-        }
-        if (auxLen > 0 && auxLen < sizeof(ownBuffer) - ownBufferUsed) {
-            auxBuffer = ownBuffer + ownBufferUsed;
-            ownBufferUsed += auxLen;
-        } else {
-            auxBuffer = NULL;
-        }
-        if (idBuffer == NULL || (auxLen > 0 && auxBuffer == NULL)) {
-            extraBuffer = new char[(idBuffer == NULL ? baseRead.getIdLength() + 1 : 0) + auxLen];
-            int extraBufferUsed = 0;
-            if (idBuffer == NULL) {
-                idBuffer = extraBuffer;
-                extraBufferUsed += baseRead.getIdLength() + 1;
-            }
-            if (auxLen > 0 && auxBuffer == NULL) {
-                auxBuffer = extraBuffer + extraBufferUsed;
-            }
-        } else {
+        size_t needed = 2 * (baseRead.getUnclippedLength() + 1) + baseRead.getIdLength() + 1 + auxLen;
+        if (needed <= sizeof(ownBuffer)) {
+            dataBuffer = ownBuffer;
             extraBuffer = NULL;
+        } else {
+            extraBuffer = new char[needed];
+            dataBuffer = extraBuffer;
         }
+        qualityBuffer = dataBuffer + baseRead.getUnclippedLength() + 1;
+        idBuffer = qualityBuffer + baseRead.getUnclippedLength() + 1;
+        auxBuffer = auxLen > 0 ? idBuffer + baseRead.getIdLength() + 1 : NULL;
 
         // copy data into buffers
         memcpy(idBuffer,baseRead.getId(),baseRead.getIdLength());
@@ -847,7 +859,7 @@ private:
         }
     }
         
-    char ownBuffer[MAX_READ_LENGTH * 2 + 1000]; // internal buffer for copied data
+    char ownBuffer[INITIAL_MAX_READ_LENGTH * 2 + 1000]; // internal buffer for copied data
     char* extraBuffer; // extra buffer if internal buffer not big enough
 
     // should all point into ownBuffer or extraBuffer
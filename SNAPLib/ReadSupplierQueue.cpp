@@ -277,12 +277,15 @@ ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **e
         int sizes[2] = {elements[0]->totalReads, elements[1]->totalReads};
         int largerOne = elements[1]->totalReads > elements[0]->totalReads;
         int minReads = elements[1-largerOne]->totalReads;
-        memcpy(copyOut->reads, elements[largerOne]->reads, minReads * sizeof(Read));
+        for (int i = 0; i < minReads; i++) {
+            copyOut->reads[i] = elements[largerOne]->reads[i];
+        }
         _ASSERT(elements[0]->totalReads == sizes[0] && elements[1]->totalReads == sizes[1] && elements[largerOne]->totalReads > elements[1-largerOne]->totalReads);
         copyOut->totalReads = minReads;
         _ASSERT(elements[0]->totalReads == sizes[0] && elements[1]->totalReads == sizes[1] && elements[largerOne]->totalReads > elements[1-largerOne]->totalReads);
-        memmove(elements[largerOne]->reads, &elements[largerOne]->reads[minReads],
-            (elements[largerOne]->totalReads - minReads) * sizeof(Read));
+        for (int i = minReads; i < elements[largerOne]->totalReads; i++) {
+            elements[largerOne]->reads[i - minReads] = elements[largerOne]->reads[i];
+        }
         elements[largerOne]->totalReads -= minReads;
         copyOut->batches.append(&elements[largerOne]->batches);
         for (BatchVector::iterator i = copyOut->batches.begin(); i != copyOut->batches.end(); i++) {
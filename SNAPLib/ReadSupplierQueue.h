@@ -38,21 +38,17 @@ struct ReadQueueElement {
     ReadQueueElement()
         : next(NULL), prev(NULL)
     {
-        reads = (Read*) BigAlloc(MaxReadsPerElement * sizeof(Read));
+        reads = new Read[MaxReadsPerElement];
     }
 
     ~ReadQueueElement()
     {
-        BigDealloc(reads);
+        delete [] reads;
         reads = NULL;
     }
 
     // note this should be about read buffer size for input reads
-#ifdef LONG_READS
-    static const int    MaxReadsPerElement = 400; 
-#else
     static const int    MaxReadsPerElement = 5000; 
-#endif
     ReadQueueElement    *next;
     ReadQueueElement    *prev;
     int                 totalReads;
@@ -27,6 +27,7 @@ Environment:
 #include "Util.h"
 #include "ReadSupplierQueue.h"
 #include "FileFormat.h"
+#include "AffineGap.h"
 #include "exit.h"
 #include "Error.h"
 #include "Genome.h"
@@ -34,13 +35,19 @@ Environment:
 class SimpleReadWriter : public ReadWriter
 {
 public:
-    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome)
-        : format(i_format), writer(i_writer), genome(i_genome)
-    {}
+    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome, unsigned gapOpenPenalty)
+        : format(i_format), writer(i_writer), genome(i_genome), affineGap(NULL)
+    {
+        if (0 != gapOpenPenalty) {
+            affineGap = new AffineGapWithCigar(1, 4, gapOpenPenalty, 1);
+            lvc.setAffineGapRealigner(affineGap);
+        }
+    }
 
     virtual ~SimpleReadWriter()
     {
         delete writer;
+        delete affineGap;
     }
 
 	virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine, bool omitSQLines);
@@ -57,6 +64,7 @@ private:
     DataWriter* writer;
     const Genome* genome;
     LandauVishkinWithCigar lvc;
+    AffineGapWithCigar *affineGap;  // Used by lvc, NULL unless -G was specified
 };
 
     bool
@@ -514,11 +522,12 @@ SimpleReadWriter::close()
 class SimpleReadWriterSupplier : public ReadWriterSupplier
 {
 public:
-    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome)
+    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome, unsigned i_gapOpenPenalty)
         :
         format(i_format),
         dataSupplier(i_dataSupplier),
-        genome(i_genome)
+        genome(i_genome),
+        gapOpenPenalty(i_gapOpenPenalty)
     {}
 
     ~SimpleReadWriterSupplier()
@@ -528,7 +537,7 @@ public:
 
     virtual ReadWriter* getWriter()
     {
-        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome);
+        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome, gapOpenPenalty);
     }
 
     virtual void close()
@@ -540,14 +549,16 @@ private:
     const FileFormat* format;
     DataWriterSupplier* dataSupplier;
     const Genome* genome;
+    unsigned gapOpenPenalty;
 };
 
     ReadWriterSupplier*
 ReadWriterSupplier::create(
     const FileFormat* format,
     DataWriterSupplier* dataSupplier,
-    const Genome* genome)
+    const Genome* genome,
+    unsigned gapOpenPenalty)
 {
-    return new SimpleReadWriterSupplier(format, dataSupplier, genome);
+    return new SimpleReadWriterSupplier(format, dataSupplier, genome, gapOpenPenalty);
 }
 
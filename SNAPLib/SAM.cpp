@@ -21,6 +21,7 @@ Environment:
 #include "Compat.h"
 #include "Read.h"
 #include "SAM.h"
+#include "SAMEmitter.h"
 #include "Bam.h"
 #include "Tables.h"
 #include "RangeSplitter.h"
@@ -118,10 +119,11 @@ SAMReader::create(
     int bufferCount,
     const ReaderContext& context,
     _int64 startingOffset, 
-    _int64 amountOfFileToProcess)
+    _int64 amountOfFileToProcess,
+    bool compressed)
 {
-    DataReader* data = supplier->getDataReader(bufferCount, maxLineLen, 0.0, 0);
-    SAMReader *reader = new SAMReader(data, context);
+    DataReader* data = supplier->getDataReader(bufferCount, maxLineLen(), 0.0, 0);
+    SAMReader *reader = new SAMReader(data, context, compressed);
     reader->init(fileName, startingOffset, amountOfFileToProcess);
     return reader;
 }
@@ -161,8 +163,9 @@ SAMReader::readHeader(const char *fileName)
 
 SAMReader::SAMReader(
     DataReader* i_data,
-    const ReaderContext& i_context)
-    : ReadReader(i_context), data(i_data), headerSize(-1), clipping(i_context.clipping)
+    const ReaderContext& i_context,
+    bool i_compressed)
+    : ReadReader(i_context), data(i_data), headerSize(-1), clipping(i_context.clipping), compressed(i_compressed)
 {
 }
 
@@ -554,6 +557,29 @@ SAMReader::init(
     }
 
     headerSize = context.headerBytes;
+    if (compressed) {
+        //
+        // The header size is in decompressed bytes, so start at the beginning and skip over it.
+        //
+        _ASSERT(0 == startingOffset && 0 == amountOfFileToProcess);
+        data->reinit(0, 0);
+        _int64 bytesToSkip = headerSize;
+        while (bytesToSkip > 0) {
+            char* buffer;
+            _int64 validBytes;
+            if (! data->getData(&buffer, &validBytes)) {
+                if (data->isEOF()) {
+                    break;
+                }
+                data->nextBatch();
+                continue;
+            }
+            _int64 bytesToSkipThisTime = __min(validBytes, bytesToSkip);
+            data->advance(bytesToSkipThisTime);
+            bytesToSkip -= bytesToSkipThisTime;
+        }
+        return;
+    }
     reinit(max(startingOffset, (_int64) context.headerBytes),
         amountOfFileToProcess == 0 || startingOffset >= (_int64) context.headerBytes ? amountOfFileToProcess
             : amountOfFileToProcess - (context.headerBytes - startingOffset));
@@ -636,20 +662,29 @@ SAMReader::getNextRead(
 SAMReader::createReadSupplierGenerator(
     const char *fileName,
     int numThreads,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    bool compressed)
 {
     //
-    // single-ended SAM files always can be read with the range splitter, unless reading from stdin, which needs a queue
+    // single-ended SAM files always can be read with the range splitter, unless reading from stdin or a compressed file,
+    // which need a queue
     //
-    if (!strcmp(fileName, "-")) {
+    bool isStdin = !strcmp(fileName, "-");
+    if (isStdin || compressed) {
         //
         // Stdin must run from a queue, not range splitter.
         //
         ReadReader* reader;
+        DataSupplier* supplier;
+        if (isStdin) {
+            supplier = compressed ? DataSupplier::GzipStdio : DataSupplier::Stdio;
+        } else {
+            supplier = DataSupplier::DecompressDefaultForFile(fileName);
+        }
         //
         // Because we can only have one stdin reader, we need to use a queue if we're reading from stdin
         //
-        reader = SAMReader::create(DataSupplier::Stdio, "-", ReadSupplierQueue::BufferCount(numThreads), context, 0, 0);
+        reader = SAMReader::create(supplier, fileName, ReadSupplierQueue::BufferCount(numThreads), context, 0, 0, compressed);
    
         if (reader == NULL) {
             return NULL;
@@ -671,19 +706,26 @@ SAMReader::createPairedReader(
     _int64 startingOffset,
     _int64 amountOfFileToProcess, 
     bool quicklyDropUnpairedReads,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    bool compressed,
+    int matcherThreads)
 {
     DataSupplier *data;
     if (!strcmp("-", fileName)) {
-        data = DataSupplier::Stdio;
+        data = compressed ? DataSupplier::GzipStdio : DataSupplier::Stdio;
+    } else if (compressed) {
+        data = DataSupplier::DecompressDefaultForFile(fileName);
     } else {
         data = DataSupplier::Default;
     }
 
-    SAMReader* reader = SAMReader::create(data, fileName, bufferCount + PairedReadReader::MatchBuffers, context, 0, 0);
+    SAMReader* reader = SAMReader::create(data, fileName, bufferCount + PairedReadReader::MatchBuffers, context, 0, 0, compressed);
     if (reader == NULL) {
         return NULL;
     }
+    if (matcherThreads > 0) {
+        return PairedReadReader::ShardedPairMatcher(reader, quicklyDropUnpairedReads, matcherThreads);
+    }
     return PairedReadReader::PairMatcher(reader, quicklyDropUnpairedReads);
 }
 
@@ -693,14 +735,15 @@ SAMReader::createPairedReadSupplierGenerator(
     const char *fileName,
     int numThreads,
     bool quicklyDropUnpairedReads, 
-    const ReaderContext& context)
+    const ReaderContext& context,
+    bool compressed)
 {
     //
     // need to use a queue so that pairs can be matched
     //
 
     PairedReadReader* paired = SAMReader::createPairedReader(DataSupplier::Default, fileName,
-        ReadSupplierQueue::BufferCount(numThreads), 0, 0, quicklyDropUnpairedReads, context);
+        ReadSupplierQueue::BufferCount(numThreads), 0, 0, quicklyDropUnpairedReads, context, compressed, numThreads);
     if (paired == NULL) {
         WriteErrorMessage( "Cannot create reader on %s\n", fileName);
         soft_exit(1);
@@ -874,16 +917,16 @@ SAMFormat::getWriterSupplier(
     DataWriterSupplier* dataSupplier;
     if (options->sortOutput) {
         size_t len = strlen(options->outputFile.fileName);
-        // todo: this is going to leak, but there's no easy way to free it, and it's small...
         char* tempFileName = (char*) malloc(5 + len);
         strcpy(tempFileName, options->outputFile.fileName);
         strcpy(tempFileName + len, ".tmp");
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName, options->sortMemory * (1ULL << 30),
             options->numThreads, options->outputFile.fileName, NULL, options->writeBufferSize);
+        free(tempFileName);
     } else {
         dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, options->writeBufferSize);
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
 }
 
     bool
@@ -1163,6 +1206,21 @@ SAMFormat::createSAMLine(
     return true;
 }
 
+//
+// The contig names that createSAMLine hands back are either the genome's own, whose lengths it already has, or "*" or "=".
+//
+    static inline size_t
+contigNameLength(
+    const Genome*   genome,
+    const char*     name,
+    int             contigIndex)
+{
+    if (contigIndex >= 0 && name == genome->getContigs()[contigIndex].name) {
+        return genome->getContigs()[contigIndex].nameLength;
+    }
+    return strlen(name);
+}
+
     bool
 SAMFormat::writeRead(
     const ReaderContext& context,
@@ -1187,12 +1245,12 @@ SAMFormat::writeRead(
     bool alignedAsPair
     ) const
 {
-    const int MAX_READ = MAX_READ_LENGTH;
+    const int MAX_READ = __max((int) read->getUnclippedLength(), INITIAL_MAX_READ_LENGTH);
     const int cigarBufSize = MAX_READ * 2;
-    char cigarBuf[cigarBufSize];
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH * 2> cigarBuf(cigarBufSize);
 
     const int cigarBufWithClippingSize = MAX_READ * 2 + 32;
-    char cigarBufWithClipping[cigarBufWithClippingSize];
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH * 2 + 32> cigarBufWithClipping(cigarBufWithClippingSize);
 
     int flags = 0;
     const char *contigName = "*";
@@ -1204,8 +1262,8 @@ SAMFormat::writeRead(
     GenomeDistance matePositionInContig = 0;
     _int64 templateLength = 0;
 
-    char data[MAX_READ];
-    char quality[MAX_READ];
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH> data(MAX_READ);
+    util::StackOrHeapArray<char, INITIAL_MAX_READ_LENGTH> quality(MAX_READ);
 
     const char* clippedData;
     unsigned fullLength;
@@ -1260,10 +1318,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];  
-    snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -1300,34 +1354,48 @@ SAMFormat::writeRead(
             readGroupString = read->getReadGroup();
         }
     }
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s\n",
-        qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString, rglineAuxLen, rglineAux);
-
-    if (charsInString > bufferSpace) {
+    SAMEmitter out(buffer, bufferSpace);
+    out.chars(read->getId(), qnameLen);
+    out.tab();
+    out.number(flags);
+    out.tab();
+    out.chars(contigName, contigNameLength(context.genome, contigName, contigIndex));
+    out.tab();
+    out.number((unsigned) positionInContig);
+    out.tab();
+    out.number(mapQuality);
+    out.tab();
+    out.text(cigar);
+    out.tab();
+    out.chars(matecontigName, contigNameLength(context.genome, matecontigName, mateContigIndex));
+    out.tab();
+    out.number((unsigned) matePositionInContig);
+    out.tab();
+    out.signedNumber(templateLength);
+    out.tab();
+    out.chars(data, fullLength);
+    out.tab();
+    out.chars(quality, fullLength);
+    if (aux != NULL) {
+        out.tab();
+        out.chars(aux, auxLen);
+    }
+    out.text(readGroupSeparator);
+    out.text(readGroupString);
+    out.text("\tPG:Z:SNAP\tNM:i:");
+    out.signedNumber(editDistance);
+    out.chars(rglineAux, rglineAuxLen);
+    out.ch('\n');
+
+    if (out.overflowed()) {
         //
         // Out of buffer space.
         //
         return false;
-    } else if (charsInString == bufferSpace) {
-      buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
     }
 
-
     if (NULL != spaceUsed) {
-        *spaceUsed = charsInString;
+        *spaceUsed = out.used();
     }
     return true;
 }
@@ -1499,23 +1567,25 @@ SAMFormat::computeCigarString(
         return "*";
     } else {
         // Add some CIGAR instructions for soft-clipping if we've ignored some bases in the read.
-        char clipBefore[16] = {'\0'};
-        char clipAfter[16] = {'\0'};
-        char hardClipBefore[16] = {'\0'};
-        char hardClipAfter[16] = {'\0'};
+        SAMEmitter out(cigarBufWithClipping, cigarBufWithClippingLen - 1);  // leave room for the null
         if (frontHardClipping > 0) {
-            snprintf(hardClipBefore, sizeof(hardClipBefore), "%uH", frontHardClipping);
+            out.number(frontHardClipping);
+            out.ch('H');
         }
         if (basesClippedBefore + extraBasesClippedBefore > 0) {
-            snprintf(clipBefore, sizeof(clipBefore), "%lluS", basesClippedBefore + extraBasesClippedBefore);
+            out.number(basesClippedBefore + extraBasesClippedBefore);
+            out.ch('S');
         }
+        out.text(cigarBuf);
         if (basesClippedAfter + extraBasesClippedAfter > 0) {
-            snprintf(clipAfter, sizeof(clipAfter), "%lluS", basesClippedAfter + extraBasesClippedAfter);
+            out.number(basesClippedAfter + extraBasesClippedAfter);
+            out.ch('S');
         }
         if (backHardClipping > 0) {
-            snprintf(hardClipAfter, sizeof(hardClipAfter), "%uH", backHardClipping);
+            out.number(backHardClipping);
+            out.ch('H');
         }
-        snprintf(cigarBufWithClipping, cigarBufWithClippingLen, "%s%s%s%s%s", hardClipBefore, clipBefore, cigarBuf, clipAfter, hardClipAfter);
+        cigarBufWithClipping[out.used()] = '\0';
 
 		validateCigarString(genome, cigarBufWithClipping, cigarBufWithClippingLen, 
 			data - basesClippedBefore, dataLength + (basesClippedBefore + basesClippedAfter), genomeLocation + extraBasesClippedBefore, direction, useM);
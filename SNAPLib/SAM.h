@@ -53,7 +53,7 @@ class SAMReader : public ReadReader {
 public:
         virtual ~SAMReader() {}
 
-        SAMReader(DataReader* i_data, const ReaderContext& i_context);
+        SAMReader(DataReader* i_data, const ReaderContext& i_context, bool i_compressed = false);
 
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
 
@@ -73,17 +73,24 @@ public:
         
         static SAMReader* create(DataSupplier* supplier, const char *fileName,
                 int bufferCount, const ReaderContext& i_context,
-                _int64 startingOffset, _int64 amountOfFileToProcess);
+                _int64 startingOffset, _int64 amountOfFileToProcess, bool compressed = false);
         
+        //
+        // matcherThreads is the number of aligner threads the pair matcher has to keep up with, or 0 for the simple one.
+        //
         static PairedReadReader* createPairedReader(const DataSupplier* supplier,
                 const char *fileName, int bufferCount, _int64 startingOffset, _int64 amountOfFileToProcess, 
-                bool quicklyDropUnpairedReads, const ReaderContext& context);
+                bool quicklyDropUnpairedReads, const ReaderContext& context, bool compressed = false, int matcherThreads = 0);
 
+        //
+        // Compressed (gzip or zstd) SAM files are decompressed on the fly, and have to be read from the start by a single
+        // reader because offsets in the file don't correspond to offsets in the SAM text.
+        //
         static ReadSupplierGenerator *createReadSupplierGenerator(
-            const char *fileName, int numThreads, const ReaderContext& context);
+            const char *fileName, int numThreads, const ReaderContext& context, bool compressed = false);
 
         static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(
-            const char *fileName, int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context);
+            const char *fileName, int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context, bool compressed = false);
         
         // result and fieldLengths must be of size nSAMFields
         static bool parseHeader(const char *fileName, char *firstLine, char *endOfBuffer, const Genome *genome, _int64 *o_headerSize, bool* o_headerMatchesIndex, bool *o_sawWholeHeader = NULL);
@@ -110,7 +117,7 @@ protected:
         static const unsigned  OPT          = 11;
         static const unsigned  nSAMFields   = 12;
 
-        static const int maxLineLen = MAX_READ_LENGTH * 5;
+        static int maxLineLen() { return (int) MaxReadLength * 5; }
 
         static bool parseLine(char *line, char *endOfBuffer, char *result[],
             size_t *lineLength, size_t fieldLengths[]);
@@ -139,6 +146,7 @@ private:
         DataReader*         data;
         _int64              headerSize;
         ReadClippingType    clipping;
+        bool                compressed;
 
         bool                didInitialSkip;   // Have we skipped to the beginning of the first SAM line?  We may start in the middle of one.
 
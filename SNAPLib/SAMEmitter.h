@@ -0,0 +1,127 @@
+/*++
+
+Module Name:
+
+    SAMEmitter.h
+
+Abstract:
+
+    Appends SAM text fields to an output buffer without going through printf.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; each writer makes its own for the buffer it's filling.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Tables.h"
+
+//
+// Builds a SAM line (or a piece of one, like a CIGAR string) in a caller's buffer.  snprintf has to parse its format
+// string and handle padding, precision and locales for every field of every read, which made it one of the biggest
+// costs of writing SAM; this just copies bytes and writes numbers two digits at a time from DECIMAL_DIGIT_PAIRS.
+//
+// Nothing is written past the end of the buffer.  Once something doesn't fit, the emitter stops appending and
+// overflowed() is true, so callers can do all of their appends and check once at the end.  It doesn't null
+// terminate anything.
+//
+class SAMEmitter
+{
+public:
+
+    SAMEmitter(char* i_buffer, size_t i_bufferSize) : start(i_buffer), next(i_buffer), end(i_buffer + i_bufferSize), overflow(false) {}
+
+    inline void chars(const char* s, size_t length)
+    {
+        if (length > (size_t)(end - next)) {
+            overflow = true;
+            next = end;
+            return;
+        }
+        memcpy(next, s, length);
+        next += length;
+    }
+
+    inline void text(const char* s)
+    {
+        chars(s, strlen(s));
+    }
+
+    inline void ch(char c)
+    {
+        if (next == end) {
+            overflow = true;
+            return;
+        }
+        *next++ = c;
+    }
+
+    inline void tab()
+    {
+        ch('\t');
+    }
+
+    inline void number(_uint64 value)
+    {
+        char digits[MaxDigits];
+        int n = FormatUnsigned(digits, value);
+        chars(digits, n);
+    }
+
+    inline void signedNumber(_int64 value)
+    {
+        if (value < 0) {
+            ch('-');
+            number((_uint64) 0 - (_uint64) value);  // works for the most negative value too
+        } else {
+            number((_uint64) value);
+        }
+    }
+
+    size_t used() const { return next - start; }
+
+    bool overflowed() const { return overflow; }
+
+    static const int MaxDigits = 20;    // in a 64 bit unsigned number
+
+    //
+    // Writes value in decimal into out, which has to have room for MaxDigits characters, and returns how many it wrote.
+    // The digits come out backwards into a local buffer, two per divide, so there's no need to know ahead of time how
+    // many there'll be.
+    //
+        static inline int
+    FormatUnsigned(char* out, _uint64 value)
+    {
+        char digits[MaxDigits];
+        char* p = digits + MaxDigits;
+        while (value >= 100) {
+            unsigned pair = (unsigned)(value % 100);
+            value /= 100;
+            p -= 2;
+            p[0] = DECIMAL_DIGIT_PAIRS[2 * pair];
+            p[1] = DECIMAL_DIGIT_PAIRS[2 * pair + 1];
+        }
+        if (value >= 10) {
+            p -= 2;
+            p[0] = DECIMAL_DIGIT_PAIRS[2 * value];
+            p[1] = DECIMAL_DIGIT_PAIRS[2 * value + 1];
+        } else {
+            *--p = (char)('0' + value);
+        }
+        int n = (int)(digits + MaxDigits - p);
+        memcpy(out, p, n);
+        return n;
+    }
+
+private:
+
+    char*           start;
+    char*           next;
+    char* const     end;
+    bool            overflow;
+};
@@ -0,0 +1,499 @@
+/*++
+
+Module Name:
+
+    ShardedDataWriter.cpp
+
+Abstract:
+
+    Splits the merged output of a sort into a file per contig or per interval.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; the merge writes through a single writer.
+
+--*/
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "DataWriter.h"
+#include "FileFormat.h"
+#include "Genome.h"
+#include "exit.h"
+#include "Error.h"
+
+using std::max;
+
+SortedShards::~SortedShards()
+{
+    for (int i = 0; i < shards.size(); i++) {
+        delete [] shards[i].fileName;
+    }
+    delete [] restFileName;
+}
+
+    char*
+SortedShards::shardFileName(
+    const char* fileName,
+    const char* name)
+{
+    //
+    // The name goes before the extension, so out.bam becomes out.chr1.bam.  Contig names can have characters that
+    // don't belong in a file name (e.g. HLA alleles like HLA-A*01:01), so anything but letters, digits, '.', '-' and
+    // '_' turns into '_'.
+    //
+    const char* slash = max(strrchr(fileName, '/'), strrchr(fileName, '\\'));
+    const char* dot = strrchr(fileName, '.');
+    size_t stem = dot != NULL && dot > slash && dot > fileName ? dot - fileName : strlen(fileName);
+    size_t nameLength = strlen(name);
+    char* result = new char[strlen(fileName) + nameLength + 2];
+    memcpy(result, fileName, stem);
+    result[stem] = '.';
+    for (size_t i = 0; i < nameLength; i++) {
+        char c = name[i];
+        result[stem + 1 + i] = isalnum((unsigned char) c) || c == '.' || c == '-' || c == '_' ? c : '_';
+    }
+    strcpy(result + stem + 1 + nameLength, fileName + stem);
+    return result;
+}
+
+    void
+SortedShards::addShard(
+    GenomeLocation begin,
+    GenomeLocation end,
+    const char* fileName,
+    const char* name)
+{
+    shards.push_back(Shard(begin, end, shardFileName(fileName, name)));
+}
+
+    bool
+SortedShards::addContigs(
+    const Genome* genome,
+    const char* fileName)
+{
+    const Genome::Contig* contigs = genome->getContigs();
+    int nContigs = genome->getNumContigs();
+    for (int i = 0; i < nContigs; i++) {
+        // reads in the padding after a contig still sort with it
+        GenomeLocation end = i + 1 < nContigs ? contigs[i + 1].beginningLocation : GenomeLocation(genome->getCountOfBases());
+        addShard(contigs[i].beginningLocation, end, fileName, contigs[i].name);
+    }
+    return finish(fileName);
+}
+
+    bool
+SortedShards::addIntervals(
+    const Genome* genome,
+    const char* fileName,
+    const char* bedFileName)
+{
+    FILE* bedFile = fopen(bedFileName, "r");
+    if (bedFile == NULL) {
+        WriteErrorMessage("-shard: unable to open BED file '%s'\n", bedFileName);
+        return false;
+    }
+    char line[4096];
+    for (int lineNumber = 1; fgets(line, sizeof(line), bedFile) != NULL; lineNumber++) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || ! strncmp(line, "track", 5) || ! strncmp(line, "browser", 7)) {
+            continue;
+        }
+        // BED is already [begin, end) counting from 0
+        char* tab = strchr(line, '\t');
+        char* numberEnd = NULL;
+        long begin = -1, end = -1;
+        if (tab != NULL) {
+            begin = strtol(tab + 1, &numberEnd, 10);
+            if (*numberEnd == '\t') {
+                end = strtol(numberEnd + 1, &numberEnd, 10);
+            }
+        }
+        if (tab == NULL || begin < 0 || end <= begin || (*numberEnd != '\t' && *numberEnd != '\n' && *numberEnd != '\r' && *numberEnd != 0)) {
+            WriteErrorMessage("-shard: line %d of BED file '%s' is malformed\n", lineNumber, bedFileName);
+            fclose(bedFile);
+            return false;
+        }
+        *tab = '\0';
+        GenomeLocation contigStart;
+        int contigNum;
+        if (! genome->getLocationOfContig(line, &contigStart, &contigNum)) {
+            WriteErrorMessage("-shard: '%s' on line %d of BED file '%s' isn't a contig in the genome\n", line, lineNumber, bedFileName);
+            fclose(bedFile);
+            return false;
+        }
+        end = (long) min((GenomeDistance) end, genome->getContigs()[contigNum].length);
+        if (begin >= end) {
+            continue;   // all past the end of the contig
+        }
+        char name[sizeof(line) + 48];
+        snprintf(name, sizeof(name), "%s_%ld-%ld", line, begin + 1, end);
+        addShard(contigStart + begin, contigStart + end, fileName, name);
+    }
+    fclose(bedFile);
+    if (shards.size() == 0) {
+        WriteErrorMessage("-shard: BED file '%s' doesn't have any intervals\n", bedFileName);
+        return false;
+    }
+    return finish(fileName);
+}
+
+//
+// Windows and macOS file systems don't care about case, so out.chrM.bam and out.chrm.bam would be the same file there.
+//
+static bool FileNameLess(const char* a, const char* b)
+{
+    return _stricmp(a, b) < 0;
+}
+
+    bool
+SortedShards::finish(
+    const char* fileName)
+{
+    // the merge goes through the shards in order, so they can't overlap
+    std::sort(shards.begin(), shards.end());
+    for (int i = 1; i < shards.size(); i++) {
+        if (shards[i].begin < shards[i - 1].end) {
+            WriteErrorMessage("-shard: intervals for %s and %s overlap\n", shards[i - 1].fileName, shards[i].fileName);
+            return false;
+        }
+    }
+    restFileName = shardFileName(fileName, "unplaced");
+
+    VariableSizeVector<const char*> names;
+    for (int i = 0; i < shards.size(); i++) {
+        names.push_back(shards[i].fileName);
+    }
+    names.push_back(restFileName);
+    std::sort(names.begin(), names.end(), FileNameLess);
+    for (int i = 1; i < names.size(); i++) {
+        if (! _stricmp(names[i - 1], names[i])) {
+            WriteErrorMessage("-shard: more than one shard would be written to %s (%s and %s are the same once they're made safe for a file name)\n",
+                names[i], names[i - 1], names[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// The merge writes through this as if it were the one output file.  Each read is copied on to the writer for the shard
+// its alignment starts in (so a read that starts just before an interval and runs into it goes in whatever file is for
+// where it starts, usually the unplaced one), which is opened when the first read for it shows up (or the merge gets past it) and gets the header
+// that was written here first.  Since the reads come in order, once one is past the end of a shard nothing more can
+// go in it, so it's closed on a thread of its own while the merge goes on to the next; closing has to wait for the
+// encoder to finish with the shard's last buffers and then writes the index, which would otherwise stall the merge
+// once per shard.  Only a couple are closed at a time, to keep a bound on the memory in their buffers.
+//
+class ShardedDataWriter : public DataWriter
+{
+public:
+    ShardedDataWriter(const FileFormat* i_format, const Genome* i_genome, SortedShards* i_shards, size_t i_bufferSize);
+
+    virtual ~ShardedDataWriter();
+
+    virtual void inHeader(bool flag)
+    { writingHeader = flag; }
+
+    virtual bool getBuffer(char** o_buffer, size_t* o_size);
+
+    virtual void advance(GenomeDistance bytes, GenomeLocation location = 0);
+
+    // there's only ever the current batch
+    virtual bool getBatch(int relative, char** o_buffer, size_t* o_size = NULL, size_t* o_used = NULL, size_t* o_offset = NULL, size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL);
+
+    virtual bool nextBatch();
+
+    virtual void close();
+
+private:
+
+    struct ShardFile
+    {
+        ShardFile() : fileName(NULL), supplier(NULL), filterSupplier(NULL), writer(NULL), closing(false) {}
+
+        const char*                     fileName;
+        DataWriterSupplier*             supplier;
+        DataWriter::FilterSupplier*     filterSupplier;
+        DataWriter*                     writer;
+        bool                            closing;
+        SingleWaiterObject              closed;
+    };
+
+    static const int MaxClosing = 2;
+
+    void open(ShardFile* file);
+
+    // close the shard on another thread
+    void finish(ShardFile* file);
+
+    // wait for a shard to finish closing
+    void waitForClose(ShardFile* file);
+
+    static void CloseThreadMain(void* param);
+
+    const FileFormat*           format;
+    const Genome*               genome;
+    SortedShards*               shards;
+    ShardFile*                  files; // one per shard, then the rest
+    int                         nShards;
+    int                         current; // first shard that the merge isn't past yet
+    int                         nextToWait; // first shard that might still be closing
+    char*                       buffer;
+    const size_t                bufferSize;
+    size_t                      used;
+    bool                        writingHeader;
+    char*                       header;
+    size_t                      headerSize;
+    size_t                      headerCapacity;
+};
+
+ShardedDataWriter::ShardedDataWriter(
+    const FileFormat* i_format,
+    const Genome* i_genome,
+    SortedShards* i_shards,
+    size_t i_bufferSize)
+    :
+    DataWriter(NULL),
+    format(i_format),
+    genome(i_genome),
+    shards(i_shards),
+    nShards((int) i_shards->shards.size()),
+    current(0),
+    nextToWait(0),
+    bufferSize(i_bufferSize),
+    used(0),
+    writingHeader(false),
+    header(NULL),
+    headerSize(0),
+    headerCapacity(0)
+{
+    files = new ShardFile[nShards + 1];
+    for (int i = 0; i < nShards; i++) {
+        files[i].fileName = shards->shards[i].fileName;
+    }
+    files[nShards].fileName = shards->restFileName;
+    buffer = (char*) BigAlloc(bufferSize);
+}
+
+ShardedDataWriter::~ShardedDataWriter()
+{
+    BigDealloc(buffer);
+    delete [] header;
+    delete [] files;
+}
+
+    bool
+ShardedDataWriter::getBuffer(
+    char** o_buffer,
+    size_t* o_size)
+{
+    *o_buffer = buffer + used;
+    *o_size = bufferSize - used;
+    return true;
+}
+
+    void
+ShardedDataWriter::advance(
+    GenomeDistance bytes,
+    GenomeLocation location)
+{
+    _ASSERT((size_t) bytes <= bufferSize - used);
+    char* data = buffer + used;
+    used += bytes;
+    if (writingHeader) {
+        if (headerSize + bytes > headerCapacity) {
+            headerCapacity = max(2 * headerCapacity, headerSize + bytes);
+            char* bigger = new char[headerCapacity];
+            memcpy(bigger, header, headerSize);
+            delete [] header;
+            header = bigger;
+        }
+        memcpy(header + headerSize, data, bytes);
+        headerSize += bytes;
+        return;
+    }
+
+    GenomeLocation readLocation;
+    GenomeDistance readBytes;
+    int refID = -1;
+    format->getSortInfo(genome, data, bytes, &readLocation, &readBytes, &refID);
+    ShardFile* file = &files[nShards];
+    if (refID >= 0) {
+        while (current < nShards && readLocation >= shards->shards[current].end) {
+            finish(&files[current++]);
+        }
+        if (current < nShards && readLocation >= shards->shards[current].begin) {
+            file = &files[current];
+        }
+    }
+    if (file->writer == NULL) {
+        open(file);
+    }
+    if (! file->writer->write(data, bytes)) {
+        WriteErrorMessage("ShardedDataWriter: read too big for the write buffer of %s\n", file->fileName);
+        soft_exit(1);
+    }
+}
+
+    bool
+ShardedDataWriter::getBatch(
+    int relative,
+    char** o_buffer,
+    size_t* o_size,
+    size_t* o_used,
+    size_t* o_offset,
+    size_t* o_logicalUsed,
+    size_t* o_logicalOffset)
+{
+    if (relative != 0) {
+        return false;
+    }
+    *o_buffer = buffer;
+    if (o_size != NULL) {
+        *o_size = bufferSize;
+    }
+    if (o_used != NULL) {
+        *o_used = used;
+    }
+    if (o_offset != NULL) {
+        *o_offset = 0;
+    }
+    if (o_logicalUsed != NULL) {
+        *o_logicalUsed = used;
+    }
+    if (o_logicalOffset != NULL) {
+        *o_logicalOffset = 0;
+    }
+    return true;
+}
+
+    bool
+ShardedDataWriter::nextBatch()
+{
+    // everything's already been handed on to the shards
+    used = 0;
+    return true;
+}
+
+    void
+ShardedDataWriter::close()
+{
+    // shards nothing went into still get a file
+    while (current < nShards) {
+        finish(&files[current++]);
+    }
+    finish(&files[nShards]);
+    while (nextToWait < nShards) {
+        waitForClose(&files[nextToWait++]);
+    }
+    waitForClose(&files[nShards]);
+}
+
+    void
+ShardedDataWriter::open(
+    ShardFile* file)
+{
+    file->supplier = shards->createWriterSupplier(file->fileName, &file->filterSupplier);
+    file->writer = file->supplier->getWriter();
+    if (file->writer == NULL) {
+        WriteErrorMessage("unable to open %s for write\n", file->fileName);
+        soft_exit(1);
+    }
+    file->writer->inHeader(true);
+    for (size_t done = 0; done < headerSize; ) {
+        char* wbuffer;
+        size_t wbytes;
+        if ((! file->writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
+            file->writer->nextBatch();
+            if (! file->writer->getBuffer(&wbuffer, &wbytes)) {
+                WriteErrorMessage("write header failed for %s\n", file->fileName);
+                soft_exit(1);
+            }
+        }
+        size_t xfer = min(headerSize - done, wbytes);
+        memcpy(wbuffer, header + done, xfer);
+        file->writer->advance((unsigned) xfer);
+        done += xfer;
+    }
+    file->writer->nextBatch();
+    file->writer->inHeader(false);
+}
+
+    void
+ShardedDataWriter::finish(
+    ShardFile* file)
+{
+    if (file->writer == NULL) {
+        open(file);
+    }
+    if (file != &files[nShards]) {
+        while (file - files - nextToWait >= MaxClosing) {
+            waitForClose(&files[nextToWait++]);
+        }
+    }
+    CreateSingleWaiterObject(&file->closed);
+    file->closing = true;
+    if (! StartNewThread(CloseThreadMain, file)) {
+        WriteErrorMessage("unable to start a thread to close %s\n", file->fileName);
+        soft_exit(1);
+    }
+}
+
+    void
+ShardedDataWriter::waitForClose(
+    ShardFile* file)
+{
+    if (file->closing) {
+        WaitForSingleWaiterObject(&file->closed);
+        DestroySingleWaiterObject(&file->closed);
+        file->closing = false;
+    }
+}
+
+    void
+ShardedDataWriter::CloseThreadMain(
+    void* param)
+{
+    ShardFile* file = (ShardFile*) param;
+    file->writer->close();
+    delete file->writer;
+    file->writer = NULL;
+    file->supplier->close();
+    delete file->supplier;
+    file->supplier = NULL;
+    delete file->filterSupplier;
+    file->filterSupplier = NULL;
+    SignalSingleWaiterObject(&file->closed);
+}
+
+class ShardedDataWriterSupplier : public DataWriterSupplier
+{
+public:
+    ShardedDataWriterSupplier(const FileFormat* i_format, const Genome* i_genome, SortedShards* i_shards, size_t i_bufferSize)
+        : format(i_format), genome(i_genome), shards(i_shards), bufferSize(i_bufferSize)
+    {}
+
+    virtual DataWriter* getWriter()
+    { return new ShardedDataWriter(format, genome, shards, bufferSize); }
+
+    // the writer closes each shard's file
+    virtual void close() {}
+
+private:
+    const FileFormat*   format;
+    const Genome*       genome;
+    SortedShards*       shards;
+    const size_t        bufferSize;
+};
+
+    DataWriterSupplier*
+DataWriterSupplier::sharded(
+    const FileFormat* format,
+    const Genome* genome,
+    SortedShards* shards,
+    size_t bufferSize)
+{
+    return new ShardedDataWriterSupplier(format, genome, shards, bufferSize);
+}
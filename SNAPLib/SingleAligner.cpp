@@ -25,6 +25,7 @@ Revision History:
 #include "stdafx.h"
 #include "options.h"
 #include "BaseAligner.h"
+#include "LongReadAligner.h"
 #include "Compat.h"
 #include "RangeSplitter.h"
 #include "GenomeIndex.h"
@@ -99,44 +100,21 @@ SingleAlignerContext::runIterationThread()
         return;
     }
 
-    int maxReadSize = MAX_READ_LENGTH;
-
-    SingleAlignmentResult *alignmentResults = NULL;
+    //
+    // Start out sized for ordinary short reads, and grow when a longer one comes along, so that a run of short
+    // reads doesn't pay for the memory the longest possible read would need.
+    //
+    unsigned maxReadSize = INITIAL_MAX_READ_LENGTH;
+    BigAllocator *allocator;
+    SingleAlignmentResult *alignmentResults;
     unsigned alignmentResultBufferCount;
-    if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
-        alignmentResultBufferCount = 1; // For the primary alignment
-    } else {
-        alignmentResultBufferCount = BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength()) + 1; // +1 for the primary alignment
-    }
-    size_t alignmentResultBufferSize = sizeof(*alignmentResults) * (alignmentResultBufferCount + 1); // +1 is for primary result
- 
-    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig) 
-        + alignmentResultBufferSize);
-   
-    BaseAligner *aligner = new (allocator) BaseAligner(
-            index,
-            maxHits,
-            maxDist,
-            maxReadSize,
-            numSeedsFromCommandLine,
-            seedCoverage,
-			minWeightToCheck,
-            extraSearchDepth,
-            noUkkonen,
-            noOrderedEvaluation,
-			noTruncation,
-            maxSecondaryAlignmentsPerContig,
-            NULL,               // LV (no need to cache in the single aligner)
-            NULL,               // reverse LV
-            stats,
-            allocator);
-
-    alignmentResults = (SingleAlignmentResult *)allocator->allocate(alignmentResultBufferSize);
- 
-    allocator->checkCanaries();
+    BaseAligner *aligner = newAligner(maxReadSize, &allocator, &alignmentResults, &alignmentResultBufferCount);
 
-    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
-    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    LongReadAligner *longReadAligner = NULL;
+    if (options->longReadMinLength > 0) {
+        longReadAligner = new LongReadAligner(index, maxHits, maxReadSize,
+            options->maxDistFraction > 0.0 ? options->maxDistFraction : LongReadAligner::DefaultMaxEditDistanceFraction);
+    }
 
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
@@ -162,8 +140,11 @@ SingleAlignerContext::runIterationThread()
             lastReportTime = timeInMillis();
         }
 
+        bool useLongReadAligner = NULL != longReadAligner && read->getDataLength() >= options->longReadMinLength;
+        unsigned maxNs = useLongReadAligner ? longReadAligner->getMaxEditDistance(read->getDataLength()) : maxDist;
+
         // Skip the read if it has too many Ns or trailing 2 quality scores.
-        if (read->getDataLength() < minReadLength || read->countOfNs() > maxDist) {
+        if (read->getDataLength() < minReadLength || read->countOfNs() > maxNs) {
             if (!options->passFilter(read, NotFound, true, false)) {
                 stats->filtered++;
             } else {
@@ -186,17 +167,32 @@ SingleAlignerContext::runIterationThread()
 
         int nSecondaryResults = 0;
 
-#ifdef LONG_READS
-        int oldMaxK = aligner->getMaxK();
-        if (options->maxDistFraction > 0.0) {
-            aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
+        if (!useLongReadAligner && read->getDataLength() > maxReadSize) {
+            aligner->~BaseAligner();
+            delete allocator;
+            maxReadSize = __min(MaxReadLength, __max(read->getDataLength(), 2 * maxReadSize));
+            aligner = newAligner(maxReadSize, &allocator, &alignmentResults, &alignmentResultBufferCount);
         }
-#endif
 
-        aligner->AlignRead(read, alignmentResults, maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1, &nSecondaryResults, maxSecondaryAlignments, alignmentResults + 1);
-#ifdef LONG_READS
-        aligner->setMaxK(oldMaxK);
-#endif
+        if (useLongReadAligner) {
+            longReadAligner->AlignRead(read, alignmentResults);
+        } else {
+            int oldMaxK = aligner->getMaxK();
+            if (options->maxDistFraction > 0.0) {
+                aligner->setMaxK(min(MAX_K, (int)(read->getDataLength() * options->maxDistFraction)));
+            }
+
+            aligner->AlignRead(read, alignmentResults, maxSecondaryAlignmentAdditionalEditDistance, alignmentResultBufferCount - 1, &nSecondaryResults, maxSecondaryAlignments, alignmentResults + 1);
+            aligner->setMaxK(oldMaxK);
+
+            if (NULL != longReadAligner && NotFound == alignmentResults[0].status) {
+                //
+                // Too many differences for the normal aligner.  Try chaining.
+                //
+                longReadAligner->AlignRead(read, alignmentResults);
+                nSecondaryResults = 0;
+            }
+        }
 
 #if     TIME_HISTOGRAM
         _int64 runTime = timeInNanos() - startTime;
@@ -245,6 +241,10 @@ SingleAlignerContext::runIterationThread()
     }
 
     aligner->~BaseAligner(); // This calls the destructor without calling operator delete, allocator owns the memory.
+
+    if (NULL != longReadAligner) {
+        delete longReadAligner;
+    }
  
     if (supplier != NULL) {
         delete supplier;
@@ -253,6 +253,51 @@ SingleAlignerContext::runIterationThread()
     delete allocator;   // This is what actually frees the memory.
 }
 
+    BaseAligner *
+SingleAlignerContext::newAligner(
+    unsigned                 maxReadSize,
+    BigAllocator           **allocator,
+    SingleAlignmentResult  **alignmentResults,
+    unsigned                *alignmentResultBufferCount)
+{
+    if (maxSecondaryAlignmentAdditionalEditDistance < 0) {
+        *alignmentResultBufferCount = 1; // For the primary alignment
+    } else {
+        *alignmentResultBufferCount = BaseAligner::getMaxSecondaryResults(numSeedsFromCommandLine, seedCoverage, maxReadSize, maxHits, index->getSeedLength()) + 1; // +1 for the primary alignment
+    }
+    size_t alignmentResultBufferSize = sizeof(**alignmentResults) * (*alignmentResultBufferCount + 1); // +1 is for primary result
+ 
+    *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(index, true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxSecondaryAlignmentsPerContig) 
+        + alignmentResultBufferSize);
+   
+    BaseAligner *aligner = new (*allocator) BaseAligner(
+            index,
+            maxHits,
+            maxDist,
+            maxReadSize,
+            numSeedsFromCommandLine,
+            seedCoverage,
+			minWeightToCheck,
+            extraSearchDepth,
+            noUkkonen,
+            noOrderedEvaluation,
+			noTruncation,
+            maxSecondaryAlignmentsPerContig,
+            NULL,               // LV (no need to cache in the single aligner)
+            NULL,               // reverse LV
+            stats,
+            *allocator);
+
+    *alignmentResults = (SingleAlignmentResult *)(*allocator)->allocate(alignmentResultBufferSize);
+ 
+    (*allocator)->checkCanaries();
+
+    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
+    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+
+    return aligner;
+}
+
     void
 SingleAlignerContext::updateStats(
     AlignerStats* stats,
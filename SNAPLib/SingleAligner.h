@@ -29,6 +29,9 @@ Revision History:
 #include "ReadSupplierQueue.h"
 #include "AlignmentResult.h"
 
+class BaseAligner;
+class BigAllocator;
+
 class SingleAlignerContext : public AlignerContext
 {
 public:
@@ -53,6 +56,12 @@ protected:
 
     virtual void updateStats(AlignerStats* stats, Read* read, AlignmentResult result, int score, int mapq);
 
+    //
+    // Make a thread's aligner, with room for reads of up to maxReadSize bases and their secondary results, all in
+    // one new allocator.  The aligner is rebuilt bigger when a longer read comes along.
+    //
+    BaseAligner *newAligner(unsigned maxReadSize, BigAllocator **allocator, SingleAlignmentResult **alignmentResults, unsigned *alignmentResultBufferCount);
+
     //RangeSplittingReadSupplierGenerator   *readSupplierGenerator;
 
     ReadSupplierGenerator *readSupplierGenerator;
@@ -6,7 +6,7 @@ Module Name:
 
 Abstract:
 
-    File writer that sorts records using a temporary file.
+    File writer that sorts records, using a temporary file for whatever doesn't fit in memory.
 
 Environment:
 
@@ -24,7 +24,10 @@ Environment:
 #include "BufferedAsync.h"
 #include "VariableSizeVector.h"
 #include "FileFormat.h"
-#include "PriorityQueue.h"
+#include "LoserTree.h"
+#include "ParallelTask.h"
+#include "GzipCodec.h"
+#include "RadixSort.h"
 #include "exit.h"
 #include "Bam.h"
 #include "Error.h"
@@ -47,75 +50,132 @@ struct SortEntry
     {
         return e1.location < e2.location;
     }
+
+    // for RadixSort, with the sign bit flipped so it orders the same way
+    struct Key
+    {
+        _uint64 operator()(const SortEntry& e) const
+        { return (_uint64) e.location ^ ((_uint64) 1 << 63); }
+    };
+};
+
+// location of the read that starts a piece of a sorted block, see SortedDataWriter::nextBatch
+struct SortSample
+{
+    SortSample() : location(0), offset(0), spillOffset(0) {}
+    SortSample(GenomeLocation i_location, size_t i_offset) : location(i_location), offset(i_offset), spillOffset(0) {}
+    GenomeLocation              location;
+    size_t                      offset; // from start of block
+    size_t                      spillOffset; // of the compressed piece from start of block in temp file, if it's there
 };
 #pragma pack(pop)
 
 typedef VariableSizeVector<SortEntry,150,true> SortVector;
+typedef VariableSizeVector<SortSample,150,true> SortSampleVector;
+
+//
+// Take a sample every this many bytes of each sorted block.  It's the granularity of the ranges that the merge is split
+// into, so each range reads up to twice this much extra from each block, but a smaller interval means more samples
+// to keep around (about 1.5 bytes per KB of reads at 16KB).  It's also the unit of compression in the temp file.
+//
+static const size_t SortSampleBytes = 16 * 1024;
+
+//
+// A position in the merged output.  Reads sort by location, ties go to the earlier block, and within a block they're
+// already in order, so every read has a distinct key even when lots of them are at one location (e.g. the unmapped ones).
+//
+struct SortKey
+{
+    SortKey() : location(0), block(0), offset(0) {}
+    SortKey(GenomeLocation i_location, int i_block, size_t i_offset)
+        : location(i_location), block(i_block), offset(i_offset) {}
+    GenomeLocation              location;
+    int                         block;
+    size_t                      offset; // from start of block
+
+    bool operator<(const SortKey& other) const
+    {
+        return location < other.location ||
+            (location == other.location && (block < other.block || (block == other.block && offset < other.offset)));
+    }
+};
 
 struct SortBlock
 {
-#ifdef VALIDATE_SORT
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
-#else
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL) {}
-#endif
+    SortBlock() : data(NULL), start(0), bytes(0), spillBytes(0), firstSample(0), nSamples(0) {}
 	SortBlock(const SortBlock& other) { *this = other; }
     void operator=(const SortBlock& other);
 
-    size_t      start;
+    char*       data; // if it's in memory, else it's in the temp file
+    size_t      start; // in temp file
     size_t      bytes;
-#ifdef VALIDATE_SORT
-	GenomeLocation	minLocation, maxLocation;
-#endif
-    // for mergesort phase
-    DataReader* reader;
-    GenomeLocation    location; // genome location of current read
-    char*       data; // read data in read buffer
-    GenomeDistance    length; // length in bytes
+    size_t      spillBytes; // compressed, in temp file
+    _int64      firstSample; // index in SortedDataWriterSupplier::samples
+    _int64      nSamples;
 };
 
     void
 SortBlock::operator=(
     const SortBlock& other)
 {
+    data = other.data;
     start = other.start;
     bytes = other.bytes;
-    location = other.location;
-    length = other.length;
-    reader = other.reader;
-#ifdef VALIDATE_SORT
-	minLocation = other.minLocation;
-	maxLocation = other.maxLocation;
-#endif
+    spillBytes = other.spillBytes;
+    firstSample = other.firstSample;
+    nSamples = other.nSamples;
 }
 
 typedef VariableSizeVector<SortBlock> SortBlockVector;
     
-class SortedDataFilterSupplier;
+class SortedDataWriterSupplier;
 
-class SortedDataFilter : public DataWriter::Filter
+//
+// Per-thread writer for output that's going to be sorted.  When a batch is full it gets sorted by location and copied
+// out into a block of its own, which stays in memory while there's room for it in the sort memory and goes to the temp
+// file after that.  All the blocks get merged into the real output file when the supplier is closed, so if the output
+// fits in memory (e.g. for panels and exomes) there's no temp file at all.
+//
+class SortedDataWriter : public DataWriter
 {
 public:
-    SortedDataFilter(SortedDataFilterSupplier* i_parent)
-        : Filter(DataWriter::CopyFilter), parent(i_parent), locations(10000000)
-    {}
+    SortedDataWriter(SortedDataWriterSupplier* i_supplier, size_t i_bufferSize, bool i_header);
+
+    virtual ~SortedDataWriter() {}
+
+    virtual bool getBuffer(char** o_buffer, size_t* o_size);
+
+    virtual void advance(GenomeDistance bytes, GenomeLocation location = 0);
 
-    virtual ~SortedDataFilter() {}
+    // there's only ever the current batch
+    virtual bool getBatch(int relative, char** o_buffer, size_t* o_size = NULL, size_t* o_used = NULL, size_t* o_offset = NULL, size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL);
 
-    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, GenomeDistance bytes, GenomeLocation location);
+    virtual bool nextBatch();
 
-    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
+    virtual void close();
 
 private:
-    SortedDataFilterSupplier*   parent;
+    // wait for the block being written to the temp file, if any, and free it
+    void finishSpill();
+
+    SortedDataWriterSupplier*   supplier;
+    const bool                  header; // only writes the header, which isn't sorted
+    char*                       buffer;
+    const size_t                bufferSize;
+    size_t                      used;
     SortVector                  locations;
+    SortVector                  scratch; // for sorting locations
+    SortSampleVector            samples;
+    AsyncFile::Writer*          spillWriter; // NULL until this thread needs the temp file
+    GzipCodec*                  codec; // likewise
+    char*                       spilling; // compressed block being written to the temp file
 };
 
-class SortedDataFilterSupplier : public DataWriter::FilterSupplier
+class SortedDataWriterSupplier : public DataWriterSupplier
 {
 public:
 
-    SortedDataFilterSupplier(
+    SortedDataWriterSupplier(
         const FileFormat* i_fileFormat,
         const Genome* i_genome,
         const char* i_tempFileName,
@@ -123,194 +183,929 @@ public:
         DataWriter::FilterSupplier* i_sortedFilterSupplier,
         size_t i_bufferSize,
         size_t i_bufferSpace,
-        FileEncoder* i_encoder = NULL)
+        size_t i_memoryBudget,
+        int i_numThreads,
+        FileEncoder* i_encoder = NULL,
+        SortedStage* i_stage = NULL,
+        SortedShards* i_shards = NULL)
         :
         format(i_fileFormat),
         genome(i_genome),
-        FilterSupplier(DataWriter::CopyFilter),
         encoder(i_encoder),
-        tempFileName(i_tempFileName),
+        stage(i_stage),
+        shards(i_shards),
+        tempFileName(NULL),
         sortedFileName(i_sortedFileName),
         sortedFilterSupplier(i_sortedFilterSupplier),
         bufferSize(i_bufferSize),
         bufferSpace(i_bufferSpace),
+        memoryBudget(i_memoryBudget),
+        memoryUsed(0),
+        numThreads(max(1, i_numThreads)),
+        header(NULL),
+        headerSize(0),
+        nWriters(0),
+        tempFile(NULL),
+        tempFileSize(0),
+        spilledBytes(0),
         blocks()
     {
+        tempFileName = new char[strlen(i_tempFileName) + 1];
+        strcpy(tempFileName, i_tempFileName);
         InitializeExclusiveLock(&lock);
     }
 
-    virtual ~SortedDataFilterSupplier()
+    virtual ~SortedDataWriterSupplier()
     {
+        delete [] tempFileName;
         DestroyExclusiveLock(&lock);
     }
 
-    virtual DataWriter::Filter* getFilter();
+    virtual DataWriter* getWriter();
 
-    virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier);
+    virtual void close();
 
-    void setHeaderSize(size_t bytes)
-    { headerSize = bytes; }
+private:
 
-#ifndef VALIDATE_SORT
-	void addBlock(size_t start, size_t bytes);
-#else
-    void addBlock(size_t start, size_t bytes, GenomeLocation minLocation, GenomeLocation maxLocation);
-#endif
+    friend class SortedDataWriter;
+
+    // the first writer only writes the header (see AlignerContext, which gets it before starting the aligner threads),
+    // which is kept here until the merge
+    void appendHeader(char* data, size_t bytes);
+
+    // get room for a sorted block in memory, false if there isn't any left
+    bool reserveMemory(size_t bytes);
+
+    // get a place for a block of bytes that compressed to spillBytes in the temp file, opening it if need be
+    size_t allocateSpill(size_t bytes, size_t spillBytes);
+
+    AsyncFile::Writer* getSpillWriter()
+    { return tempFile->getWriter(); }
+
+	void addBlock(char* data, size_t start, size_t bytes, size_t spillBytes, const SortSampleVector& blockSamples);
 
-private:
     bool mergeSort();
 
+    void writeHeader(DataWriter* writer);
+
     const Genome*                   genome;
     const FileFormat*               format;
-    const char*                     tempFileName;
+    char*                           tempFileName; // our own copy
     const char*                     sortedFileName;
     DataWriter::FilterSupplier*     sortedFilterSupplier;
+    SortedStage*                    stage; // between merge & writer, or NULL
+    SortedShards*                   shards; // files to split the output into, or NULL for just sortedFileName
     FileEncoder*                    encoder;
+    char*                           header;
     size_t                          headerSize;
-    ExclusiveLock                   lock; // for adding blocks
+    int                             nWriters;
+    ExclusiveLock                   lock; // for everything below
     SortBlockVector                 blocks;
+    SortSampleVector                samples; // for all blocks
     size_t                          bufferSize;
     size_t                          bufferSpace;
-
-	friend class SortedDataFilter;
+    const size_t                    memoryBudget; // for blocks kept in memory
+    size_t                          memoryUsed;
+    int                             numThreads;
+    AsyncFile*                      tempFile; // NULL until something doesn't fit in memory
+    size_t                          tempFileSize;
+    size_t                          spilledBytes; // before compression
 };
 
+SortedDataWriter::SortedDataWriter(
+    SortedDataWriterSupplier* i_supplier,
+    size_t i_bufferSize,
+    bool i_header)
+    :
+    DataWriter(NULL),
+    supplier(i_supplier),
+    header(i_header),
+    bufferSize(i_bufferSize),
+    used(0),
+    locations(10000000),
+    spillWriter(NULL),
+    codec(NULL),
+    spilling(NULL)
+{
+    buffer = (char*) BigAlloc(bufferSize);
+}
+
+    bool
+SortedDataWriter::getBuffer(
+    char** o_buffer,
+    size_t* o_size)
+{
+    *o_buffer = buffer + used;
+    *o_size = bufferSize - used;
+    return true;
+}
+
     void
-SortedDataFilter::onAdvance(
-    DataWriter* writer,
-    size_t batchOffset,
-    char* data,
+SortedDataWriter::advance(
     GenomeDistance bytes,
     GenomeLocation location)
 {
-    SortEntry entry(batchOffset, bytes, location);
-#ifdef VALIDATE_SORT
-		if (memcmp(data, "BAM", 3) != 0 && memcmp(data, "@HD", 3) != 0) { // skip header block
-            GenomeLocation loc;
-			GenomeDistance len;
-			parent->format->getSortInfo(parent->genome, data, bytes, &loc, &len);
-			_ASSERT(loc == location);
-		}
-#endif
-    locations.push_back(entry);
+    _ASSERT((size_t) bytes <= bufferSize - used);
+    locations.push_back(SortEntry(used, bytes, location));
+    used += bytes;
 }
 
-    size_t
-SortedDataFilter::onNextBatch(
-    DataWriter* writer,
-    size_t offset,
-    size_t bytes)
+    bool
+SortedDataWriter::getBatch(
+    int relative,
+    char** o_buffer,
+    size_t* o_size,
+    size_t* o_used,
+    size_t* o_offset,
+    size_t* o_logicalUsed,
+    size_t* o_logicalOffset)
+{
+    if (relative != 0) {
+        return false;
+    }
+    *o_buffer = buffer;
+    if (o_size != NULL) {
+        *o_size = bufferSize;
+    }
+    if (o_used != NULL) {
+        *o_used = used;
+    }
+    if (o_offset != NULL) {
+        *o_offset = 0;
+    }
+    if (o_logicalUsed != NULL) {
+        *o_logicalUsed = used;
+    }
+    if (o_logicalOffset != NULL) {
+        *o_logicalOffset = 0;
+    }
+    return true;
+}
+
+    bool
+SortedDataWriter::nextBatch()
 {
+    if (used == 0 || header) {
+        if (used > 0) {
+            supplier->appendHeader(buffer, used);
+        }
+        used = 0;
+        locations.clear();
+        return true;
+    }
+
     // sort buffered reads by location for later merge sort
-    std::stable_sort(locations.begin(), locations.end(), SortEntry::comparator);
+    size_t n = locations.size();
+    scratch.reserve(n);
+    SortEntry* sorted = RadixSort(locations.begin(), scratch.begin(), n, SortEntry::Key());
     
-    // copy from previous buffer into current in sorted order
-    char* fromBuffer;
-    size_t fromSize, fromUsed;
-    char* toBuffer;
-    size_t toSize, toUsed;
-    if (! (writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed) &&
-        writer->getBatch(0, &toBuffer, &toSize, &toUsed)))
-    {
-        WriteErrorMessage( "SortedDataFilter::onNextBatch getBatch failed\n");
-        soft_exit(1);
-    }
+    //
+    // Copy into a block of its own in sorted order.  The reads come from all over the buffer, so fetch a few ahead.
+    //
+    const size_t PrefetchDistance = 8;
+    char* block = (char*) BigAlloc(used);
     size_t target = 0;
-	GenomeLocation previous = 0;
-    for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+    samples.clear();
+    for (size_t j = 0; j < n; j++) {
+        if (j + PrefetchDistance < n) {
+            _mm_prefetch(buffer + sorted[j + PrefetchDistance].offset, _MM_HINT_T0);
+        }
+        const SortEntry* entry = &sorted[j];
 #ifdef VALIDATE_SORT
-		if (locations.size() > 1) { // skip header block
-            GenomeLocation loc;
-            GenomeDistance len;
-			parent->format->getSortInfo(parent->genome, fromBuffer + i->offset, i->length, &loc, &len);
-			_ASSERT(loc >= previous);
-			previous = loc;
-		}
+        GenomeLocation loc;
+        GenomeDistance len;
+        supplier->format->getSortInfo(supplier->genome, buffer + entry->offset, entry->length, &loc, &len);
+        _ASSERT(loc == entry->location && len == entry->length);
 #endif
-        memcpy(toBuffer + target, fromBuffer + i->offset, i->length);
-        target += i->length;
+        // sample where every SortSampleBytes starts, so the merge can be split up without reading the blocks
+        if (samples.size() == 0 || target - samples[samples.size() - 1].offset >= SortSampleBytes) {
+            samples.push_back(SortSample(entry->location, target));
+        }
+        memcpy(block + target, buffer + entry->offset, entry->length);
+        target += entry->length;
     }
+    _ASSERT(target == used);
     
-    // remember block extent for later merge sort
-    SortBlock block;
-    // handle header specially
-    size_t header = offset > 0 ? 0 : locations[0].length;
-    if (header > 0) {
-        parent->setHeaderSize(header);
+    if (supplier->reserveMemory(target)) {
+        supplier->addBlock(block, 0, target, 0, samples);
+    } else {
+        //
+        // Compress each piece on its own, so the merge only has to read and decompress the pieces in its range.  It's
+        // the fastest deflate level; BAM records still shrink to about a third, and the aligner threads have the time.
+        //
+        finishSpill();
+        if (codec == NULL) {
+            codec = GzipCodec::create(GzipCodec::DefaultBackend, GzipCodec::FastestLevel);
+        }
+        size_t compressedSize = target + target / 256 + samples.size() * 64;
+        char* compressed = (char*) BigAlloc(compressedSize);
+        size_t compressedBytes = 0;
+        for (_int64 i = 0; i < samples.size(); i++) {
+            size_t pieceBytes = (i + 1 < samples.size() ? samples[i + 1].offset : target) - samples[i].offset;
+            samples[i].spillOffset = compressedBytes;
+            size_t n = codec->compressMember(block + samples[i].offset, pieceBytes, compressed + compressedBytes,
+                min(compressedSize - compressedBytes, 2 * pieceBytes + 64), false);
+            if (n == 0) {
+                WriteErrorMessage("error: unable to compress %lld bytes for temp file\n", pieceBytes);
+                soft_exit(1);
+            }
+            compressedBytes += n;
+        }
+        BigDealloc(block);
+
+        size_t offset = supplier->allocateSpill(target, compressedBytes);
+        if (spillWriter == NULL) {
+            spillWriter = supplier->getSpillWriter();
+        }
+        if (! spillWriter->beginWrite(compressed, compressedBytes, offset, NULL)) {
+            WriteErrorMessage("error: write %lld bytes at offset %lld of temp file %s failed\n", compressedBytes, offset, supplier->tempFileName);
+            soft_exit(1);
+        }
+        spilling = compressed;
+        supplier->addBlock(NULL, offset, target, compressedBytes, samples);
     }
-	int first = offset == 0;
-#ifdef VALIDATE_SORT
-	GenomeLocation minLocation = locations.size() > first ? locations[first].location : 0;
-    GenomeLocation maxLocation = locations.size() > first ? locations[locations.size() - 1].location : UINT32_MAX;
-    parent->addBlock(offset + header, bytes - header, minLocation, maxLocation);
-#else
-    parent->addBlock(offset + header, bytes - header);
-#endif
+
+    used = 0;
     locations.clear();
+    return true;
+}
 
-    return target;
+    void
+SortedDataWriter::finishSpill()
+{
+    if (spilling != NULL) {
+        if (! spillWriter->waitForCompletion()) {
+            WriteErrorMessage("error: write to temp file %s failed\n", supplier->tempFileName);
+            soft_exit(1);
+        }
+        BigDealloc(spilling);
+        spilling = NULL;
+    }
 }
-    
-    DataWriter::Filter*
-SortedDataFilterSupplier::getFilter()
+
+    void
+SortedDataWriter::close()
 {
-    return new SortedDataFilter(this);
+    nextBatch();
+    finishSpill();
+    if (spillWriter != NULL) {
+        spillWriter->close();
+        delete spillWriter;
+        spillWriter = NULL;
+    }
+    delete codec;
+    codec = NULL;
+    BigDealloc(buffer);
+    buffer = NULL;
+}
+
+    DataWriter*
+SortedDataWriterSupplier::getWriter()
+{
+    AcquireExclusiveLock(&lock);
+    bool first = nWriters++ == 0;
+    ReleaseExclusiveLock(&lock);
+    return new SortedDataWriter(this, bufferSize, first);
 }
 
     void
-SortedDataFilterSupplier::onClosed(
-    DataWriterSupplier* supplier)
-{
-    if (blocks.size() == 1 && sortedFilterSupplier == NULL) {
-        // just rename/move temp file to real file, we're done
-        DeleteSingleFile(sortedFileName); // if it exists
-        if (! MoveSingleFile(tempFileName, sortedFileName)) {
-            WriteErrorMessage( "unable to move temp file %s to final sorted file %s\n", tempFileName, sortedFileName);
+SortedDataWriterSupplier::appendHeader(
+    char* data,
+    size_t bytes)
+{
+    char* newHeader = (char*) BigAlloc(headerSize + bytes);
+    if (header != NULL) {
+        memcpy(newHeader, header, headerSize);
+        BigDealloc(header);
+    }
+    memcpy(newHeader + headerSize, data, bytes);
+    header = newHeader;
+    headerSize += bytes;
+}
+
+    bool
+SortedDataWriterSupplier::reserveMemory(
+    size_t bytes)
+{
+    AcquireExclusiveLock(&lock);
+    bool fits = memoryUsed + bytes <= memoryBudget;
+    if (fits) {
+        memoryUsed += bytes;
+    }
+    ReleaseExclusiveLock(&lock);
+    return fits;
+}
+
+    size_t
+SortedDataWriterSupplier::allocateSpill(
+    size_t bytes,
+    size_t spillBytes)
+{
+    AcquireExclusiveLock(&lock);
+    if (tempFile == NULL) {
+        tempFile = AsyncFile::open(tempFileName, true);
+        if (tempFile == NULL) {
+            WriteErrorMessage("failed to open temp file %s for write\n", tempFileName);
             soft_exit(1);
         }
-        return;
+    }
+    size_t offset = tempFileSize;
+    tempFileSize += spillBytes;
+    spilledBytes += bytes;
+    ReleaseExclusiveLock(&lock);
+    return offset;
+}
+
+    void
+SortedDataWriterSupplier::addBlock(
+    char* data,
+    size_t start,
+    size_t bytes,
+    size_t spillBytes,
+    const SortSampleVector& blockSamples)
+{
+    AcquireExclusiveLock(&lock);
+    SortBlock block;
+    block.data = data;
+    block.start = start;
+    block.bytes = bytes;
+    block.spillBytes = spillBytes;
+    block.firstSample = samples.size();
+    block.nSamples = blockSamples.size();
+    for (_int64 i = 0; i < blockSamples.size(); i++) {
+        samples.push_back(blockSamples[i]);
+    }
+    blocks.push_back(block);
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+SortedDataWriterSupplier::close()
+{
+    // all the writers are closed, so everything's been written
+    if (tempFile != NULL && ! tempFile->close()) {
+        WriteErrorMessage("error closing temp file %s\n", tempFileName);
+        soft_exit(1);
     }
     // merge sort into final file
     if (! mergeSort()) {
         WriteErrorMessage( "merge sort failed\n");
         soft_exit(1);
     }
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        if (i->data != NULL) {
+            BigDealloc(i->data);
+        }
+    }
+    if (header != NULL) {
+        BigDealloc(header);
+    }
+    delete stage;
+    delete shards;
+}
+
+//
+// Merges the sorted blocks on several threads.  The samples split the output into ranges of about rangeBytes, and each
+// round merges one range per thread while the ranges from the previous round are being written, so the writer thread
+// only has to copy reads into its buffers (the encoder does the compression on its own threads).  A range is merged by
+// reading and decompressing its piece of every block that's in the temp file into one buffer and running a loser tree
+// over the pieces, which produces the list of reads in order; blocks in memory are merged from where they are.
+//
+class SortedMerger : public ParallelWorkerManager
+{
+public:
+    SortedMerger(
+        const FileFormat* i_format,
+        const Genome* i_genome,
+        const char* i_tempFileName,
+        const SortBlockVector& i_blocks,
+        const SortSampleVector& i_samples,
+        int i_numThreads,
+        size_t i_rangeBytes);
+
+    virtual ~SortedMerger();
+
+    virtual ParallelWorker* createWorker();
+
+    // merge all the blocks into writer, through stage if it's not NULL
+    bool run(DataWriter* writer, SortedStage* stage, _int64* o_total);
+
+    int getNumRanges() const
+    { return (int) splitters.size() + 1; }
+
+    // temp file read time, over all threads
+    _int64 getReadWaitTime() const
+    { return readWaitTime; }
+
+    // likewise for decompression
+    _int64 getDecompressTime() const
+    { return decompressTime; }
+
+private:
+
+    friend class SortedMergeWorker;
+
+    // current read in a block's piece of a range
+    struct Cursor
+    {
+        char*           data;
+        size_t          left; // bytes in piece
+        size_t          offset; // from start of block
+        GenomeLocation  location;
+        GenomeDistance  length;
+        _int64          firstPiece; // samples that start the piece's first & last+1 compressed pieces
+        _int64          endPiece;
+    };
+
+    struct MergedRead
+    {
+        MergedRead() : data(NULL), length(0) {}
+        MergedRead(char* i_data, GenomeDistance i_length) : data(i_data), length(i_length) {}
+        char*           data; // in range buffer or in memory block
+        GenomeDistance  length;
+    };
+
+    typedef VariableSizeVector<MergedRead,150,true> MergedVector;
+
+    struct Range
+    {
+        Range() : index(-1), buffer(NULL), bufferSize(0), compressed(NULL), compressedSize(0), cursors(NULL), reads() {}
+        ~Range()
+        {
+            if (buffer != NULL) {
+                BigDealloc(buffer);
+            }
+            if (compressed != NULL) {
+                BigDealloc(compressed);
+            }
+            delete [] cursors;
+        }
+
+        int             index; // in splitters, or -1 if there's none for this thread in the round
+        char*           buffer; // pieces of all the blocks in the temp file
+        size_t          bufferSize;
+        char*           compressed; // one block's piece as read from the temp file
+        size_t          compressedSize;
+        Cursor*         cursors; // one per block
+        MergedVector    reads; // in order
+    };
+
+    struct Candidate
+    {
+        SortKey         key;
+        size_t          bytes; // up to the next sample
+        bool operator<(const Candidate& other) const { return key < other.key; }
+    };
+
+    void chooseRanges(size_t rangeBytes);
+
+    // number of samples in block that are before key
+    _int64 samplesBefore(int block, const SortKey& key) const;
+
+    void mergeRange(Range* range, AsyncFile::Reader* reader, GzipCodec* codec);
+
+    // read & decompress the block's piece of a range into cursor->data
+    void readPiece(Range* range, int block, AsyncFile::Reader* reader, GzipCodec* codec);
+
+    // get the location & length of the cursor's read, false if there's none left in the range
+    bool readKey(Cursor* cursor, int block, const SortKey* upper);
+
+    void startRound(int set);
+
+    bool writeRound(DataWriter* writer, SortedStage* stage, int set, _int64* io_total);
+
+    static void roundDoneCallback(void* p);
+
+    const FileFormat*           format;
+    const Genome*               genome;
+    const char*                 tempFileName;
+    const SortBlockVector&      blocks;
+    const SortSampleVector&     samples;
+    const int                   numThreads;
+    AsyncFile*                  file; // NULL if all the blocks are in memory
+    VariableSizeVector<SortKey> splitters; // range i is from splitters[i-1] (or the start) up to splitters[i] (or the end)
+    Range*                      ranges[2]; // numThreads each, one set merging while the other is written
+    int                         mergingSet;
+    int                         nextRange;
+    ParallelCoworker*           coworker;
+    EventObject                 roundDone;
+    volatile _int64             readWaitTime;
+    volatile _int64             decompressTime;
+};
+
+class SortedMergeWorker : public ParallelWorker
+{
+public:
+    SortedMergeWorker() : reader(NULL), codec(NULL) {}
+
+    virtual ~SortedMergeWorker()
+    {
+        if (reader != NULL) {
+            reader->close();
+            delete reader;
+        }
+        delete codec;
+    }
+
+    virtual void step()
+    {
+        SortedMerger* merger = (SortedMerger*) getManager();
+        if (reader == NULL && merger->file != NULL) {
+            reader = merger->file->getReader();
+            codec = GzipCodec::create();
+        }
+        merger->mergeRange(&merger->ranges[merger->mergingSet][getThreadNum()], reader, codec);
+    }
+
+private:
+    AsyncFile::Reader*  reader;
+    GzipCodec*          codec;
+};
+
+SortedMerger::SortedMerger(
+    const FileFormat* i_format,
+    const Genome* i_genome,
+    const char* i_tempFileName,
+    const SortBlockVector& i_blocks,
+    const SortSampleVector& i_samples,
+    int i_numThreads,
+    size_t i_rangeBytes)
+    :
+    format(i_format),
+    genome(i_genome),
+    tempFileName(i_tempFileName),
+    blocks(i_blocks),
+    samples(i_samples),
+    numThreads(i_numThreads),
+    mergingSet(0),
+    nextRange(0),
+    readWaitTime(0),
+    decompressTime(0)
+{
+    file = NULL;
+    for (int i = 0; i < blocks.size(); i++) {
+        if (blocks[i].data == NULL) {
+            file = AsyncFile::open(tempFileName, false);
+            if (file == NULL) {
+                WriteErrorMessage("unable to open temp file %s for merge\n", tempFileName);
+                soft_exit(1);
+            }
+            break;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        ranges[i] = new Range[numThreads];
+        for (int j = 0; j < numThreads; j++) {
+            ranges[i][j].cursors = new Cursor[blocks.size()];
+        }
+    }
+    chooseRanges(i_rangeBytes);
+    CreateEventObject(&roundDone);
+    coworker = new ParallelCoworker(numThreads, false, this, roundDoneCallback, this);
+    coworker->start();
+}
+
+SortedMerger::~SortedMerger()
+{
+    coworker->stop();
+    delete coworker; // closes the readers
+    DestroyEventObject(&roundDone);
+    delete [] ranges[0];
+    delete [] ranges[1];
+    if (file != NULL) {
+        file->close();
+        delete file;
+    }
+}
+
+    ParallelWorker*
+SortedMerger::createWorker()
+{
+    return new SortedMergeWorker();
 }
 
     void
-SortedDataFilterSupplier::addBlock(
-    size_t start,
-    size_t bytes
-#ifdef VALIDATE_SORT
-	, GenomeLocation minLocation
-	, GenomeLocation maxLocation
-#endif
-	)
+SortedMerger::chooseRanges(
+    size_t rangeBytes)
 {
-    if (bytes > 0) {
-        AcquireExclusiveLock(&lock);
-#if VALIDATE_SORT
-		for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
-			_ASSERT(i->start + i->length <= start || start + bytes <= i->start);
-		}
-#endif
-        SortBlock block;
-        block.start = start;
-        block.bytes = bytes;
-#if VALIDATE_SORT
-		block.minLocation = minLocation;
-		block.maxLocation = maxLocation;
+    //
+    // Each sample stands for the reads up to the next one in its block, so going through them in order and cutting
+    // whenever there's rangeBytes gives ranges that are about the same size no matter how the reads are spread out.
+    //
+    Candidate* candidates = (Candidate*) BigAlloc(max((_int64) 1, samples.size()) * sizeof(Candidate));
+    _int64 n = 0;
+    for (int b = 0; b < blocks.size(); b++) {
+        const SortBlock* block = &blocks[b];
+        for (_int64 i = 0; i < block->nSamples; i++) {
+            const SortSample* sample = &samples[block->firstSample + i];
+            size_t next = i + 1 < block->nSamples ? samples[block->firstSample + i + 1].offset : block->bytes;
+            candidates[n].key = SortKey(sample->location, b, sample->offset);
+            candidates[n].bytes = next - sample->offset;
+            n++;
+        }
+    }
+    std::sort(candidates, candidates + n);
+    size_t bytes = 0;
+    for (_int64 i = 0; i < n; i++) {
+        if (bytes >= rangeBytes) {
+            splitters.push_back(candidates[i].key);
+            bytes = 0;
+        }
+        bytes += candidates[i].bytes;
+    }
+    BigDealloc(candidates);
+}
+
+    _int64
+SortedMerger::samplesBefore(
+    int block,
+    const SortKey& key) const
+{
+    const SortSample* blockSamples = &samples[blocks[block].firstSample];
+    _int64 lo = 0, hi = blocks[block].nSamples;
+    while (lo < hi) {
+        _int64 mid = (lo + hi) / 2;
+        if (SortKey(blockSamples[mid].location, block, blockSamples[mid].offset) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+    bool
+SortedMerger::readKey(
+    Cursor* cursor,
+    int block,
+    const SortKey* upper)
+{
+    if (cursor->left == 0) {
+        return false;
+    }
+    format->getSortInfo(genome, cursor->data, cursor->left, &cursor->location, &cursor->length);
+    _ASSERT(cursor->length > 0 && (size_t) cursor->length <= cursor->left);
+    return upper == NULL || SortKey(cursor->location, block, cursor->offset) < *upper;
+}
+
+    void
+SortedMerger::mergeRange(
+    Range* range,
+    AsyncFile::Reader* reader,
+    GzipCodec* codec)
+{
+    range->reads.clear();
+    if (range->index < 0 || blocks.size() == 0) {
+        return;
+    }
+    const SortKey* lower = range->index > 0 ? &splitters[range->index - 1] : NULL;
+    const SortKey* upper = range->index < splitters.size() ? &splitters[range->index] : NULL;
+
+    //
+    // The piece of each block starts at the last sample before the range and ends at the first one after it, which
+    // can take in a few reads that belong to the neighboring ranges; they get skipped below.
+    //
+    size_t total = 0;
+    for (int b = 0; b < blocks.size(); b++) {
+        const SortBlock* block = &blocks[b];
+        const SortSample* blockSamples = &samples[block->firstSample];
+        _int64 first = lower != NULL ? samplesBefore(b, *lower) : 0;
+        _int64 last = upper != NULL ? samplesBefore(b, *upper) : block->nSamples;
+        Cursor* cursor = &range->cursors[b];
+        cursor->firstPiece = first > 0 ? first - 1 : 0;
+        cursor->endPiece = last;
+        cursor->offset = blockSamples[cursor->firstPiece].offset;
+        cursor->left = (last < block->nSamples ? blockSamples[last].offset : block->bytes) - cursor->offset;
+        if (block->data == NULL) {
+            total += cursor->left;
+        }
+    }
+    if (total > range->bufferSize) {
+        if (range->buffer != NULL) {
+            BigDealloc(range->buffer);
+        }
+        range->bufferSize = total + total / 8;
+        range->buffer = (char*) BigAlloc(range->bufferSize);
+    }
+    char* p = range->buffer;
+    for (int b = 0; b < blocks.size(); b++) {
+        Cursor* cursor = &range->cursors[b];
+        if (blocks[b].data != NULL) {
+            cursor->data = blocks[b].data + cursor->offset;
+        } else {
+            cursor->data = p;
+            readPiece(range, b, reader, codec);
+            p += cursor->left;
+        }
+    }
+
+    LoserTree<GenomeLocation> tree((int) blocks.size());
+    for (int b = 0; b < blocks.size(); b++) {
+        Cursor* cursor = &range->cursors[b];
+        bool valid = readKey(cursor, b, upper);
+        while (valid && lower != NULL && SortKey(cursor->location, b, cursor->offset) < *lower) {
+            cursor->data += cursor->length;
+            cursor->left -= cursor->length;
+            cursor->offset += cursor->length;
+            valid = readKey(cursor, b, upper);
+        }
+        if (valid) {
+            tree.set(b, cursor->location);
+        } else {
+            tree.setEmpty(b);
+        }
+    }
+    tree.start();
+    while (! tree.isEmpty()) {
+        int b = tree.winner();
+        Cursor* cursor = &range->cursors[b];
+        range->reads.push_back(MergedRead(cursor->data, cursor->length));
+        cursor->data += cursor->length;
+        cursor->left -= cursor->length;
+        cursor->offset += cursor->length;
+        if (readKey(cursor, b, upper)) {
+            tree.replace(cursor->location);
+        } else {
+            tree.finish();
+        }
+    }
+}
+
+    void
+SortedMerger::readPiece(
+    Range* range,
+    int block,
+    AsyncFile::Reader* reader,
+    GzipCodec* codec)
+{
+    Cursor* cursor = &range->cursors[block];
+    if (cursor->left == 0) {
+        return;
+    }
+    const SortBlock* b = &blocks[block];
+    const SortSample* blockSamples = &samples[b->firstSample];
+    size_t spillStart = blockSamples[cursor->firstPiece].spillOffset;
+    size_t spillBytes = (cursor->endPiece < b->nSamples ? blockSamples[cursor->endPiece].spillOffset : b->spillBytes) - spillStart;
+    if (spillBytes > range->compressedSize) {
+        if (range->compressed != NULL) {
+            BigDealloc(range->compressed);
+        }
+        range->compressedSize = spillBytes + spillBytes / 8;
+        range->compressed = (char*) BigAlloc(range->compressedSize);
+    }
+
+    _int64 start = timeInNanos();
+    for (size_t done = 0; done < spillBytes; ) {
+        size_t bytesRead = 0;
+        if (! (reader->beginRead(range->compressed + done, spillBytes - done, b->start + spillStart + done, &bytesRead) &&
+            reader->waitForCompletion()) || bytesRead == 0)
+        {
+            WriteErrorMessage("error reading %lld bytes at offset %lld in temp file %s\n", spillBytes - done,
+                b->start + spillStart + done, tempFileName);
+            soft_exit(1);
+        }
+        done += bytesRead;
+    }
+    _int64 readDone = timeInNanos();
+    InterlockedAdd64AndReturnNewValue(&readWaitTime, readDone - start);
+
+    for (_int64 i = cursor->firstPiece; i < cursor->endPiece; i++) {
+        size_t pieceBytes = (i + 1 < b->nSamples ? blockSamples[i + 1].offset : b->bytes) - blockSamples[i].offset;
+        size_t compressedBytes = (i + 1 < b->nSamples ? blockSamples[i + 1].spillOffset : b->spillBytes) - blockSamples[i].spillOffset;
+        size_t used;
+        if (! (codec->decompressMember(range->compressed + blockSamples[i].spillOffset - spillStart, compressedBytes,
+                cursor->data + blockSamples[i].offset - cursor->offset, pieceBytes, &used) && used == pieceBytes))
+        {
+            WriteErrorMessage("error decompressing %lld bytes at offset %lld in temp file %s\n", compressedBytes,
+                b->start + blockSamples[i].spillOffset, tempFileName);
+            soft_exit(1);
+        }
+    }
+    InterlockedAdd64AndReturnNewValue(&decompressTime, timeInNanos() - readDone);
+}
+
+    void
+SortedMerger::roundDoneCallback(
+    void* p)
+{
+    AllowEventWaitersToProceed(&((SortedMerger*) p)->roundDone);
+}
+
+    void
+SortedMerger::startRound(
+    int set)
+{
+    mergingSet = set;
+    for (int i = 0; i < numThreads; i++) {
+        ranges[set][i].index = nextRange < getNumRanges() ? nextRange++ : -1;
+    }
+    PreventEventWaitersFromProceeding(&roundDone);
+    coworker->step();
+}
+
+    bool
+SortedMerger::writeRound(
+    DataWriter* writer,
+    SortedStage* stage,
+    int set,
+    _int64* io_total)
+{
+    char* writeBuffer = NULL;
+    size_t writeBytes = 0;
+    if (stage == NULL) {
+        writer->getBuffer(&writeBuffer, &writeBytes);
+    }
+    for (int i = 0; i < numThreads && ranges[set][i].index >= 0; i++) {
+        Range* range = &ranges[set][i];
+        *io_total += range->reads.size();
+        if (stage != NULL) {
+            for (MergedVector::iterator r = range->reads.begin(); r != range->reads.end(); r++) {
+                if (! stage->onRead(writer, r->data, r->length)) {
+                    WriteErrorMessage( "mergeSort: buffer size too small\n");
+                    return false;
+                }
+            }
+            continue;
+        }
+        for (MergedVector::iterator r = range->reads.begin(); r != range->reads.end(); r++) {
+            if (writeBytes < (size_t) r->length) {
+                writer->nextBatch();
+                writer->getBuffer(&writeBuffer, &writeBytes);
+                if (writeBytes < (size_t) r->length) {
+                    WriteErrorMessage( "mergeSort: buffer size too small\n");
+                    return false;
+                }
+            }
+            memcpy(writeBuffer, r->data, r->length);
+#ifdef VALIDATE_BAM
+            if (format == FileFormat::BAM[0] || format == FileFormat::BAM[1]) {
+                ((BAMAlignment*)writeBuffer)->validate();
+            }
 #endif
-        blocks.push_back(block);
-        ReleaseExclusiveLock(&lock);
+            writer->advance(r->length);
+            writeBytes -= r->length;
+            writeBuffer += r->length;
+        }
     }
+    return true;
 }
 
     bool
-SortedDataFilterSupplier::mergeSort()
+SortedMerger::run(
+    DataWriter* writer,
+    SortedStage* stage,
+    _int64* o_total)
 {
-    // merge sort from temp file into sorted file
+    *o_total = 0;
+    startRound(0);
+    while (true) {
+        WaitForEvent(&roundDone);
+        int written = mergingSet;
+        bool more = nextRange < getNumRanges();
+        if (more) {
+            startRound(1 - written);
+        }
+        if (! writeRound(writer, stage, written, o_total)) {
+            if (more) {
+                WaitForEvent(&roundDone);
+            }
+            return false;
+        }
+        if (! more) {
+            return stage == NULL || stage->onDone(writer);
+        }
+    }
+}
+
+    void
+SortedDataWriterSupplier::writeHeader(
+    DataWriter* writer)
+{
+	writer->inHeader(true);
+    char* wbuffer;
+    size_t wbytes;
+	for (size_t done = 0; done < headerSize; ) {
+		if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
+			writer->nextBatch();
+			if (! writer->getBuffer(&wbuffer, &wbytes)) {
+				WriteErrorMessage( "write header failed\n");
+				soft_exit(1);
+			}
+		}
+		size_t xfer = min(headerSize - done, wbytes);
+		_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
+		memcpy(wbuffer, header + done, xfer);
+		writer->advance((unsigned) xfer);
+		done += xfer;
+	}
+	writer->nextBatch();
+	writer->inHeader(false);
+}
+
+    bool
+SortedDataWriterSupplier::mergeSort()
+{
+    // merge sort blocks into sorted file
 #if USE_DEVTEAM_OPTIONS
     WriteStatusMessage("sorting...");
     _int64 start = timeInMillis();
@@ -321,165 +1116,68 @@ SortedDataFilterSupplier::mergeSort()
 #endif
 
     // set up buffered output
-    DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, bufferSize, sortedFilterSupplier,
-        encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
+    DataWriterSupplier* writerSupplier = shards != NULL ? DataWriterSupplier::sharded(format, genome, shards, bufferSize)
+        : DataWriterSupplier::create(sortedFileName, bufferSize, sortedFilterSupplier,
+            encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
     DataWriter* writer = writerSupplier->getWriter();
     if (writer == NULL) {
         WriteErrorMessage( "open sorted file for write failed\n");
         return false;
     }
-    DataSupplier* readerSupplier = DataSupplier::Default; // autorelease
-    // setup - open all files, read first block, begin read for second
     if (blocks.size() > 5000) {
         WriteErrorMessage("warning: merging %d blocks could be slow, try increasing sort memory with -sm option\n", blocks.size());
     }
-    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
-        i->reader = readerSupplier->getDataReader(1, MAX_READ_LENGTH * 8, 0.0,
-            min(1UL << 23, max(1UL << 17, bufferSpace / blocks.size()))); // 128kB to 8MB buffer space per block
-        i->reader->init(tempFileName);
-        i->reader->reinit(i->start, i->bytes);
-    }
+
+    //
+    // Two sets of ranges are in memory at once, plus the lists of reads, so this leaves some of the sort memory for the
+    // writer's buffers.
+    //
+    const size_t MinRangeBytes = 16 * 1024 * 1024;
+    size_t rangeBytes = max(MinRangeBytes, bufferSpace / (3 * numThreads));
+    SortedMerger* merger = new SortedMerger(format, genome, tempFileName, blocks, samples, numThreads, rangeBytes);
 
     // write out header
     if (headerSize > 0xffffffff) {
-        WriteErrorMessage("SortedDataFilterSupplier: headerSize too big\n");
+        WriteErrorMessage("SortedDataWriterSupplier: headerSize too big\n");
         soft_exit(1);
     }
-    if (headerSize > 0) {
-        blocks[0].reader->reinit(0, headerSize);
-		writer->inHeader(true);
-        char* rbuffer;
-        _int64 rbytes;
-        char* wbuffer;
-        size_t wbytes;
-		for (size_t left = headerSize; left > 0; ) {
-			if ((! blocks[0].reader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
-				blocks[0].reader->nextBatch();
-				if (! blocks[0].reader->getData(&rbuffer, &rbytes)) {
-					WriteErrorMessage( "read header failed\n");
-					soft_exit(1);
-				}
-			}
-			if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
-				writer->nextBatch();
-				if (! writer->getBuffer(&wbuffer, &wbytes)) {
-					WriteErrorMessage( "write header failed\n");
-					soft_exit(1);
-				}
-			}
-			size_t xfer = min(left, min((size_t) rbytes, wbytes));
-			_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
-			memcpy(wbuffer, rbuffer, xfer);
-			blocks[0].reader->advance(xfer);
-			writer->advance((unsigned) xfer);
-			left -= xfer;
-		}
-        blocks[0].reader->reinit(blocks[0].start, blocks[0].bytes);
-		writer->nextBatch();
-		writer->inHeader(false);
-    }
+    writeHeader(writer);
 
-    // merge temp blocks into output
+    // merge temp blocks into output, first through just the stage if it wants to look ahead
     _int64 total = 0;
-    // get initial merge sort data
-    typedef PriorityQueue<GenomeLocation, _int64> BlockQueue;
-    BlockQueue queue;
-    for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
-        _int64 bytes;
-        b->reader->getData(&b->data, &bytes);
-        format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
-        queue.add((_uint32) (b - blocks.begin()), b->location); 
-    }
-    GenomeLocation current = 0; // current location for validation
-	int lastRefID = -1, lastPos = 0;
-    while (queue.size() > 0) {
-#if VALIDATE_SORT
-        GenomeLocation check;
-		queue.peek(&check);
-		_ASSERT(check >= current);
-#endif
-        GenomeLocation secondLocation;
-        _int64 smallestIndex = queue.pop();
-        _int64 secondIndex = queue.size() > 0 ? queue.peek(&secondLocation) : -1;
-        GenomeLocation limit = secondIndex != -1 ? secondLocation : InvalidGenomeLocation;
-        SortBlock* b = &blocks[smallestIndex];
-        char* writeBuffer;
-        size_t writeBytes;
-        writer->getBuffer(&writeBuffer, &writeBytes);
-        const int NBLOCKS = 20;
-        SortBlock oldBlocks[NBLOCKS];
-        int oldBlockIndex = 0;
-        while (b->location <= limit) {
-#if VALIDATE_SORT
-			_ASSERT(b->location >= b->minLocation && b->location <= b->maxLocation);
-#endif
-            if (writeBytes < (size_t)b->length) {
-                writer->nextBatch();
-                writer->getBuffer(&writeBuffer, &writeBytes);
-                if (writeBytes < (size_t)b->length) {
-                    WriteErrorMessage( "mergeSort: buffer size too small\n");
-                    return false;
-                }
-            }
-            memcpy(writeBuffer, b->data, b->length);
-#ifdef VALIDATE_BAM
-            if (format == FileFormat::BAM[0] || format == FileFormat::BAM[1]) {
-                ((BAMAlignment*)b->data)->validate();
-            }
-#endif
-#if VALIDATE_SORT
-			int refID, pos;
-			format->getSortInfo(genome, b->data, b->length, NULL, NULL, &refID, &pos);
-			_ASSERT(refID == -1 || refID > lastRefID || (refID == lastRefID && pos >= lastPos));
-			if (refID != -1) {
-				lastRefID = refID;
-				lastPos = pos;
-			}
-#endif
-			total++;
-            writer->advance(b->length);
-            writeBytes -= b->length;
-            writeBuffer += b->length;
-            oldBlocks[oldBlockIndex] = *b;
-            oldBlockIndex = (oldBlockIndex + 1) % NBLOCKS;
-            b->reader->advance(b->length);
-            _ASSERT(b->location >= current);
-            current = b->location;
-            _int64 readBytes;
-            if (! b->reader->getData(&b->data, &readBytes)) {
-                b->reader->nextBatch();
-                if (! b->reader->getData(&b->data, &readBytes)) {
-                    _ASSERT(b->reader->isEOF());
-                    delete b->reader;
-                    b->reader = NULL;
-                    break;
-                }
-            }
-            GenomeLocation previous = b->location;
-            format->getSortInfo(genome, b->data, readBytes, &b->location, &b->length);
-            _ASSERT(b->length <= readBytes && b->location >= previous);
-        }
-        if (b->reader != NULL) {
-            queue.add(smallestIndex, b->location);
+    if (stage != NULL && stage->needsLookahead()) {
+        SortedMerger* lookahead = new SortedMerger(format, genome, tempFileName, blocks, samples, numThreads, rangeBytes);
+        bool ok = lookahead->run(NULL, stage, &total);
+        delete lookahead;
+        if (! ok) {
+            delete merger;
+            return false;
         }
     }
+    if (! merger->run(writer, stage, &total)) {
+        delete merger;
+        return false;
+    }
+    int nRanges = merger->getNumRanges();
+    _int64 mergeReadWaitTime = merger->getReadWaitTime();
+    _int64 mergeDecompressTime = merger->getDecompressTime();
+    delete merger;
     
     // close everything
     writer->close();
     delete writer;
     writerSupplier->close();
     delete writerSupplier;
-    if (! DeleteSingleFile(tempFileName)) {
+    if (tempFile != NULL && ! DeleteSingleFile(tempFileName)) {
         WriteErrorMessage( "warning: failure deleting temp file %s\n", tempFileName);
     }
 
 #if USE_DEVTEAM_OPTIONS
-    WriteStatusMessage("sorted %lld reads in %u blocks, %lld s\n"
-        "read wait align %.3f s + merge %.3f s, read release align %.3f s + merge %.3f s\n"
+    WriteStatusMessage("sorted %lld reads in %u blocks (%lld MB in memory, %lld MB in temp file compressed to %lld MB), %d ranges on %d threads, %lld s\n"
+        "read wait align %.3f s + merge %.3f s (all threads), merge decompress %.3f s (all threads), read release align %.3f s\n"
         "write wait %.3f s align + %.3f s merge, write filter %.3f s align + %.3f s merge\n",
-        total, blocks.size(), (timeInMillis() - start)/1000,
-        startReadWaitTime * 1e-9, (DataReader::ReadWaitTime - startReadWaitTime) * 1e-9,
-        startReleaseWaitTime * 1e-9, (DataReader::ReleaseWaitTime - startReleaseWaitTime) * 1e-9,
+        total, blocks.size(), memoryUsed >> 20, spilledBytes >> 20, tempFileSize >> 20, nRanges, numThreads, (timeInMillis() - start)/1000,
+        startReadWaitTime * 1e-9, mergeReadWaitTime * 1e-9, mergeDecompressTime * 1e-9, startReleaseWaitTime * 1e-9,
         startWriteWaitTime * 1e-9, (DataWriter::WaitTime - startWriteWaitTime) * 1e-9,
         startWriteFilterTime * 1e-9, (DataWriter::FilterTime - startWriteFilterTime) * 1e-9);
 #endif
@@ -496,12 +1194,16 @@ DataWriterSupplier::sorted(
     const char* sortedFileName,
     DataWriter::FilterSupplier* sortedFilterSuppler,
     size_t maxBufferSize,
-    FileEncoder* encoder)
+    FileEncoder* encoder,
+    SortedStage* sortedStage,
+    SortedShards* shards)
 {
-    const int bufferCount = 3;
+    //
+    // A third of the sort memory goes to the threads' buffers, a third to sorted blocks kept in memory, and the rest to
+    // blocks on their way to the temp file once the memory is full.
+    //
     const size_t bufferSpace = tempBufferMemory > 0 ? tempBufferMemory : (numThreads * (size_t)1 << 30);
-    const size_t bufferSize = bufferSpace / (bufferCount * numThreads);
-    DataWriter::FilterSupplier* filterSupplier =
-        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, bufferSize, bufferSpace, encoder);
-    return DataWriterSupplier::create(tempFileName, bufferSize, filterSupplier, NULL, bufferCount);
+    const size_t bufferSize = bufferSpace / (3 * numThreads);
+    return new SortedDataWriterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, bufferSize,
+        bufferSpace, bufferSpace / 3, numThreads, encoder, sortedStage, shards);
 }
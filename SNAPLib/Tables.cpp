@@ -17,6 +17,7 @@ const unsigned *IS_LOWER_CASE_OR_DOT = tables.getIsLowerCaseOrDot();
 const char *TO_UPPER_CASE_DOT_TO_N = tables.getToUpperCaseDotToN();
 const char *PACKED_VALUE_BASE_RC = tables.getPackedValueBaseRC();
 const char *CIGAR_QUAL_TO_SAM = tables.getCigarQualToSam();
+const char *DECIMAL_DIGIT_PAIRS = tables.getDecimalDigitPairs();
 
 Tables::Tables()
 {
@@ -91,4 +92,9 @@ Tables::Tables()
     for (unsigned i = 0; i < 256; i++) {
         cigarQualToSam[i] = i > ('~' - '!') ? '!' : '!' + i;
     }
+
+    for (int i = 0; i < 100; i++) {
+        decimalDigitPairs[2 * i] = '0' + i / 10;
+        decimalDigitPairs[2 * i + 1] = '0' + i % 10;
+    }
 }
@@ -29,6 +29,8 @@ class Tables
 
     char cigarQualToSam[256];
 
+    char decimalDigitPairs[200]; // "00", "01", ... "99", for writing numbers two digits at a time
+
 public:
     Tables();
 
@@ -46,6 +48,7 @@ public:
     const unsigned *getIsLowerCaseOrDot() const {return isLowerCaseOrDot; }
     const char *getToUpperCaseDotToN() const { return toUpperCaseDotToN; }
     const char *getCigarQualToSam() const { return cigarQualToSam; }
+    const char *getDecimalDigitPairs() const { return decimalDigitPairs; }
 };
 
 extern const char *COMPLEMENT;
@@ -61,4 +64,5 @@ extern const int  *BASE_VALUE_NO_N;
 extern const unsigned *IS_LOWER_CASE_OR_DOT;
 extern const char *TO_UPPER_CASE_DOT_TO_N;
 extern const char *CIGAR_QUAL_TO_SAM;
+extern const char *DECIMAL_DIGIT_PAIRS;
 
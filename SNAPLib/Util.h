@@ -492,6 +492,27 @@ struct IdIntPair
 
 void memrevcpy(void* dst, const void* src, size_t bytes);
 
+//
+// An array of count Ts that's on the stack if it fits in N, and on the heap if it doesn't.  For per-read buffers, so
+// that ordinary reads don't allocate, and long ones don't blow the stack.
+//
+template <class T, int N>
+class StackOrHeapArray
+{
+public:
+    StackOrHeapArray(size_t count) : heap(count > N ? new T[count] : NULL) {}
+    ~StackOrHeapArray() { delete [] heap; }
+
+    operator T*() { return heap != NULL ? heap : stack; }
+
+private:
+    StackOrHeapArray(const StackOrHeapArray&);
+    void operator=(const StackOrHeapArray&);
+
+    T   stack[N];
+    T*  heap;
+};
+
 
 } // namespace util
 
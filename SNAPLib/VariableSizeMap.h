@@ -150,8 +150,9 @@ public:
     {
         if (entries != NULL) {
             if (_empty == 0 && sizeof(Entry) < 4 * sizeof(K) && ! _big) {
-                // optimize zero case
-                memset(entries, 0, capacity * sizeof(Entry));
+                // optimize zero case; entries are only ever copied by assignment, so zeroing the memory is fine even
+                // though Entry has a constructor
+                memset((void*)entries, 0, capacity * sizeof(Entry));
             } else {
                 const K e(_empty);
                 for (int i = 0; i < capacity; i++) {
@@ -369,6 +369,11 @@ int main(int argc, char * argv[])
     ReaderContext readerContext;
     readerContext.clipping = NoClipping;
     readerContext.defaultReadGroup = "";
+    readerContext.regions = NULL;
+    readerContext.writeMateScores = false;
+    readerContext.matcherMemory = PairedReadReader::DefaultMatcherMemory;
+    readerContext.spillDirectory = NULL;
+    readerContext.outputFileName = NULL;
     readerContext.genome = genome;
     readerContext.ignoreSecondaryAlignments = true;
     readerContext.ignoreSupplementaryAlignments = true;
@@ -71,7 +71,7 @@ void workerThreadMain(void *context)
 
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
 
-    const unsigned maxReadLen = MAX_READ_LENGTH;
+    const unsigned maxReadLen = MaxReadLength;
     char *rcBuffer = new char[maxReadLen];
 
     Read *read;
@@ -63,6 +63,11 @@ int main(int argc, char * argv[])
     readerContext.ignoreSecondaryAlignments = true;
     readerContext.ignoreSupplementaryAlignments = true;
     readerContext.defaultReadGroup = "";
+    readerContext.regions = NULL;
+    readerContext.writeMateScores = false;
+    readerContext.matcherMemory = PairedReadReader::DefaultMatcherMemory;
+    readerContext.spillDirectory = NULL;
+    readerContext.outputFileName = NULL;
 
     ReadSupplierGenerator *readSupplierGenerator = BAMReader::createReadSupplierGenerator(fileName,1, readerContext);
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
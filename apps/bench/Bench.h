@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+ * Microbenchmarks, registered the same way as the unit tests in tests/TestLib.h:
+ *
+ *    BENCHMARK("description") { body }
+ *
+ * The body times whatever it's comparing and prints the results.  bench runs every benchmark, or just the ones whose
+ * descriptions contain its argument.  They're kept out of unit_tests because they only report numbers, and take a
+ * while to do it.
+ *
+ * BENCH_CHECK(expression) stops the run if something that's being timed gave the wrong answer.
+ */
+
+#include <stdio.h>
+#include <vector>
+
+namespace bench {
+
+typedef void (*FunctionPtr)();
+
+struct Benchmark {
+    Benchmark(const char *name_, FunctionPtr func_) : name(name_), func(func_) {
+        getBenchmarks().push_back(this);
+    }
+
+    const char *name;
+    FunctionPtr func;
+
+    static std::vector<Benchmark*>& getBenchmarks() {
+        static std::vector<Benchmark*> benchmarks;
+        return benchmarks;
+    }
+};
+
+void checkFailed(const char *file, int line, const char *expression);
+
+}
+
+#define BENCH_CONCAT1( x, y ) x ## y
+#define BENCH_CONCAT2( x, y ) BENCH_CONCAT1( x, y ) /* To escape weird macro expansion rules */
+#define BENCH_FUNC(line)  BENCH_CONCAT2(_bench_func_,  line)
+#define BENCH_CASE(line)  BENCH_CONCAT2(_bench_case_,  line)
+
+#define BENCHMARK(name) \
+    static void BENCH_FUNC(__LINE__)(); \
+    static bench::Benchmark BENCH_CASE(__LINE__)(name, BENCH_FUNC(__LINE__)); \
+    static void BENCH_FUNC(__LINE__)()
+
+#define BENCH_CHECK(expr) \
+    do { if (!(expr)) { bench::checkFailed(__FILE__, __LINE__, #expr); } } while (0)
@@ -0,0 +1,71 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "GzipCodec.h"
+#include "Bench.h"
+
+static const size_t BlockSize = 65280;     // Small enough that a BGZF block always fits in 64KB compressed
+
+static void makeBlock(char *data, size_t size, unsigned seed)
+{
+    static const char bases[] = "ACGT";
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (i % 101 == 100) ? '\n' : bases[(seed >> 16) & 3];
+    }
+}
+
+//
+// Compression ratio and speed of each backend that's compiled in, over BGZF blocks of sequence-like text.
+//
+BENCHMARK("gzip codec throughput") {
+    const int nBlocks = 64;      // About 4MB
+    const int nPasses = 3;       // Report the fastest of these
+    char *input = new char[nBlocks * BlockSize];
+    for (int i = 0; i < nBlocks; i++) {
+        makeBlock(input + i * BlockSize, BlockSize, i);
+    }
+    char *compressed = new char[nBlocks * 0x10000];
+    size_t *compressedSizes = new size_t[nBlocks];
+    char *output = new char[BlockSize];
+
+    for (int backend = 0; backend < GzipCodec::NumBackends; backend++) {
+        if (!GzipCodec::IsAvailable((GzipCodec::Backend)backend)) {
+            printf("    %-10s not compiled in\n", GzipCodec::BackendName((GzipCodec::Backend)backend));
+            continue;
+        }
+        GzipCodec *codec = GzipCodec::create((GzipCodec::Backend)backend);
+
+        _int64 compressNanos = 0, decompressNanos = 0;
+        size_t totalCompressed = 0;
+        for (int pass = 0; pass < nPasses; pass++) {
+            _int64 start = timeInNanos();
+            totalCompressed = 0;
+            for (int i = 0; i < nBlocks; i++) {
+                compressedSizes[i] = codec->compressMember(input + i * BlockSize, BlockSize, compressed + i * 0x10000, 0x10000, true);
+                BENCH_CHECK(compressedSizes[i] > 0);
+                totalCompressed += compressedSizes[i];
+            }
+            _int64 nanos = timeInNanos() - start;
+            compressNanos = pass == 0 ? nanos : __min(compressNanos, nanos);
+
+            start = timeInNanos();
+            for (int i = 0; i < nBlocks; i++) {
+                size_t outputUsed;
+                BENCH_CHECK(codec->decompressMember(compressed + i * 0x10000, compressedSizes[i], output, BlockSize, &outputUsed));
+                BENCH_CHECK(outputUsed == BlockSize);
+            }
+            nanos = timeInNanos() - start;
+            decompressNanos = pass == 0 ? nanos : __min(decompressNanos, nanos);
+        }
+
+        double megabytes = (double)nBlocks * BlockSize / (1024 * 1024);
+        printf("    %-10s ratio %.2f, compress %.0f MB/s, decompress %.0f MB/s\n", GzipCodec::BackendName((GzipCodec::Backend)backend),
+            (double)nBlocks * BlockSize / totalCompressed, megabytes * 1e9 / __max(compressNanos, (_int64)1), megabytes * 1e9 / __max(decompressNanos, (_int64)1));
+        delete codec;
+    }
+
+    delete [] input;
+    delete [] compressed;
+    delete [] compressedSizes;
+    delete [] output;
+}
@@ -0,0 +1,26 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "exit.h"
+#include "Bench.h"
+
+void bench::checkFailed(const char *file, int line, const char *expression)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    soft_exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    // Allow passing in a substring to search for in benchmark names
+    const char *filter = (argc == 2 ? argv[1] : NULL);
+    std::vector<bench::Benchmark*>& benchmarks = bench::Benchmark::getBenchmarks();
+    for (size_t i = 0; i < benchmarks.size(); i++) {
+        if (filter != NULL && strstr(benchmarks[i]->name, filter) == NULL) {
+            continue;
+        }
+        printf("- %s:\n", benchmarks[i]->name);
+        fflush(stdout);
+        benchmarks[i]->func();
+    }
+    return 0;
+}
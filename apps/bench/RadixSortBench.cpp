@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "RadixSort.h"
+#include "Bench.h"
+
+//
+// Same layout as the SortEntry that SortedDataWriter sorts each batch of.
+//
+#pragma pack(push, 4)
+struct Entry
+{
+    size_t  offset;
+    _int64  length;
+    _int64  location;
+};
+#pragma pack(pop)
+
+struct EntryKey
+{
+    _uint64 operator()(const Entry& e) const { return (_uint64) e.location ^ ((_uint64) 1 << 63); }
+};
+
+static bool entryLess(const Entry& a, const Entry& b)
+{
+    return a.location < b.location;
+}
+
+//
+// Reads from one batch of output: mostly spread over a 3Gb genome, with pileups at a few places and a run of unmapped
+// ones at the end, all with the same location.
+//
+static void makeBatch(Entry* entries, size_t n, unsigned seed)
+{
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8;
+        entries[i].offset = offset;
+        entries[i].length = 300 + (r & 127);
+        offset += entries[i].length;
+        if (r % 10 == 0) {
+            entries[i].location = 0xffffffff;
+        } else if (r % 10 == 1) {
+            entries[i].location = 1000000 + (r & 15);
+        } else {
+            seed = seed * 1103515245 + 12345;
+            entries[i].location = ((_int64) r << 8 | (seed >> 24)) % 3000000000LL;
+        }
+    }
+}
+
+//
+// std::stable_sort, which SortedDataWriter used to sort each batch with, against RadixSort for batches up to the size
+// that the aligner threads sort (about a million reads for the default sort memory).
+//
+BENCHMARK("RadixSort vs. stable_sort") {
+    const size_t sizes[] = {10000, 100000, 1000000, 4000000};
+    const int nPasses = 3;      // Report the fastest of these
+    for (int s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+        size_t n = sizes[s];
+        Entry* original = new Entry[n];
+        Entry* entries = new Entry[n];
+        Entry* scratch = new Entry[n];
+        Entry* expected = new Entry[n];
+        makeBatch(original, n, 17);
+
+        _int64 stableNanos = 0, radixNanos = 0;
+        for (int pass = 0; pass < nPasses; pass++) {
+            memcpy(expected, original, n * sizeof(Entry));
+            _int64 start = timeInNanos();
+            std::stable_sort(expected, expected + n, entryLess);
+            _int64 nanos = timeInNanos() - start;
+            stableNanos = pass == 0 ? nanos : __min(stableNanos, nanos);
+
+            memcpy(entries, original, n * sizeof(Entry));
+            start = timeInNanos();
+            Entry* sorted = RadixSort(entries, scratch, n, EntryKey());
+            nanos = timeInNanos() - start;
+            radixNanos = pass == 0 ? nanos : __min(radixNanos, nanos);
+
+            BENCH_CHECK(memcmp(sorted, expected, n * sizeof(Entry)) == 0);
+        }
+
+        printf("    %8lld entries: stable_sort %7.1f ms, RadixSort %7.1f ms (%.1fx)\n", (_int64) n, stableNanos * 1e-6, radixNanos * 1e-6,
+            (double) stableNanos / __max(radixNanos, (_int64) 1));
+        delete [] original;
+        delete [] entries;
+        delete [] scratch;
+        delete [] expected;
+    }
+}
@@ -0,0 +1,94 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "SAMEmitter.h"
+#include "Bench.h"
+
+//
+// Building typical SAM lines (100 base paired reads) with snprintf, the way SAMFormat::writeRead used to, against
+// SAMEmitter.  Each fills a 1MB buffer, like a writer's batch, starting over when the next line might not fit.
+//
+BENCHMARK("SAMEmitter vs. snprintf") {
+    const int nLines = 1000000;
+    const size_t bufferSize = 1024 * 1024;
+    const size_t maxLine = 600;
+    const int nPasses = 3;      // Report the fastest of these
+    char *snprintfBuffer = new char[bufferSize];
+    char *emitterBuffer = new char[bufferSize];
+    char data[101], quality[101];
+    for (int i = 0; i < 100; i++) {
+        data[i] = "ACGT"[i % 4];
+        quality[i] = '!' + (i * 7) % 40;
+    }
+    const char *id = "HWI-ST1234:8:1101:15254:39426";
+    int idLen = (int)strlen(id);
+
+    _int64 snprintfNanos = 0, emitterNanos = 0;
+    size_t snprintfBytes = 0, emitterBytes = 0;
+    for (int pass = 0; pass < nPasses; pass++) {
+        _int64 start = timeInNanos();
+        size_t used = 0;
+        snprintfBytes = 0;
+        for (int i = 0; i < nLines; i++) {
+            if (bufferSize - used < maxLine) {
+                snprintfBytes += used;
+                used = 0;
+            }
+            used += snprintf(snprintfBuffer + used, maxLine, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s\n",
+                idLen, id, 99, "chr12", 13000000 + i * 37, 60, "52M1I47M", "=", 13000250 + i * 37, (_int64) 350 - (i & 1023), 100, data,
+                100, quality, "", 0, "", "", "", "\tNM:i:2", 0, "");
+        }
+        snprintfBytes += used;
+        _int64 nanos = timeInNanos() - start;
+        snprintfNanos = pass == 0 ? nanos : __min(snprintfNanos, nanos);
+
+        start = timeInNanos();
+        used = 0;
+        emitterBytes = 0;
+        for (int i = 0; i < nLines; i++) {
+            if (bufferSize - used < maxLine) {
+                emitterBytes += used;
+                used = 0;
+            }
+            SAMEmitter out(emitterBuffer + used, maxLine);
+            out.chars(id, idLen);
+            out.tab();
+            out.number(99);
+            out.tab();
+            out.chars("chr12", 5);
+            out.tab();
+            out.number(13000000 + i * 37);
+            out.tab();
+            out.number(60);
+            out.tab();
+            out.text("52M1I47M");
+            out.tab();
+            out.chars("=", 1);
+            out.tab();
+            out.number(13000250 + i * 37);
+            out.tab();
+            out.signedNumber(350 - (i & 1023));
+            out.tab();
+            out.chars(data, 100);
+            out.tab();
+            out.chars(quality, 100);
+            out.text("\tPG:Z:SNAP\tNM:i:");
+            out.signedNumber(2);
+            out.ch('\n');
+            used += out.used();
+        }
+        emitterBytes += used;
+        nanos = timeInNanos() - start;
+        emitterNanos = pass == 0 ? nanos : __min(emitterNanos, nanos);
+
+        // The same lines in the same places, so the last buffer full has to match too
+        BENCH_CHECK(snprintfBytes == emitterBytes);
+        BENCH_CHECK(memcmp(snprintfBuffer, emitterBuffer, used) == 0);
+    }
+
+    printf("    snprintf   %7.1f MB/s\n", snprintfBytes * 1e3 / __max(snprintfNanos, (_int64) 1));
+    printf("    SAMEmitter %7.1f MB/s (%.1fx)\n", emitterBytes * 1e3 / __max(emitterNanos, (_int64) 1),
+        (double) snprintfNanos / __max(emitterNanos, (_int64) 1));
+
+    delete [] snprintfBuffer;
+    delete [] emitterBuffer;
+}
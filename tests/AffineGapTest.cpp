@@ -0,0 +1,60 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "AffineGap.h"
+#include "Bam.h"
+
+// Test fixture for the affine gap realigner
+struct AffineGapTest {
+    AffineGapWithCigar ag;
+    _uint32 ops[100];
+    int nOps, textUsed, netIndel;
+    char cigar[1000];
+
+    int align(const char *text, const char *pattern, bool useM = false) {
+        int editDistance = ag.computeCigarOps(text, (int)strlen(text), pattern, (int)strlen(pattern), 10, useM, ops, 100, &nOps, &textUsed, &netIndel);
+        if (editDistance >= 0) {
+            BAMAlignment::decodeCigar(cigar, sizeof(cigar), ops, nOps);
+        } else {
+            cigar[0] = '\0';
+        }
+        return editDistance;
+    }
+};
+
+TEST_F(AffineGapTest, "equal strings") {
+    ASSERT_EQ(0, align("ACGTTGCAAGGCTTACCGAT", "ACGTTGCAAGGCTTACCGAT"));
+    ASSERT_STREQ("20=", cigar);
+    ASSERT_EQ(0, netIndel);
+    ASSERT_EQ(20, textUsed);
+}
+
+TEST_F(AffineGapTest, "mismatches") {
+    ASSERT_EQ(1, align("ACGTTGCAAGGCTTACCGATTT", "ACGTTGCAATGCTTACCGAT"));
+    ASSERT_STREQ("9=1X10=", cigar);
+
+    ASSERT_EQ(1, align("ACGTTGCAAGGCTTACCGATTT", "ACGTTGCAATGCTTACCGAT", true));
+    ASSERT_STREQ("20M", cigar);
+}
+
+TEST_F(AffineGapTest, "one long indel rather than several short ones") {
+    // Three deleted bases
+    ASSERT_EQ(3, align("ACGTTGCAAGGCTTACCGATGGACTTAGC", "ACGTTGCAAGGACCGATGGACTTAGC"));
+    ASSERT_STREQ("11=3D15=", cigar);
+    ASSERT_EQ(3, netIndel);
+    ASSERT_EQ(29, textUsed);
+
+    // Three inserted bases
+    ASSERT_EQ(3, align("ACGTTGCAAGGCTTACCGATGGACTTAGCAAAA", "ACGTTGCAAGGCTTTTTACCGATGGACTTAGC"));
+    ASSERT_STREQ("12=3I17=", cigar);
+    ASSERT_EQ(-3, netIndel);
+}
+
+TEST_F(AffineGapTest, "indels are left normalized") {
+    // Deleting any one of the As gives the same alignment; it should be the first one
+    ASSERT_EQ(1, align("GATTACAGCAAAAAGCTTACCGAT", "GATTACAGCAAAAGCTTACCGAT"));
+    ASSERT_STREQ("9=1D14=", cigar);
+}
+
+TEST_F(AffineGapTest, "leading indels are left to LV") {
+    ASSERT_EQ(-1, align("TTACGTTGCAAGGCTTACCGAT", "CCCCACGTTGCAAGGCTTACCGAT"));
+}
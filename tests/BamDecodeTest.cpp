@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "Bam.h"
+#include "Tables.h"
+
+//
+// Compare the decoders (which use SIMD when they can) with the obvious one base at a time versions, for every length
+// around the 32 bases that the vector code does at once.
+//
+static const int MaxBases = 200;
+
+static void makeRecord(_uint8 *nibbles, char *quality, int bases, unsigned seed)
+{
+    for (int i = 0; i < (bases + 1) / 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        nibbles[i] = (_uint8)(seed >> 16);
+    }
+    for (int i = 0; i < bases; i++) {
+        seed = seed * 1103515245 + 12345;
+        quality[i] = (char)(i % 37 == 36 ? 0xff : (seed >> 16) % 100);  // Some out of range
+    }
+}
+
+static char baseAt(const _uint8 *nibbles, int i)
+{
+    return BAMAlignment::CodeToSeq[(i % 2 == 0) ? nibbles[i / 2] >> 4 : nibbles[i / 2] & 0xf];
+}
+
+static char complement(char base)
+{
+    return BAMAlignment::CodeToSeqRC[BAMAlignment::SeqToCode[(_uint8)base]];
+}
+
+TEST("BAM sequence decoding matches one base at a time") {
+    _uint8 nibbles[MaxBases / 2 + 1];
+    char quality[MaxBases];
+    char sequence[MaxBases + 1];
+
+    for (int bases = 0; bases <= MaxBases; bases++) {
+        makeRecord(nibbles, quality, bases, bases);
+
+        sequence[bases] = 'x';
+        BAMAlignment::decodeSeq(sequence, nibbles, bases);
+        for (int i = 0; i < bases; i++) {
+            ASSERT_EQ(baseAt(nibbles, i), sequence[i]);
+        }
+        ASSERT_EQ('x', sequence[bases]);
+
+        BAMAlignment::decodeSeqRC(sequence, nibbles, bases);
+        for (int i = 0; i < bases; i++) {
+            ASSERT_EQ(complement(baseAt(nibbles, bases - i - 1)), sequence[i]);
+        }
+        ASSERT_EQ('x', sequence[bases]);
+    }
+}
+
+TEST("BAM quality decoding matches the table, in place or not") {
+    char quality[MaxBases];
+    char original[MaxBases];
+    char decoded[MaxBases];
+    _uint8 nibbles[MaxBases / 2 + 1];
+
+    for (int bases = 0; bases <= MaxBases; bases++) {
+        makeRecord(nibbles, original, bases, bases + 1000);
+
+        memcpy(quality, original, bases);
+        BAMAlignment::decodeQual(decoded, quality, bases);
+        BAMAlignment::decodeQual(quality, quality, bases);
+        for (int i = 0; i < bases; i++) {
+            ASSERT_EQ(CIGAR_QUAL_TO_SAM[(_uint8)original[i]], decoded[i]);
+            ASSERT_EQ(decoded[i], quality[i]);
+        }
+
+        memcpy(quality, original, bases);
+        BAMAlignment::decodeQualRC(decoded, quality, bases);
+        BAMAlignment::decodeQualRC(quality, quality, bases);
+        for (int i = 0; i < bases; i++) {
+            ASSERT_EQ(CIGAR_QUAL_TO_SAM[(_uint8)original[bases - i - 1]], decoded[i]);
+            ASSERT_EQ(decoded[i], quality[i]);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "Bam.h"
+
+//
+// The .bai bin calculation from the SAM spec, to check the generalized (.csi) one against at the .bai's shift and depth.
+//
+static int specReg2bin(int beg, int end)
+{
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+TEST("BAM bins match the .bai spec") {
+    ASSERT_EQ(37449u, BAMAlignment::binCount(BAMAlignment::BAI_DEPTH));
+    ASSERT_EQ(37450u, BAMAlignment::metadataBin(BAMAlignment::BAI_DEPTH));
+
+    unsigned seed = 1;
+    for (int i = 0; i < 100000; i++) {
+        seed = seed * 1103515245 + 12345;
+        int beg = (int)((seed >> 1) % (1 << 29));
+        seed = seed * 1103515245 + 12345;
+        int end = __min(beg + 1 + (int)((seed >> 8) % (i % 2 ? 1000 : 10000000)), 1 << 29);
+        ASSERT_EQ((_uint32) specReg2bin(beg, end), BAMAlignment::reg2bin(beg, end, BAMAlignment::BAI_MIN_SHIFT, BAMAlignment::BAI_DEPTH));
+        ASSERT_EQ(specReg2bin(beg, end), BAMAlignment::reg2bin(beg, end));
+    }
+}
+
+TEST("BAM reg2bins covers every overlapping bin") {
+    //
+    // A read's bin has to be in the list for any region it overlaps, at the .bai depth and a deeper .csi one.
+    //
+    const int depths[] = {BAMAlignment::BAI_DEPTH, 6};
+    for (int d = 0; d < 2; d++) {
+        int depth = depths[d];
+        int limit = 1 << (BAMAlignment::BAI_MIN_SHIFT + 3 * depth);
+        unsigned seed = 7;
+        for (int i = 0; i < 2000; i++) {
+            seed = seed * 1103515245 + 12345;
+            int regionBegin = (int)((seed >> 1) % (limit - 100000));
+            int regionEnd = regionBegin + 1 + (int)((seed >> 4) % 100000);
+            VariableSizeVector<_uint32> bins;
+            BAMAlignment::reg2bins(regionBegin, regionEnd, BAMAlignment::BAI_MIN_SHIFT, depth, &bins);
+            for (int j = 0; j < 20; j++) {
+                seed = seed * 1103515245 + 12345;
+                int readBegin = regionBegin - 5000 + (int)((seed >> 8) % (regionEnd - regionBegin + 5000));
+                int readEnd = readBegin + 1 + (int)((seed >> 4) % 5000);
+                if (readBegin < 0 || readEnd <= regionBegin) {
+                    continue;
+                }
+                _uint32 bin = BAMAlignment::reg2bin(readBegin, readEnd, BAMAlignment::BAI_MIN_SHIFT, depth);
+                bool found = false;
+                for (int k = 0; k < bins.size(); k++) {
+                    found |= bins[k] == bin;
+                }
+                ASSERT(found);
+            }
+        }
+    }
+}
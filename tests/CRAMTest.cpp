@@ -0,0 +1,479 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "CRAMCodecs.h"
+#include "CRAM.h"
+#include "FASTA.h"
+#include "Genome.h"
+#include "SAM.h"
+
+//
+// ITF8 and LTF8 from the CRAM 3.0 spec: the number of leading one bits in the first byte is the number of bytes that
+// follow, except that a five byte ITF8 only uses the low four bits of its last byte.
+//
+struct IntegerVector
+{
+    _int64      value;
+    int         size;
+    _uint8      bytes[9];
+};
+
+static const IntegerVector Itf8Vectors[] = {
+    {0, 1, {0x00}},
+    {127, 1, {0x7f}},
+    {128, 2, {0x80, 0x80}},
+    {0x3fff, 2, {0xbf, 0xff}},
+    {0x4000, 3, {0xc0, 0x40, 0x00}},
+    {0x1fffff, 3, {0xdf, 0xff, 0xff}},
+    {0x200000, 4, {0xe0, 0x20, 0x00, 0x00}},
+    {0x0fffffff, 4, {0xef, 0xff, 0xff, 0xff}},
+    {0x10000000, 5, {0xf1, 0x00, 0x00, 0x00, 0x00}},
+    {0x7fffffff, 5, {0xf7, 0xff, 0xff, 0xff, 0x0f}},
+    {-1, 5, {0xff, 0xff, 0xff, 0xff, 0x0f}},
+};
+
+static const IntegerVector Ltf8Vectors[] = {
+    {0, 1, {0x00}},
+    {127, 1, {0x7f}},
+    {128, 2, {0x80, 0x80}},
+    {0x4000, 3, {0xc0, 0x40, 0x00}},
+    {(_int64)1 << 21, 4, {0xe0, 0x20, 0x00, 0x00}},
+    {(_int64)1 << 28, 5, {0xf0, 0x10, 0x00, 0x00, 0x00}},
+    {(_int64)1 << 35, 6, {0xf8, 0x08, 0x00, 0x00, 0x00, 0x00}},
+    {(_int64)1 << 42, 7, {0xfc, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00}},
+    {(_int64)1 << 49, 8, {0xfe, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}},
+    {(_int64)1 << 56, 9, {0xff, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}},
+    {-1, 9, {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}},
+};
+
+TEST("CRAM ITF8 and LTF8 match the spec") {
+    for (size_t i = 0; i < sizeof(Itf8Vectors) / sizeof(Itf8Vectors[0]); i++) {
+        const IntegerVector& v = Itf8Vectors[i];
+        CRAMOutput output;
+        output.itf8((_int32)v.value);
+        ASSERT_EQ((size_t)v.size, output.used);
+        ASSERT(0 == memcmp(v.bytes, output.data, v.size));
+        CRAMBytes input(v.bytes, v.size);
+        ASSERT_EQ((_int32)v.value, input.itf8());
+        ASSERT(input.next == input.end);
+    }
+    for (size_t i = 0; i < sizeof(Ltf8Vectors) / sizeof(Ltf8Vectors[0]); i++) {
+        const IntegerVector& v = Ltf8Vectors[i];
+        CRAMOutput output;
+        output.ltf8(v.value);
+        ASSERT_EQ((size_t)v.size, output.used);
+        ASSERT(0 == memcmp(v.bytes, output.data, v.size));
+        CRAMBytes input(v.bytes, v.size);
+        ASSERT_EQ(v.value, input.ltf8());
+        ASSERT(input.next == input.end);
+    }
+}
+
+TEST("CRAM EOF container matches the spec") {
+    //
+    // The EOF container from section 9 of the spec, built field by field: a container header with no records and
+    // one block, and that block, an empty compression header.  Both end in their CRC32.
+    //
+    static const _uint8 eof[] = {
+        0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+        0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63, 0x01, 0x4b
+    };
+    CRAMOutput output;
+    output.int32(15);           // bytes of blocks
+    output.itf8(-1);            // reference
+    output.itf8(4542278);       // start, which spells EOF
+    output.itf8(0);             // span
+    output.itf8(0);             // records
+    output.ltf8(0);             // record counter
+    output.ltf8(0);             // bases
+    output.itf8(1);             // blocks
+    output.itf8(0);             // landmarks
+    output.int32(CRAMCrc32(output.data, output.used));
+    size_t blockStart = output.used;
+    output.byte(0);             // raw
+    output.byte(1);             // compression header
+    output.itf8(0);             // content ID
+    output.itf8(6);
+    output.itf8(6);
+    static const _uint8 emptyMaps[] = {0x01, 0x00, 0x01, 0x00, 0x01, 0x00};
+    output.bytes(emptyMaps, sizeof(emptyMaps));
+    output.int32(CRAMCrc32(output.data + blockStart, output.used - blockStart));
+
+    ASSERT_EQ(sizeof(eof), output.used);
+    ASSERT(0 == memcmp(eof, output.data, sizeof(eof)));
+}
+
+TEST("CRAM MD5 matches RFC 1321") {
+    static const char* inputs[] = {"", "a", "abc", "message digest", "abcdefghijklmnopqrstuvwxyz",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+        "12345678901234567890123456789012345678901234567890123456789012345678901234567890"};
+    static const char* digests[] = {"d41d8cd98f00b204e9800998ecf8427e", "0cc175b9c0f1b6a831c399e269772661",
+        "900150983cd24fb0d6963f7d28e17f72", "f96b697d7cb7938d525a2f31aaf161d0", "c3fcd3d76192e4007dfb496cca67e13b",
+        "d174ab98d277d9f5a5611c2c9f419d9f", "57edf4a22be3c955ac49da2e2107b67a"};
+    for (int i = 0; i < 7; i++) {
+        _uint8 digest[16];
+        CRAMMD5((const _uint8*)inputs[i], strlen(inputs[i]), digest);
+        char hex[33];
+        for (int j = 0; j < 16; j++) {
+            sprintf(hex + 2 * j, "%02x", digest[j]);
+        }
+        ASSERT_STREQ(digests[i], hex);
+    }
+}
+
+TEST("CRAM reference MD5 is of the FASTA's bases") {
+    // long enough to have whole chunks as well as the tail, with lower case, Ns and other IUPAC codes
+    char bases[151], upper[150];
+    for (int i = 0; i < 150; i++) {
+        bases[i] = "acgtnACGTNacgtRACGTm"[i % 20];
+        upper[i] = (char)toupper(bases[i]);
+    }
+    bases[150] = '\0';
+    const char* fastaName = "CRAMMD5Test.fa";
+    const char* genomeName = "CRAMMD5Test.genome";
+    const char* codesName = "CRAMMD5Test.iupac";
+    FILE* file = fopen(fastaName, "w");
+    fprintf(file, ">contig\n%s\n", bases);
+    fclose(file);
+
+    _uint8 digest[16], expected[16];
+    CRAMMD5((const _uint8*)upper, sizeof(upper), expected);
+    const Genome* genome = ReadFASTAGenome(fastaName, NULL, true, 100);
+    ASSERT(genome != NULL);
+    GenomeLocation contig = genome->getContigs()[0].beginningLocation;
+    ASSERT(CRAMReferenceMD5(genome, contig, sizeof(upper), digest));
+    ASSERT(0 == memcmp(expected, digest, 16));
+
+    // and the same once the genome has been saved and loaded again with its IUPAC codes
+    ASSERT(genome->saveToFile(genomeName));
+    ASSERT(genome->saveIUPACCodes(codesName));
+    delete genome;
+    Genome* loaded = (Genome*)Genome::loadFromFile(genomeName, 100);
+    ASSERT(loaded != NULL);
+    ASSERT(CRAMReferenceMD5(loaded, contig, 14, digest));     // just before the first code other than N
+    ASSERT(! CRAMReferenceMD5(loaded, contig, sizeof(upper), digest));   // without the codes it can't know
+    ASSERT(loaded->loadIUPACCodes(codesName));
+    ASSERT(CRAMReferenceMD5(loaded, contig, sizeof(upper), digest));
+    ASSERT(0 == memcmp(expected, digest, 16));
+    delete loaded;
+
+    remove(fastaName);
+    remove(genomeName);
+    remove(codesName);
+}
+
+//
+// rANS vectors.  These weren't written by RansEncoder: they come from an encoder written separately from the CRAM
+// codecs spec, which also normalizes the frequencies differently.  They have two byte frequencies, runs of
+// consecutive symbols and contexts, and lengths that aren't a multiple of four.
+//
+static const char Abracadabra[] = "abracadabra";
+static const char Skewed[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaabcdefghaaaaaaaaaaaaaaaaaaaa";
+static const char Bases[] = "ACGTACGTTTGACCAGTACCGTTAGCAAGT";
+static const char Short[] = "ab";
+
+static const _uint8 Abracadabra0[] = {
+    0x00, 0x1f, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x61, 0x87, 0x46, 0x62, 0x02, 0x82, 0xe9, 0x81, 0x74, 0x81,
+    0x74, 0x72, 0x82, 0xe9, 0x00, 0xf6, 0x20, 0x95, 0x42, 0x10, 0x4a, 0x3f, 0x21, 0xce, 0x6d, 0x95, 0x42, 0x66, 0x61,
+    0x6b, 0x02
+};
+
+static const _uint8 Skewed0[] = {
+    0x00, 0x21, 0x00, 0x00, 0x00, 0x57, 0x00, 0x00, 0x00, 0x61, 0x8e, 0xb7, 0x62, 0x06, 0x2f, 0x2f, 0x2f, 0x2f, 0x2f,
+    0x2f, 0x2f, 0x00, 0xb6, 0xd0, 0x28, 0x4f, 0x2e, 0xd2, 0x28, 0x4f, 0x5d, 0xd2, 0x28, 0x4f, 0x55, 0x81, 0xe8, 0x00,
+    0x94, 0x74, 0xa3, 0xd2
+};
+
+static const _uint8 Bases1[] = {
+    0x01, 0x47, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x41, 0x88, 0x00, 0x54, 0x88, 0x00, 0x00, 0x41, 0x41,
+    0x82, 0x00, 0x43, 0x88, 0x00, 0x47, 0x86, 0x00, 0x00, 0x43, 0x41, 0x82, 0xab, 0x43, 0x85, 0x55, 0x47, 0x88, 0x00,
+    0x00, 0x47, 0x41, 0x83, 0x33, 0x43, 0x83, 0x33, 0x54, 0x89, 0x9a, 0x00, 0x54, 0x41, 0x86, 0xdc, 0x47, 0x82, 0x49,
+    0x54, 0x86, 0xdb, 0x00, 0x00, 0x86, 0x65, 0x33, 0x3e, 0x29, 0xbf, 0x78, 0x04, 0x2b, 0x37, 0x6d, 0x7c, 0x1c, 0x5a,
+    0x76, 0x3c, 0xfb, 0x57
+};
+
+static const _uint8 Short1[] = {
+    0x01, 0x1b, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x61, 0x90, 0x00, 0x00, 0x61, 0x62, 0x90, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00
+};
+
+//
+// What RansEncoder writes for the same input, which the spec decoder that the vectors above were checked with reads.
+// The output depends on how the frequencies are rounded, so these have to change if that does.
+//
+static const _uint8 Abracadabra0Out[] = {
+    0x00, 0x1f, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00, 0x61, 0x87, 0x48, 0x62, 0x02, 0x82, 0xe8, 0x81, 0x74, 0x81,
+    0x74, 0x72, 0x82, 0xe8, 0x00, 0xec, 0xd6, 0x9a, 0x42, 0x20, 0x89, 0x4d, 0x21, 0x4c, 0xbe, 0x99, 0x42, 0x60, 0x05,
+    0x6a, 0x02
+};
+
+static const _uint8 Skewed0Out[] = {
+    0x00, 0x21, 0x00, 0x00, 0x00, 0x57, 0x00, 0x00, 0x00, 0x61, 0x8e, 0xb7, 0x62, 0x06, 0x2f, 0x2f, 0x2f, 0x2f, 0x2f,
+    0x2f, 0x2f, 0x00, 0xb6, 0xd0, 0x28, 0x4f, 0x2e, 0xd2, 0x28, 0x4f, 0x5d, 0xd2, 0x28, 0x4f, 0x55, 0x81, 0xe8, 0x00,
+    0x94, 0x74, 0xa3, 0xd2
+};
+
+static const _uint8 Bases1Out[] = {
+    0x01, 0x47, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00, 0x00, 0x41, 0x88, 0x00, 0x54, 0x88, 0x00, 0x00, 0x41, 0x41,
+    0x82, 0x00, 0x43, 0x88, 0x01, 0x47, 0x85, 0xff, 0x00, 0x43, 0x41, 0x82, 0xab, 0x43, 0x85, 0x55, 0x47, 0x88, 0x00,
+    0x00, 0x47, 0x41, 0x83, 0x33, 0x43, 0x83, 0x33, 0x54, 0x89, 0x9a, 0x00, 0x54, 0x41, 0x86, 0xdc, 0x47, 0x82, 0x49,
+    0x54, 0x86, 0xdb, 0x00, 0x00, 0xa4, 0xa2, 0x23, 0x3e, 0x2b, 0x3b, 0x78, 0x04, 0x19, 0x72, 0x72, 0x7c, 0xb6, 0xfb,
+    0x8a, 0x3c, 0xdb, 0x8a
+};
+
+static const _uint8 Short1Out[] = {
+    0x01, 0x1b, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x61, 0x90, 0x00, 0x00, 0x61, 0x62, 0x90, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00
+};
+
+struct RansVector
+{
+    const char*     text;
+    int             order;
+    const _uint8*   encoded;
+    size_t          encodedSize;
+    const _uint8*   ours;
+    size_t          oursSize;
+};
+
+#define RANS_VECTOR(text, order, name) {text, order, name, sizeof(name), name##Out, sizeof(name##Out)}
+
+static const RansVector RansVectors[] = {
+    RANS_VECTOR(Abracadabra, 0, Abracadabra0),
+    RANS_VECTOR(Skewed, 0, Skewed0),
+    RANS_VECTOR(Bases, 1, Bases1),
+    RANS_VECTOR(Short, 1, Short1),
+};
+
+TEST("rANS decodes the spec vectors") {
+    RansDecoder* decoder = new RansDecoder;
+    for (size_t i = 0; i < sizeof(RansVectors) / sizeof(RansVectors[0]); i++) {
+        const RansVector& v = RansVectors[i];
+        size_t size = strlen(v.text);
+        char output[100];
+        ASSERT(decoder->decode(v.encoded, v.encodedSize, (_uint8*)output, size));
+        ASSERT(0 == memcmp(v.text, output, size));
+        ASSERT(decoder->decode(v.ours, v.oursSize, (_uint8*)output, size));
+        ASSERT(0 == memcmp(v.text, output, size));
+
+        // the wrong size, and the data cut short
+        ASSERT(!decoder->decode(v.encoded, v.encodedSize, (_uint8*)output, size + 1));
+        ASSERT(!decoder->decode(v.encoded, 20, (_uint8*)output, size));
+    }
+    delete decoder;
+}
+
+TEST("rANS encoder output matches") {
+    RansEncoder* encoder = new RansEncoder;
+    for (size_t i = 0; i < sizeof(RansVectors) / sizeof(RansVectors[0]); i++) {
+        const RansVector& v = RansVectors[i];
+        CRAMOutput output;
+        encoder->encode(v.order, (const _uint8*)v.text, strlen(v.text), &output);
+        ASSERT_EQ(v.oursSize, output.used);
+        ASSERT(0 == memcmp(v.ours, output.data, v.oursSize));
+    }
+    delete encoder;
+}
+
+TEST("rANS round trips") {
+    RansEncoder* encoder = new RansEncoder;
+    RansDecoder* decoder = new RansDecoder;
+    const size_t MaxSize = 100000;
+    _uint8* input = new _uint8[MaxSize];
+    _uint8* output = new _uint8[MaxSize];
+    static const size_t sizes[] = {1, 2, 3, 4, 5, 7, 1000, 1001, 1002, 1003, MaxSize};
+    unsigned seed = 1;
+    for (int order = 0; order < 2; order++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (int alphabet = 1; alphabet <= 256; alphabet *= 4) {
+                //
+                // Runs of repeats, so that order 1 has something to work with, from an alphabet of one symbol up to
+                // all of them.
+                //
+                size_t size = sizes[s];
+                for (size_t i = 0; i < size; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    input[i] = i > 0 && (seed >> 28) < 8 ? input[i - 1] : (_uint8)((seed >> 16) % alphabet);
+                }
+                CRAMOutput encoded;
+                encoder->encode(order, input, size, &encoded);
+                ASSERT(decoder->decode(encoded.data, encoded.used, output, size));
+                ASSERT(0 == memcmp(input, output, size));
+            }
+        }
+    }
+    delete [] input;
+    delete [] output;
+    delete encoder;
+    delete decoder;
+}
+
+//
+// A small CRAM file written by tests/cram_fixtures.py, which builds it from the CRAM 3.0 spec and doesn't share any
+// code with ours.  It's mapped to datatest/datatest.fa's ref1 and has five reads:
+//
+//   pair       99, at 1, with a substitution at 6 whose code is from a non-default substitution matrix
+//   clipped    0, at 30, 3S10M2I5M2D10M, with tag NM:C:4
+//   pair       147, at 100, the first one's mate, found from its record
+//   lone       81, at 150, with its mate at 10 given explicitly and an N from a B feature
+//   unmapped   4, placed at 150, with its own bases
+//
+// Most of the data series are in the core block, with Huffman (including a zero length code), beta, gamma and
+// subexponential codes.  The names are in a gzip block and the bases and qualities in rANS order 0 and 1 blocks.
+//
+static const _uint8 CRAMFixture[] = {
+    0x43, 0x52, 0x41, 0x4d, 0x03, 0x00, 0x73, 0x6e, 0x61, 0x70, 0x20, 0x74, 0x65, 0x73, 0x74, 0x20, 0x66, 0x69, 0x78,
+    0x74, 0x75, 0x72, 0x65, 0x00, 0x00, 0x00, 0x75, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0xca, 0x01, 0x27, 0xde, 0x00, 0x00, 0x00, 0x6c, 0x6c, 0x68, 0x00, 0x00, 0x00, 0x40, 0x48, 0x44, 0x09, 0x56, 0x4e,
+    0x3a, 0x31, 0x2e, 0x34, 0x09, 0x53, 0x4f, 0x3a, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x69, 0x6e, 0x61, 0x74, 0x65, 0x0a,
+    0x40, 0x53, 0x51, 0x09, 0x53, 0x4e, 0x3a, 0x72, 0x65, 0x66, 0x31, 0x09, 0x4c, 0x4e, 0x3a, 0x32, 0x30, 0x32, 0x09,
+    0x4d, 0x35, 0x3a, 0x37, 0x64, 0x31, 0x38, 0x33, 0x31, 0x64, 0x39, 0x37, 0x65, 0x63, 0x63, 0x32, 0x33, 0x34, 0x61,
+    0x66, 0x30, 0x63, 0x33, 0x65, 0x39, 0x65, 0x37, 0x37, 0x37, 0x34, 0x61, 0x66, 0x35, 0x30, 0x37, 0x0a, 0x40, 0x52,
+    0x47, 0x09, 0x49, 0x44, 0x3a, 0x67, 0x72, 0x6f, 0x75, 0x70, 0x31, 0x09, 0x53, 0x4d, 0x3a, 0x73, 0x61, 0x6d, 0x70,
+    0x6c, 0x65, 0x0a, 0x1e, 0xcc, 0xd1, 0x73, 0x77, 0x03, 0x00, 0x00, 0x00, 0x01, 0x80, 0xa9, 0x05, 0x00, 0x80, 0x8e,
+    0x14, 0x01, 0x80, 0xff, 0x40, 0x41, 0x6b, 0x20, 0x00, 0x01, 0x00, 0x80, 0xf4, 0x80, 0xf4, 0x20, 0x05, 0x52, 0x4e,
+    0x01, 0x41, 0x50, 0x01, 0x52, 0x52, 0x01, 0x53, 0x4d, 0xe4, 0x1b, 0x1b, 0x1b, 0x1b, 0x54, 0x44, 0x0c, 0x00, 0x58,
+    0x30, 0x5a, 0x58, 0x31, 0x5a, 0x00, 0x4e, 0x4d, 0x43, 0x00, 0x80, 0x99, 0x16, 0x42, 0x46, 0x03, 0x0d, 0x05, 0x63,
+    0x00, 0x80, 0x93, 0x51, 0x04, 0x05, 0x02, 0x02, 0x02, 0x03, 0x03, 0x43, 0x46, 0x03, 0x08, 0x03, 0x01, 0x03, 0x05,
+    0x03, 0x01, 0x02, 0x02, 0x52, 0x4c, 0x06, 0x02, 0x00, 0x06, 0x41, 0x50, 0x09, 0x01, 0x01, 0x52, 0x47, 0x03, 0x0a,
+    0x02, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00, 0x02, 0x01, 0x01, 0x52, 0x4e, 0x05, 0x02, 0x00, 0x0b, 0x4d, 0x46, 0x01,
+    0x01, 0x0c, 0x4e, 0x53, 0x01, 0x01, 0x0d, 0x4e, 0x50, 0x01, 0x01, 0x0e, 0x54, 0x53, 0x01, 0x01, 0x0f, 0x4e, 0x46,
+    0x07, 0x02, 0x00, 0x01, 0x54, 0x4c, 0x06, 0x02, 0x00, 0x02, 0x46, 0x4e, 0x01, 0x01, 0x10, 0x46, 0x43, 0x01, 0x01,
+    0x11, 0x46, 0x50, 0x01, 0x01, 0x12, 0x42, 0x53, 0x03, 0x04, 0x01, 0x01, 0x01, 0x00, 0x49, 0x4e, 0x04, 0x06, 0x01,
+    0x01, 0x14, 0x01, 0x01, 0x15, 0x53, 0x43, 0x05, 0x02, 0x00, 0x16, 0x44, 0x4c, 0x06, 0x02, 0x00, 0x04, 0x42, 0x41,
+    0x01, 0x01, 0x17, 0x51, 0x53, 0x01, 0x01, 0x18, 0x4d, 0x51, 0x01, 0x01, 0x19, 0x37, 0x03, 0xe0, 0x58, 0x30, 0x5a,
+    0x04, 0x0c, 0x01, 0x04, 0xe0, 0x58, 0x30, 0x5a, 0x01, 0x04, 0xe0, 0x58, 0x30, 0x5a, 0xe0, 0x58, 0x31, 0x5a, 0x04,
+    0x0c, 0x01, 0x04, 0xe0, 0x58, 0x31, 0x5a, 0x01, 0x04, 0xe0, 0x58, 0x31, 0x5a, 0xe0, 0x4e, 0x4d, 0x43, 0x04, 0x0c,
+    0x03, 0x04, 0x01, 0x01, 0x01, 0x00, 0x01, 0x04, 0xe0, 0x4e, 0x4d, 0x43, 0xe4, 0x5b, 0x5b, 0xa4, 0x00, 0x02, 0x00,
+    0x37, 0x37, 0x00, 0x01, 0x80, 0xa9, 0x05, 0x00, 0x12, 0x11, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x14,
+    0x15, 0x16, 0x17, 0x18, 0x19, 0xe0, 0x4e, 0x4d, 0x43, 0xe0, 0x58, 0x30, 0x5a, 0xe0, 0x58, 0x31, 0x5a, 0xff, 0xff,
+    0xff, 0xff, 0x0f, 0xac, 0x1e, 0xf3, 0xf2, 0x4a, 0xd8, 0xb9, 0x95, 0x83, 0xfd, 0x06, 0xbc, 0x56, 0xba, 0xb2, 0x06,
+    0xbd, 0xd8, 0x21, 0x66, 0x00, 0x05, 0x00, 0x0e, 0x0e, 0x7a, 0x35, 0x0f, 0x07, 0xb1, 0x4a, 0x00, 0x8f, 0x7c, 0xa0,
+    0x33, 0x1a, 0x32, 0x00, 0x77, 0x7f, 0xec, 0xcc, 0x01, 0x04, 0x0b, 0x2e, 0x20, 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x02, 0x03, 0x2b, 0x48, 0xcc, 0x2c, 0x62, 0x48, 0xce, 0xc9, 0x2c, 0x28, 0x48, 0x4d, 0x61, 0x28, 0x00,
+    0x71, 0x72, 0xf2, 0xf3, 0x52, 0x19, 0x4a, 0xf3, 0x72, 0x13, 0xc1, 0x42, 0x00, 0x5a, 0x7b, 0x40, 0x4c, 0x20, 0x00,
+    0x00, 0x00, 0xb4, 0x93, 0x14, 0x8a, 0x00, 0x04, 0x0c, 0x02, 0x02, 0x00, 0x00, 0x8c, 0x6c, 0x80, 0x6a, 0x00, 0x04,
+    0x0d, 0x06, 0x06, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0x0f, 0xdf, 0xfe, 0x9f, 0x00, 0x04, 0x0e, 0x02, 0x02, 0x0a,
+    0x00, 0x66, 0xd7, 0xaf, 0xea, 0x00, 0x04, 0x0f, 0x06, 0x06, 0xff, 0xff, 0xff, 0xf6, 0x00, 0x00, 0x29, 0x87, 0x86,
+    0x59, 0x00, 0x04, 0x10, 0x04, 0x04, 0x01, 0x03, 0x00, 0x01, 0xe6, 0x8b, 0x71, 0xa6, 0x00, 0x04, 0x11, 0x05, 0x05,
+    0x58, 0x53, 0x49, 0x44, 0x42, 0x6f, 0x8e, 0xd5, 0xae, 0x00, 0x04, 0x12, 0x05, 0x05, 0x06, 0x01, 0x0d, 0x07, 0x05,
+    0xe6, 0xd2, 0x02, 0x82, 0x00, 0x04, 0x14, 0x01, 0x01, 0x02, 0xf1, 0xfd, 0xee, 0x6d, 0x00, 0x04, 0x15, 0x02, 0x02,
+    0x47, 0x41, 0xbb, 0x31, 0x93, 0xb9, 0x00, 0x04, 0x16, 0x04, 0x04, 0x54, 0x54, 0x54, 0x00, 0xbf, 0xd1, 0x51, 0xf9,
+    0x04, 0x04, 0x17, 0x2a, 0x0d, 0x00, 0x21, 0x00, 0x00, 0x00, 0x0d, 0x00, 0x00, 0x00, 0x41, 0x83, 0xb2, 0x43, 0x83,
+    0xb1, 0x47, 0x83, 0xb1, 0x4e, 0x82, 0x76, 0x54, 0x82, 0x76, 0x00, 0x62, 0x0d, 0x8d, 0x01, 0xc0, 0x40, 0x84, 0x5b,
+    0xc6, 0x66, 0xa0, 0x28, 0xdc, 0x6a, 0xb6, 0x28, 0x8e, 0xc1, 0xfb, 0xa6, 0x80, 0x04, 0x04, 0x18, 0x80, 0xdb, 0x80,
+    0x8f, 0x01, 0xd2, 0x00, 0x00, 0x00, 0x8f, 0x00, 0x00, 0x00, 0x00, 0x04, 0x82, 0x49, 0x05, 0x00, 0x86, 0xdc, 0x07,
+    0x82, 0x49, 0x0f, 0x82, 0x49, 0x25, 0x82, 0x49, 0x00, 0x01, 0x27, 0x06, 0x90, 0x00, 0x00, 0x07, 0x8c, 0xcd, 0x22,
+    0x83, 0x33, 0x00, 0x08, 0x90, 0x00, 0x00, 0x09, 0x90, 0x00, 0x00, 0x0a, 0x90, 0x00, 0x00, 0x0b, 0x8a, 0xab, 0x1c,
+    0x85, 0x55, 0x00, 0x0c, 0x90, 0x00, 0x00, 0x0d, 0x90, 0x00, 0x00, 0x0e, 0x90, 0x00, 0x00, 0x0f, 0x90, 0x00, 0x00,
+    0x10, 0x90, 0x00, 0x00, 0x11, 0x90, 0x00, 0x00, 0x12, 0x90, 0x00, 0x00, 0x13, 0x90, 0x00, 0x00, 0x14, 0x90, 0x00,
+    0x00, 0x15, 0x90, 0x00, 0x00, 0x16, 0x90, 0x00, 0x00, 0x17, 0x90, 0x00, 0x00, 0x18, 0x90, 0x00, 0x00, 0x19, 0x90,
+    0x00, 0x00, 0x1a, 0x90, 0x00, 0x00, 0x1b, 0x90, 0x00, 0x00, 0x1c, 0x90, 0x00, 0x00, 0x1d, 0x90, 0x00, 0x00, 0x1e,
+    0x90, 0x00, 0x00, 0x1f, 0x90, 0x00, 0x00, 0x00, 0x84, 0x00, 0x20, 0x8c, 0x00, 0x00, 0x21, 0x90, 0x00, 0x00, 0x22,
+    0x90, 0x00, 0x00, 0x23, 0x90, 0x00, 0x00, 0x24, 0x90, 0x00, 0x00, 0x25, 0x90, 0x00, 0x00, 0x26, 0x90, 0x00, 0x00,
+    0x27, 0x90, 0x00, 0x00, 0x02, 0x85, 0x55, 0x28, 0x8a, 0xab, 0x00, 0x00, 0x90, 0x00, 0x00, 0x01, 0x90, 0x00, 0x00,
+    0x02, 0x90, 0x00, 0x00, 0x03, 0x90, 0x00, 0x00, 0x04, 0x90, 0x00, 0x00, 0x00, 0xdc, 0xae, 0x5e, 0x12, 0xc6, 0x99,
+    0x3b, 0x3d, 0xc3, 0x20, 0x69, 0x14, 0xc0, 0xec, 0xb5, 0x01, 0xcc, 0x72, 0x1c, 0xa1, 0x30, 0x00, 0x04, 0x19, 0x04,
+    0x04, 0x3c, 0x2d, 0x3c, 0x1e, 0xa9, 0xf1, 0x80, 0xfd, 0x00, 0x04, 0xe0, 0x4e, 0x4d, 0x43, 0x01, 0x01, 0x04, 0x1b,
+    0x23, 0xc7, 0x62, 0x00, 0x04, 0xe0, 0x58, 0x30, 0x5a, 0x10, 0x10, 0x07, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x30, 0x00,
+    0x07, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x30, 0x00, 0x54, 0x4f, 0x30, 0xaa, 0x00, 0x04, 0xe0, 0x58, 0x31, 0x5a, 0x10,
+    0x10, 0x07, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x31, 0x00, 0x07, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x31, 0x00, 0x6d, 0x2e,
+    0x8e, 0x39, 0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63,
+    0x01, 0x4b
+};
+
+static const char DatatestRef1[] =
+    "GTCACAAATGCCACAGAGCAAATGGTCCTGAACAAGCAAACAGAACAGGCCCAGAACACGCCAACCTGTTGAAGACAGAAAGTAGCTTCGTGGCCGGGGGG"
+    "CCACAGCTCTGACTCCTGCATCCTTCTCCTGTGAAGGGGAGGGAGGTGGTGCTGCAGGGGAGGGGAGGGGGCTAGGAGATGTCACTGGGAGCGGAAACGGC";
+
+struct ExpectedRead
+{
+    const char*     id;
+    unsigned        flag;
+    int             position;       // 1 based, 0 for unmapped
+    unsigned        mapq;
+    const char*     data;           // as sequenced, so reverse complemented for the reverse strand
+    unsigned        qualitySeed;    // the fixture's qualities are (seed * 7 + 5 * i) % 41 in the reference's direction
+    unsigned        frontClipping;
+    const char*     rnext;
+    unsigned        pnext;
+    const char*     aux;            // BAM format, with the read group from the RG data series last
+    unsigned        auxLength;
+};
+
+static const ExpectedRead CRAMFixtureReads[] = {
+    {"pair", 99, 1, 60, "GTCACTAATGCCACAGAGCAAATGGTCCTGAACAAGCAAA", 99, 0, "ref1", 100,
+        "X0Zvalue0\0X1Zvalue1\0RGZgroup1", 30},
+    {"clipped", 0, 30, 45, "TTTGAACAAGCAAGAACAGAAGGCCCAGAA", 0, 3, "*", 0, "NMC\x04RGZgroup1", 14},
+    {"pair", 147, 100, 60, "CCCTTCACAGGAGAAGGATGCAGGAGTCAGAGCTGTGGCC", 147, 0, "ref1", 1,
+        "X0Zvalue0\0X1Zvalue1\0RGZgroup1", 30},
+    {"lone", 81, 150, 30, "CCTCCCCTCCCCTGCNGCAC", 81, 0, "ref1", 10, NULL, 0},
+    {"unmapped", 4, 0, 0, "ACGTNACGTACG", 4, 0, "*", 0, NULL, 0},
+};
+
+TEST("CRAM reader decodes a file from another writer") {
+    const char* fastaName = "CRAMTest.fa";
+    const char* cramName = "CRAMTest.cram";
+    FILE* file = fopen(fastaName, "w");
+    fprintf(file, ">ref1\n%s\n", DatatestRef1);
+    fclose(file);
+    file = fopen(cramName, "wb");
+    fwrite(CRAMFixture, 1, sizeof(CRAMFixture), file);
+    fclose(file);
+
+    const Genome* genome = ReadFASTAGenome(fastaName, NULL, true, 100);
+    ASSERT(genome != NULL);
+    GenomeLocation ref1 = genome->getContigs()[0].beginningLocation;
+
+    ReaderContext context;
+    memset(&context, 0, sizeof(context));
+    context.genome = genome;
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+    CRAMReader* reader = CRAMReader::create(cramName, context);
+
+    Read read;
+    for (size_t r = 0; r < sizeof(CRAMFixtureReads) / sizeof(CRAMFixtureReads[0]); r++) {
+        const ExpectedRead& e = CRAMFixtureReads[r];
+        ASSERT(reader->getNextRead(&read));
+        ASSERT_EQ((unsigned)strlen(e.id), read.getIdLength());
+        ASSERT(0 == memcmp(e.id, read.getId(), read.getIdLength()));
+        ASSERT_EQ(e.flag, read.getOriginalSAMFlags());
+        ASSERT(read.getOriginalAlignedLocation() == (e.position == 0 ? InvalidGenomeLocation : ref1 + e.position - 1));
+        ASSERT_EQ(e.mapq, read.getOriginalMAPQ());
+
+        unsigned length = (unsigned)strlen(e.data);
+        ASSERT_EQ(length, read.getDataLength());
+        ASSERT(0 == memcmp(e.data, read.getData(), length));
+        bool reversed = (e.flag & SAM_REVERSE_COMPLEMENT) != 0;
+        for (unsigned i = 0; i < length; i++) {
+            unsigned stored = reversed ? length - 1 - i : i;
+            ASSERT_EQ((char)(33 + (e.qualitySeed * 7 + 5 * stored) % 41), read.getQuality()[i]);
+        }
+        ASSERT_EQ(e.frontClipping, read.getOriginalFrontClipping());
+        ASSERT_EQ(0u, read.getOriginalBackClipping());
+
+        ASSERT_EQ((unsigned)strlen(e.rnext), read.getOriginalRNEXTLength());
+        ASSERT(0 == memcmp(e.rnext, read.getOriginalRNEXT(), read.getOriginalRNEXTLength()));
+        ASSERT_EQ(e.pnext, read.getOriginalPNEXT());
+
+        unsigned auxLength;
+        bool auxSAM;
+        const char* aux = read.getAuxiliaryData(&auxLength, &auxSAM);
+        ASSERT_EQ(e.auxLength, auxLength);
+        if (e.aux != NULL) {
+            ASSERT(!auxSAM);
+            ASSERT(0 == memcmp(e.aux, aux, auxLength));
+            ASSERT(read.getReadGroup() == READ_GROUP_FROM_AUX);
+        } else {
+            ASSERT(aux == NULL);
+            ASSERT(read.getReadGroup() == context.defaultReadGroup);
+        }
+    }
+    ASSERT(!reader->getNextRead(&read));
+
+    delete reader;
+    delete genome;
+    remove(fastaName);
+    remove(cramName);
+}
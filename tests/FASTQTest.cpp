@@ -0,0 +1,70 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "FASTQ.h"
+
+//
+// A record long enough that its newlines are found 16 bytes at a time, with a short one after it that's left for the
+// scalar tail.
+//
+static const char* LongRecord =
+    "@read1 some description\n"
+    "ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT\n"
+    "+\n"
+    "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII\n";
+
+static const char* ShortRecord = "@r\nAC\n+\nII\n";
+
+TEST("finds the newlines of a record") {
+    char buffer[1000];
+    strcpy(buffer, LongRecord);
+    strcat(buffer, ShortRecord);
+    _int64 validBytes = strlen(buffer);
+    char* newlines[4];
+
+    ASSERT_EQ(4u, FASTQReader::findNewlines(buffer, validBytes, newlines, 4));
+    ASSERT(newlines[0] == strchr(buffer, '\n'));
+    for (int i = 1; i < 4; i++) {
+        ASSERT(newlines[i] == strchr(newlines[i - 1] + 1, '\n'));
+    }
+
+    // the second record is all in the last 16 bytes
+    char* second = newlines[3] + 1;
+    _int64 left = validBytes - (second - buffer);
+    ASSERT(left < 16);
+    ASSERT_EQ(4u, FASTQReader::findNewlines(second, left, newlines, 4));
+    ASSERT(newlines[0] == second + 2);
+    ASSERT(newlines[1] == second + 5);
+    ASSERT(newlines[2] == second + 7);
+    ASSERT(newlines[3] == second + 10);
+
+    // and it's cut short by the end of the valid bytes
+    ASSERT_EQ(3u, FASTQReader::findNewlines(second, left - 1, newlines, 4));
+}
+
+TEST("stops at a NUL") {
+    char buffer[1000];
+    strcpy(buffer, LongRecord);
+    _int64 validBytes = strlen(buffer);
+    char* newlines[4];
+
+    // in the sequence, found 16 bytes at a time
+    char* sequence = strchr(buffer, '\n') + 1;
+    sequence[20] = 0;
+    ASSERT_EQ(1u, FASTQReader::findNewlines(buffer, validBytes, newlines, 4));
+    sequence[20] = 'A';
+
+    // in the quality line
+    buffer[validBytes - 20] = 0;
+    ASSERT_EQ(3u, FASTQReader::findNewlines(buffer, validBytes, newlines, 4));
+    buffer[validBytes - 20] = 'I';
+
+    // in the scalar tail, just before the last newline
+    ASSERT(validBytes % 16 > 2);
+    buffer[validBytes - 2] = 0;
+    ASSERT_EQ(3u, FASTQReader::findNewlines(buffer, validBytes, newlines, 4));
+
+    // in a record that's all scalar tail
+    strcpy(buffer, ShortRecord);
+    buffer[6] = 0;
+    ASSERT_EQ(2u, FASTQReader::findNewlines(buffer, strlen(ShortRecord), newlines, 4));
+}
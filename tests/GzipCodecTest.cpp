@@ -0,0 +1,89 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "GzipCodec.h"
+#include "zlib.h"
+
+static const size_t BlockSize = 65280;     // Small enough that a BGZF block always fits in 64KB compressed
+
+static void makeBlock(char *data, size_t size, unsigned seed)
+{
+    static const char bases[] = "ACGT";
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (i % 101 == 100) ? '\n' : bases[(seed >> 16) & 3];
+    }
+}
+
+TEST("codecs round trip and read each other's output") {
+    char *input = new char[BlockSize];
+    makeBlock(input, BlockSize, 1);
+    char *compressed = new char[2 * BlockSize];
+    char *output = new char[BlockSize];
+
+    for (int writer = 0; writer < GzipCodec::NumBackends; writer++) {
+        if (!GzipCodec::IsAvailable((GzipCodec::Backend)writer)) {
+            continue;
+        }
+        GzipCodec *compressor = GzipCodec::create((GzipCodec::Backend)writer);
+        for (int bgzf = 0; bgzf <= 1; bgzf++) {
+            size_t compressedSize = compressor->compressMember(input, BlockSize, compressed, 2 * BlockSize, bgzf != 0);
+            ASSERT(compressedSize > 0 && compressedSize < BlockSize);
+            if (bgzf) {
+                ASSERT_EQ(compressedSize - 1, (size_t)(((_uint8)compressed[17] << 8) | (_uint8)compressed[16]));
+            }
+
+            for (int reader = 0; reader < GzipCodec::NumBackends; reader++) {
+                if (!GzipCodec::IsAvailable((GzipCodec::Backend)reader)) {
+                    continue;
+                }
+                GzipCodec *decompressor = GzipCodec::create((GzipCodec::Backend)reader);
+                size_t outputUsed = 0;
+                ASSERT(decompressor->decompressMember(compressed, compressedSize, output, BlockSize, &outputUsed));
+                ASSERT_EQ(BlockSize, outputUsed);
+                ASSERT(0 == memcmp(input, output, BlockSize));
+
+                // A corrupt CRC is caught
+                compressed[compressedSize - 5] ^= 1;
+                ASSERT(!decompressor->decompressMember(compressed, compressedSize, output, BlockSize, &outputUsed));
+                compressed[compressedSize - 5] ^= 1;
+                delete decompressor;
+            }
+        }
+        delete compressor;
+    }
+
+    delete [] input;
+    delete [] compressed;
+    delete [] output;
+}
+
+TEST("zlib codec writes the same bytes as zlib's own gzip wrapper") {
+    char *input = new char[BlockSize];
+    makeBlock(input, BlockSize, 2);
+    char *compressed = new char[2 * BlockSize];
+    char *expected = new char[2 * BlockSize];
+
+    GzipCodec *codec = GzipCodec::create(GzipCodec::Zlib);
+    size_t compressedSize = codec->compressMember(input, BlockSize, compressed, 2 * BlockSize, false);
+    delete codec;
+
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+    zstream.next_in = (Bytef *)input;
+    zstream.avail_in = (uInt)BlockSize;
+    zstream.next_out = (Bytef *)expected;
+    zstream.avail_out = (uInt)(2 * BlockSize);
+    deflate(&zstream, Z_FINISH);
+    size_t expectedSize = 2 * BlockSize - zstream.avail_out;
+    deflateEnd(&zstream);
+
+    ASSERT_EQ(expectedSize, compressedSize);
+    // Byte 9 is the OS, which zlib only sets to Unix on Unix
+    ASSERT(0 == memcmp(expected, compressed, 9));
+    ASSERT(0 == memcmp(expected + 10, compressed + 10, compressedSize - 10));
+
+    delete [] input;
+    delete [] compressed;
+    delete [] expected;
+}
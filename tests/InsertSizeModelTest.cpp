@@ -0,0 +1,62 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "InsertSizeModel.h"
+#include "Read.h"
+
+TEST("learns a window around each read group") {
+    InsertSizeModel model(1000, 50, 1000);
+
+    for (int i = 0; i < 499; i++) {
+        model.recordPair("short", 200 + (i % 21) - 10);
+        model.recordPair("long", 600 + (i % 41) - 20);
+    }
+    ASSERT(!model.isLearned());
+
+    model.recordPair("long", 600);
+    model.recordPair("short", 200);
+    ASSERT(model.isLearned());
+
+    const InsertSizeDistribution *shortInserts = model.getDistribution("short");
+    ASSERT_EQ(200, (int)shortInserts->median);
+    ASSERT(shortInserts->minSpacing >= 50 && shortInserts->minSpacing <= 190);
+    ASSERT(shortInserts->maxSpacing >= 210 && shortInserts->maxSpacing < 600);
+
+    const InsertSizeDistribution *longInserts = model.getDistribution("long");
+    ASSERT_EQ(600, (int)longInserts->median);
+    ASSERT(longInserts->minSpacing > 210 && longInserts->minSpacing <= 580);
+    ASSERT(longInserts->maxSpacing >= 620 && longInserts->maxSpacing <= 1000);
+
+    ASSERT(longInserts->relativeLikelihood(600) > longInserts->relativeLikelihood(640));
+
+    // An unknown read group gets the overall estimate, which covers both libraries
+    const InsertSizeDistribution *unknown = model.getDistribution("unknown");
+    ASSERT(unknown->minSpacing <= 190 && unknown->maxSpacing >= 620);
+
+    // Pairs after learning don't change anything
+    model.recordPair("short", 900);
+    ASSERT_EQ(200, (int)model.getDistribution("short")->median);
+}
+
+TEST("finds the read group that readers leave in the RG:Z field") {
+    Read read;
+    char data[] = "ACGT", quality[] = "IIII";
+    read.init("r", 1, data, quality, 4);
+    char buffer[32];
+
+    read.setReadGroup("group1");
+    ASSERT_STREQ("group1", read.getReadGroupName(buffer, sizeof(buffer)));
+
+    // SAM fields aren't null terminated
+    char sam[] = "X0:Z:value0\tRG:Z:lib2\tX1:Z:value1";
+    read.setReadGroup(READ_GROUP_FROM_AUX);
+    read.setAuxiliaryData(sam, (unsigned)strlen(sam));
+    ASSERT_STREQ("lib2", read.getReadGroupName(buffer, sizeof(buffer)));
+
+    char bam[] = "XAc\x05RGZlib3\0";
+    read.setAuxiliaryData(bam, sizeof(bam) - 1);
+    ASSERT_STREQ("lib3", read.getReadGroupName(buffer, sizeof(buffer)));
+
+    char none[] = "X0:Z:value0";
+    read.setAuxiliaryData(none, (unsigned)strlen(none));
+    ASSERT(NULL == read.getReadGroupName(buffer, sizeof(buffer)));
+}
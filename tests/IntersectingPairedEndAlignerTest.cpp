@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "IntersectingPairedEndAligner.h"
+
+//
+// Hit lists are sorted from largest to smallest.  These check the search for the first hit <= a target against
+// looking at each hit in turn, for lists short enough to be scanned and long enough to gallop, with 32 and 64 bit hits.
+//
+
+template<class GL> static _int64
+firstHitLessThanOrEqualTo(const GL *hits, _int64 first, _int64 nHits, _int64 target)
+{
+    for (; first < nHits; first++) {
+        if (GenomeLocationAsInt64(hits[first]) <= target) {
+            return first;
+        }
+    }
+    return nHits;
+}
+
+template<class GL> static void
+checkEveryStartAndTarget(const GL *hits, _int64 nHits)
+{
+    _int64 largest = nHits == 0 ? 0 : GenomeLocationAsInt64(hits[0]);
+    for (_int64 first = 0; first <= nHits; first++) {
+        for (_int64 target = 0; target <= largest + 1; target++) {
+            _int64 expected = firstHitLessThanOrEqualTo(hits, first, nHits, target);
+            ASSERT_EQ(expected, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, first, nHits, GenomeLocation(target)));
+            ASSERT_EQ(expected, IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(hits, first, nHits, GenomeLocation(target)));
+        }
+    }
+}
+
+template<class GL> static void
+checkHitSearch()
+{
+    //
+    // Odd numbers from 2 * n - 1 down to 1, so every even target falls between two hits.
+    //
+    const int MaxHits = 100;
+    GL hits[MaxHits] = {};
+    for (int nHits = 0; nHits <= MaxHits; nHits += (nHits < 20 ? 1 : 17)) {
+        for (int i = 0; i < nHits; i++) {
+            hits[i] = GL(2 * (nHits - i) - 1);
+        }
+        checkEveryStartAndTarget(hits, nHits);
+    }
+
+    //
+    // Runs of the same position, which have to give the first of the run.
+    //
+    for (int i = 0; i < MaxHits; i++) {
+        hits[i] = GL(1000 - 10 * (i / 7));
+    }
+    checkEveryStartAndTarget(hits, MaxHits);
+    ASSERT_EQ(7, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, MaxHits, GenomeLocation(990)));
+    ASSERT_EQ(7, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, MaxHits, GenomeLocation(999)));
+    ASSERT_EQ(70, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 3, MaxHits, GenomeLocation(900)));
+    ASSERT_EQ(98, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 98, MaxHits, GenomeLocation(860)));
+}
+
+TEST("an empty range has no hit") {
+    unsigned hits32[] = {50, 40, 30};
+    GenomeLocation hits64[] = {50, 40, 30};
+    ASSERT_EQ(0, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits32, 0, 0, GenomeLocation(100)));
+    ASSERT_EQ(3, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits32, 3, 3, GenomeLocation(100)));
+    ASSERT_EQ(2, IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(hits32, 2, 2, GenomeLocation(100)));
+    ASSERT_EQ(3, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits64, 3, 3, GenomeLocation(100)));
+    ASSERT_EQ(2, IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(hits64, 2, 2, GenomeLocation(100)));
+}
+
+TEST("finds the first hit <= a target in 32 bit hits") {
+    checkHitSearch<unsigned>();
+}
+
+TEST("finds the first hit <= a target in 64 bit hits") {
+    checkHitSearch<GenomeLocation>();
+}
+
+TEST("targets past either end of 32 bit hits") {
+    //
+    // All hits greater than the target gives nHits, and all less gives first, including for targets that don't fit in 32
+    // bits, which the 32 bit scan handles before looking at the hits.
+    //
+    const int nHits = 40;
+    unsigned hits[nHits];
+    for (int i = 0; i < nHits; i++) {
+        hits[i] = 0xfffffff0u - 1000 * i;
+    }
+    ASSERT_EQ(nHits, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, nHits, GenomeLocation(0)));
+    ASSERT_EQ(nHits, IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(hits, 5, nHits, GenomeLocation(-1)));
+    ASSERT_EQ(0, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, nHits, GenomeLocation(0xfffffff0)));
+    ASSERT_EQ(5, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 5, nHits, GenomeLocation(0x100000000ll)));
+    ASSERT_EQ(5, IntersectingPairedEndAligner::scanForHitLessThanOrEqualTo(hits, 5, nHits, GenomeLocation(0xffffffffll)));
+
+    // exactly the last hit
+    ASSERT_EQ(nHits - 1, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, nHits, GenomeLocation(hits[nHits - 1])));
+    ASSERT_EQ(nHits, IntersectingPairedEndAligner::findFirstHitLessThanOrEqualTo(hits, 0, nHits, GenomeLocation(hits[nHits - 1] - 1)));
+}
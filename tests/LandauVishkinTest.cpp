@@ -127,3 +127,29 @@ TEST_F(LandauVishkinTest, "CIGAR strings") {
     lvc.computeEditDistance("abc", 3, "abXde", 5, 3, cigarBuf, bufLen, true);
     ASSERT_STREQ("5M", cigarBuf);
 }
+
+TEST_F(LandauVishkinTest, "CIGAR strings beyond MAX_K") {
+    //
+    // 400 bases (the read length the aligners start out sized for) with a substitution every 5, which is far more than MAX_K edits in total
+    // but few enough in any one chunk.
+    //
+    const int length = 400;
+    char text[length + MAX_K + 8];
+    char pattern[length + 8];
+    for (int i = 0; i < length + MAX_K; i++) {
+        text[i] = "ACGT"[(i * 7 + i / 5) % 4];
+    }
+    for (int i = 0; i < length; i++) {
+        pattern[i] = (i % 5 == 4) ? (text[i] == 'A' ? 'C' : 'A') : text[i];
+    }
+    memset(text + length + MAX_K, 0, 8);
+    memset(pattern + length, 0, 8);
+
+    char cigarBuf[4096];
+    int netIndel;
+    ASSERT_EQ(-1, lvc.computeEditDistance(text, length + MAX_K, pattern, length, MAX_K - 1, cigarBuf, sizeof(cigarBuf), true));
+    ASSERT_EQ(length / 5, lvc.computeEditDistanceNormalized(text, length + MAX_K, pattern, length, MAX_K - 1, cigarBuf, sizeof(cigarBuf),
+        true, COMPACT_CIGAR_STRING, NULL, NULL, &netIndel));
+    ASSERT_STREQ("400M", cigarBuf);
+    ASSERT_EQ(0, netIndel);
+}
@@ -0,0 +1,36 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "LongReadAligner.h"
+
+// Test fixture for the banded edit distance used to fill the gaps between chained anchors
+struct BandedEditDistanceTest {
+    int rows[1000];
+
+    int distance(const char *text, const char *pattern, int limit = 100) {
+        return BandedEditDistance(text, (int)strlen(text), pattern, (int)strlen(pattern), 4, limit, rows);
+    }
+};
+
+TEST_F(BandedEditDistanceTest, "equal strings") {
+    ASSERT_EQ(0, distance("ACGTTGCAAG", "ACGTTGCAAG"));
+    ASSERT_EQ(0, distance("", ""));
+}
+
+TEST_F(BandedEditDistanceTest, "both ends are anchored") {
+    ASSERT_EQ(1, distance("ACGTTGCAAG", "ACGTTGCAA"));
+    ASSERT_EQ(1, distance("ACGTTGCAAG", "CGTTGCAAG"));
+    ASSERT_EQ(3, distance("ACG", ""));
+    ASSERT_EQ(2, distance("", "AC"));
+}
+
+TEST_F(BandedEditDistanceTest, "substitutions and indels") {
+    ASSERT_EQ(2, distance("ACGTTGCAAG", "ACTTTGCATG"));
+    ASSERT_EQ(3, distance("ACGTTGCAAGGCTTACCGAT", "ACGTTGCAAGGACCGAT"));
+    ASSERT_EQ(3, distance("ACGTTGCAAGGACCGAT", "ACGTTGCAAGGCTTACCGAT"));
+}
+
+TEST_F(BandedEditDistanceTest, "limit") {
+    ASSERT_EQ(-1, distance("ACGTTGCAAG", "TGCATGCTTA", 3));
+    ASSERT_EQ(3, distance("ACGTTGCAAGGCTTACCGAT", "ACGTTGCAAGGACCGAT", 3));
+    ASSERT_EQ(-1, distance("ACGTTGCAAGGCTTACCGAT", "ACGTTGCAAGGACCGAT", 2));
+}
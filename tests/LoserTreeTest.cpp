@@ -0,0 +1,68 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "LoserTree.h"
+
+//
+// Merge nStreams sorted streams of small keys (so there are lots of ties) and check that the result is in order and
+// that ties come out in stream order.
+//
+static void mergeAndCheck(int nStreams, int maxLength)
+{
+    const int MaxStreams = 40;
+    const int MaxLength = 50;
+    int keys[MaxStreams][MaxLength];
+    int lengths[MaxStreams];
+    int total = 0;
+    unsigned seed = 12345 + nStreams;
+    for (int s = 0; s < nStreams; s++) {
+        seed = seed * 1103515245 + 12345;
+        lengths[s] = (seed >> 16) % (maxLength + 1);
+        int key = 0;
+        for (int i = 0; i < lengths[s]; i++) {
+            seed = seed * 1103515245 + 12345;
+            key += (seed >> 16) % 3;
+            keys[s][i] = key;
+        }
+        total += lengths[s];
+    }
+
+    LoserTree<int> tree(nStreams);
+    int next[MaxStreams];
+    for (int s = 0; s < nStreams; s++) {
+        next[s] = 0;
+        if (lengths[s] > 0) {
+            tree.set(s, keys[s][0]);
+        } else {
+            tree.setEmpty(s);
+        }
+    }
+    tree.start();
+
+    int merged = 0, lastKey = -1, lastStream = -1;
+    while (! tree.isEmpty()) {
+        int s = tree.winner();
+        ASSERT_EQ(keys[s][next[s]], tree.winnerKey());
+        ASSERT(tree.winnerKey() > lastKey || (tree.winnerKey() == lastKey && s >= lastStream));
+        lastKey = tree.winnerKey();
+        lastStream = s;
+        merged++;
+        if (++next[s] < lengths[s]) {
+            tree.replace(keys[s][next[s]]);
+        } else {
+            tree.finish();
+        }
+    }
+    ASSERT_EQ(total, merged);
+}
+
+TEST("LoserTree merges in order") {
+    for (int n = 1; n <= 40; n++) {
+        mergeAndCheck(n, 50);
+    }
+}
+
+TEST("LoserTree handles empty streams") {
+    for (int n = 1; n <= 9; n++) {
+        mergeAndCheck(n, 1);
+    }
+}
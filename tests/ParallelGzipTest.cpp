@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "ParallelGzip.h"
+#include "zlib.h"
+
+static const _int64 TestChunkSize = 64 * 1024;
+
+//
+// Something shaped like FASTQ, so it compresses about as well as real input does.
+//
+static void makeInput(char *data, _int64 size)
+{
+    static const char bases[] = "ACGT";
+    unsigned seed = 12345;
+    _int64 i = 0;
+    int read = 0;
+    while (i < size) {
+        char record[400];
+        int length = sprintf(record, "@read%d\n", read++);
+        for (int j = 0; j < 100; j++) {
+            seed = seed * 1103515245 + 12345;
+            record[length++] = bases[(seed >> 16) & 3];
+        }
+        length += sprintf(record + length, "\n+\n");
+        for (int j = 0; j < 100; j++) {
+            seed = seed * 1103515245 + 12345;
+            record[length++] = (char)('#' + ((seed >> 16) % 40));
+        }
+        record[length++] = '\n';
+        for (int j = 0; j < length && i < size; j++) {
+            data[i++] = record[j];
+        }
+    }
+}
+
+static void appendGzipMember(FILE *file, const char *data, _int64 size, int level)
+{
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    deflateInit2(&zstream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);     // 31 is a 32K window with a gzip wrapper
+    uLong bound = deflateBound(&zstream, (uLong)size);
+    Bytef *compressed = new Bytef[bound];
+    zstream.next_in = (Bytef *)data;
+    zstream.avail_in = (uInt)size;
+    zstream.next_out = compressed;
+    zstream.avail_out = (uInt)bound;
+    deflate(&zstream, Z_FINISH);
+    fwrite(compressed, 1, bound - zstream.avail_out, file);
+    deflateEnd(&zstream);
+    delete [] compressed;
+}
+
+static void checkInflate(const char *fileName, const char *expected, _int64 expectedSize)
+{
+    ParallelGzipInflater *inflater = ParallelGzipInflater::create(fileName, 4, TestChunkSize);
+    ASSERT(NULL != inflater);
+
+    char *output = new char[expectedSize + 1];
+    _int64 total = 0;
+    _int64 readSize = 1000;
+    for (;;) {
+        _int64 bytes = inflater->read(output + total, min(readSize, expectedSize + 1 - total));
+        total += bytes;
+        if (bytes == 0 || total > expectedSize) {
+            break;
+        }
+        readSize = readSize * 3 / 2;    // Odd sizes, so reads straddle chunk boundaries
+    }
+    ASSERT(inflater->isDone());
+    ASSERT_EQ(expectedSize, total);
+    ASSERT(0 == memcmp(expected, output, expectedSize));
+
+    delete [] output;
+    delete inflater;
+}
+
+TEST("parallel gzip matches the input") {
+    const _int64 size = 4 * 1024 * 1024;
+    char *data = new char[size];
+    makeInput(data, size);
+
+    const char *fileName = "ParallelGzipTest.gz";
+
+    // One member
+    FILE *file = fopen(fileName, "wb");
+    appendGzipMember(file, data, size, 6);
+    fclose(file);
+    checkInflate(fileName, data, size);
+
+    // Several members, which is what you get from cat'ing gzip files together
+    file = fopen(fileName, "wb");
+    appendGzipMember(file, data, size / 3, 6);
+    appendGzipMember(file, data + size / 3, size / 3, 1);
+    appendGzipMember(file, data + 2 * (size / 3), size - 2 * (size / 3), 9);
+    fclose(file);
+    checkInflate(fileName, data, size);
+
+    // Stored blocks only, so none of the guesses about where blocks start can be right
+    file = fopen(fileName, "wb");
+    appendGzipMember(file, data, size / 4, 0);
+    fclose(file);
+    checkInflate(fileName, data, size / 4);
+
+    // Not gzip
+    file = fopen(fileName, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+    ASSERT(NULL == ParallelGzipInflater::create(fileName, 4, TestChunkSize));
+
+    remove(fileName);
+    delete [] data;
+}
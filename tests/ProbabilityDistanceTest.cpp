@@ -8,7 +8,7 @@ struct ProbabilityDistanceTest {
     ProbabilityDistance dist;
     double prob;
     
-    ProbabilityDistanceTest(): dist(0.1, 0.01, 0.2) {}
+    ProbabilityDistanceTest(): dist(0.1, 0.01, 0.2, 100) {}
 };
 
 
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "RadixSort.h"
+
+//
+// Same layout as the SortEntry that SortedDataWriter sorts each batch of.
+//
+#pragma pack(push, 4)
+struct Entry
+{
+    size_t  offset;
+    _int64  length;
+    _int64  location;
+};
+#pragma pack(pop)
+
+struct EntryKey
+{
+    _uint64 operator()(const Entry& e) const { return (_uint64) e.location ^ ((_uint64) 1 << 63); }
+};
+
+static bool entryLess(const Entry& a, const Entry& b)
+{
+    return a.location < b.location;
+}
+
+//
+// Reads from one batch of output: mostly spread over a 3Gb genome, with pileups at a few places and a run of unmapped
+// ones at the end, all with the same location.
+//
+static void makeBatch(Entry* entries, size_t n, unsigned seed)
+{
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8;
+        entries[i].offset = offset;
+        entries[i].length = 300 + (r & 127);
+        offset += entries[i].length;
+        if (r % 10 == 0) {
+            entries[i].location = 0xffffffff;
+        } else if (r % 10 == 1) {
+            entries[i].location = 1000000 + (r & 15);
+        } else {
+            seed = seed * 1103515245 + 12345;
+            entries[i].location = ((_int64) r << 8 | (seed >> 24)) % 3000000000LL;
+        }
+    }
+}
+
+static void sortAndCheck(size_t n, unsigned seed)
+{
+    Entry* entries = new Entry[n];
+    Entry* scratch = new Entry[n];
+    Entry* expected = new Entry[n];
+    makeBatch(entries, n, seed);
+    memcpy(expected, entries, n * sizeof(Entry));
+    std::stable_sort(expected, expected + n, entryLess);
+
+    Entry* sorted = RadixSort(entries, scratch, n, EntryKey());
+    ASSERT(sorted == entries || sorted == scratch);
+    for (size_t i = 0; i < n; i++) {
+        ASSERT_EQ(expected[i].location, sorted[i].location);
+        ASSERT_EQ(expected[i].offset, sorted[i].offset);   // stable
+    }
+
+    delete [] entries;
+    delete [] scratch;
+    delete [] expected;
+}
+
+TEST("RadixSort matches stable_sort") {
+    sortAndCheck(0, 1);
+    sortAndCheck(1, 1);
+    sortAndCheck(1000, 2);
+    sortAndCheck(4095, 3);
+    sortAndCheck(4096, 4);
+    sortAndCheck(100000, 5);
+    sortAndCheck(1000000, 6);   // about what an aligner thread sorts with the default sort memory
+}
+
+TEST("RadixSort handles negative and equal keys") {
+    const size_t n = 10000;
+    Entry* entries = new Entry[n];
+    Entry* scratch = new Entry[n];
+    for (size_t i = 0; i < n; i++) {
+        entries[i].offset = i;
+        entries[i].length = 1;
+        entries[i].location = (i % 3 == 0) ? -1 : 7;
+    }
+    Entry* sorted = RadixSort(entries, scratch, n, EntryKey());
+    for (size_t i = 0; i < n; i++) {
+        ASSERT_EQ(i < (n + 2) / 3 ? -1 : 7, sorted[i].location);
+        if (i > 0 && sorted[i].location == sorted[i - 1].location) {
+            ASSERT(sorted[i].offset > sorted[i - 1].offset);
+        }
+    }
+    delete [] entries;
+    delete [] scratch;
+}
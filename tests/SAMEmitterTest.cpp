@@ -0,0 +1,101 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "SAMEmitter.h"
+
+TEST("SAMEmitter numbers match printf") {
+    const _int64 values[] = {0, 1, 9, 10, 11, 99, 100, 101, 999, 1000, 12345, 99999, 100000, 2147483647LL, 4294967295LL,
+        4294967296LL, 1000000000000LL, 9223372036854775807LL, -1, -9, -10, -100, -12345, -2147483647LL - 1};
+    const int nValues = sizeof(values) / sizeof(values[0]);
+    for (int i = 0; i < nValues; i++) {
+        char buffer[64], expected[64];
+        SAMEmitter out(buffer, sizeof(buffer));
+        out.signedNumber(values[i]);
+        ASSERT(! out.overflowed());
+        buffer[out.used()] = '\0';
+        snprintf(expected, sizeof(expected), "%lld", values[i]);
+        ASSERT_STREQ(expected, buffer);
+    }
+
+    char buffer[64], expected[64];
+    SAMEmitter out(buffer, sizeof(buffer));
+    out.number(18446744073709551615ULL);
+    buffer[out.used()] = '\0';
+    snprintf(expected, sizeof(expected), "%llu", 18446744073709551615ULL);
+    ASSERT_STREQ(expected, buffer);
+
+    // every value up to a million, which covers everything but the odd position in a big contig
+    for (unsigned v = 0; v < 1000000; v++) {
+        char digits[SAMEmitter::MaxDigits + 1];
+        digits[SAMEmitter::FormatUnsigned(digits, v)] = '\0';
+        snprintf(expected, sizeof(expected), "%u", v);
+        ASSERT_STREQ(expected, digits);
+    }
+}
+
+TEST("SAMEmitter stops at the end of the buffer") {
+    char buffer[16];
+    memset(buffer, 'x', sizeof(buffer));
+    SAMEmitter out(buffer, 8);
+    out.text("read1");
+    out.tab();
+    ASSERT(! out.overflowed());
+    out.number(12345);
+    ASSERT(out.overflowed());
+    out.ch('\n');
+    ASSERT(out.overflowed());
+    for (int i = 8; i < 16; i++) {
+        ASSERT_EQ('x', buffer[i]);
+    }
+}
+
+//
+// A typical SAM line (a 100 base paired read), built with snprintf the way SAMFormat::writeRead used to and with
+// SAMEmitter.
+//
+TEST("SAMEmitter builds the same SAM line as snprintf") {
+    const size_t bufferSize = 600;
+    char snprintfBuffer[bufferSize], emitterBuffer[bufferSize];
+    char data[101], quality[101];
+    for (int i = 0; i < 100; i++) {
+        data[i] = "ACGT"[i % 4];
+        quality[i] = '!' + (i * 7) % 40;
+    }
+    const char *id = "HWI-ST1234:8:1101:15254:39426";
+    int idLen = (int)strlen(id);
+
+    for (int i = 0; i < 1000; i++) {
+        size_t snprintfBytes = snprintf(snprintfBuffer, bufferSize, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s%.*s\n",
+            idLen, id, 99, "chr12", 13000000 + i * 37, 60, "52M1I47M", "=", 13000250 + i * 37, (_int64) 350 - i, 100, data,
+            100, quality, "", 0, "", "", "", "\tNM:i:2", 0, "");
+
+        SAMEmitter out(emitterBuffer, bufferSize);
+        out.chars(id, idLen);
+        out.tab();
+        out.number(99);
+        out.tab();
+        out.chars("chr12", 5);
+        out.tab();
+        out.number(13000000 + i * 37);
+        out.tab();
+        out.number(60);
+        out.tab();
+        out.text("52M1I47M");
+        out.tab();
+        out.chars("=", 1);
+        out.tab();
+        out.number(13000250 + i * 37);
+        out.tab();
+        out.signedNumber(350 - i);
+        out.tab();
+        out.chars(data, 100);
+        out.tab();
+        out.chars(quality, 100);
+        out.text("\tPG:Z:SNAP\tNM:i:");
+        out.signedNumber(2);
+        out.ch('\n');
+
+        ASSERT(! out.overflowed());
+        ASSERT_EQ(snprintfBytes, out.used());
+        ASSERT(! memcmp(snprintfBuffer, emitterBuffer, snprintfBytes));
+    }
+}
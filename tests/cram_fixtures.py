@@ -0,0 +1,466 @@
+# cram_fixtures.py
+#
+# Writes the CRAM files that the tests decode, straight from the CRAM 3.0 and CRAMcodecs specs and without using any
+# of SNAP's code, so that the reader is checked against something other than our own writer:
+#
+#   datatest/datatest.cram     the reads from datatest/datatest.sam, mapped to datatest.fa, for datatest.py
+#   CRAMTest.cpp's fixture     printed as a C array with -c; reads that use most of the encodings and read features
+#
+# Unlike SNAP's writer, these put most data series in the core block with Huffman, beta, gamma and subexponential
+# codes, and compress the external blocks with gzip and both orders of rANS.
+#
+# usage: python3 cram_fixtures.py [-c]
+#
+
+import gzip
+import hashlib
+import os
+import struct
+import sys
+import zlib
+
+# ---- integers ----
+
+def itf8(v):
+    v &= 0xffffffff
+    if v < 0x80:
+        return bytes([v])
+    if v < 0x4000:
+        return bytes([0x80 | (v >> 8), v & 0xff])
+    if v < 0x200000:
+        return bytes([0xc0 | (v >> 16), (v >> 8) & 0xff, v & 0xff])
+    if v < 0x10000000:
+        return bytes([0xe0 | (v >> 24), (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff])
+    return bytes([0xf0 | (v >> 28), (v >> 20) & 0xff, (v >> 12) & 0xff, (v >> 4) & 0xff, v & 0x0f])
+
+def ltf8(v):
+    v &= 0xffffffffffffffff
+    for extra in range(8):
+        if v < 1 << (7 * (extra + 1)):
+            first = (0xff00 >> extra) & 0xff | (v >> (8 * extra))
+            return bytes([first & 0xff]) + v.to_bytes(extra, 'big')
+    return b'\xff' + v.to_bytes(8, 'big')
+
+def int32(v):
+    return struct.pack('<i', v)
+
+# ---- rANS 4x8 (CRAMcodecs section 2) ----
+
+TF_SHIFT = 12
+TOTFREQ = 1 << TF_SHIFT
+RANS_L = 1 << 23
+
+def normalize(counts):
+    # largest remainder, every symbol that occurs getting at least one
+    total = sum(counts)
+    syms = [s for s in range(256) if counts[s]]
+    exact = dict((s, counts[s] * TOTFREQ / total) for s in syms)
+    F = [0] * 256
+    for s in syms:
+        F[s] = max(1, int(exact[s]))
+    diff = TOTFREQ - sum(F)
+    order = sorted(syms, key=lambda s: -(exact[s] - int(exact[s])))
+    i = 0
+    while diff > 0:
+        F[order[i % len(order)]] += 1
+        diff -= 1
+        i += 1
+    while diff < 0:
+        s = max(syms, key=lambda s: F[s])
+        F[s] -= 1
+        diff += 1
+    return F
+
+def run_length_symbols(present, write_one):
+    out = bytearray()
+    rle = 0
+    for s in range(256):
+        if not present[s]:
+            continue
+        if rle:
+            rle -= 1
+        else:
+            out.append(s)
+            if s and present[s - 1]:
+                rle = s + 1
+                while rle < 256 and present[rle]:
+                    rle += 1
+                rle -= s + 1
+                out.append(rle)
+        out += write_one(s)
+    out.append(0)
+    return out
+
+def frequency(f):
+    return bytes([f]) if f < 128 else bytes([0x80 | (f >> 8), f & 0xff])
+
+def cumulative(F):
+    C = [0] * 256
+    t = 0
+    for s in range(256):
+        C[s] = t
+        t += F[s]
+    return C
+
+def rans_put(x, f, c, out):
+    x_max = ((RANS_L >> TF_SHIFT) << 8) * f
+    while x >= x_max:
+        out.append(x & 0xff)
+        x >>= 8
+    return ((x // f) << TF_SHIFT) + (x % f) + c
+
+def rans(order, data):
+    n = len(data)
+    rev = bytearray()
+    R = [RANS_L] * 4
+    if order == 0:
+        counts = [0] * 256
+        for b in data:
+            counts[b] += 1
+        F = normalize(counts)
+        C = cumulative(F)
+        header = run_length_symbols(F, lambda s: frequency(F[s]))
+        for i in range(n - 1, -1, -1):
+            R[i % 4] = rans_put(R[i % 4], F[data[i]], C[data[i]], rev)
+    else:
+        q = n >> 2
+        def context(pos, j):
+            return 0 if pos == j * q else data[pos - 1]
+        seq = []
+        idx = [0, q, 2 * q, 3 * q]
+        for i in range(q):
+            for j in range(4):
+                seq.append((j, idx[j]))
+                idx[j] += 1
+        while idx[3] < n:
+            seq.append((3, idx[3]))
+            idx[3] += 1
+        counts = [[0] * 256 for _ in range(256)]
+        for j, pos in seq:
+            counts[context(pos, j)][data[pos]] += 1
+        used = [any(counts[c]) for c in range(256)]
+        F = [normalize(counts[c]) if used[c] else None for c in range(256)]
+        C = [cumulative(F[c]) if used[c] else None for c in range(256)]
+        header = run_length_symbols(used, lambda c: run_length_symbols(F[c], lambda s: frequency(F[c][s])))
+        for j, pos in reversed(seq):
+            ctx = context(pos, j)
+            R[j] = rans_put(R[j], F[ctx][data[pos]], C[ctx][data[pos]], rev)
+    payload = bytes(header) + b''.join(struct.pack('<I', r) for r in R) + bytes(reversed(rev))
+    return bytes([order]) + struct.pack('<II', len(payload), n) + payload
+
+# ---- blocks and containers ----
+
+RAW, GZIP, RANS = 0, 1, 4
+FILE_HEADER, COMPRESSION_HEADER, SLICE_HEADER, EXTERNAL, CORE = 0, 1, 2, 4, 5
+
+def block(method, content_type, content_id, raw, rans_order=0):
+    if method == GZIP:
+        data = gzip.compress(raw, mtime=0)
+    elif method == RANS:
+        data = rans(rans_order, raw)
+        method = RANS
+    else:
+        data = raw
+    b = bytes([method, content_type]) + itf8(content_id) + itf8(len(data)) + itf8(len(raw)) + data
+    return b + struct.pack('<I', zlib.crc32(b))
+
+def container(blocks, ref_id=0, start=0, span=0, n_records=0, counter=0, n_bases=0, landmarks=()):
+    body = b''.join(blocks)
+    h = int32(len(body)) + itf8(ref_id) + itf8(start) + itf8(span) + itf8(n_records) + ltf8(counter) + ltf8(n_bases)
+    h += itf8(len(blocks)) + itf8(len(landmarks)) + b''.join(itf8(l) for l in landmarks)
+    return h + struct.pack('<I', zlib.crc32(h)) + body
+
+EOF_CONTAINER = bytes.fromhex('0f000000ffffffff0fe0454f4600000000010005bdd94f0001000606010001000100ee63014b')
+
+def sized(b):
+    return itf8(len(b)) + b
+
+def cram_map(entries):
+    return sized(itf8(len(entries)) + b''.join(entries))
+
+# encodings: (codec, parameters)
+def external(cid):
+    return itf8(1) + sized(itf8(cid))
+
+def huffman(symbols, lengths):
+    return itf8(3) + sized(itf8(len(symbols)) + b''.join(itf8(s) for s in symbols) + itf8(len(lengths)) + b''.join(itf8(l) for l in lengths))
+
+def byte_array_len(length, value):
+    return itf8(4) + sized(length + value)
+
+def byte_array_stop(stop, cid):
+    return itf8(5) + sized(bytes([stop]) + itf8(cid))
+
+def beta(offset, bits):
+    return itf8(6) + sized(itf8(offset) + itf8(bits))
+
+def subexp(offset, k):
+    return itf8(7) + sized(itf8(offset) + itf8(k))
+
+def gamma(offset):
+    return itf8(9) + sized(itf8(offset))
+
+class Bits:
+    # the core block, most significant bit first
+    def __init__(self):
+        self.bits = []
+
+    def put(self, value, count):
+        for i in range(count - 1, -1, -1):
+            self.bits.append((value >> i) & 1)
+
+    def huffman(self, symbols, lengths, value):
+        ordered = sorted(zip(lengths, symbols))
+        code = 0
+        for i, (l, s) in enumerate(ordered):
+            if i:
+                code = (code + 1) << (l - ordered[i - 1][0])
+            if s == value:
+                self.put(code, l)
+                return
+        raise ValueError(value)
+
+    def gamma(self, value, offset):
+        n = value + offset
+        zeros = n.bit_length() - 1
+        self.put(0, zeros)
+        self.put(n, zeros + 1)
+
+    def subexp(self, value, offset, k):
+        n = value + offset
+        if n < 1 << k:
+            self.put(0, 1)
+            self.put(n, k)
+        else:
+            b = n.bit_length() - 1
+            self.put((1 << (b - k + 1)) - 1, b - k + 1)
+            self.put(0, 1)
+            self.put(n, b)
+
+    def bytes(self):
+        bits = self.bits + [0] * (-len(self.bits) % 8)
+        return bytes(int(''.join(map(str, bits[i:i + 8])), 2) for i in range(0, len(bits), 8))
+
+def definition():
+    return b'CRAM' + bytes([3, 0]) + b'snap test fixture'.ljust(20, b'\0')
+
+def header_container(text):
+    raw = int32(len(text)) + text
+    return container([block(RAW, FILE_HEADER, 0, raw)])
+
+def reference(path):
+    names, seqs = [], []
+    for line in open(path):
+        line = line.strip()
+        if line.startswith('>'):
+            names.append(line[1:].split()[0])
+            seqs.append('')
+        elif line:
+            seqs[-1] += line.upper()
+    return names, seqs
+
+def tag_key(name):
+    return (ord(name[0]) << 16) | (ord(name[1]) << 8) | ord(name[2])
+
+# ---- the unit test's fixture ----
+
+#
+# Five reads on ref1: a pair whose mates are both in the slice (one with a substitution), a read with a soft clip, an
+# insertion and a deletion, a reverse read whose mate isn't in the slice and has a base given by a B feature, and an
+# unmapped read placed with it.  CRAMTest.cpp has what each should decode to.
+#
+def unit_fixture(ref):
+    R = ref
+    SM_A = 0xe4     # for reference A, C G T N are codes 3 2 1 0 rather than the usual 0 1 2 3
+    sm = bytes([SM_A, 0x1b, 0x1b, 0x1b, 0x1b])
+    td = b'\0' + b'X0ZX1Z\0' + b'NMC\0'
+
+    BF = ([99, 0, 147, 81, 4], [2, 2, 2, 3, 3])
+    CF = ([1, 3, 5], [1, 2, 2])
+    RG = ([-1, 0], [1, 1])
+    BS = ([1], [0])
+
+    enc = [
+        (b'BF', huffman(*BF)),
+        (b'CF', huffman(*CF)),
+        (b'RL', beta(0, 6)),
+        (b'AP', gamma(1)),
+        (b'RG', huffman(*RG)),
+        (b'RN', byte_array_stop(0, 11)),
+        (b'MF', external(12)),
+        (b'NS', external(13)),
+        (b'NP', external(14)),
+        (b'TS', external(15)),
+        (b'NF', subexp(0, 1)),
+        (b'TL', beta(0, 2)),
+        (b'FN', external(16)),
+        (b'FC', external(17)),
+        (b'FP', external(18)),
+        (b'BS', huffman(*BS)),
+        (b'IN', byte_array_len(external(20), external(21))),
+        (b'SC', byte_array_stop(0, 22)),
+        (b'DL', beta(0, 4)),
+        (b'BA', external(23)),
+        (b'QS', external(24)),
+        (b'MQ', external(25)),
+    ]
+    tag_enc = [
+        (tag_key('X0Z'), byte_array_len(external(tag_key('X0Z')), external(tag_key('X0Z')))),
+        (tag_key('X1Z'), byte_array_len(external(tag_key('X1Z')), external(tag_key('X1Z')))),
+        (tag_key('NMC'), byte_array_len(huffman([1], [0]), external(tag_key('NMC')))),
+    ]
+    preservation = cram_map([b'RN\x01', b'AP\x01', b'RR\x01', b'SM' + sm, b'TD' + sized(td)])
+    series = cram_map([k + e for k, e in enc])
+    tags = cram_map([itf8(k) + e for k, e in tag_enc])
+    compression = preservation + series + tags
+
+    core = Bits()
+    ext = dict((cid, bytearray()) for cid in [11, 12, 13, 14, 15, 16, 17, 18, 20, 21, 22, 23, 24, 25] + [k for k, _ in tag_enc])
+
+    def quals(n, seed):
+        return bytes((seed * 7 + i * 5) % 41 for i in range(n))
+
+    def record(flag, cf, length, delta, rg, name, tl, mapq=None, mate=None, nf=None, features=(), ba=None, tagvals=()):
+        core.huffman(BF[0], BF[1], flag)
+        core.huffman(CF[0], CF[1], cf)
+        core.put(length, 6)
+        core.gamma(delta, 1)
+        core.huffman(RG[0], RG[1], rg)
+        ext[11] += name + b'\0'
+        if cf & 2:
+            mf, ns, np, ts = mate
+            ext[12] += itf8(mf)
+            ext[13] += itf8(ns)
+            ext[14] += itf8(np)
+            ext[15] += itf8(ts)
+        elif cf & 4:
+            core.subexp(nf, 0, 1)
+        core.put(tl, 2)
+        for key, value in tagvals:
+            if key == 'NMC':
+                ext[tag_key(key)] += value
+            else:
+                ext[tag_key(key)] += itf8(len(value)) + value
+        if not flag & 4:
+            ext[16] += itf8(len(features))
+            last = 0
+            for code, pos, data in features:
+                ext[17].append(ord(code))
+                ext[18] += itf8(pos - last)
+                last = pos
+                if code == 'X':
+                    core.huffman(BS[0], BS[1], data)
+                elif code == 'S':
+                    ext[22] += data + b'\0'
+                elif code == 'I':
+                    ext[20] += itf8(len(data))
+                    ext[21] += data
+                elif code == 'D':
+                    core.put(data, 4)
+                elif code == 'B':
+                    ext[23] += data[0]
+                    ext[24].append(data[1])
+            ext[25] += itf8(mapq)
+        else:
+            ext[23] += ba
+        ext[24] += quals(length, flag)
+
+    # the pair, attached; NF is the number of records between them
+    record(99, 5, 40, 0, 0, b'pair', 1, mapq=60, nf=1, features=[('X', 6, 1)],
+           tagvals=[('X0Z', b'value0\0'), ('X1Z', b'value1\0')])
+    record(0, 1, 30, 29, 0, b'clipped', 2, mapq=45, features=[('S', 1, b'TTT'), ('I', 14, b'GA'), ('D', 21, 2)],
+           tagvals=[('NMC', bytes([4]))])
+    record(147, 1, 40, 70, 0, b'pair', 1, mapq=60, tagvals=[('X0Z', b'value0\0'), ('X1Z', b'value1\0')])
+    # mate is forward and mapped, on ref1 at 10
+    record(81, 3, 20, 50, -1, b'lone', 0, mapq=30, mate=(0, 0, 10, -160), features=[('B', 5, (b'N', 2))])
+    record(4, 3, 12, 0, -1, b'unmapped', 0, mate=(0, -1, 0, 0), ba=b'ACGTNACGTACG')
+
+    start, end = 1, 169
+    ids = sorted(ext)
+    methods = {11: GZIP, 23: RANS, 24: RANS}
+    orders = {24: 1}
+    blocks = [block(RAW, CORE, 0, core.bytes())]
+    for cid in ids:
+        blocks.append(block(methods.get(cid, RAW), EXTERNAL, cid, bytes(ext[cid]), orders.get(cid, 0)))
+    md5 = hashlib.md5(R[start - 1:end].encode()).digest()
+    slice_header = itf8(0) + itf8(start) + itf8(end - start + 1) + itf8(5) + ltf8(0) + itf8(len(blocks)) + \
+        itf8(len(ids)) + b''.join(itf8(i) for i in ids) + itf8(-1) + md5
+    ch = block(RAW, COMPRESSION_HEADER, 0, compression)
+    data = container([ch, block(RAW, SLICE_HEADER, 0, slice_header)] + blocks, 0, start, end - start + 1, 5, 0,
+                     40 + 30 + 40 + 20 + 12, [len(ch)])
+    text = ('@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:ref1\tLN:%d\tM5:%s\n@RG\tID:group1\tSM:sample\n' %
+            (len(R), hashlib.md5(R.encode()).hexdigest())).encode()
+    return definition() + header_container(text) + data + EOF_CONTAINER
+
+# ---- datatest.cram ----
+
+#
+# datatest.sam's pair, at the places on ref1 that they actually match, with SAM's qualities and tags.  The read group
+# of the first comes from the RG data series and the tags are in one external block each, which is how htslib does it.
+#
+def datatest_cram(ref, sam):
+    header, reads = [], []
+    for line in open(sam):
+        if line.startswith('@'):
+            header.append(line)
+        else:
+            reads.append(line.rstrip('\n').split('\t'))
+    R = ref
+    text = ''
+    for line in header:
+        if line.startswith('@SQ'):
+            line = line.rstrip('\n') + '\tM5:%s\n' % hashlib.md5(R.encode()).hexdigest()
+        text += line
+    text = text.encode()
+
+    positions = [R.index(reads[0][9]) + 1, R.index(reads[1][9]) + 1]
+    td = b'X0ZX1Z\0'
+    enc = [
+        (b'BF', external(1)), (b'CF', external(2)), (b'RL', external(3)), (b'AP', external(4)), (b'RG', external(5)),
+        (b'RN', byte_array_stop(0, 6)), (b'NF', external(7)), (b'TL', external(8)), (b'FN', external(9)),
+        (b'MQ', external(10)), (b'QS', external(11)),
+    ]
+    tag_enc = [(tag_key(t), byte_array_len(external(tag_key(t)), external(tag_key(t)))) for t in ('X0Z', 'X1Z')]
+    compression = cram_map([b'RN\x01', b'AP\x01', b'RR\x01', b'SM\x1b\x1b\x1b\x1b\x1b', b'TD' + sized(td)]) + \
+        cram_map([k + e for k, e in enc]) + cram_map([itf8(k) + e for k, e in tag_enc])
+    ext = dict((cid, bytearray()) for cid in list(range(1, 12)) + [k for k, _ in tag_enc])
+    last = positions[0]
+    for i, r in enumerate(reads):
+        ext[1] += itf8(int(r[1]))
+        ext[2] += itf8(1 | (4 if i == 0 else 0))
+        ext[3] += itf8(len(r[9]))
+        ext[4] += itf8(positions[i] - last)
+        last = positions[i]
+        ext[5] += itf8(0 if any(t == 'RG:Z:group1' for t in r[11:]) else -1)
+        ext[6] += r[0].encode() + b'\0'
+        if i == 0:
+            ext[7] += itf8(0)
+        ext[8] += itf8(0)
+        for t in r[11:]:
+            if t[:2] in ('X0', 'X1'):
+                value = t[5:].encode() + b'\0'
+                ext[tag_key(t[:2] + 'Z')] += itf8(len(value)) + value
+        ext[9] += itf8(0)
+        ext[10] += itf8(int(r[4]))
+        ext[11] += bytes(ord(c) - 33 for c in r[10])
+    ids = sorted(ext)
+    blocks = [block(RAW, CORE, 0, b'')] + [block(RANS if cid == 11 else RAW, EXTERNAL, cid, bytes(ext[cid])) for cid in ids]
+    start, end = positions[0], positions[1] + len(reads[1][9]) - 1
+    md5 = hashlib.md5(R[start - 1:end].encode()).digest()
+    slice_header = itf8(0) + itf8(start) + itf8(end - start + 1) + itf8(2) + ltf8(0) + itf8(len(blocks)) + \
+        itf8(len(ids)) + b''.join(itf8(i) for i in ids) + itf8(-1) + md5
+    ch = block(RAW, COMPRESSION_HEADER, 0, compression)
+    data = container([ch, block(RAW, SLICE_HEADER, 0, slice_header)] + blocks, 0, start, end - start + 1, 2, 0,
+                     sum(len(r[9]) for r in reads), [len(ch)])
+    return definition() + header_container(text) + data + EOF_CONTAINER
+
+if __name__ == '__main__':
+    here = os.path.dirname(os.path.abspath(__file__))
+    names, seqs = reference(os.path.join(here, 'datatest', 'datatest.fa'))
+    if len(sys.argv) > 1 and sys.argv[1] == '-c':
+        fixture = unit_fixture(seqs[0])
+        for i in range(0, len(fixture), 19):
+            print('    ' + ' '.join('0x%02x,' % b for b in fixture[i:i + 19]))
+    else:
+        open(os.path.join(here, 'datatest', 'datatest.cram'), 'wb').write(
+            datatest_cram(seqs[0], os.path.join(here, 'datatest', 'datatest.sam')))
@@ -0,0 +1,139 @@
+# cramtest.py
+#
+# Write CRAM output end to end, unsorted and sorted, and check that it reads back
+#
+# The reference and the reads are made up here from a fixed seed: two contigs, one with an IUPAC code in it, and 100
+# base pairs from both of them whose names say where they came from, plus some that don't align.  Each CRAM file is
+# read back in with SNAP to see that every read is there, and the temp file from sorting has to be gone.
+#
+# If samtools is on the PATH, each CRAM file is also decoded with it (so with htslib, against the FASTA file) and has to
+# match the BAM file SNAP writes for the same run, field for field up to the tags.  Without samtools that's skipped.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import random
+import shutil
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+Contigs = [("chrA", 30000), ("chrB", 20000)]
+ReadLength = 100
+Insert = 400
+PairsPerContig = 200
+UnalignedPairs = 20
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag, stdout=None):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(_f("stdout-%s" % tag) if stdout is None else stdout, "w"), stderr=open(ferr, "w"))
+    return retcode, open(ferr, "r").read()
+
+def complement(s):
+    table = {"A": "T", "C": "G", "G": "C", "T": "A"}
+    return "".join([table[c] for c in reversed(s)])
+
+def readnames(cramFile, tag):
+    # the file gets realigned, but all that matters is which reads are in it
+    retcode, err = runit([snap, "single", _f("cram.idx"), cramFile, "-t", "1", "-o", _f(tag + ".sam")], tag)
+    if retcode != 0:
+        print(err)
+        return None
+    return [line.split("\t")[0] for line in open(_f(tag + ".sam"), "r") if not line.startswith("@")]
+
+def samtoolsview(fileName, tag):
+    # the alignment fields of each record, as htslib decodes them
+    retcode, err = runit(["samtools", "view", "-T", _f("cram.fa"), fileName], tag, _f(tag + ".sam"))
+    if retcode != 0:
+        print(err)
+        return None
+    return [line.split("\t")[:11] for line in open(_f(tag + ".sam"), "r")]
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+
+rng = random.Random(47)
+genome = [(name, "".join([rng.choice("ACGT") for i in range(length)])) for name, length in Contigs]
+# an IUPAC code, which has to be in the M5 the same as in the FASTA file
+genome[1] = (genome[1][0], genome[1][1][:5000] + "R" + genome[1][1][5001:])
+fasta = open(_f("cram.fa"), "w")
+for name, sequence in genome:
+    fasta.write(">%s\n" % name)
+    for i in range(0, len(sequence), 80):
+        fasta.write(sequence[i : i + 80] + "\n")
+fasta.close()
+
+retcode, err = runit([snap, "index", _f("cram.fa"), _f("cram.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+f1 = open(_f("cram_1.fq"), "w")
+f2 = open(_f("cram_2.fq"), "w")
+names = []
+for name, sequence in genome:
+    for i in range(PairsPerContig):
+        pos = rng.randrange(0, len(sequence) - Insert)
+        left = sequence[pos : pos + ReadLength].replace("R", "A")
+        right = complement(sequence[pos + Insert - ReadLength : pos + Insert].replace("R", "A"))
+        names.append("%s_%d" % (name, pos))
+        f1.write("@%s/1\n%s\n+\n%s\n" % (names[-1], left, "I" * ReadLength))
+        f2.write("@%s/2\n%s\n+\n%s\n" % (names[-1], right, "I" * ReadLength))
+for i in range(UnalignedPairs):
+    names.append("unaligned_%d" % i)
+    for f in [f1, f2]:
+        f.write("@%s\n%s\n+\n%s\n" % (names[-1], "".join([rng.choice("ACGT") for j in range(ReadLength)]), "I" * ReadLength))
+f1.close()
+f2.close()
+expected = sorted(names + names)
+
+haveSamtools = shutil.which("samtools") is not None
+if not haveSamtools:
+    print("samtools isn't on the PATH, skipping the htslib checks")
+
+failures = 0
+for tag, args in [("unsorted", []), ("sorted", ["-so"])]:
+    for ext in ["cram", "bam"]:
+        retcode, err = runit([snap, "paired", _f("cram.idx"), _f("cram_1.fq"), _f("cram_2.fq"), "-t", "1"] + args +
+            ["-o", _f("%s.%s" % (tag, ext))], tag + "-" + ext)
+        if retcode != 0:
+            print(err)
+            failures += 1
+    if not os.path.exists(_f(tag + ".cram")):
+        continue
+    back = readnames(_f(tag + ".cram"), tag + "-back")
+    if back is None:
+        failures += 1
+    elif sorted(back) != expected:
+        print("%s.cram read back with %d reads, should be %d" % (tag, len(back), len(expected)))
+        failures += 1
+    if os.path.exists(_f(tag + ".cram.tmp")):
+        print("%s.cram.tmp was left behind" % tag)
+        failures += 1
+    if haveSamtools:
+        cram = samtoolsview(_f(tag + ".cram"), tag + "-samtools-cram")
+        bam = samtoolsview(_f(tag + ".bam"), tag + "-samtools-bam")
+        if cram is None or bam is None:
+            failures += 1
+        elif cram != bam:
+            differ = [i for i in range(min(len(cram), len(bam))) if cram[i] != bam[i]]
+            print("htslib decodes %s.cram to %d records and %s.bam to %d, %d differ%s" % (tag, len(cram), tag, len(bam), len(differ),
+                ", e.g.\n  %s\n  %s" % ("\t".join(cram[differ[0]]), "\t".join(bam[differ[0]])) if differ else ""))
+            failures += 1
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)
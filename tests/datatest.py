@@ -2,8 +2,8 @@
 #
 # Run data i/o tests on SNAP
 #
-# There are 3 possibilities for input:
-# FQ |SAM | BAM
+# There are 4 possibilities for input:
+# FQ |SAM | BAM | CRAM (made by cram_fixtures.py)
 #
 # There are 2 references datatest.fa and datatest2.fa (with an extra refseq)
 #
@@ -67,7 +67,7 @@ if not quick:
 
 runs = 0
 succeeded = 0
-for input_format in ["fq", "bam", "sam"]:
+for input_format in ["fq", "bam", "sam", "cram"]:
     for index in ["datatest", "datatest2"]:
         for output_format in ["sam", "bam"]:
             runs += 1
@@ -0,0 +1,238 @@
+# duptest.py
+#
+# Run duplicate marking on sorted BAM output end to end
+#
+# The reference and the reads are made up here from a fixed seed: one 60Kbase contig with a 2000 base stretch repeated
+# with a few changes, and sets of 100 base pairs that are copies of each other.  The read names say which set a read is
+# in, and the copy that should be kept has the best base qualities.  The BAM file's flags are read back here directly.
+#
+#   big     a set of 40000 pairs, whose run of reads at each end is much more than a buffer's worth
+#   pair    a set of pairs, plus fragments (pairs whose mate doesn't align) with an end at the same place, which are
+#           all duplicates because a pair has an end there.  A fragment's unmapped mate is marked along with it.
+#   solo    a set of fragments with nothing else there, where the best one is kept
+#   rep     sets of pairs from each copy of the repeat, aligned with -om so they get secondary alignments on the other
+#           copy, some before the primary and some after.  A secondary is a duplicate if its primary is.
+#   tied    a set of pairs with a deletion in one end, all with the same qualities, where any one pair can be kept but
+#           both its ends have to be
+#   junk    pairs where neither end aligns, which come out at the end without being marked
+#
+# The ms:i field that the aligner adds for duplicate marking mustn't be in the output on any read.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import gzip
+import random
+import shutil
+import struct
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+ContigLength = 60000
+RepeatLength = 2000
+RepeatCopies = [10000, 40000]
+ReadLength = 100
+Insert = 400
+BigCopies = 40000
+SetCopies = 5
+TiedCopies = 40
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(_f("stdout-%s" % tag), "w"), stderr=open(ferr, "w"))
+    return retcode, open(ferr, "r").read()
+
+def complement(s):
+    table = {"A": "T", "C": "G", "G": "C", "T": "A"}
+    return "".join([table[c] for c in reversed(s)])
+
+def randombases():
+    return "".join([rng.choice("ACGT") for i in range(ReadLength)])
+
+def writepairs(f1, f2, name, pos, copies, mateAligns=True, aligns=True):
+    left = reference[pos : pos + ReadLength]
+    right = complement(reference[pos + Insert - ReadLength : pos + Insert])
+    for j in range(copies):
+        qual = "I" * ReadLength if j == copies // 2 else "5" * ReadLength
+        mate = right if mateAligns else randombases()
+        if not aligns:
+            left = randombases()
+        f1.write("@%s_%d/1\n%s\n+\n%s\n" % (name, j, left, qual))
+        f2.write("@%s_%d/2\n%s\n+\n%s\n" % (name, j, mate, qual))
+
+def writetied(f1, f2, name, pos, copies):
+    # one base deleted 71 bases into the first end
+    left = reference[pos : pos + 71] + reference[pos + 72 : pos + ReadLength + 1]
+    right = complement(reference[pos + Insert - ReadLength : pos + Insert])
+    for j in range(copies):
+        f1.write("@%s_%d/1\n%s\n+\n%s\n" % (name, j, left, "5" * ReadLength))
+        f2.write("@%s_%d/2\n%s\n+\n%s\n" % (name, j, right, "5" * ReadLength))
+
+def readbam(fileName):
+    # (name, flag, contig, pos, has ms) for each read
+    data = gzip.open(fileName, "rb").read()
+    lText, = struct.unpack("<i", data[4:8])
+    p = 8 + lText
+    nRef, = struct.unpack("<i", data[p : p + 4])
+    p += 4
+    for i in range(nRef):
+        lName, = struct.unpack("<i", data[p : p + 4])
+        p += 8 + lName
+    reads = []
+    while p < len(data):
+        blockSize, refID, pos, lName = struct.unpack("<iiiB", data[p : p + 13])
+        flag, = struct.unpack("<H", data[p + 18 : p + 20])
+        name = data[p + 36 : p + 36 + lName - 1].decode()
+        # ms:i would be the last field
+        reads.append((name, flag, refID, pos, data[p + 4 + blockSize - 7 : p + 4 + blockSize - 4] == b"msi"))
+        p += 4 + blockSize
+    return reads
+
+def checkset(reads, name, kept):
+    # kept is the copy that shouldn't be a duplicate, or -1 for none
+    failures = 0
+    for read in reads:
+        if read[1] & 0x904:
+            continue
+        copy = int(read[0].split("_")[-1])
+        if ((read[1] & 0x400) != 0) != (copy != kept):
+            print("%s %s marked as a duplicate" % (read[0], "is" if read[1] & 0x400 else "isn't"))
+            failures += 1
+    if len(reads) == 0:
+        print("no reads from set %s" % name)
+        failures += 1
+    return failures
+
+def checktied(reads, name, copies):
+    # one copy kept, whichever it is, and both ends of every copy marked the same
+    marked = {}
+    for read in reads:
+        if read[1] & 0x904 == 0:
+            marked.setdefault(read[0], []).append(read[1] & 0x400 != 0)
+    failures = 0
+    if len(marked) != copies or [m for m in marked.values() if len(m) != 2]:
+        print("expected both ends of %d pairs from set %s, got %d pairs" % (copies, name, len(marked)))
+        failures += 1
+    split = [n for n, m in marked.items() if m[0] != m[1]]
+    if len(split) > 0:
+        print("%d pairs from set %s have only one end marked as a duplicate, e.g. %s" % (len(split), name, split[0]))
+        failures += 1
+    kept = [n for n, m in marked.items() if not m[0] and not m[1]]
+    if len(kept) != 1:
+        print("%d pairs from set %s kept, should be 1" % (len(kept), name))
+        failures += 1
+    return failures
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+
+rng = random.Random(45)
+reference = [rng.choice("ACGT") for i in range(ContigLength)]
+for i in range(RepeatLength):
+    reference[RepeatCopies[1] + i] = reference[RepeatCopies[0] + i]
+for i in range(RepeatLength // 2, RepeatLength, 50):
+    # the second half of the second copy is a little different, so reads from there prefer it
+    reference[RepeatCopies[1] + i] = "A" if reference[RepeatCopies[1] + i] != "A" else "C"
+reference = "".join(reference)
+fasta = open(_f("dup.fa"), "w")
+fasta.write(">dup\n")
+for i in range(0, ContigLength, 80):
+    fasta.write(reference[i : i + 80] + "\n")
+fasta.close()
+
+retcode, err = runit([snap, "index", _f("dup.fa"), _f("dup.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+f1 = open(_f("dup_1.fq"), "w")
+f2 = open(_f("dup_2.fq"), "w")
+writepairs(f1, f2, "big", 2000, BigCopies)
+writepairs(f1, f2, "pair", 20000, SetCopies)
+writepairs(f1, f2, "pairfrag", 20000, SetCopies, False)
+writepairs(f1, f2, "solo", 25000, SetCopies, False)
+writepairs(f1, f2, "repA", RepeatCopies[0] + RepeatLength // 2 + 100, SetCopies)
+writepairs(f1, f2, "repB", RepeatCopies[1] + RepeatLength // 2 + 100, SetCopies)
+writetied(f1, f2, "tied", 30000, TiedCopies)
+writepairs(f1, f2, "junk", 0, SetCopies, False, False)
+f1.close()
+f2.close()
+
+failures = 0
+primaryFlags = None
+for tag, args in [("primary", []), ("secondary", ["-om", "4", "-D", "4"])]:
+    retcode, err = runit([snap, "paired", _f("dup.idx"), _f("dup_1.fq"), _f("dup_2.fq"), "-so", "-t", "2"] + args + ["-o", _f(tag + ".bam")], tag)
+    if retcode != 0:
+        print(err)
+        failures += 1
+        continue
+    reads = readbam(_f(tag + ".bam"))
+    for name, kept in [("big", BigCopies // 2), ("pair", SetCopies // 2), ("pairfrag", -1), ("solo", SetCopies // 2), ("repA", SetCopies // 2), ("repB", SetCopies // 2)]:
+        failures += checkset([r for r in reads if r[0].startswith(name + "_")], name, kept)
+    failures += checktied([r for r in reads if r[0].startswith("tied_")], "tied", TiedCopies)
+    mappedEnds = dict([(r[0], r[1]) for r in reads if r[1] & 0x90c == 0x8])
+    unmappedMates = [r for r in reads if r[1] & 0x90c == 0x4]
+    for read in unmappedMates:
+        if read[0] not in mappedEnds or (read[1] & 0x400) != (mappedEnds[read[0]] & 0x400):
+            print("unmapped mate %s flag 0x%x doesn't go with its mapped end" % (read[0], read[1]))
+            failures += 1
+    if len([r for r in unmappedMates if r[0].startswith("pairfrag_")]) != SetCopies:
+        print("expected %d unmapped mates from set pairfrag" % SetCopies)
+        failures += 1
+
+    withMateScores = [r for r in reads if r[4]]
+    if len(withMateScores) > 0:
+        print("%d reads have an ms:i field, e.g. %s flag 0x%x" % (len(withMateScores), withMateScores[0][0], withMateScores[0][1]))
+        failures += 1
+    junk = [r for r in reads if r[0].startswith("junk_")]
+    if len(junk) != 2 * SetCopies or [r for r in junk if r[1] & 0x400]:
+        print("expected %d unmarked junk reads, got %d, %d marked" % (2 * SetCopies, len(junk), len([r for r in junk if r[1] & 0x400])))
+        failures += 1
+
+    # the same primaries are marked with and without secondaries
+    flags = sorted([(r[0], r[1] & 0xc0, r[1] & 0x400) for r in reads if not r[1] & 0x900])
+    if primaryFlags is None:
+        primaryFlags = flags
+    elif flags != primaryFlags:
+        print("primary alignments are marked differently with secondary alignments")
+        failures += 1
+
+    if tag == "secondary":
+        primaries = dict([((r[0], r[1] & 0xc0), r) for r in reads if not r[1] & 0x900])
+        before = 0
+        after = 0
+        for r in reads:
+            if not r[1] & 0x100:
+                continue
+            primary = primaries[(r[0], r[1] & 0xc0)]
+            if (r[1] & 0x400) != (primary[1] & 0x400):
+                print("%s secondary at %d %s marked as a duplicate, but its primary at %d %s" % (r[0], r[3], "is" if r[1] & 0x400 else "isn't",
+                    primary[3], "is" if primary[1] & 0x400 else "isn't"))
+                failures += 1
+            elif r[1] & 0x400:
+                if r[3] < primary[3]:
+                    before += 1
+                else:
+                    after += 1
+        print("%d duplicate secondary alignments before their primaries and %d after" % (before, after))
+        if before == 0 or after == 0:
+            print("expected duplicate secondary alignments both before and after their primaries, got %d before and %d after" % (before, after))
+            failures += 1
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)
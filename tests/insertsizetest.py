@@ -0,0 +1,108 @@
+# insertsizetest.py
+#
+# Run the paired aligner's insert size learning (-is) end to end on BAM input with read groups
+#
+# The reference and the reads are made up here from a fixed seed: one 100Kbase contig,
+# and two libraries of 100 base pairs, one with inserts around 300 and one with inserts
+# around 700.  Each library is aligned to its own BAM file with -rg, so every read in it
+# has an RG:Z field, and then both BAM files are realigned together with -is.
+#
+# The realignment has to learn a separate insert size for each read group.  What SNAP learns
+# is the spacing between the starts of the reads, which is the insert less the read length.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import random
+import re
+import shutil
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+ContigLength = 100000
+ReadLength = 100
+PairsPerLibrary = 1500
+Libraries = [("short", 300, 15), ("long", 700, 30)]    # read group, mean insert, standard deviation
+Slack = 25      # how far off a learned median can be
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    fout = _f("stdout-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(fout, "w"), stderr=open(ferr, "w"))
+    return retcode, open(fout, "r").read(), open(ferr, "r").read()
+
+def complement(s):
+    table = {"A": "T", "C": "G", "G": "C", "T": "A"}
+    return "".join([table[c] for c in reversed(s)])
+
+def makepairs(rng, mean, stdDev, fileName1, fileName2):
+    f1 = open(fileName1, "w")
+    f2 = open(fileName2, "w")
+    for i in range(PairsPerLibrary):
+        insert = max(ReadLength, int(rng.gauss(mean, stdDev)))
+        pos = rng.randint(0, ContigLength - insert - 1)
+        left = reference[pos : pos + ReadLength]
+        right = complement(reference[pos + insert - ReadLength : pos + insert])
+        name = "pair%d_%d_%d" % (i, pos + 1, insert)
+        f1.write("@%s/1\n%s\n+\n%s\n" % (name, left, "I" * ReadLength))
+        f2.write("@%s/2\n%s\n+\n%s\n" % (name, right, "I" * ReadLength))
+    f1.close()
+    f2.close()
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+
+rng = random.Random(30)
+reference = "".join([rng.choice("ACGT") for i in range(ContigLength)])
+fasta = open(_f("is.fa"), "w")
+fasta.write(">is\n")
+for i in range(0, ContigLength, 80):
+    fasta.write(reference[i : i + 80] + "\n")
+fasta.close()
+
+retcode, out, err = runit([snap, "index", _f("is.fa"), _f("is.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+failures = 0
+bams = []
+for group, mean, stdDev in Libraries:
+    makepairs(rng, mean, stdDev, _f(group + "_1.fq"), _f(group + "_2.fq"))
+    bams.append(_f(group + ".bam"))
+    retcode, out, err = runit([snap, "paired", _f("is.idx"), _f(group + "_1.fq"), _f(group + "_2.fq"), "-rg", group, "-t", "1", "-o", bams[-1]], group)
+    if retcode != 0:
+        print(err)
+        exit(1)
+
+retcode, out, err = runit([snap, "paired", _f("is.idx")] + bams + ["-is", str(PairsPerLibrary + PairsPerLibrary // 3), "-t", "1", "-o", _f("out.sam")], "is")
+if retcode != 0:
+    print(err)
+    failures += 1
+else:
+    for group, mean, stdDev in Libraries:
+        m = re.search(r"read group %s \(\d+ pairs\): median (\d+)" % group, out)
+        if m is None:
+            print("no insert size learned for read group %s" % group)
+            failures += 1
+        elif abs(int(m.group(1)) - (mean - ReadLength)) > Slack:
+            print("read group %s learned median %s, not about %d" % (group, m.group(1), mean - ReadLength))
+            failures += 1
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)
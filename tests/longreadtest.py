@@ -0,0 +1,164 @@
+# longreadtest.py
+#
+# Run SNAP's long read mode (-lr) end to end on multi-kilobase reads
+#
+# The reference and the reads are made up here from a fixed seed: one 60Kbase contig,
+# and reads of 300 to 5000 bases from both strands with about 3% substitutions and a
+# few short indels.  Each read's name says where it came from.
+#
+# Every read has to align to within a few bases of where it came from with -lr, which
+# sends the long reads to the chaining aligner.  Reads with far fewer differences have
+# to align without -lr too, in the single and paired aligners, which grow to fit them.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import random
+import shutil
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+ContigLength = 60000
+ShortLength = 300
+LongLengths = [2000, 3000, 5000]
+PairReadLength = 1500
+PairCount = 6
+ErrorRate = 0.04        # about 3% substitutions and a few short indels
+LowErrorRate = 0.002    # few enough differences for the ordinary aligners
+Slack = 20      # how far off a read's position can be, since indels near the ends may be clipped or moved
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(_f("stdout-%s" % tag), "w"), stderr=open(ferr, "w"))
+    return retcode, open(ferr, "r").read()
+
+def complement(s):
+    table = {"A": "T", "C": "G", "G": "C", "T": "A"}
+    return "".join([table[c] for c in reversed(s)])
+
+def mutate(rng, s, rate):
+    out = []
+    for c in s:
+        x = rng.random() / rate
+        if x < 0.75:
+            out.append(rng.choice([b for b in "ACGT" if b != c]))
+        elif x < 0.8:
+            pass                                # deletion
+        elif x < 0.85:
+            out.append(c + rng.choice("ACGT"))  # insertion
+        else:
+            out.append(c)
+    return "".join(out)
+
+def makereads(rng, lengths, rate, fileName):
+    f = open(fileName, "w")
+    for i in range(len(lengths)):
+        pos = rng.randint(0, ContigLength - lengths[i] - 1)
+        rc = i % 2 == 1
+        seq = mutate(rng, reference[pos : pos + lengths[i]], rate)
+        if rc:
+            seq = complement(seq)
+        f.write("@read%d_%d_%s\n%s\n+\n%s\n" % (i, pos + 1, "r" if rc else "f", seq, "I" * len(seq)))
+    f.close()
+
+def makepairs(rng, fileName1, fileName2):
+    f1 = open(fileName1, "w")
+    f2 = open(fileName2, "w")
+    for i in range(PairCount):
+        insert = rng.randint(PairReadLength * 2, PairReadLength * 4)
+        pos = rng.randint(0, ContigLength - insert - 1)
+        left = mutate(rng, reference[pos : pos + PairReadLength], LowErrorRate)
+        rightPos = pos + insert - PairReadLength
+        right = complement(mutate(rng, reference[rightPos : rightPos + PairReadLength], LowErrorRate))
+        f1.write("@pair%d_%d_f/1\n%s\n+\n%s\n" % (i, pos + 1, left, "I" * len(left)))
+        f2.write("@pair%d_%d_r/2\n%s\n+\n%s\n" % (i, rightPos + 1, right, "I" * len(right)))
+    f1.close()
+    f2.close()
+
+def check(samFile, expectedReads):
+    failures = 0
+    seen = 0
+    for line in open(samFile, "r"):
+        if line.startswith("@"):
+            continue
+        fields = line.split("\t")
+        flag = int(fields[1])
+        if flag & 0x900:
+            continue
+        seen += 1
+        name, pos, strand = fields[0].split("/")[0].split("_")
+        if flag & 4:
+            print("%s didn't align" % fields[0])
+            failures += 1
+        elif abs(int(fields[3]) - int(pos)) > Slack or ((flag & 16) != 0) != (strand == "r"):
+            print("%s aligned to %s %s" % (fields[0], fields[3], "reverse" if flag & 16 else "forward"))
+            failures += 1
+        elif fields[5] == "*":
+            print("%s has no CIGAR string" % fields[0])
+            failures += 1
+    if seen != expectedReads:
+        print("%s has %d reads, not %d" % (samFile, seen, expectedReads))
+        failures += 1
+    return failures
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+
+rng = random.Random(28)
+reference = "".join([rng.choice("ACGT") for i in range(ContigLength)])
+fasta = open(_f("long.fa"), "w")
+fasta.write(">long\n")
+for i in range(0, ContigLength, 80):
+    fasta.write(reference[i : i + 80] + "\n")
+fasta.close()
+
+retcode, err = runit([snap, "index", _f("long.fa"), _f("long.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+makereads(rng, [ShortLength] * 6, ErrorRate, _f("short.fq"))
+makereads(rng, [ShortLength] * 2 + LongLengths * 4, ErrorRate, _f("long.fq"))
+makereads(rng, [ShortLength] * 2 + LongLengths * 2, LowErrorRate, _f("clean.fq"))
+makepairs(rng, _f("long_1.fq"), _f("long_2.fq"))
+
+failures = 0
+retcode, err = runit([snap, "single", _f("long.idx"), _f("short.fq"), "-lr", "250", "-t", "1", "-o", _f("short.sam")], "short")
+if retcode != 0:
+    print(err)
+    failures += 1
+else:
+    failures += check(_f("short.sam"), 6)
+
+for tag, args, nReads in [("long", ["-lr", "250"], 2 + 4 * len(LongLengths)), ("clean", [], 2 + 2 * len(LongLengths))]:
+    retcode, err = runit([snap, "single", _f("long.idx"), _f(tag + ".fq")] + args + ["-t", "1", "-o", _f(tag + ".sam")], tag)
+    if retcode != 0:
+        print(err)
+        failures += 1
+    else:
+        failures += check(_f(tag + ".sam"), nReads)
+
+retcode, err = runit([snap, "paired", _f("long.idx"), _f("long_1.fq"), _f("long_2.fq"), "-s", "0", "20000", "-I", "-t", "1", "-o", _f("pairs.sam")], "pairs")
+if retcode != 0:
+    print(err)
+    failures += 1
+else:
+    failures += check(_f("pairs.sam"), 2 * PairCount)
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)
@@ -0,0 +1,128 @@
+# pairmatchtest.py
+#
+# Run the paired aligner on SAM input whose mates are far apart, with so little -pmm memory for the unmatched reads
+# that they have to spill to temp files and be split into parts to be matched at the end
+#
+# The reference and the reads are made up here from a fixed seed: one 100Kbase contig, and pairs of 100 base reads
+# whose names say where they came from.  The input SAM file has every first read before any second one, so nothing
+# matches until halfway through.
+#
+# Every pair has to come out and align where it came from, and the spill files have to be gone afterwards, both when
+# they go next to the output and when -pmt puts them somewhere else.  A -pmt directory that doesn't exist has to stop
+# SNAP with an error, which shows that the reads really spilled.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import random
+import shutil
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+ContigLength = 100000
+ReadLength = 100
+Pairs = 40000
+Slack = 5
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(_f("stdout-%s" % tag), "w"), stderr=open(ferr, "w"))
+    return retcode, open(ferr, "r").read()
+
+def complement(s):
+    table = {"A": "T", "C": "G", "G": "C", "T": "A"}
+    return "".join([table[c] for c in reversed(s)])
+
+def check(samFile):
+    failures = 0
+    seen = 0
+    for line in open(samFile, "r"):
+        if line.startswith("@"):
+            continue
+        fields = line.split("\t")
+        flag = int(fields[1])
+        if flag & 0x900:
+            continue
+        seen += 1
+        name, pos1, pos2 = fields[0].split("_")
+        expected = int(pos1) if flag & 0x40 else int(pos2)
+        if flag & 4 or abs(int(fields[3]) - expected) > Slack:
+            if failures < 10:
+                print("%s read %d aligned to %s, not %d" % (fields[0], 1 if flag & 0x40 else 2, fields[3], expected))
+            failures += 1
+    if seen != 2 * Pairs:
+        print("%s has %d reads, not %d" % (samFile, seen, 2 * Pairs))
+        failures += 1
+    return failures
+
+def leftovers(directory):
+    return [f for f in os.listdir(directory) if ".pairs" in f]
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+os.mkdir(_f("spill"))
+
+rng = random.Random(39)
+reference = "".join([rng.choice("ACGT") for i in range(ContigLength)])
+fasta = open(_f("pm.fa"), "w")
+fasta.write(">pm\n")
+for i in range(0, ContigLength, 80):
+    fasta.write(reference[i : i + 80] + "\n")
+fasta.close()
+
+retcode, err = runit([snap, "index", _f("pm.fa"), _f("pm.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+firsts = []
+seconds = []
+for i in range(Pairs):
+    insert = rng.randint(300, 500)
+    pos = rng.randint(0, ContigLength - insert - 1)
+    rightPos = pos + insert - ReadLength
+    name = "pair%d_%d_%d" % (i, pos + 1, rightPos + 1)
+    firsts.append("%s\t77\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n" % (name, reference[pos : pos + ReadLength], "I" * ReadLength))
+    seconds.append("%s\t141\t*\t0\t0\t*\t*\t0\t0\t%s\t%s\n" % (name, complement(reference[rightPos : rightPos + ReadLength]), "I" * ReadLength))
+rng.shuffle(seconds)
+sam = open(_f("in.sam"), "w")
+sam.write("@HD\tVN:1.4\n")
+sam.writelines(firsts)
+sam.writelines(seconds)
+sam.close()
+
+failures = 0
+for tag, args, spillDirectory in [("beside", [], temp), ("pmt", ["-pmt", _f("spill")], _f("spill"))]:
+    retcode, err = runit([snap, "paired", _f("pm.idx"), _f("in.sam"), "-pmm", "1", "-t", "2", "-o", _f(tag + ".sam")] + args, tag)
+    if retcode != 0:
+        print(err)
+        failures += 1
+        continue
+    failures += check(_f(tag + ".sam"))
+    if len(leftovers(spillDirectory)) > 0:
+        print("spill files left behind: %s" % " ".join(leftovers(spillDirectory)))
+        failures += 1
+
+retcode, err = runit([snap, "paired", _f("pm.idx"), _f("in.sam"), "-pmm", "1", "-t", "2", "-o", _f("nowhere.sam"), "-pmt", _f("nowhere")], "nowhere")
+if retcode == 0 or "-pmt" not in err:
+    print("spilling to a directory that doesn't exist didn't fail as it should have")
+    print(err)
+    failures += 1
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)
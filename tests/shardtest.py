@@ -0,0 +1,153 @@
+# shardtest.py
+#
+# Run sorted BAM output with -shard end to end, by contig and by the intervals of a BED file
+#
+# The reference and the reads are made up here from a fixed seed: a few contigs, one with a name that isn't safe for a
+# file name, and 100 base reads from all of them whose names say where they came from, plus some that don't align.
+# Each shard's BAM file is read back in with SNAP to see which reads went where.
+#
+# A read goes in the shard where its alignment starts, so one that starts just before an interval and runs into it
+# belongs with the unplaced reads.  Contig names that come out the same once they're made safe for a file name, or that
+# differ only in case, have to stop SNAP with an error rather than write two shards to one file.
+#
+# Temp files are put in temp_dir
+#
+
+import sys
+import os
+import random
+import shutil
+import subprocess
+
+if len(sys.argv) != 3:
+    print("usage: %s snap-aligner temp_dir" % sys.argv[0])
+    exit(1)
+
+snap = sys.argv[1]
+temp = sys.argv[2]
+
+Contigs = [("chrA", 30000), ("chrB", 20000), ("HLA-A*01:01", 3000)]
+ReadLength = 100
+ReadsPerContig = 200
+Intervals = [("chrA", 10000, 20000), ("chrB", 0, 5000)]     # BED: 0-based, end exclusive
+
+def _f(name):
+    return os.path.normpath(temp + "/" + name)
+
+def runit(args, tag):
+    print("> %s" % ' '.join(args))
+    ferr = _f("stderr-%s" % tag)
+    retcode = subprocess.call(args, stdout=open(_f("stdout-%s" % tag), "w"), stderr=open(ferr, "w"))
+    return retcode, open(ferr, "r").read()
+
+def writefasta(fileName, contigs):
+    fasta = open(fileName, "w")
+    for name, sequence in contigs:
+        fasta.write(">%s\n" % name)
+        for i in range(0, len(sequence), 80):
+            fasta.write(sequence[i : i + 80] + "\n")
+    fasta.close()
+
+def readnames(bamFile, tag):
+    # the file gets realigned, but all that matters is which reads are in it
+    retcode, err = runit([snap, "single", _f("shard.idx"), bamFile, "-t", "1", "-o", _f(tag + ".sam")], tag)
+    if retcode != 0:
+        print(err)
+        return None
+    return set([line.split("\t")[0] for line in open(_f(tag + ".sam"), "r") if not line.startswith("@")])
+
+def checkshards(expected, tag):
+    failures = 0
+    for fileName in sorted(expected.keys()):
+        if not os.path.exists(_f(fileName)):
+            print("%s wasn't written" % fileName)
+            failures += 1
+            continue
+        names = readnames(_f(fileName), tag + "-" + fileName)
+        if names is None:
+            failures += 1
+        elif names != expected[fileName]:
+            print("%s has %d reads that don't belong and is missing %d" % (fileName, len(names - expected[fileName]), len(expected[fileName] - names)))
+            failures += 1
+    return failures
+
+if os.path.exists(temp):
+    shutil.rmtree(temp)
+os.mkdir(temp)
+
+rng = random.Random(49)
+genome = [(name, "".join([rng.choice("ACGT") for i in range(length)])) for name, length in Contigs]
+writefasta(_f("shard.fa"), genome)
+retcode, err = runit([snap, "index", _f("shard.fa"), _f("shard.idx")], "index")
+if retcode != 0:
+    print(err)
+    exit(1)
+
+reads = []  # (name, contig, 0-based start)
+fastq = open(_f("reads.fq"), "w")
+for contigNumber in range(len(genome)):
+    name, sequence = genome[contigNumber]
+    starts = [rng.randint(0, len(sequence) - ReadLength) for i in range(ReadsPerContig)]
+    if name == "chrA":
+        starts += [9950, 9990, 10000, 19950]    # into the interval, just, at its start, and out of it
+    for start in starts:
+        readName = "r%d_%d_%d" % (len(reads), contigNumber, start)
+        reads.append((readName, name, start))
+        fastq.write("@%s\n%s\n+\n%s\n" % (readName, sequence[start : start + ReadLength], "I" * ReadLength))
+unaligned = set()
+for i in range(20):
+    readName = "u%d" % i
+    unaligned.add(readName)
+    fastq.write("@%s\n%s\n+\n%s\n" % (readName, "".join([rng.choice("ACGT") for j in range(ReadLength)]), "I" * ReadLength))
+fastq.close()
+
+failures = 0
+
+retcode, err = runit([snap, "single", _f("shard.idx"), _f("reads.fq"), "-so", "-shard", "contigs", "-t", "1", "-o", _f("contigs.bam")], "contigs")
+if retcode != 0:
+    print(err)
+    failures += 1
+else:
+    expected = {"contigs.unplaced.bam": set(unaligned)}
+    for name, sequence in genome:
+        safeName = "".join([c if c.isalnum() or c in ".-_" else "_" for c in name])
+        expected["contigs.%s.bam" % safeName] = set([r[0] for r in reads if r[1] == name])
+    failures += checkshards(expected, "contigs")
+
+bed = open(_f("intervals.bed"), "w")
+for contig, begin, end in Intervals:
+    bed.write("%s\t%d\t%d\n" % (contig, begin, end))
+bed.close()
+retcode, err = runit([snap, "single", _f("shard.idx"), _f("reads.fq"), "-so", "-shard", _f("intervals.bed"), "-t", "1", "-o", _f("bed.bam")], "bed")
+if retcode != 0:
+    print(err)
+    failures += 1
+else:
+    expected = {"bed.unplaced.bam": set(unaligned)}
+    for contig, begin, end in Intervals:
+        expected["bed.%s_%d-%d.bam" % (contig, begin + 1, end)] = set()
+    for name, contig, start in reads:
+        fileName = "bed.unplaced.bam"
+        for intervalContig, begin, end in Intervals:
+            if contig == intervalContig and begin <= start < end:
+                fileName = "bed.%s_%d-%d.bam" % (contig, begin + 1, end)
+        expected[fileName].add(name)
+    failures += checkshards(expected, "bed")
+
+for tag, names in [("sanitized", ["HLA-A*01:01", "HLA-A_01_01"]), ("case", ["chrM", "chrm"])]:
+    writefasta(_f(tag + ".fa"), [(name, "".join([rng.choice("ACGT") for i in range(2000)])) for name in names])
+    retcode, err = runit([snap, "index", _f(tag + ".fa"), _f(tag + ".idx")], tag + "-index")
+    if retcode != 0:
+        print(err)
+        failures += 1
+        continue
+    retcode, err = runit([snap, "single", _f(tag + ".idx"), _f("reads.fq"), "-so", "-shard", "contigs", "-t", "1", "-o", _f(tag + ".bam")], tag)
+    if retcode == 0 or "more than one shard" not in err:
+        print("contigs %s didn't collide as they should have" % " and ".join(names))
+        print(err)
+        failures += 1
+
+if failures == 0:
+    shutil.rmtree(temp)
+print("%d failures" % failures)
+exit(1 if failures > 0 else 0)